@@ -1,6 +1,9 @@
 [bits 32]
 [extern load_kernel]
+[global stage2_entry]
 
+; Named so the linker can discard the filesystem code stage 2 never calls
+stage2_entry:
 call load_kernel
 mov ebp, 0x90000 ; Move to the final kernel stack location
 mov esp, ebp
@@ -1,49 +1,142 @@
 #include <tomfs.h>
 
 void initScreen();
+void ataInit();
+void printShort(unsigned short num);
 
 int pciGetIDEConfig(int slave, unsigned int *cmdBase, unsigned int *ctrlBase, unsigned int *bmideBase, int *irqNum) {
     // TODO: Do PCI scan in stage 2 as well
-    *cmdBase = 0x1F0;
-    *ctrlBase = 0x370;
+    *cmdBase = slave ? 0x170 : 0x1F0;
+    *ctrlBase = slave ? 0x370 : 0x3F0;
+    return 1;
 }
 
+// Blocks are read into a ring of CACHE_BYTES at BLOCK_CACHE_ADDR, after a
+// table of what's in it, the oldest being read over first. A read carrying on
+// from where the last one from the drive ended takes twice as many blocks as
+// that one did, up to READAHEAD_SECTORS in one command, as the kernel's blocks
+// mostly follow each other.
 #define BLOCK_CACHE_ADDR 0x204000
+#define CACHE_TABLE_BYTES 4096
+#define CACHE_BYTES (1024 * 1024)
+#define READAHEAD_SECTORS 128
 
-// block_cache[idx] = the filesystem block index cached at address
-// BLOCK_CACHE_ADDR + 4096*(idx+1)
-unsigned int *block_cache;
+// Where TomFS works on blocks, after the cache. There's only room on the
+// stack for small ones.
+#define TFS_SCRATCH_ADDR (BLOCK_CACHE_ADDR + CACHE_TABLE_BYTES + CACHE_BYTES)
+
+// First sector of the filesystem on each drive, and the most drives it can be
+// striped across (see filesystem.c in the kernel)
+#define FS_START_SECTOR(drive) ((drive) ? 0 : 34)
+#define FS_MAX_DRIVES 4
+
+typedef struct BlockCacheEntry {
+    int drive;
+    unsigned int block;
+} BlockCacheEntry;
+
+// block_cache[idx] = the drive and block index cached at address
+// BLOCK_CACHE_ADDR + CACHE_TABLE_BYTES + block_size*idx
+BlockCacheEntry *block_cache;
 int block_cache_size;
+int block_cache_next;
+
+// The drive and block after the last blocks read, and how many that was
+int readahead_drive;
+unsigned int readahead_next;
+int readahead_blocks;
+
+// Blocks the kernel was loaded with, and the commands that read them
+unsigned int blocks_read;
+unsigned int disk_reads;
+
+// The drives the filesystem is striped across, if it is
+TFS drives[FS_MAX_DRIVES];
+TFSStripe stripe;
+
+// There are no processes to wait for interrupts, which the ATA driver polls
+// for until the kernel has them set up (see ataInitIRQ)
+int procWait(void *queue, long timeout) {
+    return 0;
+}
 
-void sleep(unsigned int count) {
-    int i, x;
-    for (i = 0; i < count * 100; i++) {
-        x += 123;
+void procWaitQueueInit(void *queue) {
+}
+
+void procWakeQueue(void *queue) {
+}
+
+static char *cache_data(int idx, int block_size) {
+    return (char*)BLOCK_CACHE_ADDR + CACHE_TABLE_BYTES + block_size * idx;
+}
+
+// Empties the cache and splits it up for blocks of 'block_size'
+static void cache_reset(int block_size) {
+    int i;
+    block_cache_size = CACHE_BYTES / block_size;
+    for (i = 0; i < block_cache_size; i++) {
+        block_cache[i].drive = -1;
     }
+    block_cache_next = 0;
+    readahead_drive = -1;
 }
 
+// 'fs' is the filesystem or one of the drives it's striped across, with the
+// drive number as its user_data
 int read_fn(struct TFS *fs, char *buf, unsigned int block) {
-    int i;
-    // Check the cache
+    int i, idx, count, drive = (int)fs->user_data, sectors = fs->block_size >> 9;
+    char *data;
+
+    // Check the cache, newest first
     for (i = 0; i < block_cache_size; i++) {
-        if (block_cache[i] == block) {
-            char *cached_block = ((char*)BLOCK_CACHE_ADDR) + 4096 * (i+1);
-            for (i = 0; i < 4096; i++) {
-                buf[i] = cached_block[i];
-            }
-            return 0;
+        idx = (block_cache_next + block_cache_size - 1 - i) % block_cache_size;
+        if (block_cache[idx].drive == drive && block_cache[idx].block == block) {
+            break;
         }
     }
-    // 8 sectors per block in our filesystem
-    if (loadFromDisk(34 + (block << 3), 8, buf) == 1) {
-        char *cached_block = ((char*)BLOCK_CACHE_ADDR) + 4096 * (block_cache_size+1);
-        for (i = 0; i < 4096; i++) {
-            cached_block[i] = buf[i];
+    if (i == block_cache_size) {
+        count = 1;
+        if (drive == readahead_drive && block == readahead_next) {
+            count = readahead_blocks * 2;
+            if (count > READAHEAD_SECTORS / sectors) {
+                count = READAHEAD_SECTORS / sectors ? READAHEAD_SECTORS / sectors : 1;
+            }
+        }
+        // The blocks go next to each other, so back to the start if there
+        // isn't room before the end
+        if (block_cache_next + count > block_cache_size) {
+            block_cache_next = 0;
+        }
+        idx = block_cache_next;
+        // What was in the slots is gone once the read starts, whether or not
+        // it succeeds
+        for (i = 0; i < count; i++) {
+            block_cache[idx + i].drive = -1;
+        }
+        disk_reads++;
+        if (loadFromDisk(drive, FS_START_SECTOR(drive) + block * sectors, count * sectors, cache_data(idx, fs->block_size)) != 1) {
+            // Reading ahead may have run off the end of the drive
+            count = 1;
+            disk_reads++;
+            if (loadFromDisk(drive, FS_START_SECTOR(drive) + block * sectors, sectors, cache_data(idx, fs->block_size)) != 1) {
+                return -1;
+            }
         }
-        block_cache[block_cache_size++] = block;
-        return 0;
+        for (i = 0; i < count; i++) {
+            block_cache[idx + i].drive = drive;
+            block_cache[idx + i].block = block + i;
+        }
+        block_cache_next = (idx + count) % block_cache_size;
+        blocks_read += count;
+        readahead_drive = drive;
+        readahead_next = block + count;
+        readahead_blocks = count;
+    }
+    data = cache_data(idx, fs->block_size);
+    for (i = 0; i < fs->block_size; i++) {
+        buf[i] = data[i];
     }
-    return -1;
+    return 0;
 }
 
 void load_kernel() {
@@ -53,21 +146,45 @@ void load_kernel() {
     TFS tfs;
     char handle_storage[8*TFS_FILE_HANDLE_SIZE];
     FileHandle *file;
+    int i;
 
     initScreen();
     printStr("Bootloader stage 2 loaded.\n");
 
-    block_cache = (unsigned int*)BLOCK_CACHE_ADDR;
-    block_cache_size = 0;
+    ataInit();
+
+    block_cache = (BlockCacheEntry*)BLOCK_CACHE_ADDR;
+    cache_reset(TFS_MIN_BLOCK_SIZE);
 
+    for (i = 0; i < FS_MAX_DRIVES; i++) {
+        drives[i].read_fn = read_fn;
+        drives[i].submit_fn = NULL;
+        drives[i].user_data = (void*)i;
+    }
     tfs.read_fn = read_fn;
+    tfs.user_data = (void*)0;
     // We really don't want a write function at this moment
     tfsInit(&tfs, (FileHandle*)handle_storage, 8);
 
     if (tfsOpenFilesystem(&tfs) != 0) {
-        printStr("Failed to open filesystem!\n");
-        while (1) {};
+        // The kernel may be on any of the drives the filesystem is striped across
+        if (tfs.header.magic != TFS_MAGIC || tfs.header.stripe_devices <= 1 ||
+            tfs.header.stripe_devices > FS_MAX_DRIVES ||
+            tfsStripeInit(&stripe, drives, tfs.header.stripe_devices) != 0) {
+            printStr("Failed to open filesystem!\n");
+            while (1) {};
+        }
+        tfsStripeAttach(&stripe, &tfs);
+        if (tfsOpenFilesystem(&tfs) != 0) {
+            printStr("Failed to open filesystem!\n");
+            while (1) {};
+        }
     }
+    // The header was read before the block size was known
+    cache_reset(tfs.block_size);
+    tfsSetScratch(&tfs, (char*)TFS_SCRATCH_ADDR, TFS_SCRATCH_SIZE(tfs.block_size));
+    blocks_read = 0;
+    disk_reads = 0;
 
     file = tfsOpenFile(&tfs, "", "kernel");
     if (file == NULL) {
@@ -82,6 +199,11 @@ void load_kernel() {
         while (1) {};
     }
 
+    printStr("Read 0x");
+    printShort(blocks_read);
+    printStr(" blocks in 0x");
+    printShort(disk_reads);
+    printStr(" commands.\n");
     printStr("Starting kernel...\n");
 }
 
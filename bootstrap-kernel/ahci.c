@@ -0,0 +1,637 @@
+#include "kernel.h"
+#include <tomfs.h>
+
+// HBA registers, from the ABAR
+#define AHCI_CAP            0x00
+#define AHCI_GHC            0x04
+#define AHCI_IS             0x08
+#define AHCI_PI             0x0C
+
+#define AHCI_CAP_SNCQ       (1 << 30)
+#define AHCI_GHC_IE         (1 << 1)
+#define AHCI_GHC_AE         (1 << 31)
+
+// Port registers, from AHCI_PORT_REGS
+#define AHCI_PORT_REGS(port) (0x100 + (port) * 0x80)
+#define PX_CLB              0x00
+#define PX_CLBU             0x04
+#define PX_FB               0x08
+#define PX_FBU              0x0C
+#define PX_IS               0x10
+#define PX_IE               0x14
+#define PX_CMD              0x18
+#define PX_TFD              0x20
+#define PX_SIG              0x24
+#define PX_SSTS             0x28
+#define PX_SERR             0x30
+#define PX_SACT             0x34
+#define PX_CI               0x38
+
+#define PX_CMD_ST           (1 << 0)
+#define PX_CMD_SUD          (1 << 1)
+#define PX_CMD_POD          (1 << 2)
+#define PX_CMD_FRE          (1 << 4)
+#define PX_CMD_FR           (1 << 14)
+#define PX_CMD_CR           (1 << 15)
+
+// A command finished (register FIS), a PIO command finished (PIO setup FIS)
+// or queued commands finished (set device bits FIS)
+#define PX_IS_DONE          0x0000000B
+// Task file, host bus, interface and overflow errors, after which the port
+// has stopped
+#define PX_IS_ERRORS        0x7D000000
+
+#define PX_TFD_BUSY         0x88
+
+// Signature of a SATA disk, rather than ATAPI or a port multiplier
+#define AHCI_SIG_ATA        0x00000101
+
+#define AHCI_CMD_READ_DMA_EXT       0x25
+#define AHCI_CMD_WRITE_DMA_EXT      0x35
+#define AHCI_CMD_READ_FPDMA_QUEUED  0x60
+#define AHCI_CMD_WRITE_FPDMA_QUEUED 0x61
+#define AHCI_CMD_FLUSH_CACHE_EXT    0xEA
+#define AHCI_CMD_IDENTIFY           0xEC
+
+#define AHCI_MAX_SLOTS      32
+
+// A command table is the command FIS and friends in its first 128 bytes, then
+// the PRDT. 24 entries cover the largest TomFS block a page at a time, with a
+// page to spare for a buffer that doesn't start on a page boundary.
+#define AHCI_MAX_PRDS       24
+#define AHCI_TABLE_SIZE     (0x80 + AHCI_MAX_PRDS * 16)
+
+// Ticks a request is waited on before the port is checked in case its
+// interrupt isn't coming
+#define AHCI_POLL_TICKS     4
+
+// Register polls before setting up a port is given up on
+#define AHCI_SPIN_TIMEOUT   10000000
+
+// The result of a request that hasn't completed yet, as for the block queue
+#define AHCI_PENDING        BLOCK_PENDING
+
+#define AHCI_REG(address)   (*(volatile unsigned int *)(address))
+
+typedef struct {
+    int present;
+    int number;
+    unsigned int regs;
+
+    // 32 command headers of 8 words, then the FIS receive area
+    unsigned int *command_list;
+    unsigned char *received_fis;
+    // A command table for each slot, 8 to a page
+    unsigned char *tables[AHCI_MAX_SLOTS / 8];
+
+    // Size of the disk, up to 2 TB
+    unsigned int sectors;
+    // Whether it takes queued commands (NCQ), and how many commands are put
+    // to it at once, which is 1 without NCQ
+    int ncq;
+    int depth;
+
+    // Slots with a command in them, and whether those are queued commands,
+    // which can't share the port with ones that aren't
+    unsigned int busy;
+    int busy_count;
+    int busy_queued;
+    TFSIORequest *slots[AHCI_MAX_SLOTS];
+
+    // Times the port has stopped on an error, and the interrupt status of the
+    // last one
+    unsigned int errors;
+    unsigned int last_error;
+
+    // Requests waiting for a slot, linked through their next
+    TFSIORequest *pending_head;
+    TFSIORequest *pending_tail;
+
+    // The filesystem or device the port is attached to (see ahciAttach),
+    // which its requests are completed on, and the sector its block 0 is at
+    struct TFS *tfs;
+    unsigned int start_sector;
+
+    // Processes waiting for a request on the port to complete
+    TKWaitQueue queue;
+} AHCIPort;
+
+unsigned int ahci_abar = 0;
+int ahci_irq = -1;
+AHCIPort ahci_ports[AHCI_MAX_PORTS];
+
+static unsigned char *ahciTable(AHCIPort *port, int slot) {
+    return port->tables[slot >> 3] + (slot & 7) * AHCI_TABLE_SIZE;
+}
+
+// Fills in a command table's PRDT for 'bytes' at 'buffer'. The buffer's pages
+// needn't be next to each other in memory, so it's described a page at a
+// time, joining pages that are. Returns the number of entries, or -1 if it
+// won't fit or isn't word aligned.
+static int ahciBuildPRDT(unsigned char *table, char *buffer, unsigned int bytes) {
+    unsigned int *prd = (unsigned int *)(table + 0x80);
+    unsigned int address = (unsigned int)buffer, physical, chunk;
+    TKVPageDirectory directory = tk_process_table[0].vmm_directory;
+    int n = 0;
+
+    if ((address & 1) != 0 || (bytes & 1) != 0) {
+        return -1;
+    }
+    while (bytes > 0) {
+        chunk = 4096 - (address & 0xfff);
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        physical = vmmGetPhysical(directory, address);
+        if (n > 0 && prd[(n - 1) * 4] + (prd[(n - 1) * 4 + 3] & 0x3fffff) + 1 == physical) {
+            // Carries on from the last entry; the byte count is one less
+            // than the bytes it covers
+            prd[(n - 1) * 4 + 3] += chunk;
+        } else {
+            if (n == AHCI_MAX_PRDS) {
+                return -1;
+            }
+            prd[n * 4] = physical;
+            prd[n * 4 + 1] = 0;
+            prd[n * 4 + 2] = 0;
+            prd[n * 4 + 3] = chunk - 1;
+            n++;
+        }
+        address += chunk;
+        bytes -= chunk;
+    }
+    return n;
+}
+
+// Sets up the command in 'slot'. A queued command carries its sector count
+// in the features register, and its slot as its tag. Returns 0 on success.
+static int ahciBuildCommand(AHCIPort *port, int slot, unsigned char command, unsigned int lba, int sectors,
+                            char *buffer, unsigned int bytes, int write, int queued) {
+    unsigned char *table = ahciTable(port, slot), *fis = table;
+    unsigned int *header = &port->command_list[slot * 8];
+    int i, prds = 0;
+
+    if (bytes > 0 && (prds = ahciBuildPRDT(table, buffer, bytes)) < 0) {
+        return -1;
+    }
+    for (i = 0; i < 64; i++) {
+        fis[i] = 0;
+    }
+    // Register FIS, host to device, carrying a command
+    fis[0] = 0x27;
+    fis[1] = 0x80;
+    fis[2] = command;
+    fis[4] = lba & 0xff;
+    fis[5] = (lba >> 8) & 0xff;
+    fis[6] = (lba >> 16) & 0xff;
+    // LBA addressing
+    fis[7] = 0x40;
+    fis[8] = (lba >> 24) & 0xff;
+    if (queued) {
+        fis[3] = sectors & 0xff;
+        fis[11] = (sectors >> 8) & 0xff;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = sectors & 0xff;
+        fis[13] = (sectors >> 8) & 0xff;
+    }
+
+    // The FIS is 5 words long
+    header[0] = 5 | (write ? (1 << 6) : 0) | (prds << 16);
+    header[1] = 0;
+    header[2] = (unsigned int)table;
+    header[3] = 0;
+    return 0;
+}
+
+// Puts waiting requests into free slots, for as long as there's room
+static void ahciStart(AHCIPort *port) {
+    TFSIORequest *req;
+    unsigned char command;
+    int slot, queued, write, result, sectors = port->tfs->block_size >> 9;
+
+    while ((req = port->pending_head) != NULL) {
+        queued = port->ncq && req->op != TFS_IO_FLUSH;
+        if (port->busy_count == port->depth ||
+            (port->busy_count > 0 && !(queued && port->busy_queued))) {
+            break;
+        }
+        port->pending_head = req->next;
+        if (port->pending_head == NULL) {
+            port->pending_tail = NULL;
+        }
+
+        for (slot = 0; port->busy & (1u << slot); slot++) {
+        }
+        write = req->op == TFS_IO_WRITE;
+        if (req->op == TFS_IO_FLUSH) {
+            result = ahciBuildCommand(port, slot, AHCI_CMD_FLUSH_CACHE_EXT, 0, 0, NULL, 0, 0, 0);
+        } else {
+            if (queued) {
+                command = write ? AHCI_CMD_WRITE_FPDMA_QUEUED : AHCI_CMD_READ_FPDMA_QUEUED;
+            } else {
+                command = write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+            }
+            result = ahciBuildCommand(port, slot, command, port->start_sector + req->block * sectors, sectors,
+                                      req->buf, port->tfs->block_size, write, queued);
+        }
+        if (result != 0) {
+            tfsCompleteRequest(port->tfs, req, -1);
+            continue;
+        }
+
+        port->slots[slot] = req;
+        port->busy |= 1u << slot;
+        port->busy_count++;
+        port->busy_queued = queued;
+        if (queued) {
+            AHCI_REG(port->regs + PX_SACT) = 1u << slot;
+        }
+        AHCI_REG(port->regs + PX_CI) = 1u << slot;
+    }
+}
+
+static int ahciStopPort(unsigned int regs) {
+    unsigned int timeout;
+
+    AHCI_REG(regs + PX_CMD) &= ~PX_CMD_ST;
+    for (timeout = 0; AHCI_REG(regs + PX_CMD) & PX_CMD_CR; timeout++) {
+        if (timeout == AHCI_SPIN_TIMEOUT) {
+            return -1;
+        }
+    }
+    AHCI_REG(regs + PX_CMD) &= ~PX_CMD_FRE;
+    for (timeout = 0; AHCI_REG(regs + PX_CMD) & PX_CMD_FR; timeout++) {
+        if (timeout == AHCI_SPIN_TIMEOUT) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void ahciStartPort(unsigned int regs) {
+    AHCI_REG(regs + PX_SERR) = 0xffffffff;
+    AHCI_REG(regs + PX_IS) = 0xffffffff;
+    AHCI_REG(regs + PX_CMD) |= PX_CMD_FRE | PX_CMD_SUD | PX_CMD_POD;
+    AHCI_REG(regs + PX_CMD) |= PX_CMD_ST;
+}
+
+// Completes the requests the port has finished and starts waiting ones in
+// their slots. Called with interrupts disabled, from the interrupt handler or
+// by a process that's been waiting a while in case the interrupt isn't
+// coming.
+static void ahciPortPoll(AHCIPort *port) {
+    TFSIORequest *finished[AHCI_MAX_SLOTS];
+    unsigned int status, done;
+    int slot, i, n = 0, result = 0;
+
+    status = AHCI_REG(port->regs + PX_IS);
+    AHCI_REG(port->regs + PX_IS) = status;
+    if (status & PX_IS_ERRORS) {
+        // The port has stopped. Rather than work out which command failed,
+        // restart it and fail them all. This goes to the screen only: the log
+        // may be on this very port, which can't take a request from here.
+        port->errors++;
+        port->last_error = status;
+        printStr("AHCI: Error ");
+        printInt(status);
+        printStr(" on port ");
+        printByte(port->number);
+        printStr("\n");
+        ahciStopPort(port->regs);
+        ahciStartPort(port->regs);
+        done = port->busy;
+        result = -1;
+    } else {
+        // A queued command is done once the drive clears it in SACT, and any
+        // other once the HBA clears it in CI
+        done = port->busy & ~(AHCI_REG(port->regs + PX_CI) | AHCI_REG(port->regs + PX_SACT));
+    }
+
+    for (slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (done & (1u << slot)) {
+            finished[n++] = port->slots[slot];
+            port->slots[slot] = NULL;
+        }
+    }
+    port->busy &= ~done;
+    port->busy_count -= n;
+
+    // Refill the slots first, as completing a request may submit another
+    ahciStart(port);
+    for (i = 0; i < n; i++) {
+        tfsCompleteRequest(port->tfs, finished[i], result);
+    }
+    if (n > 0) {
+        procWakeQueue(&port->queue);
+    }
+}
+
+int ahciHandleIRQ(unsigned int irq) {
+    unsigned int pending;
+    int port;
+
+    if (ahci_abar == 0 || irq != ahci_irq) {
+        return 0;
+    }
+    pending = AHCI_REG(ahci_abar + AHCI_IS);
+    for (port = 0; port < AHCI_MAX_PORTS; port++) {
+        if ((pending & (1u << port)) && ahci_ports[port].present) {
+            ahciPortPoll(&ahci_ports[port]);
+        }
+    }
+    // Cleared after the ports, which would otherwise raise it again
+    AHCI_REG(ahci_abar + AHCI_IS) = pending;
+    return 1;
+}
+
+// Requests are started as soon as there's a slot for them, and completed from
+// the interrupt handler. With NCQ, the disk has up to 'depth' of them at once.
+static int ahciSubmit(struct TFS *fs, TFSIORequest *req) {
+    AHCIPort *port = (AHCIPort *)fs->user_data;
+    unsigned int flags;
+
+    if (req->op != TFS_IO_READ && req->op != TFS_IO_WRITE && req->op != TFS_IO_FLUSH) {
+        return -1;
+    }
+    flags = disableInterrupts();
+    req->next = NULL;
+    if (port->pending_tail) {
+        port->pending_tail->next = req;
+    } else {
+        port->pending_head = req;
+    }
+    port->pending_tail = req;
+    ahciStart(port);
+    restoreInterrupts(flags);
+    return 0;
+}
+
+// Waits for a request on 'port' to complete, running other processes in the
+// meantime
+static void ahciWait(AHCIPort *port, volatile int *result) {
+    unsigned int flags = disableInterrupts();
+    while (*result == AHCI_PENDING) {
+        if (!procWait(&port->queue, AHCI_POLL_TICKS)) {
+            ahciPortPoll(port);
+        }
+    }
+    restoreInterrupts(flags);
+}
+
+int ahciWaitRequest(struct TFS *fs, TFSIORequest *req) {
+    ahciWait((AHCIPort *)fs->user_data, &req->result);
+    return req->result;
+}
+
+static void ahciSyncDone(struct TFS *fs, TFSIORequest *req) {
+}
+
+// Carries out a request and waits for it, for read_fn and write_fn
+static int ahciSyncRequest(struct TFS *fs, int op, char *buf, unsigned int block) {
+    TFSIORequest req;
+
+    req.op = op;
+    req.buf = buf;
+    req.block = block;
+    req.callback = ahciSyncDone;
+    req.result = AHCI_PENDING;
+    if (tfsSubmitRequest(fs, &req) != 0) {
+        return -1;
+    }
+    ahciWait((AHCIPort *)fs->user_data, &req.result);
+    return req.result;
+}
+
+static int ahciReadBlock(struct TFS *fs, char *buf, unsigned int block) {
+    return ahciSyncRequest(fs, TFS_IO_READ, buf, block);
+}
+
+static int ahciWriteBlock(struct TFS *fs, const char *buf, unsigned int block) {
+    return ahciSyncRequest(fs, TFS_IO_WRITE, (char *)buf, block);
+}
+
+// Runs a command in slot 0 and spins until it's done, for setting up a port
+// before it takes requests. Returns 0 on success.
+static int ahciRunCommand(AHCIPort *port, unsigned char command, char *buffer, unsigned int bytes) {
+    unsigned int timeout;
+
+    if (ahciBuildCommand(port, 0, command, 0, 0, buffer, bytes, 0, 0) != 0) {
+        return -1;
+    }
+    AHCI_REG(port->regs + PX_CI) = 1;
+    for (timeout = 0; timeout < AHCI_SPIN_TIMEOUT; timeout++) {
+        if (AHCI_REG(port->regs + PX_IS) & PX_IS_ERRORS) {
+            return -1;
+        }
+        if ((AHCI_REG(port->regs + PX_CI) & 1) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Sets up the port if there's a SATA disk on it, and finds out how big it is
+// and how many commands it can queue
+static void ahciInitPort(int number, unsigned int cap) {
+    AHCIPort *port = &ahci_ports[number];
+    unsigned int regs = ahci_abar + AHCI_PORT_REGS(number), ssts, timeout;
+    unsigned short identify[256];
+    unsigned char *page;
+    int i, depth;
+
+    // Wants a device that's there and awake (DET 3, IPM 1)
+    ssts = AHCI_REG(regs + PX_SSTS);
+    if ((ssts & 0xf) != 3 || ((ssts >> 8) & 0xf) != 1 || AHCI_REG(regs + PX_SIG) != AHCI_SIG_ATA) {
+        return;
+    }
+    if (ahciStopPort(regs) != 0) {
+        kprintf("AHCI: Port %d won't stop\n", number);
+        return;
+    }
+
+    page = (unsigned char *)allocPage();
+    for (i = 0; i < 4096; i++) {
+        page[i] = 0;
+    }
+    port->command_list = (unsigned int *)page;
+    port->received_fis = page + 1024;
+    for (i = 0; i < AHCI_MAX_SLOTS / 8; i++) {
+        port->tables[i] = (unsigned char *)allocPage();
+    }
+    AHCI_REG(regs + PX_CLB) = (unsigned int)port->command_list;
+    AHCI_REG(regs + PX_CLBU) = 0;
+    AHCI_REG(regs + PX_FB) = (unsigned int)port->received_fis;
+    AHCI_REG(regs + PX_FBU) = 0;
+    ahciStartPort(regs);
+
+    port->number = number;
+    port->regs = regs;
+    port->busy = 0;
+    port->busy_count = 0;
+    port->pending_head = NULL;
+    port->pending_tail = NULL;
+    port->tfs = NULL;
+    procWaitQueueInit(&port->queue);
+
+    for (timeout = 0; AHCI_REG(regs + PX_TFD) & PX_TFD_BUSY; timeout++) {
+        if (timeout == AHCI_SPIN_TIMEOUT) {
+            kprintf("AHCI: Port %d stays busy\n", number);
+            return;
+        }
+    }
+    if (ahciRunCommand(port, AHCI_CMD_IDENTIFY, (char *)identify, sizeof(identify)) != 0) {
+        kprintf("AHCI: Port %d didn't identify its disk\n", number);
+        return;
+    }
+    if (identify[83] & (1 << 10)) {
+        // 48-bit sector count, of which 2 TB worth is used
+        port->sectors = (identify[102] || identify[103]) ? 0xffffffff : identify[100] | (identify[101] << 16);
+    } else {
+        port->sectors = identify[60] | (identify[61] << 16);
+    }
+    // The drive's queue depth is in word 75, and the HBA's in CAP
+    port->ncq = (cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8));
+    port->depth = 1;
+    if (port->ncq) {
+        port->depth = (identify[75] & 0x1f) + 1;
+        depth = ((cap >> 8) & 0x1f) + 1;
+        if (depth < port->depth) {
+            port->depth = depth;
+        }
+    }
+
+    AHCI_REG(regs + PX_IE) = PX_IS_DONE | PX_IS_ERRORS;
+    port->present = 1;
+    kprintf("AHCI: Port %d has a %d MB disk taking %d commands at once\n", number, port->sectors >> 11, port->depth);
+}
+
+void ahciInit() {
+    unsigned int abar, cap, implemented;
+    int irq, i;
+
+    for (i = 0; i < AHCI_MAX_PORTS; i++) {
+        ahci_ports[i].present = 0;
+    }
+    if (!pciGetAHCIConfig(&abar, &irq)) {
+        return;
+    }
+    // The registers are above the memory the kernel has mapped. They're
+    // uncached as the region PCI devices are in is set up that way.
+    vmmMapPage(tk_process_table[0].vmm_directory, abar & 0xfffff000, abar & 0xfffff000, 0);
+    vmmMapPage(tk_process_table[0].vmm_directory, (abar & 0xfffff000) + 0x1000, (abar & 0xfffff000) + 0x1000, 0);
+    ahci_abar = abar;
+
+    AHCI_REG(abar + AHCI_GHC) |= AHCI_GHC_AE;
+    cap = AHCI_REG(abar + AHCI_CAP);
+    implemented = AHCI_REG(abar + AHCI_PI);
+    for (i = 0; i < AHCI_MAX_PORTS; i++) {
+        if (implemented & (1u << i)) {
+            ahciInitPort(i, cap);
+        }
+    }
+
+    ahci_irq = irq;
+    AHCI_REG(abar + AHCI_IS) = 0xffffffff;
+    AHCI_REG(abar + AHCI_GHC) |= AHCI_GHC_IE;
+}
+
+// Has 'tfs' read and write the disk on 'port', from 'start_sector' on.
+// Requests are completed on 'tfs', so only one TFS can be attached to a port.
+// A request with no callback goes on the completion queue from the interrupt
+// handler, so reap them with interrupts disabled. Returns 0 on success, or -1
+// if there's no disk on the port.
+int ahciAttach(int port, struct TFS *tfs, unsigned int start_sector) {
+    if (port < 0 || port >= AHCI_MAX_PORTS || !ahci_ports[port].present) {
+        return -1;
+    }
+    ahci_ports[port].tfs = tfs;
+    ahci_ports[port].start_sector = start_sector;
+    tfs->read_fn = ahciReadBlock;
+    tfs->write_fn = ahciWriteBlock;
+    tfs->submit_fn = ahciSubmit;
+    tfs->user_data = &ahci_ports[port];
+    return 0;
+}
+
+// Reads 'count' 4 KB blocks at random from the first 8 MB of each disk, at
+// queue depths from 1 to as many as it takes, then from the first IDE drive
+// for comparison, and logs how long each took
+void ahciBenchmark(int count) {
+    static const int depths[] = { 1, 4, 16, 32 };
+    static TFS tfs;
+    TFSIORequest reqs[AHCI_MAX_SLOTS], *done[AHCI_MAX_SLOTS];
+    char *buffers[AHCI_MAX_SLOTS];
+    unsigned int seed, blocks = 2048, flags;
+    int p, d, i, n, submitted, completed, ok;
+    AHCIPort *port;
+    long start, ms;
+
+    for (i = 0; i < AHCI_MAX_SLOTS; i++) {
+        buffers[i] = (char *)allocPage();
+    }
+    for (p = 0; p < AHCI_MAX_PORTS; p++) {
+        port = &ahci_ports[p];
+        if (!port->present) {
+            continue;
+        }
+        tfs.block_size = 4096;
+        tfs.completed_head = NULL;
+        tfs.completed_tail = NULL;
+        ahciAttach(p, &tfs, 0);
+
+        for (d = 0; d < sizeof(depths) / sizeof(depths[0]) && depths[d] <= port->depth; d++) {
+            seed = 1;
+            submitted = 0;
+            completed = 0;
+            ok = 1;
+            start = getSystemCounter();
+            for (i = 0; i < depths[d] && submitted < count; i++, submitted++) {
+                seed = seed * 1103515245 + 12345;
+                reqs[i].op = TFS_IO_READ;
+                reqs[i].block = (seed >> 16) % blocks;
+                reqs[i].buf = buffers[i];
+                reqs[i].callback = NULL;
+                tfsSubmitRequest(&tfs, &reqs[i]);
+            }
+            while (completed < submitted) {
+                flags = disableInterrupts();
+                while ((n = tfsReapCompletions(&tfs, done, AHCI_MAX_SLOTS)) == 0) {
+                    if (!procWait(&port->queue, AHCI_POLL_TICKS)) {
+                        ahciPortPoll(port);
+                    }
+                }
+                restoreInterrupts(flags);
+                for (i = 0; i < n; i++) {
+                    completed++;
+                    ok &= done[i]->result == 0;
+                    if (submitted < count) {
+                        seed = seed * 1103515245 + 12345;
+                        done[i]->block = (seed >> 16) % blocks;
+                        tfsSubmitRequest(&tfs, done[i]);
+                        submitted++;
+                    }
+                }
+            }
+            // The system counter runs at 1024 Hz
+            ms = (getSystemCounter() - start) * 1000 / 1024;
+            kprintf("AHCI: Port %d, queue depth %d: %d random 4 KB reads in %d ms (%d IOPS)%s\n", p, depths[d],
+                    count, ms, ms ? count * 1000 / ms : 0, ok ? "" : ", with errors");
+        }
+        if (port->errors > 0) {
+            kprintf("AHCI: Port %d has stopped on %d errors, the last %X\n", p, port->errors, port->last_error);
+        }
+        port->tfs = NULL;
+    }
+
+    seed = 1;
+    ok = 1;
+    start = getSystemCounter();
+    for (i = 0; i < count && ok; i++) {
+        seed = seed * 1103515245 + 12345;
+        ok = loadFromDisk(0, (seed >> 16) % blocks * 8, 8, (unsigned char *)buffers[0]);
+    }
+    ms = (getSystemCounter() - start) * 1000 / 1024;
+    kprintf("ATA: Drive 0: %d random 4 KB reads in %d ms (%d IOPS)%s\n",
+            count, ms, ms ? count * 1000 / ms : 0, ok ? "" : ", with errors");
+}
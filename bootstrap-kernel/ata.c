@@ -1,94 +1,651 @@
 #include "kernel.h"
 
-unsigned int BASE_ADDRESS = 0;
-unsigned int CONTROL_ADDRESS = 0;
+// Bus master registers, from the channel's busmaster
+#define BM_COMMAND          0
+#define BM_STATUS           2
+#define BM_PRDT             4
 
-int waitForATABusy() {
+#define BM_CMD_START        0x01
+// Set for transfers from the drive to memory
+#define BM_CMD_READ         0x08
+
+#define BM_STATUS_ACTIVE    0x01
+#define BM_STATUS_ERROR     0x02
+#define BM_STATUS_IRQ       0x04
+
+// Commands, and their forms with 48-bit addresses and 16-bit counts
+#define ATA_CMD_READ_SECTORS        0x20
+#define ATA_CMD_READ_SECTORS_EXT    0x24
+#define ATA_CMD_WRITE_SECTORS       0x30
+#define ATA_CMD_WRITE_SECTORS_EXT   0x34
+#define ATA_CMD_READ_MULTIPLE       0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT   0x29
+#define ATA_CMD_WRITE_MULTIPLE      0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT  0x39
+#define ATA_CMD_READ_DMA            0xC8
+#define ATA_CMD_READ_DMA_EXT        0x25
+#define ATA_CMD_WRITE_DMA           0xCA
+#define ATA_CMD_WRITE_DMA_EXT       0x35
+#define ATA_CMD_FLUSH_CACHE         0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT     0xEA
+#define ATA_CMD_SET_MULTIPLE        0xC6
+#define ATA_CMD_IDENTIFY            0xEC
+
+// Most sectors one command moves. 28-bit commands write 256 to the count
+// register as 0.
+#define ATA_MAX_SECTORS     256
+
+// Sectors 28-bit commands can reach, 128 GB worth. Transfers beyond them need
+// a drive with 48-bit addressing.
+#define ATA_LBA28_LIMIT     0x10000000
+
+// Most bytes a transfer can bounce through a channel's bounce pages, which is as
+// much as one command can move
+#define ATA_DMA_BOUNCE_PAGES (ATA_MAX_SECTORS * 512 / 4096)
+
+// Memory below this is identity mapped, so its addresses can be handed to the
+// bus master as they are (see procInitKernel)
+#define ATA_DMA_IDENTITY_LIMIT 0x400000
+
+// Status polls before a drive is given up on
+#define ATA_POLL_TIMEOUT    10000000
+
+// Ticks to wait for an interrupt before a channel is taken not to raise them,
+// and polled from then on
+#define ATA_IRQ_TIMEOUT     256
+
+// A physical region descriptor: a buffer for the bus master to fill or drain,
+// which mustn't cross a 64 KB boundary. The last one in a table has
+// PRD_END set.
+typedef struct {
+    unsigned int address;
+    // 0 means 64 KB
+    unsigned short byte_count;
+    unsigned short flags;
+} ATAPhysicalRegion;
+
+#define PRD_END             0x8000
+
+// Each channel's registers and state, found once by ataInit. Channels are
+// numbered by drive >> 1, and raise IRQ 14 + channel. Each is used by one
+// process at a time, while the other can be busy with another.
+typedef struct {
+    // Command and control block registers, or 0 if the channel isn't there
+    unsigned int base;
+    unsigned int control;
+    // Bus master IDE registers of the channel, or 0 if it has none
+    unsigned int busmaster;
+    unsigned int irq;
+
+    // Set up by ataInitDMA, for channels with a bus master
+    ATAPhysicalRegion *prd_table;
+    char *bounce_pages[ATA_DMA_BOUNCE_PAGES];
+
+    // Set if the interrupt never came, and the channel is polled instead
+    int irq_failed;
+    // Set by ataHandleIRQ, with the status the drive raised the interrupt
+    // with
+    volatile int irq_done;
+    volatile unsigned char irq_status;
+    TKWaitQueue irq_queue;
+
+    // The registers are for one drive at a time, so only one process can be
+    // using the channel. The rest wait on busy_queue.
+    volatile int busy;
+    TKWaitQueue busy_queue;
+} ATAChannel;
+
+ATAChannel ata_channels[2];
+
+#define ATA_CHANNEL(drive) (&ata_channels[(drive) >> 1])
+
+// Set by ataInitDMA. Until then, and on drives DMA has failed on, every
+// transfer uses PIO.
+int ata_dma_enabled = 0;
+int ata_dma_failed[4];
+
+// What IDENTIFY DEVICE said about each drive, found out the first time it's
+// used (see ataIdentify)
+typedef struct {
+    // Whether anything answered at all when ataInit looked
+    int present;
+    int identified;
+    // Whether it has 48-bit addressing
+    int lba48;
+    // Sectors moved per interrupt by READ/WRITE MULTIPLE, or 0 if those
+    // aren't set up and READ/WRITE SECTORS is used instead
+    int multiple;
+} ATADriveInfo;
+
+ATADriveInfo ata_drive_info[4];
+
+// Set by ataInitIRQ. Until then, and on channels whose interrupt never came,
+// transfers poll the status register instead.
+int ata_irq_enabled = 0;
+
+// Waits for the channel's drive to clear BSY, spinning rather than sleeping
+// as commands are usually over in a fraction of a tick. Returns the status,
+// or 0 on error or timeout.
+static int waitForATABusy(ATAChannel *ch) {
+    unsigned int timeout;
     unsigned char b;
-    do {
-        sleep(100);
-        b = inb(BASE_ADDRESS + 7);
-        if ((b & 0x21) != 0) {
-            unsigned char e = inb(BASE_ADDRESS + 1);
-            //kprintf("Drive error! %02x %02x\n", b, e);
-            return 0;
+    // The status isn't valid for 400ns after a command is issued. Reading the
+    // alternate status takes 100ns, and doesn't acknowledge the interrupt.
+    for (timeout = 0; timeout < 4; timeout++) {
+        inb(ch->control + 6);
+    }
+    for (timeout = 0; timeout < ATA_POLL_TIMEOUT; timeout++) {
+        b = inb(ch->base + 7);
+        if ((b & 0x80) == 0) {
+            return (b & 0x21) ? 0 : b;
+        }
+    }
+    return 0;
+}
+
+// Whether anything answers as 'drive'. A channel with nothing on it floats
+// its status at 0xFF, and a missing drive next to one that's there reads 0.
+static int ataProbe(int drive) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    unsigned char status;
+    int i;
+
+    if (ch->base == 0) {
+        return 0;
+    }
+    outb(ch->base + 6, 0xA0 | ((drive & 1) << 4));
+    for (i = 0; i < 4; i++) {
+        inb(ch->control + 6);
+    }
+    status = inb(ch->base + 7);
+    return status != 0xFF && status != 0;
+}
+
+// Finds both channels' registers and which drives are on them. Drives are
+// numbered 0-3: the master and slave of the primary channel, then of the
+// secondary one.
+void ataInit() {
+    ATAChannel *ch;
+    unsigned int bmideBase;
+    int channel, drive, irqNum;
+
+    for (channel = 0; channel < 2; channel++) {
+        ch = &ata_channels[channel];
+        ch->base = 0;
+        ch->control = 0;
+        bmideBase = 0;
+        irqNum = 0;
+        if (!pciGetIDEConfig(channel, &ch->base, &ch->control, &bmideBase, &irqNum)) {
+            // Where the channels are without PCI telling us
+            ch->base = channel ? 0x170 : 0x1F0;
+            ch->control = channel ? 0x370 : 0x3F0;
         }
-    } while ((b & 0x80) != 0);
-    return b;
+        ch->busmaster = bmideBase;
+        ch->irq = irqNum;
+        ch->prd_table = 0;
+        ch->irq_failed = 0;
+        ch->irq_done = 0;
+        ch->busy = 0;
+        procWaitQueueInit(&ch->irq_queue);
+        procWaitQueueInit(&ch->busy_queue);
+    }
+    for (drive = 0; drive < 4; drive++) {
+        ata_drive_info[drive].present = ataProbe(drive);
+        ata_drive_info[drive].identified = 0;
+        ata_dma_failed[drive] = 0;
+    }
 }
 
-void ataDetectDevice(int slave) {
-    unsigned int bmideBase, irqNum;
-    pciGetIDEConfig(slave, &BASE_ADDRESS, &CONTROL_ADDRESS, &bmideBase, &irqNum);
+int ataDrivePresent(int drive) {
+    return drive >= 0 && drive < 4 && ata_drive_info[drive].present;
 }
 
-int loadFromDisk(int LBA, int sectorCount, unsigned char *buffer) {
-    int slavebit = 0;
-    int index;
+// Whether the drive's channel raises an interrupt ataHandleIRQ hears about
+static int ataUseIRQ(int drive) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    return ata_irq_enabled && !ch->irq_failed && ch->irq == 14 + (drive >> 1);
+}
+
+void ataInitIRQ() {
+    ATAChannel *ch;
+    int channel;
+
+    for (channel = 0; channel < 2; channel++) {
+        ch = &ata_channels[channel];
+        if (ch->base != 0 && ch->irq == 14 + channel) {
+            // Clear nIEN in the device control register, so the drives
+            // raise interrupts
+            outb(ch->control + 6, 0);
+        }
+    }
+    ata_irq_enabled = 1;
+}
+
+// Called for IRQ 14 and 15. Reading the status acknowledges the interrupt.
+void ataHandleIRQ(int channel) {
+    ATAChannel *ch = &ata_channels[channel];
+    if (ch->base == 0) {
+        return;
+    }
+    ch->irq_status = inb(ch->base + 7);
+    ch->irq_done = 1;
+    procWakeQueue(&ch->irq_queue);
+}
+
+// Waits for the drive's channel to raise its interrupt, which it does once a
+// command is done or a PIO sector is ready, with other processes running in
+// the meantime. The channel's irq_done must have been cleared before the command was
+// issued. Returns the status, or 0 on error; channels without a working
+// interrupt are polled instead.
+static int ataWaitIRQ(int drive) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    unsigned int flags;
     unsigned char status;
 
-    ataDetectDevice(slavebit);
-
-    // Select drive
-    //printStr("Reading from ATA...\n");
-    waitForATABusy();
-    outb(BASE_ADDRESS + 6, (0xE0 | (slavebit <<  4) | (LBA >> 24 & 0x0F))); 
-    outb(BASE_ADDRESS + 2, (unsigned char)sectorCount);
-    outb(BASE_ADDRESS + 3, LBA & 0xff); 
-    outb(BASE_ADDRESS + 4, (LBA >> 8) & 0xff);
-    outb(BASE_ADDRESS + 5, (LBA >> 16) & 0xff);
-    //issue a read sectors command
-    outb(BASE_ADDRESS + 7, 0x20);
-    //printStr("Requested...\n");
-    status = waitForATABusy();
-    if (status == 0) { return 0; }
-    //printStr("Got data!\n");
-    for (index = 0; index < 256 * sectorCount; ) {
-        ((unsigned short *)buffer)[index] = inw(BASE_ADDRESS);
-        index++;
-        if (index % 256 == 0) {
-            status = waitForATABusy();
-            if (status == 0) { return 0; }
-            sleep(100);
+    if (!ataUseIRQ(drive)) {
+        return waitForATABusy(ch);
+    }
+    flags = disableInterrupts();
+    while (!ch->irq_done && procWait(&ch->irq_queue, ATA_IRQ_TIMEOUT)) {
+    }
+    restoreInterrupts(flags);
+    if (!ch->irq_done) {
+        // The interrupt never came, so it isn't routed to us
+        ch->irq_failed = 1;
+        return waitForATABusy(ch);
+    }
+    status = ch->irq_status;
+    return (status & 0x21) ? 0 : status;
+}
+
+// Waits for the channel to be free and takes it
+static void ataLock(ATAChannel *ch) {
+    unsigned int flags = disableInterrupts();
+    while (ch->busy) {
+        procWait(&ch->busy_queue, ATA_IRQ_TIMEOUT);
+    }
+    ch->busy = 1;
+    restoreInterrupts(flags);
+}
+
+static void ataUnlock(ATAChannel *ch) {
+    unsigned int flags = disableInterrupts();
+    ch->busy = 0;
+    procWakeQueue(&ch->busy_queue);
+    restoreInterrupts(flags);
+}
+
+void ataInitDMA() {
+    ATAChannel *ch;
+    int channel, i;
+
+    for (channel = 0; channel < 2; channel++) {
+        ch = &ata_channels[channel];
+        if (ch->base == 0 || ch->busmaster == 0) {
+            continue;
+        }
+        ch->prd_table = (ATAPhysicalRegion*)allocPage();
+        for (i = 0; i < ATA_DMA_BOUNCE_PAGES; i++) {
+            ch->bounce_pages[i] = (char*)allocPage();
+        }
+    }
+    ata_dma_enabled = 1;
+}
+
+// Selects the drive and sets up the address and sector count for a command.
+// With 'lba48', each register takes two bytes, the high one first; the
+// address is only 32 bits here, which covers 2 TB.
+static void ataSetupCommand(int drive, unsigned int LBA, int sectorCount, int lba48) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    if (lba48) {
+        outb(ch->base + 6, 0x40 | ((drive & 1) << 4));
+        outb(ch->base + 2, (sectorCount >> 8) & 0xff);
+        outb(ch->base + 3, (LBA >> 24) & 0xff);
+        outb(ch->base + 4, 0);
+        outb(ch->base + 5, 0);
+    } else {
+        outb(ch->base + 6, (0xE0 | ((drive & 1) <<  4) | (LBA >> 24 & 0x0F)));
+    }
+    outb(ch->base + 2, sectorCount & 0xff);
+    outb(ch->base + 3, LBA & 0xff);
+    outb(ch->base + 4, (LBA >> 8) & 0xff);
+    outb(ch->base + 5, (LBA >> 16) & 0xff);
+}
+
+// Asks the drive what it supports with IDENTIFY DEVICE, and has READ/WRITE
+// MULTIPLE move as many sectors per interrupt as it can. A drive that doesn't
+// answer, such as a CD drive, is left with single sector 28-bit commands.
+static void ataIdentify(int drive) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    ATADriveInfo *info = &ata_drive_info[drive];
+    unsigned short word;
+    unsigned char status;
+    int index, multiple = 0;
+
+    info->identified = 1;
+    info->lba48 = 0;
+    info->multiple = 0;
+
+    waitForATABusy(ch);
+    ch->irq_done = 0;
+    outb(ch->base + 6, 0xA0 | ((drive & 1) << 4));
+    outb(ch->base + 7, ATA_CMD_IDENTIFY);
+    status = ataWaitIRQ(drive);
+    if (status == 0 || (status & 0x08) == 0) {
+        return;
+    }
+    for (index = 0; index < 256; index++) {
+        word = inw(ch->base);
+        if (index == 47) {
+            // Most sectors per interrupt
+            multiple = word & 0xff;
+        } else if (index == 83) {
+            info->lba48 = (word & (1 << 10)) != 0;
+        }
+    }
+
+    // SET MULTIPLE MODE only takes powers of 2
+    while ((multiple & (multiple - 1)) != 0) {
+        multiple &= multiple - 1;
+    }
+    if (multiple > 1) {
+        waitForATABusy(ch);
+        ch->irq_done = 0;
+        outb(ch->base + 6, 0xE0 | ((drive & 1) << 4));
+        outb(ch->base + 2, multiple);
+        outb(ch->base + 7, ATA_CMD_SET_MULTIPLE);
+        if (ataWaitIRQ(drive) != 0) {
+            info->multiple = multiple;
+        }
+    }
+}
+
+// Whether a transfer needs 48-bit addressing
+static int ataUseLBA48(int drive, unsigned int LBA, int sectorCount) {
+    return ata_drive_info[drive].lba48 && LBA + sectorCount > ATA_LBA28_LIMIT;
+}
+
+// Fills in the PRD table for a transfer of 'bytes' to or from 'buffer'. A
+// buffer in identity mapped memory is used directly, split at 64 KB
+// boundaries; anything else goes through the bounce pages, which
+// ataTransferDMA copies to or from. Returns 1 if the buffer is used directly,
+// 0 if it bounces, or -1 if it's too big to bounce.
+static int ataBuildPRD(ATAChannel *ch, unsigned char *buffer, unsigned int bytes) {
+    unsigned int address = (unsigned int)buffer, chunk;
+    int n = 0, direct;
+
+    direct = (address & 1) == 0 && address + bytes <= ATA_DMA_IDENTITY_LIMIT;
+    if (!direct && bytes > ATA_DMA_BOUNCE_PAGES * 4096) {
+        return -1;
+    }
+    while (bytes > 0) {
+        if (direct) {
+            chunk = 0x10000 - (address & 0xFFFF);
+        } else {
+            address = (unsigned int)ch->bounce_pages[n];
+            chunk = 4096;
+        }
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        ch->prd_table[n].address = address;
+        ch->prd_table[n].byte_count = chunk & 0xFFFF;
+        ch->prd_table[n].flags = 0;
+        address += chunk;
+        bytes -= chunk;
+        n++;
+    }
+    ch->prd_table[n - 1].flags = PRD_END;
+    return direct;
+}
+
+// Copies between a buffer and the bounce pages, in the direction 'to_bounce'
+static void ataCopyBounce(ATAChannel *ch, unsigned char *buffer, unsigned int bytes, int to_bounce) {
+    unsigned int i;
+    for (i = 0; i < bytes; i++) {
+        if (to_bounce) {
+            ch->bounce_pages[i >> 12][i & 0xFFF] = buffer[i];
+        } else {
+            buffer[i] = ch->bounce_pages[i >> 12][i & 0xFFF];
+        }
+    }
+}
+
+// Moves 'sectorCount' sectors with a single READ DMA or WRITE DMA command,
+// the bus master doing the copying. Returns 1 on success, 0 on failure.
+static int ataTransferDMA(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer, int write) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    unsigned int bytes = sectorCount * 512;
+    unsigned char direction = write ? 0 : BM_CMD_READ, bm_status;
+    int direct, status, lba48 = ataUseLBA48(drive, LBA, sectorCount);
+
+    if ((direct = ataBuildPRD(ch, buffer, bytes)) < 0) {
+        return 0;
+    }
+    if (!direct && write) {
+        ataCopyBounce(ch, buffer, bytes, 1);
+    }
+
+    outb(ch->busmaster + BM_COMMAND, 0);
+    outdw(ch->busmaster + BM_PRDT, (unsigned int)ch->prd_table);
+    // The error and interrupt bits are cleared by writing 1s to them
+    outb(ch->busmaster + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+    outb(ch->busmaster + BM_COMMAND, direction);
+
+    if (waitForATABusy(ch) == 0) {
+        return 0;
+    }
+    ch->irq_done = 0;
+    ataSetupCommand(drive, LBA, sectorCount, lba48);
+    if (write) {
+        outb(ch->base + 7, lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
+    } else {
+        outb(ch->base + 7, lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    }
+    outb(ch->busmaster + BM_COMMAND, direction | BM_CMD_START);
+
+    // The drive raises its interrupt once the bus master has finished, which
+    // should then no longer be active
+    status = ataWaitIRQ(drive);
+    bm_status = inb(ch->busmaster + BM_STATUS);
+    outb(ch->busmaster + BM_COMMAND, 0);
+    outb(ch->busmaster + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+    if (status == 0 || (bm_status & (BM_STATUS_ERROR | BM_STATUS_ACTIVE)) != 0) {
+        return 0;
+    }
+
+    if (!direct && !write) {
+        ataCopyBounce(ch, buffer, bytes, 0);
+    }
+    return 1;
+}
+
+// Uses DMA if it's set up and the channel has a bus master. If it fails, the
+// drive falls back to PIO for good.
+static int ataUseDMA(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer, int write) {
+    if (!ata_dma_enabled || ATA_CHANNEL(drive)->prd_table == 0 || ata_dma_failed[drive]) {
+        return 0;
+    }
+    if (ataTransferDMA(drive, LBA, sectorCount, buffer, write)) {
+        return 1;
+    }
+    ata_dma_failed[drive] = 1;
+    return 0;
+}
+
+// Reads with READ MULTIPLE, or READ SECTORS if the drive can't, the drive
+// raising its interrupt as each block of sectors is ready to be read from the
+// data register. At most ATA_MAX_SECTORS.
+static int ataRead(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    ATADriveInfo *info = &ata_drive_info[drive];
+    int index, end, sector, per_irq, lba48;
+    unsigned char status;
+
+    if (ataUseDMA(drive, LBA, sectorCount, buffer, 0)) {
+        return 1;
+    }
+
+    lba48 = ataUseLBA48(drive, LBA, sectorCount);
+    per_irq = info->multiple ? info->multiple : 1;
+    waitForATABusy(ch);
+    ch->irq_done = 0;
+    ataSetupCommand(drive, LBA, sectorCount, lba48);
+    if (info->multiple) {
+        outb(ch->base + 7, lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE);
+    } else {
+        outb(ch->base + 7, lba48 ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS);
+    }
+    for (sector = 0; sector < sectorCount; sector += per_irq) {
+        status = ataWaitIRQ(drive);
+        if (status == 0 || (status & 0x08) == 0) { return 0; }
+        // Reading the last word of the block has the drive move on to the next
+        ch->irq_done = 0;
+        end = (sector + per_irq < sectorCount ? sector + per_irq : sectorCount) * 256;
+        for (index = sector * 256; index < end; index++) {
+            ((unsigned short *)buffer)[index] = inw(ch->base);
         }
     }
     return 1;
 }
 
-int writeToDisk(int LBA, int sectorCount, unsigned char *buffer) {
-    int slavebit = 0;
-    int index;
+// Writes with WRITE MULTIPLE, or WRITE SECTORS if the drive can't. The drive
+// asks for each block of sectors after the first with its interrupt, and
+// raises it once more when it's done. The sectors may only be in the drive's
+// cache until ataFlush. At most ATA_MAX_SECTORS.
+static int ataWrite(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    ATADriveInfo *info = &ata_drive_info[drive];
+    int index, end, sector, per_irq, lba48;
     unsigned char status;
 
-    ataDetectDevice(slavebit);
-
-    // Select drive
-    //printStr("Reading from ATA...\n");
-    waitForATABusy();
-    outb(BASE_ADDRESS + 6, (0xE0 | (slavebit <<  4) | (LBA >> 24 & 0x0F))); 
-    outb(BASE_ADDRESS + 2, (unsigned char)sectorCount);
-    outb(BASE_ADDRESS + 3, LBA & 0xff); 
-    outb(BASE_ADDRESS + 4, (LBA >> 8) & 0xff);
-    outb(BASE_ADDRESS + 5, (LBA >> 16) & 0xff);
-    //issue a write sectors command
-    outb(BASE_ADDRESS + 7, 0x30);
-    //printStr("Requested...\n");
-    status = waitForATABusy();
-    if (status == 0) { return 0; }
-    //printStr("Got data!\n");
-    for (index = 0; index < 256 * sectorCount; ) {
-        outw(BASE_ADDRESS, ((unsigned short *)buffer)[index]);
-        index++;
-        if (index % 256 == 0) {
-            status = waitForATABusy();
-            if (status == 0) { return 0; }
-            sleep(100);
+    if (ataUseDMA(drive, LBA, sectorCount, buffer, 1)) {
+        return 1;
+    }
+
+    lba48 = ataUseLBA48(drive, LBA, sectorCount);
+    per_irq = info->multiple ? info->multiple : 1;
+    waitForATABusy(ch);
+    ataSetupCommand(drive, LBA, sectorCount, lba48);
+    if (info->multiple) {
+        outb(ch->base + 7, lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE);
+    } else {
+        outb(ch->base + 7, lba48 ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS);
+    }
+    for (sector = 0; sector < sectorCount; sector += per_irq) {
+        status = sector ? ataWaitIRQ(drive) : waitForATABusy(ch);
+        if (status == 0 || (status & 0x08) == 0) { return 0; }
+        ch->irq_done = 0;
+        end = (sector + per_irq < sectorCount ? sector + per_irq : sectorCount) * 256;
+        for (index = sector * 256; index < end; index++) {
+            outw(ch->base, ((unsigned short *)buffer)[index]);
         }
     }
-    status = waitForATABusy();
-    if (status == 0) { return 0; }
-    outb(BASE_ADDRESS + 7, 0xe7);
-    status = waitForATABusy();
-    if (status == 0) { return 0; }
+    return ataWaitIRQ(drive) != 0;
+}
+
+// Takes the drive's channel for a transfer, and checks the drive is there and
+// can reach its end. Returns 0 if it can't, without the channel.
+static int ataStart(int drive, unsigned int LBA, int sectorCount) {
+    if (!ataDrivePresent(drive)) {
+        return 0;
+    }
+    ataLock(ATA_CHANNEL(drive));
+    if (!ata_drive_info[drive].identified) {
+        ataIdentify(drive);
+    }
+    if (LBA + sectorCount > ATA_LBA28_LIMIT && !ata_drive_info[drive].lba48) {
+        ataUnlock(ATA_CHANNEL(drive));
+        return 0;
+    }
     return 1;
 }
+
+int loadFromDisk(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer) {
+    int ok = 1, count;
+
+    if (!ataStart(drive, LBA, sectorCount)) {
+        return 0;
+    }
+    for (; sectorCount > 0 && ok; sectorCount -= count) {
+        count = sectorCount < ATA_MAX_SECTORS ? sectorCount : ATA_MAX_SECTORS;
+        ok = ataRead(drive, LBA, count, buffer);
+        LBA += count;
+        buffer += count * 512;
+    }
+    ataUnlock(ATA_CHANNEL(drive));
+    return ok;
+}
+
+int writeToDisk(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer) {
+    int ok = 1, count;
+
+    if (!ataStart(drive, LBA, sectorCount)) {
+        return 0;
+    }
+    for (; sectorCount > 0 && ok; sectorCount -= count) {
+        count = sectorCount < ATA_MAX_SECTORS ? sectorCount : ATA_MAX_SECTORS;
+        ok = ataWrite(drive, LBA, count, buffer);
+        LBA += count;
+        buffer += count * 512;
+    }
+    ataUnlock(ATA_CHANNEL(drive));
+    return ok;
+}
+
+int ataFlush(int drive) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    int ok;
+
+    if (!ataStart(drive, 0, 0)) {
+        return 0;
+    }
+    waitForATABusy(ch);
+    ch->irq_done = 0;
+    outb(ch->base + 6, 0xE0 | ((drive & 1) << 4));
+    outb(ch->base + 7, ata_drive_info[drive].lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    ok = ataWaitIRQ(drive) != 0;
+    ataUnlock(ATA_CHANNEL(drive));
+    return ok;
+}
+
+// Reads 'count' blocks of 'sectors' sectors from the start of the drive,
+// with DMA and then with PIO, each waiting for interrupts and then polling,
+// and logs the throughput and time per block of each
+void ataBenchmark(int drive, int sectors, int count) {
+    ATAChannel *ch = ATA_CHANNEL(drive);
+    unsigned char *buffer = (unsigned char*)allocPage();
+    long start, ms;
+    int i, mode, dma, irq, ok;
+    int dma_enabled = ata_dma_enabled, irq_enabled = ata_irq_enabled;
+
+    if (sectors > 8) {
+        // A single page is the buffer
+        sectors = 8;
+    }
+    for (mode = 0; mode < 4; mode++) {
+        dma = (mode & 2) == 0;
+        irq = (mode & 1) == 0;
+        ata_dma_enabled = dma ? dma_enabled : 0;
+        ata_irq_enabled = irq ? irq_enabled : 0;
+        ata_dma_failed[drive] = 0;
+        ch->irq_failed = 0;
+        ok = 1;
+        start = getSystemCounter();
+        for (i = 0; i < count && ok; i++) {
+            ok = loadFromDisk(drive, i * sectors, sectors, buffer);
+        }
+        // The system counter runs at 1024 Hz
+        ms = (getSystemCounter() - start) * 1000 / 1024;
+        if (!ok || (dma && ata_dma_failed[drive]) || (irq && !ataUseIRQ(drive))) {
+            kprintf("ATA: %s with %s not available on drive %d\n", dma ? "DMA" : "PIO",
+                    irq ? "interrupts" : "polling", drive);
+            continue;
+        }
+        kprintf("ATA: %s with %s read %d KB from drive %d in %d ms (%d KB/s, %d us per block)\n",
+                dma ? "DMA" : "PIO", irq ? "interrupts" : "polling", count * sectors / 2, drive, ms,
+                ms ? count * sectors / 2 * 1000 / ms : 0, ms * 1000 / count);
+    }
+    ata_dma_enabled = dma_enabled;
+    ata_irq_enabled = irq_enabled;
+}
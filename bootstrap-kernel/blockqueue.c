@@ -0,0 +1,198 @@
+#include "kernel.h"
+
+// Drives with a queue, numbered as by the ATA driver, two to a channel
+#define BLOCK_MAX_DRIVES 4
+#define BLOCK_CHANNELS (BLOCK_MAX_DRIVES / 2)
+
+// Most sectors merged into one command, which go through a buffer of that
+// size
+#define BLOCK_MAX_MERGE_SECTORS 128
+
+// Ticks a request can wait while others closer to the drive's position go
+// first, after which it's next whatever its place
+#define BLOCK_DEADLINE_TICKS 256
+
+// Ticks to wait for whoever is carrying out requests before looking again
+#define BLOCK_WAIT_TICKS 4
+
+// Each drive's waiting requests, in order of LBA
+TKBlockRequest *block_queue[BLOCK_MAX_DRIVES];
+int block_queue_depth[BLOCK_MAX_DRIVES];
+// Sector after the last one each drive transferred, which the elevator
+// carries on from
+unsigned int block_position[BLOCK_MAX_DRIVES];
+
+// Requests are carried out by whichever process is waiting on one, one
+// process at a time on each channel, so the two channels' drives are busy at
+// once. The rest wait on the channel's block_waiters.
+int block_dispatching[BLOCK_CHANNELS];
+TKWaitQueue block_waiters[BLOCK_CHANNELS];
+unsigned char *block_merge_buffer[BLOCK_CHANNELS];
+
+unsigned int block_requests;
+unsigned int block_commands;
+unsigned int block_merged;
+unsigned int block_expired;
+unsigned int block_depth_total;
+int block_depth_max;
+
+void blockQueueInit() {
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_DRIVES; i++) {
+        block_queue[i] = 0;
+        block_queue_depth[i] = 0;
+        block_position[i] = 0;
+    }
+    for (i = 0; i < BLOCK_CHANNELS; i++) {
+        block_dispatching[i] = 0;
+        procWaitQueueInit(&block_waiters[i]);
+        block_merge_buffer[i] = heapVirtAllocContiguous(BLOCK_MAX_MERGE_SECTORS * 512 / 4096);
+    }
+}
+
+void blockSubmit(TKBlockRequest *req) {
+    unsigned int flags = disableInterrupts();
+    TKBlockRequest **p = &block_queue[req->drive];
+
+    // After any at the same LBA, so those go first
+    while (*p && (*p)->lba <= req->lba) {
+        p = &(*p)->next;
+    }
+    req->next = *p;
+    *p = req;
+    req->queued_at = getSystemCounter();
+    req->result = BLOCK_PENDING;
+
+    block_requests++;
+    if (++block_queue_depth[req->drive] > block_depth_max) {
+        block_depth_max = block_queue_depth[req->drive];
+    }
+    restoreInterrupts(flags);
+}
+
+// Picks the next request for 'drive': the first at or past where the drive
+// is, going back to the lowest LBA once there are none (C-LOOK), unless one
+// has waited past its deadline
+static TKBlockRequest *blockPick(int drive) {
+    TKBlockRequest *req, *oldest = 0, *ahead = 0;
+
+    for (req = block_queue[drive]; req; req = req->next) {
+        if (oldest == 0 || req->queued_at - oldest->queued_at < 0) {
+            oldest = req;
+        }
+        if (ahead == 0 && req->lba >= block_position[drive]) {
+            ahead = req;
+        }
+    }
+    if (ahead == 0) {
+        ahead = block_queue[drive];
+    }
+    if (oldest != ahead && getSystemCounter() - oldest->queued_at >= BLOCK_DEADLINE_TICKS) {
+        block_expired++;
+        return oldest;
+    }
+    return ahead;
+}
+
+// Carries out the next request for 'drive', along with any that follow on
+// from it in the same direction, as one command. Called with interrupts
+// disabled, by the dispatching process.
+static void blockDispatch(int drive) {
+    unsigned char *merge_buffer = block_merge_buffer[drive >> 1];
+    TKBlockRequest **p, *first, *last, *req;
+    unsigned int offset;
+    int i, sectors, count, ok;
+
+    first = blockPick(drive);
+    sectors = first->sectors;
+    count = 1;
+    for (last = first; last->next && last->next->write == first->write &&
+                       last->next->lba == last->lba + last->sectors &&
+                       sectors + last->next->sectors <= BLOCK_MAX_MERGE_SECTORS; last = last->next) {
+        sectors += last->next->sectors;
+        count++;
+    }
+
+    // Take them off the queue
+    for (p = &block_queue[drive]; *p != first; p = &(*p)->next) {
+    }
+    *p = last->next;
+    last->next = 0;
+    block_depth_total += block_queue_depth[drive];
+    block_queue_depth[drive] -= count;
+    block_commands++;
+    block_merged += count - 1;
+    block_position[drive] = first->lba + sectors;
+
+    // The transfer sleeps until the drive's done, letting others queue more
+    if (count == 1) {
+        ok = first->write ? writeToDisk(drive, first->lba, sectors, first->buffer)
+                          : loadFromDisk(drive, first->lba, sectors, first->buffer);
+    } else if (first->write) {
+        for (req = first, offset = 0; req; offset += req->sectors * 512, req = req->next) {
+            for (i = 0; i < req->sectors * 512; i++) {
+                merge_buffer[offset + i] = req->buffer[i];
+            }
+        }
+        ok = writeToDisk(drive, first->lba, sectors, merge_buffer);
+    } else {
+        ok = loadFromDisk(drive, first->lba, sectors, merge_buffer);
+        for (req = first, offset = 0; ok == 1 && req; offset += req->sectors * 512, req = req->next) {
+            for (i = 0; i < req->sectors * 512; i++) {
+                req->buffer[i] = merge_buffer[offset + i];
+            }
+        }
+    }
+
+    for (req = first; req; req = last) {
+        last = req->next;
+        req->result = (ok == 1) ? 0 : -1;
+    }
+    procWakeQueue(&block_waiters[drive >> 1]);
+}
+
+// Waits for 'req' to be carried out, carrying out requests for its drive
+// until it is if nobody else is on its channel. Returns 0 on success or -1 on
+// error.
+int blockWait(TKBlockRequest *req) {
+    int channel = req->drive >> 1;
+    unsigned int flags = disableInterrupts();
+
+    while (req->result == BLOCK_PENDING) {
+        if (block_dispatching[channel]) {
+            procWait(&block_waiters[channel], BLOCK_WAIT_TICKS);
+            continue;
+        }
+        block_dispatching[channel] = 1;
+        while (req->result == BLOCK_PENDING) {
+            blockDispatch(req->drive);
+        }
+        block_dispatching[channel] = 0;
+        // Whoever's waiting takes over, if their request is still queued
+        procWakeQueue(&block_waiters[channel]);
+    }
+    restoreInterrupts(flags);
+    return req->result;
+}
+
+// Carries out a single transfer through the queue. Returns 0 on success or -1
+// on error.
+int blockTransfer(int drive, int write, unsigned int lba, int sectors, unsigned char *buffer) {
+    TKBlockRequest req;
+
+    req.drive = drive;
+    req.write = write;
+    req.lba = lba;
+    req.sectors = sectors;
+    req.buffer = buffer;
+    blockSubmit(&req);
+    return blockWait(&req);
+}
+
+// Logs how many requests were merged, and how deep the queues got
+void logBlockQueueStats() {
+    kprintf("Block: %d requests in %d commands (%d merged), queue depth %d on average and %d at most, %d past deadline.\n",
+            block_requests, block_commands, block_merged,
+            block_commands ? block_depth_total / block_commands : 0, block_depth_max, block_expired);
+}
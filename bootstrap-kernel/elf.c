@@ -58,32 +58,43 @@ int loadELF(const char *path, const char *file_name) {
     TKVProcID proc_id;
     FileHandle *dir, *file;
     char *buffer;
-    int mode, block_idx, size;
+    unsigned int size;
+    unsigned long long file_size;
 
+    // Resolve the path once; the file handle keeps the directory open
+    lockFilesystem();
     if ((dir = tfsOpenPath(&gTFS, path)) == NULL) {
         kprintf("Could not find path %s!\n", path);
+        unlockFilesystem();
         return -1;
     }
-    if (tfsFindEntry(&gTFS, dir, file_name, &mode, &block_idx, &size) != 0) {
+    file = tfsOpenFileAt(&gTFS, dir, file_name);
+    tfsCloseHandle(dir);
+    if (file == NULL) {
         kprintf("Could not find file %s!\n", file_name);
-        tfsCloseHandle(dir);
+        unlockFilesystem();
         return -1;
     }
-    buffer = heapVirtAllocContiguous((size + 4095) / 4096);
-    header = (ELFHeader *)buffer;
-    tfsCloseHandle(dir);
-
-    if ((file = tfsOpenFile(&gTFS, path, file_name)) == NULL) {
-        kprintf("Could not open file %s!", file_name);
+    // The whole file is read into memory
+    file_size = tfsGetFileSize(file);
+    if (file_size > 0x10000000) {
+        kprintf("File %s is too big!\n", file_name);
+        tfsCloseHandle(file);
+        unlockFilesystem();
         return -1;
     }
+    size = file_size;
+    buffer = heapVirtAllocContiguous((size + 4095) / 4096);
+    header = (ELFHeader *)buffer;
 
-    if (tfsReadFile(&gTFS, file, buffer, size, 0) < size) {
+    if (tfsReadFile(&gTFS, file, buffer, size, 0) != (int)size) {
         kprintf("Could not read file %s!", file_name);
+        unlockFilesystem();
         return -1;
     }
 
     tfsCloseHandle(file);
+    unlockFilesystem();
     
     if (header->magic[0] != 0x7F || header->magic[1] != 'E' ||
         header->magic[2] != 'L' || header->magic[3] != 'F') {
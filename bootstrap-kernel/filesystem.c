@@ -1,84 +1,751 @@
 #include "kernel.h"
 #include <tomfs.h>
 
-typedef struct BlockCacheEntry {
+// First sector of the filesystem on each drive. The boot drive has the
+// bootloader in front of it, while the other drives of a striped filesystem
+// hold their share of it from the start.
+#define FS_START_SECTOR(drive) ((drive) ? 0 : 34)
+
+// Most drives a filesystem can be striped across, numbered as by the ATA
+// driver
+#define FS_MAX_DRIVES 4
+
+// The drive number the cache knows a virtio or AHCI disk by (see gDisk)
+#define FS_DISK_DRIVE FS_MAX_DRIVES
+
+// Blocks read from and written to the drives are kept in CACHE_BYTES of
+// memory, split into as many buffers as fit at the filesystem's block size. A
+// buffer is found through a hash of its drive and block, and when a new block
+// needs one, the least recently used buffer that isn't pinned is taken,
+// preferring one that's clean.
+#define CACHE_BYTES (1024 * 1024)
+#define CACHE_MAX_BUFFERS (CACHE_BYTES / TFS_MIN_BLOCK_SIZE)
+#define CACHE_BUCKETS 256
+
+// Ticks to wait for another process to finish reading a block, or writing
+// out the cache, before looking again
+#define CACHE_WAIT_TICKS 4
+
+// Writes are left in the cache, and written out once the oldest has been
+// there CACHE_FLUSH_TICKS (5 seconds), or once more than CACHE_DIRTY_LIMIT
+// of the buffers hold them
+#define CACHE_FLUSH_TICKS (5 * 1024)
+#define CACHE_DIRTY_LIMIT(count) ((count) / 2)
+
+// The result of a request that hasn't completed yet, which is what the
+// drivers' wait functions (see gDiskWait) look for
+#define REQUEST_PENDING BLOCK_PENDING
+
+typedef struct Buffer {
+    // -1 if the buffer doesn't hold a block
+    int drive;
     unsigned int block;
-    char *buffer;
-} BlockCacheEntry;
+    char *data;
+    // Set once the block has been read. Until then, anyone else wanting it
+    // waits on cache_queue.
+    int valid;
+    // Set if the block has been written to since it was last written out,
+    // along with the barrier epoch it was first written to in
+    int dirty;
+    unsigned int epoch;
+    // Set while the block is being written out, during which it isn't
+    // written to. Those waiting for it wait on cache_queue.
+    int writing;
+    // Processes using the buffer, which can't be taken for another block
+    // while there are any
+    int refs;
+    struct Buffer *hash_next;
+    struct Buffer *lru_prev;
+    struct Buffer *lru_next;
+} Buffer;
 
-// TODO: Make this an LRU, don't stomp memory in case this gets past the size
-// of the allocated size
-BlockCacheEntry *block_cache;
-int block_cache_size;
+Buffer cache_buffers[CACHE_MAX_BUFFERS];
+Buffer *cache_buckets[CACHE_BUCKETS];
+// Most recently used first
+Buffer *cache_lru_head;
+Buffer *cache_lru_tail;
+char *cache_memory;
+int cache_buffer_count;
+// Block size the buffers are split at. Blocks of any other size aren't
+// cached.
+int cache_block_size;
+TKWaitQueue cache_queue;
 
-int read_fn(struct TFS *fs, char *buf, unsigned int block) {
-    int i;
-    // Check the cache
-    for (i = 0; i < block_cache_size; i++) {
-        if (block_cache[i].block == block) {
-            char *buffer = block_cache[i].buffer;
-            //kprintf("Found cached block %d\n", block);
-            for (i = 0; i < 4096; i++) {
-                buf[i] = buffer[i];
-            }
-            return 0;
+int cache_dirty_count;
+// When the first of the dirty buffers was written to
+long cache_dirty_since;
+// Writes from before a barrier reach the disk before any from after it (see
+// filesystemBarrier). Each barrier starts a new epoch.
+unsigned int cache_epoch;
+// Drives written to since they were last flushed, as a bitmask, and the
+// epoch those writes were from
+int cache_unflushed_drives;
+unsigned int cache_unflushed_epoch;
+// Set while the cache is being written out, which one process does at a
+// time
+int cache_flushing;
+// The buffers being written out, and their requests: to the block queue
+// for an ATA drive, or to the disk's driver
+typedef union {
+    TKBlockRequest ata;
+    TFSIORequest disk;
+} FlushRequest;
+
+Buffer *cache_flush_buffers[CACHE_MAX_BUFFERS];
+FlushRequest cache_flush_requests[CACHE_MAX_BUFFERS];
+
+unsigned int cache_hits;
+unsigned int cache_misses;
+unsigned int cache_evictions;
+unsigned int cache_writebacks;
+
+// A virtio or AHCI disk the filesystem is on, attached to this rather than
+// to gTFS so that its blocks go through the cache like those of the ATA
+// drives, and the function that waits for a request to it, polling the
+// driver in case the interrupt isn't coming. gDiskWait is NULL if there's no
+// disk.
+TFS gDisk;
+int (*gDiskWait)(struct TFS *tfs, struct TFSIORequest *req);
+
+static void disk_done(struct TFS *fs, TFSIORequest *req) {
+}
+
+// Submits a request for 'block' of the disk. Returns 0 if it was submitted,
+// to be waited on with gDiskWait.
+static int disk_submit(TFSIORequest *req, int op, unsigned int block, char *buf) {
+    req->op = op;
+    req->block = block;
+    req->buf = buf;
+    req->callback = disk_done;
+    req->result = REQUEST_PENDING;
+    return tfsSubmitRequest(&gDisk, req);
+}
+
+// Reads or writes 'block' of a drive straight away, bypassing the cache.
+// Returns 0 on success.
+static int drive_transfer(int drive, int write, unsigned int block, int block_size, char *buf) {
+    TFSIORequest req;
+
+    if (drive == FS_DISK_DRIVE) {
+        gDisk.block_size = block_size;
+        if (disk_submit(&req, write ? TFS_IO_WRITE : TFS_IO_READ, block, buf) != 0) {
+            return -1;
         }
+        return gDiskWait(&gDisk, &req);
     }
-    // 8 sectors per block in our filesystem
-    if (loadFromDisk(34 + (block << 3), 8, buf) == 1) {
-        char *buffer = allocPage();
-        for (i = 0; i < 4096; i++) {
-            buffer[i] = buf[i];
+    return blockTransfer(drive, write, FS_START_SECTOR(drive) + block * (block_size >> 9), block_size >> 9,
+                         (unsigned char*)buf);
+}
+
+// Has a drive empty its write cache. Returns 0 on success.
+static int drive_flush(int drive) {
+    TFSIORequest req;
+
+    if (drive == FS_DISK_DRIVE) {
+        if (disk_submit(&req, TFS_IO_FLUSH, 0, NULL) != 0) {
+            return -1;
         }
-        block_cache[block_cache_size].block = block;
-        block_cache[block_cache_size].buffer = buffer;
-        block_cache_size++;
-        //kprintf("Read block %d\n", block);
-        return 0;
+        return gDiskWait(&gDisk, &req);
     }
-    kprintf("FS: Failed to read block %d.\n", block);
-    return -1;
+    return (ataFlush(drive) == 1) ? 0 : -1;
+}
+
+static unsigned int cache_hash(int drive, unsigned int block) {
+    return (block ^ (drive << 6)) % CACHE_BUCKETS;
+}
+
+static void cache_unhash(Buffer *buf) {
+    Buffer **p = &cache_buckets[cache_hash(buf->drive, buf->block)];
+    while (*p != buf) {
+        p = &(*p)->hash_next;
+    }
+    *p = buf->hash_next;
+    buf->drive = -1;
+    buf->valid = 0;
+}
+
+// Moves 'buf' to the front of the LRU list
+static void cache_touch(Buffer *buf) {
+    if (cache_lru_head == buf) {
+        return;
+    }
+    buf->lru_prev->lru_next = buf->lru_next;
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        cache_lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = NULL;
+    buf->lru_next = cache_lru_head;
+    cache_lru_head->lru_prev = buf;
+    cache_lru_head = buf;
 }
 
-int write_fn(struct TFS *fs, char *buf, unsigned int block) {
+// Empties the cache and splits it into buffers of 'block_size'. Nothing may
+// be using the cache, and nothing in it may be dirty.
+static void cache_reset(int block_size) {
     int i;
-    if (writeToDisk(34 + (block << 3), 8, buf) != 1) {
-        kprintf("FS: Failed to write block %d.\n", block);
+
+    cache_block_size = block_size;
+    cache_buffer_count = CACHE_BYTES / block_size;
+    for (i = 0; i < CACHE_BUCKETS; i++) {
+        cache_buckets[i] = NULL;
+    }
+    for (i = 0; i < cache_buffer_count; i++) {
+        cache_buffers[i].drive = -1;
+        cache_buffers[i].data = cache_memory + i * block_size;
+        cache_buffers[i].valid = 0;
+        cache_buffers[i].dirty = 0;
+        cache_buffers[i].writing = 0;
+        cache_buffers[i].refs = 0;
+        cache_buffers[i].hash_next = NULL;
+        cache_buffers[i].lru_prev = (i > 0) ? &cache_buffers[i - 1] : NULL;
+        cache_buffers[i].lru_next = (i < cache_buffer_count - 1) ? &cache_buffers[i + 1] : NULL;
+    }
+    cache_lru_head = &cache_buffers[0];
+    cache_lru_tail = &cache_buffers[cache_buffer_count - 1];
+    cache_dirty_count = 0;
+    cache_unflushed_drives = 0;
+}
+
+static Buffer *cache_lookup(int drive, unsigned int block) {
+    Buffer *buf;
+    for (buf = cache_buckets[cache_hash(drive, block)]; buf; buf = buf->hash_next) {
+        if (buf->drive == drive && buf->block == block) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void cache_release(Buffer *buf) {
+    unsigned int flags = disableInterrupts();
+    buf->refs--;
+    restoreInterrupts(flags);
+}
+
+// Has every drive written to since the last flush empty its write cache
+static void cache_flush_drives() {
+    int drive;
+    for (drive = 0; drive <= FS_DISK_DRIVE; drive++) {
+        if (cache_unflushed_drives & (1 << drive)) {
+            drive_flush(drive);
+        }
+    }
+    cache_unflushed_drives = 0;
+}
+
+// Writes out dirty buffers from 'epoch' and before, oldest epoch first. The
+// drives are flushed before the writes from each new epoch, so nothing from
+// after a barrier reaches the disk before everything from before it. Each
+// epoch's writes are submitted together: to the block queue, to be sorted
+// and merged, or to the disk's driver, to be in flight at once. A
+// block written to again after a barrier is written out with its old epoch
+// first (see write_fn), so it never carries later data into an earlier
+// epoch. Returns 0 on success.
+static int cache_flush_upto(unsigned int epoch) {
+    unsigned int flags = disableInterrupts(), oldest;
+    int i, n, result, failed = -1;
+    Buffer *buf;
+
+    while (cache_flushing) {
+        procWait(&cache_queue, CACHE_WAIT_TICKS);
+    }
+    cache_flushing = 1;
+    while (cache_dirty_count > 0 && failed < 0) {
+        oldest = epoch + 1;
+        for (i = 0; i < cache_buffer_count; i++) {
+            if (cache_buffers[i].dirty && cache_buffers[i].epoch < oldest) {
+                oldest = cache_buffers[i].epoch;
+            }
+        }
+        if (oldest > epoch) {
+            break;
+        }
+        if (cache_unflushed_drives && oldest != cache_unflushed_epoch) {
+            cache_flush_drives();
+        }
+
+        // Clean from here on, so a write to one while it's going out dirties
+        // it again
+        for (i = 0, n = 0; i < cache_buffer_count; i++) {
+            buf = &cache_buffers[i];
+            if (buf->dirty && buf->epoch == oldest) {
+                buf->refs++;
+                buf->dirty = 0;
+                buf->writing = 1;
+                cache_dirty_count--;
+                cache_unflushed_drives |= 1 << buf->drive;
+                cache_flush_buffers[n] = buf;
+                if (buf->drive == FS_DISK_DRIVE) {
+                    gDisk.block_size = cache_block_size;
+                    if (disk_submit(&cache_flush_requests[n].disk, TFS_IO_WRITE, buf->block, buf->data) != 0) {
+                        cache_flush_requests[n].disk.result = -1;
+                    }
+                } else {
+                    cache_flush_requests[n].ata.drive = buf->drive;
+                    cache_flush_requests[n].ata.write = 1;
+                    cache_flush_requests[n].ata.lba = FS_START_SECTOR(buf->drive) + buf->block * (cache_block_size >> 9);
+                    cache_flush_requests[n].ata.sectors = cache_block_size >> 9;
+                    cache_flush_requests[n].ata.buffer = (unsigned char*)buf->data;
+                    blockSubmit(&cache_flush_requests[n].ata);
+                }
+                n++;
+            }
+        }
+        cache_unflushed_epoch = oldest;
+        if (cache_dirty_count == 0) {
+            cache_dirty_since = 0;
+        }
+
+        for (i = 0; i < n; i++) {
+            buf = cache_flush_buffers[i];
+            if (buf->drive == FS_DISK_DRIVE) {
+                result = gDiskWait(&gDisk, &cache_flush_requests[i].disk);
+            } else {
+                result = blockWait(&cache_flush_requests[i].ata);
+            }
+            if (result != 0) {
+                // Nothing wrote to it in the meantime, so it's still from
+                // 'oldest'
+                failed = i;
+                buf->dirty = 1;
+                if (cache_dirty_count++ == 0) {
+                    cache_dirty_since = getSystemCounter();
+                }
+            }
+            buf->writing = 0;
+            buf->refs--;
+        }
+        procWakeQueue(&cache_queue);
+        cache_writebacks += n;
+    }
+    cache_flushing = 0;
+    procWakeQueue(&cache_queue);
+    restoreInterrupts(flags);
+
+    if (failed >= 0) {
+        kprintf("FS: Failed to write block %d of drive %d.\n",
+                cache_flush_buffers[failed]->block, cache_flush_buffers[failed]->drive);
         return -1;
     }
-    // Update the cache
-    for (i = 0; i < block_cache_size; i++) {
-        if (block_cache[i].block == block) {
-            int j;
-            char *buffer = block_cache[i].buffer;
-            for (j = 0; j < 4096; j++) {
-                buffer[j] = buf[j];
+    return 0;
+}
+
+// Returns the buffer for 'block' of 'drive', pinned. If the block isn't in
+// the cache, a buffer is taken for it and 'fresh' is set, and the caller
+// fills it and calls cache_filled. Returns NULL if the cache couldn't be
+// written out to make room. Mustn't be called by the process writing out the
+// cache, which it may wait for.
+static Buffer *cache_get(int drive, unsigned int block, int *fresh) {
+    unsigned int flags = disableInterrupts();
+    Buffer *buf;
+
+    while (1) {
+        // Wait for anyone else reading the block in
+        while ((buf = cache_lookup(drive, block)) != NULL && !buf->valid) {
+            procWait(&cache_queue, CACHE_WAIT_TICKS);
+        }
+        if (buf) {
+            cache_hits++;
+            break;
+        }
+
+        // Take the least recently used buffer that's clean, or failing that
+        // write out what's dirty up to the least recently used one
+        for (buf = cache_lru_tail; buf && (buf->refs > 0 || buf->dirty); buf = buf->lru_prev) {
+        }
+        if (buf == NULL) {
+            for (buf = cache_lru_tail; buf && buf->refs > 0; buf = buf->lru_prev) {
+            }
+            if (buf == NULL || cache_flushing) {
+                // Nothing to take until others are done with their buffers,
+                // or the cache has been written out
+                procWait(&cache_queue, CACHE_WAIT_TICKS);
+                continue;
             }
+            restoreInterrupts(flags);
+            if (cache_flush_upto(buf->epoch) != 0) {
+                return NULL;
+            }
+            flags = disableInterrupts();
+            continue;
+        }
+
+        cache_misses++;
+        if (buf->drive >= 0) {
+            cache_evictions++;
+            cache_unhash(buf);
+        }
+        buf->drive = drive;
+        buf->block = block;
+        buf->hash_next = cache_buckets[cache_hash(drive, block)];
+        cache_buckets[cache_hash(drive, block)] = buf;
+        break;
+    }
+    *fresh = buf && !buf->valid;
+    if (buf) {
+        buf->refs++;
+        cache_touch(buf);
+    }
+    restoreInterrupts(flags);
+    return buf;
+}
+
+// Called once a fresh buffer has been filled, successfully or not
+static void cache_filled(Buffer *buf, int ok) {
+    unsigned int flags = disableInterrupts();
+    if (ok) {
+        buf->valid = 1;
+    } else {
+        cache_unhash(buf);
+    }
+    procWakeQueue(&cache_queue);
+    restoreInterrupts(flags);
+}
+
+// Writes out everything that's been in the cache too long, or everything if
+// too much of it is dirty. Called on each write and system call.
+void flushFilesystemCache() {
+    if (cache_flushing || cache_dirty_count == 0) {
+        return;
+    }
+    if (cache_dirty_count > CACHE_DIRTY_LIMIT(cache_buffer_count) ||
+        getSystemCounter() - cache_dirty_since >= CACHE_FLUSH_TICKS) {
+        cache_flush_upto(cache_epoch);
+    }
+}
+
+void filesystemBarrier() {
+    unsigned int flags = disableInterrupts();
+    // Only needed if something's been written since the last one
+    if (cache_dirty_count > 0) {
+        cache_epoch++;
+    }
+    restoreInterrupts(flags);
+}
+
+// Logs how well the cache has done since boot
+void logBlockCacheStats() {
+    kprintf("FS: Cache of %d blocks: %d hits, %d misses, %d evictions, %d written back.\n",
+            cache_buffer_count, cache_hits, cache_misses, cache_evictions, cache_writebacks);
+}
+
+// 'fs' has the number of the drive it's on as its user_data: that of an ATA
+// drive, or FS_DISK_DRIVE
+int read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    int i, fresh = 1, ok, drive = (int)fs->user_data;
+    Buffer *cached = NULL;
+
+    if (fs->block_size == cache_block_size) {
+        cached = cache_get(drive, block, &fresh);
+    }
+    if (fresh) {
+        // Read straight into the buffer, or into 'buf' if there isn't one
+        ok = drive_transfer(drive, 0, block, fs->block_size, cached ? cached->data : buf) == 0;
+        if (cached) {
+            cache_filled(cached, ok);
+        }
+        if (!ok) {
+            if (cached) {
+                cache_release(cached);
+            }
+            kprintf("FS: Failed to read block %d of drive %d.\n", block, drive);
+            return -1;
+        }
+    }
+    if (cached) {
+        for (i = 0; i < fs->block_size; i++) {
+            buf[i] = cached->data[i];
+        }
+        cache_release(cached);
+    }
+    return 0;
+}
+
+// Writes go into the cache, and out to the drive later (see
+// flushFilesystemCache). Blocks of a size that isn't cached are written
+// straight away.
+int write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    int i, fresh, drive = (int)fs->user_data;
+    unsigned int flags;
+    Buffer *cached;
+
+    if (fs->block_size != cache_block_size) {
+        if (drive_transfer(drive, 1, block, fs->block_size, (char*)buf) != 0) {
+            kprintf("FS: Failed to write block %d of drive %d.\n", block, drive);
+            return -1;
+        }
+        return 0;
+    }
+    if ((cached = cache_get(drive, block, &fresh)) == NULL) {
+        return -1;
+    }
+
+    flags = disableInterrupts();
+    while (1) {
+        // Not while the drive's reading it, or half the new data could go out
+        while (cached->writing) {
+            procWait(&cache_queue, CACHE_WAIT_TICKS);
+        }
+        if (!cached->dirty || cached->epoch == cache_epoch) {
             break;
         }
+        // It's dirty from before a barrier. What it holds goes out with that
+        // epoch first, so the new data isn't written ahead of anything from
+        // before the barrier.
+        restoreInterrupts(flags);
+        if (cache_flush_upto(cached->epoch) != 0) {
+            cache_release(cached);
+            return -1;
+        }
+        flags = disableInterrupts();
+    }
+    for (i = 0; i < fs->block_size; i++) {
+        cached->data[i] = buf[i];
+    }
+    if (!cached->dirty) {
+        cached->dirty = 1;
+        cached->epoch = cache_epoch;
+        if (cache_dirty_count++ == 0) {
+            cache_dirty_since = getSystemCounter();
+        }
+    }
+    restoreInterrupts(flags);
+    if (fresh) {
+        cache_filled(cached, 1);
+    }
+    cache_release(cached);
+
+    flushFilesystemCache();
+    return 0;
+}
+
+// Carries out requests straight away, as tfsSubmitRequest does for a device
+// without a submit_fn, except that a flush writes out the cache and then
+// empties the drive's write cache, which write_fn leaves alone
+int submit_fn(struct TFS *fs, TFSIORequest *req) {
+    int result;
+    switch (req->op) {
+    case TFS_IO_READ:
+        result = read_fn(fs, req->buf, req->block);
+        break;
+    case TFS_IO_WRITE:
+        result = write_fn(fs, req->buf, req->block);
+        break;
+    case TFS_IO_FLUSH:
+        filesystemBarrier();
+        result = (cache_flush_upto(cache_epoch) == 0 && drive_flush((int)fs->user_data) == 0) ? 0 : -1;
+        break;
+    default:
+        return -1;
     }
+    tfsCompleteRequest(fs, req, result);
     return 0;
 }
 
 TFS gTFS;
+// Where the kernel log goes: a filesystem of its own on a drive of the
+// secondary channel if there is one, so logging doesn't hold up loading
+// programs from gTFS, or else gTFS
+TFS *gLogTFS;
+
+// The drives the filesystem can be on, and the stripe across them if it's on
+// more than one
+TFS gDrives[FS_MAX_DRIVES];
+TFSStripe gStripe;
+
+// Gives 'fs' the memory TomFS works on its blocks in, once its block size is
+// known. It's too much for a process's kernel stack with big blocks.
+static void alloc_scratch(TFS *fs) {
+    unsigned int size = TFS_SCRATCH_SIZE(fs->block_size);
+    tfsSetScratch(fs, heapVirtAllocContiguous(size / 4096), size);
+}
+
+// The process in TomFS, and how many times over. Since each filesystem has
+// the one scratch area, a process that has to wait for a block there would
+// have its buffers taken by the next one in, so others wait on fs_queue for
+// it to leave. It can go in again itself, as it does to log an error.
+TKVProcID fs_owner;
+int fs_depth;
+TKWaitQueue fs_queue;
+
+void lockFilesystem() {
+    unsigned int flags = disableInterrupts();
+    while (fs_depth > 0 && fs_owner != tk_cur_proc_id) {
+        procWait(&fs_queue, CACHE_WAIT_TICKS);
+    }
+    fs_owner = tk_cur_proc_id;
+    fs_depth++;
+    restoreInterrupts(flags);
+}
+
+void unlockFilesystem() {
+    unsigned int flags = disableInterrupts();
+    if (--fs_depth == 0) {
+        procWakeQueue(&fs_queue);
+    }
+    restoreInterrupts(flags);
+}
+
+// Looks for a filesystem of its own on a drive of the secondary channel that
+// gTFS isn't on, to keep the log on. It shares gTFS's file handles, so it
+// isn't set up with tfsInit.
+static void open_log_filesystem() {
+    TFS *fs;
+    int drive;
+
+    for (drive = 2; drive < FS_MAX_DRIVES; drive++) {
+        if (!ataDrivePresent(drive) || (gTFS.header.stripe_devices > 1 && drive < gStripe.num_devices)) {
+            continue;
+        }
+        fs = &gDrives[drive];
+        fs->block_size = TFS_MIN_BLOCK_SIZE;
+        fs->header.stripe_devices = 0;
+        fs->completed_head = NULL;
+        fs->completed_tail = NULL;
+        if (tfsOpenFilesystem(fs) == 0 && fs->header.stripe_devices <= 1) {
+            alloc_scratch(fs);
+            gLogTFS = fs;
+            kprintf("FS: Logging to drive %d.\n", drive);
+            return;
+        }
+    }
+}
+
+// Opens gTFS from the disk attached to gDisk, whose requests are waited on
+// with 'wait'. Returns 0 on success. Otherwise what was read from the disk is
+// forgotten, so gTFS can be opened from elsewhere.
+static int open_disk(int (*wait)(struct TFS *tfs, struct TFSIORequest *req)) {
+    gDiskWait = wait;
+    gTFS.user_data = (void*)FS_DISK_DRIVE;
+    if (tfsOpenFilesystem(&gTFS) == 0) {
+        return 0;
+    }
+    gDiskWait = NULL;
+    gTFS.user_data = (void*)0;
+    // Whatever the disk had in place of a header
+    gTFS.header.stripe_devices = 0;
+    cache_reset(TFS_MIN_BLOCK_SIZE);
+    return -1;
+}
 
 void initFilesystem() {
-    int i;
+    int i, port;
     FileHandle *handle_storage = (FileHandle*)heapVirtAllocContiguous(4);
 
-    block_cache = allocPage();
-    for (i = 0; i < block_cache_size; i++) {
-        block_cache[i].block = 0xFFFFFFFF;
-    }
+    cache_memory = heapVirtAllocContiguous(CACHE_BYTES / 4096);
+    procWaitQueueInit(&cache_queue);
+    procWaitQueueInit(&fs_queue);
+    cache_reset(TFS_MIN_BLOCK_SIZE);
 
+    for (i = 0; i < FS_MAX_DRIVES; i++) {
+        gDrives[i].read_fn = read_fn;
+        gDrives[i].write_fn = write_fn;
+        gDrives[i].submit_fn = submit_fn;
+        gDrives[i].user_data = (void*)i;
+    }
     gTFS.read_fn = read_fn;
     gTFS.write_fn = write_fn;
+    gTFS.user_data = (void*)0;
+    gLogTFS = &gTFS;
 
     // We really don't want a write function at this moment
     tfsInit(&gTFS, handle_storage, 4*4096 / TFS_FILE_HANDLE_SIZE);
+    gTFS.submit_fn = submit_fn;
+
+    // A virtio or AHCI disk holding a copy of the boot drive is much faster
+    // than IDE, so the filesystem comes from there if there is one. Its
+    // blocks go through the cache too, and the writes the cache puts out
+    // together are in flight at once.
+    if (virtioAttach(&gDisk, FS_START_SECTOR(0)) == 0 && open_disk(virtioWaitRequest) == 0) {
+        kprintf("FS: On the virtio disk.\n");
+    } else {
+        for (port = 0; port < AHCI_MAX_PORTS; port++) {
+            if (ahciAttach(port, &gDisk, FS_START_SECTOR(0)) == 0 && open_disk(ahciWaitRequest) == 0) {
+                kprintf("FS: On the disk on AHCI port %d.\n", port);
+                break;
+            }
+        }
+    }
 
-    if (tfsOpenFilesystem(&gTFS) != 0) {
-        kprintf("Failed to open filesystem!\n");
-        halt();
+    if (gDiskWait == NULL && tfsOpenFilesystem(&gTFS) != 0) {
+        // If the header on the boot drive says the filesystem is striped,
+        // open it again across that many drives
+        if (gTFS.header.magic != TFS_MAGIC || gTFS.header.stripe_devices <= 1 ||
+            gTFS.header.stripe_devices > FS_MAX_DRIVES ||
+            tfsStripeInit(&gStripe, gDrives, gTFS.header.stripe_devices) != 0) {
+            kprintf("Failed to open filesystem!\n");
+            halt();
+        }
+        tfsStripeAttach(&gStripe, &gTFS);
+        if (tfsOpenFilesystem(&gTFS) != 0) {
+            kprintf("Failed to open filesystem!\n");
+            halt();
+        }
+        kprintf("FS: Striped across %d drives.\n", gStripe.num_devices);
+    }
+    // The header was read before the block size was known
+    cache_reset(gTFS.block_size);
+    alloc_scratch(&gTFS);
+    open_log_filesystem();
+}
+
+// Moves the blocks of a file next to each other. Returns the number of
+// blocks moved, or -1 on error.
+int defragmentFile(char *path, char *file_name) {
+    FileHandle *file;
+    int moved;
+
+    lockFilesystem();
+    if ((file = tfsOpenFile(&gTFS, path, file_name)) == NULL) {
+        unlockFilesystem();
+        return -1;
+    }
+    moved = tfsDefragmentFile(&gTFS, file);
+    tfsCloseHandle(file);
+    unlockFilesystem();
+    if (moved > 0 && syncFilesystem() != 0) {
+        return -1;
+    }
+    return moved;
+}
+
+static void sync_done(struct TFS *fs, TFSIORequest *req) {
+    procWakeQueue(&cache_queue);
+}
+
+// Writes out the block cache and has every drive 'fs' is on empty its own.
+// Returns 0 on success.
+static int sync_one(TFS *fs) {
+    volatile int *result;
+    unsigned int flags;
+    TFSIORequest req;
+
+    req.op = TFS_IO_FLUSH;
+    req.callback = sync_done;
+    req.result = REQUEST_PENDING;
+    if (tfsSubmitRequest(fs, &req) != 0) {
+        return -1;
+    }
+    // submit_fn finishes the request before returning, waiting on the disk's
+    // driver if it has to, so this is only in case a request ever completes
+    // later
+    result = &req.result;
+    flags = disableInterrupts();
+    while (*result == REQUEST_PENDING) {
+        procWait(&cache_queue, CACHE_WAIT_TICKS);
+    }
+    restoreInterrupts(flags);
+    return req.result;
+}
+
+// Writes out the block cache and has every drive the filesystem and the log
+// are on empty its own, so that what's been written so far survives a power
+// cut. Returns 0 on success.
+int syncFilesystem() {
+    if (gLogTFS != &gTFS && sync_one(gLogTFS) != 0) {
+        return -1;
     }
+    return sync_one(&gTFS);
 }
@@ -195,6 +195,15 @@ void handleIRQ(unsigned int id) {
         }
         keyboardProcessCode(b);
         return;
+
+    } else if (id == 14 || id == 15) {
+        // Primary or secondary ATA channel
+        ataHandleIRQ(id - 14);
+        return;
+
+    } else if (ahciHandleIRQ(id) | virtioHandleIRQ(id)) {
+        // PCI disks, which may share a line, so each gets a look
+        return;
     }
 
     printStr("IRQ! ");
@@ -334,37 +334,37 @@ irq_handler_09:
 irq_handler_10:
     push ebp
     push ebx
-    mov ebx, 0x10
+    mov ebx, 0x0a
     jmp irq_handler
 
 irq_handler_11:
     push ebp
     push ebx
-    mov ebx, 0x11
+    mov ebx, 0x0b
     jmp irq_handler
 
 irq_handler_12:
     push ebp
     push ebx
-    mov ebx, 0x12
+    mov ebx, 0x0c
     jmp irq_handler
 
 irq_handler_13:
     push ebp
     push ebx
-    mov ebx, 0x13
+    mov ebx, 0x0d
     jmp irq_handler
 
 irq_handler_14:
     push ebp
     push ebx
-    mov ebx, 0x14
+    mov ebx, 0x0e
     jmp irq_handler
 
 irq_handler_15:
     push ebp
     push ebx
-    mov ebx, 0x15
+    mov ebx, 0x0f
     jmp irq_handler
 
 irq_handler:
@@ -382,8 +382,12 @@ irq_handler:
     call handleIRQ
     add esp, 4
 
-    ; Send EOI
+    ; Send EOI, to the slave PIC as well for IRQs 8-15
     mov al, 0x20
+    cmp ebx, 0x08
+    jb .primary_eoi
+    out 0xA0, al
+.primary_eoi:
     out 0x20, al
 
     call procCheckContextSwitch
@@ -31,6 +31,38 @@ void main() {
     pciListDevices();
     printStr("[OK] PCI\n");
 
+    ataInit();
+    for (i = 0; i < 4; i++) {
+        if (ataDrivePresent(i)) {
+            kprintf("ATA: drive %d on the %s channel\n", i, i < 2 ? "primary" : "secondary");
+        }
+    }
+    kprintf("[OK] ATA\n");
+
+    ataInitDMA();
+    kprintf("[OK] ATA DMA\n");
+
+    ataInitIRQ();
+    kprintf("[OK] ATA interrupts\n");
+#ifdef ATA_BENCHMARK
+    // 1 MB in 4 KB reads, with DMA and then PIO, interrupts and then polling
+    ataBenchmark(0, 8, 256);
+#endif
+
+    ahciInit();
+    kprintf("[OK] AHCI\n");
+#ifdef AHCI_BENCHMARK
+    // Random 4 KB reads at several queue depths, then the same on IDE
+    ahciBenchmark(1024);
+#endif
+
+    virtioInit();
+    kprintf("[OK] virtio\n");
+#ifdef VIRTIO_BENCHMARK
+    virtioBenchmark(1024);
+#endif
+
+    blockQueueInit();
     initFilesystem();
     kprintf("[OK] Filesystem\n");
 
@@ -39,6 +71,11 @@ void main() {
     // screen
     kprintf("[OK] Logger\n");
 
+    // The system counter runs at 1024 Hz
+    kprintf("Booted in %d ms\n", getSystemCounter() * 1000 / 1024);
+    logBlockCacheStats();
+    logBlockQueueStats();
+
     if (loadELF("/bin", "init.elf") != 0) {
         halt();
     }
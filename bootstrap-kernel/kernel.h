@@ -19,6 +19,7 @@
 // Process flags
 #define PROC_FLAGS_TERMINATED     (1<<0)
 #define PROC_FLAGS_RUNNABLE       (1<<1)
+#define PROC_FLAGS_WAITING        (1<<2) // In procWait; not run until woken
 
 // Typedefs
 typedef unsigned int *TKVPageDirectory;
@@ -29,6 +30,11 @@ typedef unsigned int TKStreamID;
 
 typedef struct TKSmallAllocatorPage TKSmallAllocatorPage;
 
+// Processes waiting for something, such as a disk transfer (see procWait)
+typedef struct {
+    TKVProcID head; // First waiting process, linked by wait_next, or 0
+} TKWaitQueue;
+
 typedef struct {
     TKVProcID proc_id;
     TKVPageDirectory vmm_directory;
@@ -51,8 +57,28 @@ typedef struct {
     long active_start; // last time we switched to this process
     long active_end; // last time we switched away from this process
     void *active_stack_addr; // PC saved when we last switched away from the process
+
+    // Only meaningful while PROC_FLAGS_WAITING is set
+    TKWaitQueue *wait_queue; // Queue the process is waiting on
+    TKVProcID wait_next; // Next process waiting on the same queue, or 0
+    long wait_deadline; // Time the process stops waiting even if not woken
 } TKProcessInfo;
 
+// A transfer for the block queue (see blockSubmit)
+typedef struct TKBlockRequest {
+    int drive;
+    int write;
+    unsigned int lba;
+    int sectors;
+    unsigned char *buffer;
+    long queued_at;
+    // BLOCK_PENDING until done, then 0 on success or -1 on error
+    volatile int result;
+    struct TKBlockRequest *next;
+} TKBlockRequest;
+
+#define BLOCK_PENDING 1
+
 typedef struct {
     TKStreamID stream_id;        // ID used to reference the stream
     TKVProcID read_owner;        // Process that will be reading from the stream
@@ -79,6 +105,8 @@ unsigned short inw(unsigned short port);
 void outw(unsigned short port, unsigned short data);
 unsigned int indw(unsigned short port);
 void outdw(unsigned short port, unsigned int data);
+unsigned int disableInterrupts();
+void restoreInterrupts(unsigned int flags);
 
 // PIC
 
@@ -91,6 +119,7 @@ TKVPageTable vmmGetOrCreatePageTable(TKVPageDirectory directory, unsigned int pr
 void vmmSetPage(TKVPageTable table, int src, unsigned int dest, int user);
 void vmmMapPage(TKVPageDirectory directory, unsigned int src, unsigned int dest, int user);
 void vmmSwap(TKVPageDirectory directory);
+unsigned int vmmGetPhysical(TKVPageDirectory directory, unsigned int vaddr);
 
 // Processes
 
@@ -103,6 +132,9 @@ void *procMapHeapPage(TKVProcID proc_id, unsigned int dest);
 void procStart(TKVProcID proc_id, void *ip);
 void procCheckContextSwitch();
 void procExit();
+void procWaitQueueInit(TKWaitQueue *queue);
+int procWait(TKWaitQueue *queue, long timeout);
+void procWakeQueue(TKWaitQueue *queue);
 void *procGetSharedPage(TKVProcID proc_id);
 TKStreamPointer *procGetStdoutPointer(TKVProcID proc_id);
 void halt();
@@ -144,13 +176,72 @@ void keyboardProcessCode(unsigned char code);
 // PCI
 void pciListDevices();
 int pciGetIDEConfig(int slave, unsigned int *cmdBase, unsigned int *ctrlBase, unsigned int *bmideBase, int *irqNum);
-
-// ATA driver
-int loadFromDisk(int LBA, int sectorCount, unsigned char *buffer);
+int pciGetAHCIConfig(unsigned int *abar, int *irqNum);
+int pciGetVirtioBlkConfig(unsigned int *ioBase, int *irqNum);
+
+// ATA driver. 'drive' is 0-3: the master and slave of the primary channel,
+// then of the secondary one. Transfers on different channels go on at once.
+// Writes may sit in the drive's cache until ataFlush.
+// Finds the channels and the drives on them, before anything else
+void ataInit();
+int ataDrivePresent(int drive);
+int loadFromDisk(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer);
+int writeToDisk(int drive, unsigned int LBA, int sectorCount, unsigned char *buffer);
+int ataFlush(int drive);
+// Sets up bus master DMA, which transfers use from then on where they can
+void ataInitDMA();
+// Has transfers sleep until the drive raises its interrupt, rather than poll
+void ataInitIRQ();
+void ataHandleIRQ(int channel);
+void ataBenchmark(int drive, int sectors, int count);
+
+// Block queue, which sorts and merges transfers for the ATA drives.
+// Requests in the queue at once mustn't overlap.
+void blockQueueInit();
+void blockSubmit(TKBlockRequest *req);
+int blockWait(TKBlockRequest *req);
+int blockTransfer(int drive, int write, unsigned int lba, int sectors, unsigned char *buffer);
+void logBlockQueueStats();
+
+// AHCI driver, for SATA disks on the ports of an AHCI controller. A disk is
+// read from 'start_sector' on by a TFS attached with ahciAttach. A request
+// submitted to it with its result set to BLOCK_PENDING can be waited on with
+// ahciWaitRequest, which returns the result.
+#define AHCI_MAX_PORTS 32
+struct TFS;
+struct TFSIORequest;
+void ahciInit();
+int ahciHandleIRQ(unsigned int irq);
+int ahciAttach(int port, struct TFS *tfs, unsigned int start_sector);
+int ahciWaitRequest(struct TFS *tfs, struct TFSIORequest *req);
+void ahciBenchmark(int count);
+
+// virtio-blk driver, for the paravirtual disk of a virtual machine. The disk
+// is read from 'start_sector' on by a TFS attached with virtioAttach, and
+// requests to it are waited on as for AHCI.
+void virtioInit();
+int virtioHandleIRQ(unsigned int irq);
+int virtioAttach(struct TFS *tfs, unsigned int start_sector);
+int virtioWaitRequest(struct TFS *tfs, struct TFSIORequest *req);
+void virtioBenchmark(int count);
 
 // Filesystem
 extern struct TFS gTFS;
+// The filesystem the kernel log is on, which may be gTFS
+extern struct TFS *gLogTFS;
 void initFilesystem();
+int syncFilesystem();
+// Keeps writes from before it from reaching the disk after any from after it
+void filesystemBarrier();
+// Writes out the block cache if it's been dirty a while or is mostly dirty
+void flushFilesystemCache();
+void logBlockCacheStats();
+int defragmentFile(char *path, char *file_name);
+// Held around calls into TomFS from anywhere a process can be switched away
+// from, so that only one process is using the filesystems at a time. The
+// process holding it can take it again.
+void lockFilesystem();
+void unlockFilesystem();
 
 // Memcpy
 void memcpy(void *dest, void *src, int bytes);
@@ -20,6 +20,10 @@
 
 FileHandle *log_file = 0;
 
+// Kept open so that log files can be found and created without looking up
+// "/logs" again each time
+FileHandle *log_dir = 0;
+
 int isdigit(const char c)
 {
     return c >= '0' && c <= '9';
@@ -326,7 +330,9 @@ int kprintf(const char *fmt, ...)
     va_end(args);
 
     if (log_file) {
-        tfsWriteFile(&gTFS, log_file, printf_tmp_buf, printed, tfsGetFileSize(log_file));
+        lockFilesystem();
+        tfsWriteFile(gLogTFS, log_file, printf_tmp_buf, printed, tfsGetFileSize(log_file));
+        unlockFilesystem();
     } else {
         printStr(printf_tmp_buf);
     }
@@ -335,25 +341,32 @@ int kprintf(const char *fmt, ...)
 }
 
 void initLogger() {
-    FileHandle *dir_handle;
-
     // Create the "/logs" directory if it doesn't exist
-    dir_handle = tfsOpenPath(&gTFS, "/logs");
-    if (!dir_handle) {
-        dir_handle = tfsCreateDirectory(&gTFS, "/", "logs");
-        if (!dir_handle) {
+    log_dir = tfsOpenPath(gLogTFS, "/logs");
+    if (!log_dir) {
+        log_dir = tfsCreateDirectory(gLogTFS, "/", "logs");
+        if (!log_dir) {
             kprintf("Failed to create log directory!\n");
             return;
         }
     }
-    tfsCloseHandle(dir_handle);
+    // The directory is on the disk before the log file that goes in it
+    filesystemBarrier();
 
-    // Create a new log file for this run
-    tfsDeleteFile(&gTFS, "/logs", "kernel.log");
-    log_file = tfsCreateFile(&gTFS, "/logs", 0644, "kernel.log");
+    // Start a fresh log for this run, reusing the file from the last run if
+    // there is one
+    log_file = tfsOpenFileAt(gLogTFS, log_dir, "kernel.log");
+    if (log_file) {
+        if (tfsTruncateFile(gLogTFS, log_file, 0) != 0) {
+            tfsCloseHandle(log_file);
+            log_file = 0;
+        }
+    } else {
+        log_file = tfsCreateFileAt(gLogTFS, log_dir, 0644, "kernel.log");
+    }
     if (!log_file) {
         kprintf("Failed to create log file!\n");
         return;
     }
+    syncFilesystem();
 }
-
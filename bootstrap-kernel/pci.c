@@ -5,6 +5,8 @@ typedef struct {
 } PCIDevice;
 
 PCIDevice ide;
+PCIDevice ahci;
+PCIDevice virtio_blk;
 
 unsigned int pciConfigReadDWord(unsigned char bus, unsigned char slot, unsigned char func, unsigned char offset) {
     unsigned int address;
@@ -19,6 +21,19 @@ unsigned int pciConfigReadDWord(unsigned char bus, unsigned char slot, unsigned
     return indw(0xCFC);
 }
 
+void pciConfigWriteDWord(unsigned char bus, unsigned char slot, unsigned char func, unsigned char offset, unsigned int value) {
+    unsigned int address;
+    address = (unsigned int)(
+            (((unsigned int)bus) << 16) |
+            (((unsigned int)slot) << 11) |
+            (((unsigned int)func) << 8) |
+            (((unsigned int)offset)) |
+            0x80000000);
+
+    outdw(0xCF8, address);
+    outdw(0xCFC, value);
+}
+
 unsigned int pciGetVendorAndDevice(unsigned char bus, unsigned char slot, unsigned char func)
 {
     return pciConfigReadDWord(bus,slot,func,0);
@@ -43,6 +58,8 @@ void setPCIDevice(PCIDevice *dev, unsigned char bus, unsigned char slot, unsigne
 
 void pciListDevices() {
     clearPCIDevice(&ide);
+    clearPCIDevice(&ahci);
+    clearPCIDevice(&virtio_blk);
 
     unsigned short bus, slot, function;
     unsigned int vendor, type;
@@ -74,6 +91,15 @@ void pciListDevices() {
                             printStr("Found IDE at "); printByte(bus); printStr(":"); printByte(slot); printStr(":"); printByte(function); printStr("\n");
                             setPCIDevice(&ide, bus, slot, function);
                         }
+                        if ((type >> 16) == 0x0106 && ahci.bus == 0xff) {
+                            printStr("Found AHCI at "); printByte(bus); printStr(":"); printByte(slot); printStr(":"); printByte(function); printStr("\n");
+                            setPCIDevice(&ahci, bus, slot, function);
+                        }
+                        // The legacy (transitional) virtio block device
+                        if (vendor == 0x10011af4 && virtio_blk.bus == 0xff) {
+                            printStr("Found virtio-blk at "); printByte(bus); printStr(":"); printByte(slot); printStr(":"); printByte(function); printStr("\n");
+                            setPCIDevice(&virtio_blk, bus, slot, function);
+                        }
                     }
                 }
             }
@@ -83,6 +109,7 @@ void pciListDevices() {
 
 int pciGetIDEConfig(int slave, unsigned int *cmdBase, unsigned int *ctrlBase, unsigned int *bmideBase, int *irqNum) {
     int priSec = slave ? 1 : 0;
+    unsigned int command;
     if (ide.bus == 0xff) {
         return 0;
     }
@@ -112,6 +139,12 @@ int pciGetIDEConfig(int slave, unsigned int *cmdBase, unsigned int *ctrlBase, un
         *bmideBase += 8;
     } 
 
+    // Let the controller master the bus, so it can do DMA
+    command = pciConfigReadDWord(ide.bus, ide.slot, ide.func, 0x04);
+    if ((command & 0x4) == 0) {
+        pciConfigWriteDWord(ide.bus, ide.slot, ide.func, 0x04, (command & 0xffff) | 0x4);
+    }
+
     if (!*irqNum)
     {
         *irqNum = pciConfigReadDWord(ide.bus, ide.slot, ide.func, 0x3c );
@@ -120,3 +153,45 @@ int pciGetIDEConfig(int slave, unsigned int *cmdBase, unsigned int *ctrlBase, un
 
     return 1;
 }
+
+// Finds the AHCI controller's registers (ABAR, in memory) and IRQ, and lets
+// it decode memory and master the bus. Returns 0 if there isn't one.
+int pciGetAHCIConfig(unsigned int *abar, int *irqNum) {
+    unsigned int command;
+    if (ahci.bus == 0xff) {
+        return 0;
+    }
+    *abar = pciConfigReadDWord(ahci.bus, ahci.slot, ahci.func, 0x24) & 0xfffffff0;
+    *irqNum = pciConfigReadDWord(ahci.bus, ahci.slot, ahci.func, 0x3c) & 0xff;
+    if (*abar == 0) {
+        return 0;
+    }
+
+    command = pciConfigReadDWord(ahci.bus, ahci.slot, ahci.func, 0x04);
+    if ((command & 0x6) != 0x6) {
+        pciConfigWriteDWord(ahci.bus, ahci.slot, ahci.func, 0x04, (command & 0xffff) | 0x6);
+    }
+    return 1;
+}
+
+// Finds the virtio block device's registers (BAR0, in I/O space) and IRQ, and
+// lets it decode I/O and master the bus. Returns 0 if there isn't one.
+int pciGetVirtioBlkConfig(unsigned int *ioBase, int *irqNum) {
+    unsigned int command;
+    if (virtio_blk.bus == 0xff) {
+        return 0;
+    }
+    *ioBase = pciConfigReadDWord(virtio_blk.bus, virtio_blk.slot, virtio_blk.func, 0x10);
+    *irqNum = pciConfigReadDWord(virtio_blk.bus, virtio_blk.slot, virtio_blk.func, 0x3c) & 0xff;
+    if ((*ioBase & 1) == 0) {
+        // Memory rather than I/O, so not the legacy interface
+        return 0;
+    }
+    *ioBase &= 0xfffc;
+
+    command = pciConfigReadDWord(virtio_blk.bus, virtio_blk.slot, virtio_blk.func, 0x04);
+    if ((command & 0x5) != 0x5) {
+        pciConfigWriteDWord(virtio_blk.bus, virtio_blk.slot, virtio_blk.func, 0x04, (command & 0xffff) | 0x5);
+    }
+    return 1;
+}
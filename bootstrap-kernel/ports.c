@@ -27,3 +27,14 @@ unsigned int indw(unsigned short port) {
 void outdw(unsigned short port, unsigned int data) {
     __asm__("out %%eax, %%dx" : : "a" (data), "d" (port));
 }
+
+// Disables interrupts, returning the flags to pass to restoreInterrupts
+unsigned int disableInterrupts() {
+    unsigned int flags;
+    __asm__ __volatile__ ("pushf\npop %0\ncli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+void restoreInterrupts(unsigned int flags) {
+    __asm__ __volatile__ ("push %0\npopf" : : "r" (flags) : "memory", "cc");
+}
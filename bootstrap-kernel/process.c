@@ -236,19 +236,82 @@ void procDoContextSwitch(TKProcessInfo *cur_info, TKProcessInfo *next_info) {
     context_switch(&cur_info->active_stack_addr, next_info->active_stack_addr, next_info->vmm_directory);
 }
 
+void procWaitQueueInit(TKWaitQueue *queue) {
+    queue->head = 0;
+}
+
+// Takes 'info' off the queue it's waiting on
+static void procStopWaiting(TKProcessInfo *info) {
+    TKVProcID *link = &info->wait_queue->head;
+    while (*link != 0) {
+        if (*link == info->proc_id) {
+            *link = info->wait_next;
+            break;
+        }
+        link = &tk_process_table[*link-1].wait_next;
+    }
+    info->flags &= ~PROC_FLAGS_WAITING;
+}
+
+// Puts the current process on 'queue' and runs others, or idles if there are
+// none, until procWakeQueue is called on it or 'timeout' ticks have passed.
+// Interrupts must be disabled, as they are again on return. A wakeup doesn't
+// mean whatever the caller is waiting for has happened, so it checks again.
+// Returns 1 if woken, 0 on timeout.
+int procWait(TKWaitQueue *queue, long timeout) {
+    TKProcessInfo *info = &tk_process_table[tk_cur_proc_id-1];
+
+    info->wait_queue = queue;
+    info->wait_next = queue->head;
+    info->wait_deadline = getSystemCounter() + timeout;
+    info->flags |= PROC_FLAGS_WAITING;
+    queue->head = info->proc_id;
+
+    while (info->flags & PROC_FLAGS_WAITING) {
+        if (getSystemCounter() - info->wait_deadline >= 0) {
+            procStopWaiting(info);
+            return 0;
+        }
+        // Returns once this process is picked to run again, which it isn't
+        // until woken, unless there was nothing to switch to
+        procCheckContextSwitch();
+        if (info->flags & PROC_FLAGS_WAITING) {
+            // Nothing else to run: sleep until the next interrupt
+            __asm__ __volatile__ ("sti\nhlt\ncli" : : : "memory");
+        }
+    }
+    return getSystemCounter() - info->wait_deadline < 0;
+}
+
+// Wakes every process waiting on 'queue'. Safe to call from an interrupt.
+void procWakeQueue(TKWaitQueue *queue) {
+    while (queue->head != 0) {
+        TKProcessInfo *info = &tk_process_table[queue->head-1];
+        queue->head = info->wait_next;
+        info->flags &= ~PROC_FLAGS_WAITING;
+    }
+}
+
 void procCheckContextSwitch() {
     long counter = getSystemCounter();
     TKProcessInfo *cur_info = &tk_process_table[tk_cur_proc_id-1];
 
-    // Context switches constant at 60hz for now
-    if (cur_info->flags & PROC_FLAGS_TERMINATED ||
+    // Context switches constant at 60hz for now, or straight away if the
+    // current process is waiting
+    if (cur_info->flags & (PROC_FLAGS_TERMINATED | PROC_FLAGS_WAITING) ||
             counter > cur_info->active_start + 16L) {
         int i;
         for (i = 0; i < MAX_PROCESSES - 1; i++) {
             int idx = (((int)tk_cur_proc_id) + i) % MAX_PROCESSES;
             TKProcessInfo *next_info = &tk_process_table[idx];
+            if (next_info->proc_id != 0 && next_info->flags & PROC_FLAGS_WAITING &&
+                    counter - next_info->wait_deadline >= 0) {
+                // Waited long enough
+                procStopWaiting(next_info);
+            }
             if (next_info->proc_id != 0 && next_info->proc_id != 1 &&
                     next_info->flags & PROC_FLAGS_RUNNABLE &&
+                    !(next_info->flags & PROC_FLAGS_WAITING) &&
                     next_info->proc_id != tk_cur_proc_id &&
                     next_info->active_stack_addr) {
                 procDoContextSwitch(cur_info, next_info);
@@ -2,6 +2,10 @@
 
 void syscallHandler(unsigned int func, unsigned int param1) {
     //printStack();
+    // There's nothing else to write the block cache out in the background,
+    // so processes do it on their way into the kernel
+    flushFilesystemCache();
+
     if (func == 0x1) {
         // puts
         const char *str = (const char*)procGetSharedPage(tk_cur_proc_id);
@@ -0,0 +1,552 @@
+#include "kernel.h"
+#include <tomfs.h>
+
+// Legacy virtio PCI registers, from the I/O BAR
+#define VIRTIO_DEVICE_FEATURES  0x00
+#define VIRTIO_GUEST_FEATURES   0x04
+#define VIRTIO_QUEUE_ADDRESS    0x08
+#define VIRTIO_QUEUE_SIZE       0x0C
+#define VIRTIO_QUEUE_SELECT     0x0E
+#define VIRTIO_QUEUE_NOTIFY     0x10
+#define VIRTIO_STATUS           0x12
+#define VIRTIO_ISR              0x13
+// virtio-blk's configuration, starting with its size in sectors
+#define VIRTIO_BLK_CAPACITY     0x14
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER      2
+#define VIRTIO_STATUS_DRIVER_OK   4
+#define VIRTIO_STATUS_FAILED      128
+
+// The disk has a write cache, which VIRTIO_BLK_T_FLUSH empties
+#define VIRTIO_BLK_F_FLUSH      (1 << 9)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2
+// In the available ring's flags: don't interrupt as requests complete
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+// In the used ring's flags: the device is already looking at the available
+// ring, so doesn't need to be told about new requests
+#define VIRTQ_USED_F_NO_NOTIFY  1
+
+#define VIRTIO_MAX_QUEUE_SIZE   1024
+
+// Requests in flight at once
+#define VIRTIO_MAX_REQUESTS     64
+
+// Descriptors for the data of a request: a page each of the largest TomFS
+// block, plus one for a buffer that doesn't start on a page boundary
+#define VIRTIO_MAX_DATA_DESCS   (TFS_MAX_BLOCK_SIZE / 4096 + 1)
+
+// Ticks a request is waited on before the queue is checked in case the
+// interrupt isn't coming
+#define VIRTIO_POLL_TICKS       4
+
+// The result of a request that hasn't completed yet, as for the block queue
+#define VIRTIO_PENDING          BLOCK_PENDING
+
+// Stops the compiler moving memory accesses across it. x86 keeps stores in
+// order, which is all the rings need apart from in virtioPoll.
+#define virtioBarrier() __asm__ __volatile__ ("" : : : "memory")
+
+typedef struct {
+    unsigned int address;
+    unsigned int address_high;
+    unsigned int length;
+    unsigned short flags;
+    unsigned short next;
+} VirtqDesc;
+
+// What the device reads at the start of each request
+typedef struct {
+    unsigned int type;
+    unsigned int reserved;
+    unsigned int sector;
+    unsigned int sector_high;
+} VirtioBlkHeader;
+
+// A request in flight. The header and status are what the descriptors point
+// to, so these live in a page of their own.
+typedef struct {
+    VirtioBlkHeader header;
+    TFSIORequest *req;
+    unsigned short head;
+    unsigned char status;
+} VirtioBlkRequest;
+
+// 0 until virtioInit finds a device
+unsigned int virtio_io = 0;
+int virtio_irq = -1;
+unsigned int virtio_sectors;
+int virtio_flush;
+
+// The queue, laid out as the legacy interface wants: descriptors, then the
+// available ring, then the used ring on the next page
+unsigned short virtio_queue_size;
+VirtqDesc *virtio_desc;
+volatile unsigned short *virtio_avail;
+volatile unsigned short *virtio_used;
+unsigned short virtio_avail_idx;
+unsigned short virtio_used_idx;
+
+// Free descriptors, linked through their next
+unsigned short virtio_free_desc;
+int virtio_free_count;
+
+VirtioBlkRequest *virtio_requests;
+
+// Requests waiting for descriptors, linked through their next
+TFSIORequest *virtio_pending_head;
+TFSIORequest *virtio_pending_tail;
+
+struct TFS *virtio_tfs;
+unsigned int virtio_start_sector;
+
+// Processes waiting for a request to complete
+TKWaitQueue virtio_queue;
+
+// The used ring is 4 bytes of flags and index, then the ID of each request's
+// first descriptor and the bytes written, a word each
+#define VIRTIO_USED_ID(i) (((volatile unsigned int *)virtio_used)[1 + ((i) % virtio_queue_size) * 2])
+
+// Splits 'bytes' at 'buffer' into pieces that are contiguous in memory.
+// Returns the number of pieces, or -1 if there are too many.
+static int virtioMapBuffer(char *buffer, unsigned int bytes, unsigned int *addresses, unsigned int *lengths) {
+    unsigned int address = (unsigned int)buffer, physical, chunk;
+    TKVPageDirectory directory = tk_process_table[0].vmm_directory;
+    int n = 0;
+
+    while (bytes > 0) {
+        chunk = 4096 - (address & 0xfff);
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        physical = vmmGetPhysical(directory, address);
+        if (n > 0 && addresses[n - 1] + lengths[n - 1] == physical) {
+            lengths[n - 1] += chunk;
+        } else {
+            if (n == VIRTIO_MAX_DATA_DESCS) {
+                return -1;
+            }
+            addresses[n] = physical;
+            lengths[n] = chunk;
+            n++;
+        }
+        address += chunk;
+        bytes -= chunk;
+    }
+    return n;
+}
+
+static unsigned short virtioTakeDesc(unsigned int address, unsigned int length, unsigned short flags) {
+    unsigned short i = virtio_free_desc;
+    virtio_free_desc = virtio_desc[i].next;
+    virtio_free_count--;
+    virtio_desc[i].address = address;
+    virtio_desc[i].address_high = 0;
+    virtio_desc[i].length = length;
+    virtio_desc[i].flags = flags;
+    return i;
+}
+
+// Puts waiting requests on the available ring while there are descriptors
+// for them, then tells the device about them all at once
+static void virtioStart() {
+    unsigned int addresses[VIRTIO_MAX_DATA_DESCS], lengths[VIRTIO_MAX_DATA_DESCS];
+    VirtioBlkRequest *r;
+    TFSIORequest *req;
+    unsigned short desc, last;
+    int i, n, added = 0, sectors = virtio_tfs->block_size >> 9;
+
+    while ((req = virtio_pending_head) != NULL) {
+        for (i = 0; i < VIRTIO_MAX_REQUESTS && virtio_requests[i].req; i++) {
+        }
+        if (i == VIRTIO_MAX_REQUESTS) {
+            break;
+        }
+        r = &virtio_requests[i];
+
+        n = 0;
+        if (req->op != TFS_IO_FLUSH &&
+            (n = virtioMapBuffer(req->buf, virtio_tfs->block_size, addresses, lengths)) < 0) {
+            n = -1;
+        } else if (virtio_free_count < n + 2) {
+            break;
+        }
+        virtio_pending_head = req->next;
+        if (virtio_pending_head == NULL) {
+            virtio_pending_tail = NULL;
+        }
+        if (n < 0) {
+            tfsCompleteRequest(virtio_tfs, req, -1);
+            continue;
+        }
+
+        if (req->op == TFS_IO_FLUSH) {
+            r->header.type = VIRTIO_BLK_T_FLUSH;
+            r->header.sector = 0;
+        } else {
+            r->header.type = (req->op == TFS_IO_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            r->header.sector = virtio_start_sector + req->block * sectors;
+        }
+        r->header.reserved = 0;
+        r->header.sector_high = 0;
+        r->status = 0xff;
+        r->req = req;
+
+        // Header, data (written by the device for a read), then status
+        r->head = last = virtioTakeDesc((unsigned int)&r->header, sizeof(VirtioBlkHeader), VIRTQ_DESC_F_NEXT);
+        for (i = 0; i < n; i++) {
+            desc = virtioTakeDesc(addresses[i], lengths[i],
+                                  VIRTQ_DESC_F_NEXT | ((req->op == TFS_IO_READ) ? VIRTQ_DESC_F_WRITE : 0));
+            virtio_desc[last].next = desc;
+            last = desc;
+        }
+        desc = virtioTakeDesc((unsigned int)&r->status, 1, VIRTQ_DESC_F_WRITE);
+        virtio_desc[last].next = desc;
+
+        virtio_avail[2 + virtio_avail_idx % virtio_queue_size] = r->head;
+        virtio_avail_idx++;
+        added = 1;
+    }
+
+    if (added) {
+        // The ring entries go out before the index that covers them, and
+        // the index before the device is told to look
+        virtioBarrier();
+        virtio_avail[1] = virtio_avail_idx;
+        virtioBarrier();
+        if ((virtio_used[0] & VIRTQ_USED_F_NO_NOTIFY) == 0) {
+            outw(virtio_io + VIRTIO_QUEUE_NOTIFY, 0);
+        }
+    }
+}
+
+// Completes the requests on the used ring and starts waiting ones with the
+// descriptors they free up. Called with interrupts disabled, from the
+// interrupt handler or by a process that's been waiting a while in case the
+// interrupt isn't coming.
+static void virtioPoll() {
+    TFSIORequest *finished[VIRTIO_MAX_REQUESTS];
+    int results[VIRTIO_MAX_REQUESTS];
+    VirtioBlkRequest *r;
+    unsigned short desc, id;
+    int i, n = 0;
+
+    do {
+        // Completions are picked up here, so the device needn't interrupt
+        // for them in the meantime
+        virtio_avail[0] = VIRTQ_AVAIL_F_NO_INTERRUPT;
+        while (virtio_used_idx != virtio_used[1]) {
+            virtioBarrier();
+            id = VIRTIO_USED_ID(virtio_used_idx);
+            virtio_used_idx++;
+            for (i = 0; i < VIRTIO_MAX_REQUESTS && !(virtio_requests[i].req && virtio_requests[i].head == id); i++) {
+            }
+            if (i == VIRTIO_MAX_REQUESTS) {
+                continue;
+            }
+            r = &virtio_requests[i];
+
+            // Give the chain's descriptors back
+            desc = id;
+            while (1) {
+                virtio_free_count++;
+                if ((virtio_desc[desc].flags & VIRTQ_DESC_F_NEXT) == 0) {
+                    break;
+                }
+                desc = virtio_desc[desc].next;
+            }
+            virtio_desc[desc].next = virtio_free_desc;
+            virtio_free_desc = id;
+
+            finished[n] = r->req;
+            results[n++] = (r->status == 0) ? 0 : -1;
+            r->req = NULL;
+        }
+        virtio_avail[0] = 0;
+        // The flag has to be out before the index is checked again, or a
+        // completion in between would go unnoticed until the next one
+        __asm__ __volatile__ ("lock; addl $0, (%%esp)" : : : "memory");
+    } while (virtio_used_idx != virtio_used[1]);
+
+    // Refill the queue first, as completing a request may submit another
+    virtioStart();
+    for (i = 0; i < n; i++) {
+        tfsCompleteRequest(virtio_tfs, finished[i], results[i]);
+    }
+    if (n > 0) {
+        procWakeQueue(&virtio_queue);
+    }
+}
+
+int virtioHandleIRQ(unsigned int irq) {
+    unsigned char isr;
+
+    if (virtio_io == 0 || irq != virtio_irq) {
+        return 0;
+    }
+    // Reading the ISR acknowledges the interrupt. It's 0 if the interrupt was
+    // some other device's on the same line.
+    isr = inb(virtio_io + VIRTIO_ISR);
+    if (isr & 1) {
+        virtioPoll();
+    }
+    return isr != 0;
+}
+
+static int virtioSubmit(struct TFS *fs, TFSIORequest *req) {
+    unsigned int flags;
+
+    if (req->op != TFS_IO_READ && req->op != TFS_IO_WRITE && req->op != TFS_IO_FLUSH) {
+        return -1;
+    }
+    if (req->op == TFS_IO_FLUSH && !virtio_flush) {
+        // Writes go straight to the disk
+        tfsCompleteRequest(fs, req, 0);
+        return 0;
+    }
+    flags = disableInterrupts();
+    req->next = NULL;
+    if (virtio_pending_tail) {
+        virtio_pending_tail->next = req;
+    } else {
+        virtio_pending_head = req;
+    }
+    virtio_pending_tail = req;
+    virtioStart();
+    restoreInterrupts(flags);
+    return 0;
+}
+
+static void virtioSyncDone(struct TFS *fs, TFSIORequest *req) {
+}
+
+// Waits for a request to complete, running other processes in the meantime
+static void virtioWait(volatile int *result) {
+    unsigned int flags = disableInterrupts();
+    while (*result == VIRTIO_PENDING) {
+        if (!procWait(&virtio_queue, VIRTIO_POLL_TICKS)) {
+            virtioPoll();
+        }
+    }
+    restoreInterrupts(flags);
+}
+
+int virtioWaitRequest(struct TFS *fs, TFSIORequest *req) {
+    virtioWait(&req->result);
+    return req->result;
+}
+
+// Carries out a request and waits for it, for read_fn and write_fn
+static int virtioSyncRequest(struct TFS *fs, int op, char *buf, unsigned int block) {
+    TFSIORequest req;
+
+    req.op = op;
+    req.buf = buf;
+    req.block = block;
+    req.callback = virtioSyncDone;
+    req.result = VIRTIO_PENDING;
+    if (tfsSubmitRequest(fs, &req) != 0) {
+        return -1;
+    }
+    virtioWait(&req.result);
+    return req.result;
+}
+
+static int virtioReadBlock(struct TFS *fs, char *buf, unsigned int block) {
+    return virtioSyncRequest(fs, TFS_IO_READ, buf, block);
+}
+
+static int virtioWriteBlock(struct TFS *fs, const char *buf, unsigned int block) {
+    return virtioSyncRequest(fs, TFS_IO_WRITE, (char *)buf, block);
+}
+
+// Allocates 'count' pages next to each other in memory, as the device is
+// given the one address for the whole queue. Pages that don't join up stay
+// allocated, which is fine once at boot.
+static unsigned char *virtioAllocContiguous(int count) {
+    unsigned char *first = (unsigned char *)allocPage(), *page;
+    int n = 1;
+
+    while (first && n < count) {
+        page = (unsigned char *)allocPage();
+        if (page == NULL) {
+            return NULL;
+        }
+        if (page == first + n * 4096) {
+            n++;
+        } else {
+            first = page;
+            n = 1;
+        }
+    }
+    return first;
+}
+
+void virtioInit() {
+    unsigned int io, features, used_offset, bytes, i;
+    unsigned char *queue;
+    int irq;
+
+    virtio_io = 0;
+    if (!pciGetVirtioBlkConfig(&io, &irq)) {
+        return;
+    }
+
+    // Reset, then say there's a driver for it
+    outb(io + VIRTIO_STATUS, 0);
+    outb(io + VIRTIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io + VIRTIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    features = indw(io + VIRTIO_DEVICE_FEATURES);
+    virtio_flush = (features & VIRTIO_BLK_F_FLUSH) != 0;
+    outdw(io + VIRTIO_GUEST_FEATURES, features & VIRTIO_BLK_F_FLUSH);
+
+    outw(io + VIRTIO_QUEUE_SELECT, 0);
+    virtio_queue_size = inw(io + VIRTIO_QUEUE_SIZE);
+    if (virtio_queue_size == 0 || virtio_queue_size > VIRTIO_MAX_QUEUE_SIZE) {
+        kprintf("virtio: Can't use a queue of %d\n", virtio_queue_size);
+        outb(io + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    used_offset = (virtio_queue_size * 16 + (3 + virtio_queue_size) * 2 + 4095) & ~4095;
+    bytes = used_offset + ((3 * 2 + virtio_queue_size * 8 + 4095) & ~4095);
+    queue = virtioAllocContiguous(bytes / 4096);
+    virtio_requests = (VirtioBlkRequest *)allocPage();
+    if (queue == NULL || virtio_requests == NULL) {
+        kprintf("virtio: Out of memory\n");
+        outb(io + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    for (i = 0; i < bytes; i++) {
+        queue[i] = 0;
+    }
+    virtio_desc = (VirtqDesc *)queue;
+    virtio_avail = (volatile unsigned short *)(queue + virtio_queue_size * 16);
+    virtio_used = (volatile unsigned short *)(queue + used_offset);
+    virtio_avail_idx = 0;
+    virtio_used_idx = 0;
+    for (i = 0; i < virtio_queue_size; i++) {
+        virtio_desc[i].next = i + 1;
+    }
+    virtio_free_desc = 0;
+    virtio_free_count = virtio_queue_size;
+    for (i = 0; i < VIRTIO_MAX_REQUESTS; i++) {
+        virtio_requests[i].req = NULL;
+    }
+    virtio_pending_head = NULL;
+    virtio_pending_tail = NULL;
+    virtio_tfs = NULL;
+    procWaitQueueInit(&virtio_queue);
+    outdw(io + VIRTIO_QUEUE_ADDRESS, (unsigned int)queue >> 12);
+
+    // Disks over 2 TB are cut short
+    virtio_sectors = indw(io + VIRTIO_BLK_CAPACITY + 4) ? 0xffffffff : indw(io + VIRTIO_BLK_CAPACITY);
+    outb(io + VIRTIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    virtio_irq = irq;
+    virtio_io = io;
+    kprintf("virtio: %d MB disk, queue of %d%s\n", virtio_sectors >> 11, virtio_queue_size,
+            virtio_flush ? ", write cache" : "");
+}
+
+// Has 'tfs' read and write the disk from 'start_sector' on. Requests are
+// completed on 'tfs', so only one TFS can be attached at a time. A request
+// with no callback goes on the completion queue from the interrupt handler,
+// so reap them with interrupts disabled. Returns 0 on success, or -1 if
+// there's no disk.
+int virtioAttach(struct TFS *tfs, unsigned int start_sector) {
+    if (virtio_io == 0) {
+        return -1;
+    }
+    virtio_tfs = tfs;
+    virtio_start_sector = start_sector;
+    tfs->read_fn = virtioReadBlock;
+    tfs->write_fn = virtioWriteBlock;
+    tfs->submit_fn = virtioSubmit;
+    tfs->user_data = NULL;
+    return 0;
+}
+
+// Reads 'count' 4 KB blocks at random from the first 8 MB of the disk, at
+// queue depths from 1 to 64, then from the first IDE drive for comparison,
+// and logs how long each took. The filesystem is left attached to
+// whichever disk it was on.
+void virtioBenchmark(int count) {
+    static const int depths[] = { 1, 4, 16, 64 };
+    static TFS tfs;
+    TFSIORequest reqs[VIRTIO_MAX_REQUESTS], *done[VIRTIO_MAX_REQUESTS];
+    char *buffers[VIRTIO_MAX_REQUESTS];
+    unsigned int seed, blocks = 2048, flags;
+    int d, i, n, submitted, completed, ok;
+    struct TFS *attached = virtio_tfs;
+    unsigned int attached_start = virtio_start_sector;
+    long start, ms;
+
+    if (virtio_io == 0) {
+        return;
+    }
+    for (i = 0; i < VIRTIO_MAX_REQUESTS; i++) {
+        buffers[i] = (char *)allocPage();
+    }
+    tfs.block_size = 4096;
+    tfs.completed_head = NULL;
+    tfs.completed_tail = NULL;
+    virtioAttach(&tfs, 0);
+
+    for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        seed = 1;
+        submitted = 0;
+        completed = 0;
+        ok = 1;
+        start = getSystemCounter();
+        for (i = 0; i < depths[d] && submitted < count; i++, submitted++) {
+            seed = seed * 1103515245 + 12345;
+            reqs[i].op = TFS_IO_READ;
+            reqs[i].block = (seed >> 16) % blocks;
+            reqs[i].buf = buffers[i];
+            reqs[i].callback = NULL;
+            tfsSubmitRequest(&tfs, &reqs[i]);
+        }
+        while (completed < submitted) {
+            flags = disableInterrupts();
+            while ((n = tfsReapCompletions(&tfs, done, VIRTIO_MAX_REQUESTS)) == 0) {
+                if (!procWait(&virtio_queue, VIRTIO_POLL_TICKS)) {
+                    virtioPoll();
+                }
+            }
+            restoreInterrupts(flags);
+            for (i = 0; i < n; i++) {
+                completed++;
+                ok &= done[i]->result == 0;
+                if (submitted < count) {
+                    seed = seed * 1103515245 + 12345;
+                    done[i]->block = (seed >> 16) % blocks;
+                    tfsSubmitRequest(&tfs, done[i]);
+                    submitted++;
+                }
+            }
+        }
+        // The system counter runs at 1024 Hz
+        ms = (getSystemCounter() - start) * 1000 / 1024;
+        kprintf("virtio: Queue depth %d: %d random 4 KB reads in %d ms (%d IOPS)%s\n", depths[d], count, ms,
+                ms ? count * 1000 / ms : 0, ok ? "" : ", with errors");
+    }
+    if (attached) {
+        virtioAttach(attached, attached_start);
+    }
+
+    seed = 1;
+    ok = 1;
+    start = getSystemCounter();
+    for (i = 0; i < count && ok; i++) {
+        seed = seed * 1103515245 + 12345;
+        ok = loadFromDisk(0, (seed >> 16) % blocks * 8, 8, (unsigned char *)buffers[0]);
+    }
+    ms = (getSystemCounter() - start) * 1000 / 1024;
+    kprintf("ATA: Drive 0: %d random 4 KB reads in %d ms (%d IOPS)%s\n", count, ms,
+            ms ? count * 1000 / ms : 0, ok ? "" : ", with errors");
+}
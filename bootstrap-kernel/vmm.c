@@ -51,3 +51,18 @@ void vmmSwap(TKVPageDirectory directory) {
         );
 }
 
+
+// Returns the physical address 'vaddr' is mapped to in 'directory'. Memory
+// the kernel uses without mapping it, such as its own pages, is taken to be
+// at the same physical address.
+unsigned int vmmGetPhysical(TKVPageDirectory directory, unsigned int vaddr) {
+    TKVPageTable table;
+    if ((directory[vaddr >> 22] & 1) == 0) {
+        return vaddr;
+    }
+    table = (TKVPageTable)(directory[vaddr >> 22] & 0xfffff000);
+    if ((table[(vaddr >> 12) & 0x3ff] & 1) == 0) {
+        return vaddr;
+    }
+    return (table[(vaddr >> 12) & 0x3ff] & 0xfffff000) | (vaddr & 0xfff);
+}
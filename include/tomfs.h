@@ -1,6 +1,6 @@
 // TomFS definitions
 
-// File layout:
+// File layout (with the default geometry):
 // Block 0     - TFSFilesystemHeader
 // Block 1     - Block bitmap for blocks 1..16384
 // Block 2     - Data block
@@ -9,24 +9,45 @@
 // Block 16385 - Block bitmap for blocks 16386..32769
 // Block 16386 - Data block
 // ...
+//
+// The block size and the number of blocks per group are chosen when the
+// filesystem is made, and recorded in the header. Block numbers are 32 bits,
+// so a filesystem can have up to 2^32 - 1 blocks: 16 TB of 4 KB blocks, or
+// 256 TB of 64 KB blocks. File sizes and offsets are 64 bits.
+//
+// A filesystem can also be striped across several devices (see TFSStripe),
+// with whole block groups dealt out to them in turn.
 
 #ifndef NULL
 #define NULL 0
 #endif
 
-// Block size is the same as memory page size
+// Default block size, the same as memory page size
 #define TFS_BLOCK_SIZE        4096
 
+// Block sizes a filesystem can be made with. The block size is a power of
+// two, and the header always fits in the first TFS_MIN_BLOCK_SIZE bytes.
+#define TFS_MIN_BLOCK_SIZE    4096
+#define TFS_MAX_BLOCK_SIZE    65536
+
 // A bitmap for a block group is half a block, so we can store a whole binary
 // tree in one block
 // 2048*8 = 16384
 #define TFS_BLOCK_GROUP_SIZE  16384
 
-// Therefore, a block group is 16384 * 4096 = 67,108,864 (64 MB)
+// Therefore, a block group is 16384 * 4096 = 67,108,864 (64 MB) by default.
+// Smaller groups are allowed (any power of two down to
+// TFS_MIN_BLOCK_GROUP_SIZE), and bigger blocks allow bigger groups: up to
+// 4 * block size, so 1 GB groups of 16 KB blocks or 16 GB of 64 KB blocks.
+#define TFS_MIN_BLOCK_GROUP_SIZE 64
 
 // Magic number that identifies this FS
 #define TFS_MAGIC             0x0e5c
 
+// On-disk format revision. Bumped whenever the layout of blocks or entries
+// changes in a way older code can't read.
+#define TFS_FORMAT_VERSION    5
+
 typedef struct {
     // See TFS_MAGIC
     unsigned short magic;
@@ -46,12 +67,46 @@ typedef struct {
     // The offset into the primes table for our stride
     unsigned short stride_offset;
 
-    // The size of the root directory data
+    // The size of the root directory data. Directories are always well under
+    // 4 GB, so unlike file sizes this is 32 bits.
     unsigned int root_dir_size;
+
+    // See TFS_FORMAT_VERSION
+    unsigned int format_version;
+
+    // First block of the reference count file, or 0 if nothing has ever been
+    // cloned. The file holds an unsigned short per block in the filesystem,
+    // counting the references to that block beyond the first. A block is only
+    // freed once its count is back to zero.
+    unsigned int refcount_block;
+
+    // Size of a block in bytes, and number of blocks covered by each block
+    // bitmap (see TFS_MAX_BLOCK_SIZE and TFS_BLOCK_GROUP_SIZE)
+    unsigned int block_size;
+    unsigned int block_group_size;
+
+    // The block group new blocks are looked for in first. It only moves on
+    // once that group is full, so allocation doesn't have to look through
+    // every group's bitmap to find space.
+    unsigned int alloc_group;
+
+    // First block of the dedup index and the number of buckets in it, or 0
+    // if deduplication has never been turned on (see TFSDedupEntry)
+    unsigned int dedup_block;
+    unsigned int dedup_buckets;
+
+    // Non-zero if full-block writes to files share an identical block that
+    // is already on the filesystem rather than storing another copy
+    unsigned int dedup_writes;
+
+    // Number of devices the filesystem is striped across (see TFSStripe), or
+    // 0 or 1 if it is on just one
+    unsigned int stripe_devices;
 } TFSFilesystemHeader;
 
 typedef struct {
-    // Unique ID (or 0 if this block is free)
+    // Unique ID of the file the block belongs to. Free blocks aren't cleared,
+    // so only the block bitmaps say whether a block is in use.
     unsigned int node_id;
     // Block index of the first block in the file
     unsigned int initial_block;
@@ -59,139 +114,462 @@ typedef struct {
     unsigned int previous_block;
     // Block index of the next block in the file (or 0 if this is the last)
     unsigned int next_block;
+    // Which TFS_BLOCK_DATA_SIZE-sized piece of the file this block holds.
+    // Blocks in a chain are in increasing order; any gap between two blocks is
+    // a hole that reads back as zeros and has no blocks allocated for it.
+    unsigned int logical_block;
+    // TFS_BLOCK_* flags
+    unsigned int flags;
+    // Reserved for future use; always zero
+    unsigned int reserved[2];
 } TFSBlockHeader;
 
-// Block header is followed by 4096-16 = 4080 bytes of data
+// Block header is followed by 4096-32 = 4064 bytes of data, which holds
+// exactly 127 directory entries
 #define TFS_BLOCK_DATA_SIZE    (TFS_BLOCK_SIZE - sizeof(TFSBlockHeader))
 
+// The same for the block size of the filesystem open in 'tfs'
+#define TFS_DATA_SIZE(tfs)     ((tfs)->block_size - sizeof(TFSBlockHeader))
+
+// The data of this block is a map of TFS_MAP_ENTRIES block indices rather
+// than file data. Entry i holds logical block logical_block + i of the file,
+// or 0 for a hole. Clones are made of map blocks, so that they can share data
+// blocks with other files. A block referenced from a map is either a
+// compressed chunk or plain data; apart from the flags, the header of a plain
+// data block is meaningless.
+#define TFS_BLOCK_MAP          0x1
+#define TFS_MAP_ENTRIES(tfs)   (TFS_DATA_SIZE(tfs) / sizeof(unsigned int))
+
+// The data of this block is a TFSChunkHeader followed by up to
+// TFS_CHUNK_BLOCKS logical blocks of the file, starting at logical_block. Each
+// one is compressed on its own with tfsLZCompress, so any of them can be read
+// without decompressing the rest.
+#define TFS_BLOCK_COMPRESSED   0x2
+#define TFS_CHUNK_BLOCKS       32
+
+typedef struct {
+    // Number of logical blocks in the chunk
+    unsigned short block_count;
+    // Compressed size of each logical block, stored back to back after this
+    // header. 0 means the block is all zeros.
+    unsigned short lengths[TFS_CHUNK_BLOCKS];
+} TFSChunkHeader;
+
+#define TFS_CHUNK_DATA_SIZE(tfs) (TFS_DATA_SIZE(tfs) - sizeof(TFSChunkHeader))
+
+// The dedup index is a run of dedup_buckets blocks, each an array of
+// TFSDedupEntry. The hash of a block's data picks the bucket it is listed in.
+// Entries are only hints: a block may have been changed or freed since it was
+// listed, so it is checked before anything points at it, and when a bucket is
+// full a new entry replaces an old one.
+typedef struct {
+    unsigned int hash;
+    // 0 if the slot is empty
+    unsigned int block_index;
+} TFSDedupEntry;
+
+// Most buckets an index is made with, which is enough to list 2 GB worth of
+// distinct 4 KB blocks
+#define TFS_DEDUP_MAX_BUCKETS  1024
+
+// Logical block numbers are 32 bits too. Stopping files a little short of
+// 2^32 logical blocks leaves room to add the span of a map or chunk to any
+// of them without overflowing, and still allows 16 TB files of 4 KB blocks.
+#define TFS_MAX_LOGICAL_BLOCKS 0xFFFF0000u
+#define TFS_MAX_FILE_SIZE(tfs) ((unsigned long long)TFS_DATA_SIZE(tfs) * TFS_MAX_LOGICAL_BLOCKS)
+
+// Kinds of asynchronous request
+#define TFS_IO_READ            1
+#define TFS_IO_WRITE           2
+// Completes once every write completed before it is on the device
+#define TFS_IO_FLUSH           3
+
+struct TFS;
+
+// An asynchronous block request. The caller owns the request and must keep it
+// (and buf) alive until it completes.
+typedef struct TFSIORequest {
+    // TFS_IO_*
+    int op;
+
+    // Block to read or write, and a buffer of the filesystem's block size to
+    // read it into or write it from. Both are ignored by TFS_IO_FLUSH.
+    unsigned int block;
+    char *buf;
+
+    // 0 on success or -1 on error, set when the request completes
+    int result;
+
+    // Called when the request completes, possibly from an interrupt handler.
+    // If NULL, the request goes on the completion queue instead, to be picked
+    // up with tfsReapCompletions.
+    void (*callback)(struct TFS *fs, struct TFSIORequest *req);
+
+    // Free for the caller's use
+    void *user_data;
+
+    // Internal use only
+    struct TFSIORequest *next;
+} TFSIORequest;
+
 typedef struct TFS {
     // A callback to read a block from the device at the specified blocknum
     // 'fs' is a pointer to this data structure
-    // 'buf' is a buffer of size TFS_BLOCK_SIZE to write to
+    // 'buf' is a buffer of size fs->block_size to write to
     // 'block' is the block index to read from
     int (*read_fn)(struct TFS *fs, char *buf, unsigned int block);
 
     // A callback to write a block to the device at the specified blocknum
     // 'fs' is a pointer to this data structure
-    // 'buf' is a buffer of size TFS_BLOCK_SIZE to read from
+    // 'buf' is a buffer of size fs->block_size to read from
     // 'block' is the block index to write to
     int (*write_fn)(struct TFS *fs, const char *buf, unsigned int block);
 
     // Userdata to be passed to read_fn/write_fn
     void *user_data;
 
+    // Optional callback to start an asynchronous request. Returns 0 if the
+    // device accepted it, in which case the device calls tfsCompleteRequest
+    // once it has finished. Without it, requests are carried out with
+    // read_fn/write_fn as soon as they are submitted. tfsInit clears this, so
+    // set it afterwards.
+    int (*submit_fn)(struct TFS *fs, TFSIORequest *req);
+
+    // Size of a block in bytes; block N starts at byte N * block_size of the
+    // device. tfsInit sets it to TFS_MIN_BLOCK_SIZE, which is enough to read
+    // the header, and tfsOpenFilesystem/tfsInitFilesystemGeometry set it to
+    // the filesystem's. Read only.
+    unsigned int block_size;
+
     // Internal use only
     TFSFilesystemHeader header;
+    TFSIORequest *completed_head;
+    TFSIORequest *completed_tail;
+    char *scratch;
+    unsigned int scratch_size;
+    unsigned int scratch_used;
 } TFS;
 
-#define TFS_FILENAME_ENTRY 0xFFFFFFFF
+// Directory data is a run of variable-length records: a TFSDirRecord followed
+// by the filename, padded to a multiple of 8 bytes. Records never straddle two
+// blocks; if the next one doesn't fit in what's left of a block, the rest of
+// the block is zeros, which reads as a record length of 0. The 64-bit file
+// size comes first so the layout is the same on 32 and 64-bit hosts.
+typedef struct TFSDirRecord {
+    // The size of the file in bytes
+    unsigned long long file_size;
 
-typedef struct TFSFileEntry {
-    // The mode of the file or directory
-    // If this is zero, then the entry is free. If this is TFS_FILENAME_ENTRY,
-    // then the entry is in fact a TFSFilenameEntry and not a TFSFileEntry.
+    // The mode of the file or directory, or zero if the entry is free
     unsigned int mode;
 
     // The index of the first block for this file
     unsigned int block_index;
 
-    // The size of the file in bytes
-    unsigned int file_size;
+    // A hash of the whole name, so lookups only compare names that match it
+    unsigned int name_hash;
 
-    // A hash of the name, for efficient lookups
-    unsigned short name_hash;
+    // Length of the record in bytes, including the name and padding
+    unsigned short record_length;
 
-    // Entry number for the first TFSFilenameEntry block of this entry's filename
-    unsigned short filename_entry;
-} TFSFileEntry;
+    // Length of the name that follows, which isn't null-terminated
+    unsigned char name_length;
 
-typedef struct TFSFilenameEntry {
-    // For a TFSFilenameEntry this will always be TFS_FILENAME_ENTRY.
-    unsigned int mode;
+    // Reserved for future use; always zero
+    unsigned char reserved;
+} TFSDirRecord;
 
-    // The entry number for the next TFSFilenameEntry. This is ignored if
-    // there is a null terminator in 'filename'.
-    unsigned short next_entry;
+// Longest filename a directory entry can hold
+#define TFS_MAX_FILENAME 255
 
-    // The next 10 characters in the filename.
-    char filename[10];
-} TFSFilenameEntry;
+// Length of the record for a name of 'name_length' characters
+#define TFS_DIR_RECORD_LENGTH(name_length) ((sizeof(TFSDirRecord) + (name_length) + 7) & ~7)
 
 typedef struct FileHandle FileHandle;
 
+// A decoded directory entry, as returned by tfsReadDirectoryBlock
+typedef struct TFSDirEntry {
+    // The mode, first block and size of the file, as stored in its TFSDirRecord
+    unsigned int mode;
+    unsigned int block_index;
+    unsigned long long file_size;
+
+    // The full filename, null-terminated
+    char filename[TFS_MAX_FILENAME + 1];
+} TFSDirEntry;
+
+// State for walking a directory one block at a time. The caller allocates
+// this and initializes it with tfsOpenDirIterator.
+typedef struct TFSDirIterator {
+    // The block being decoded, in the caller's buffer (see tfsOpenDirIterator)
+    char *block_buf;
+
+    // The directory being listed. The caller keeps this handle open.
+    FileHandle *directory;
+
+    // The block currently held in block_buf (0 if none has been read yet)
+    unsigned int block_index;
+
+    // Byte offset in the directory of the next record to decode
+    unsigned int offset;
+} TFSDirIterator;
+
 // This is the size of the FileHandle stucture, so that the caller can
 // allocate their own file handle array. Must be kept in sync with FileHandle,
 // unfortunately
-#define TFS_FILE_HANDLE_SIZE 20
+#define TFS_FILE_HANDLE_SIZE 32
 
 // Public API
 
 // Must be called before doing any other operations
 void tfsInit(TFS *tfs, FileHandle *handles, int max_handles);
 
-// Returns 0 on successful initialization of a new filesystem
-int tfsInitFilesystem(TFS *tfs, int num_blocks);
+// Blocks are worked on in memory given to TomFS with tfsSetScratch rather
+// than on the stack, which may not have room for many big blocks. This is
+// the most it holds at once.
+#define TFS_SCRATCH_BLOCKS    12
+#define TFS_SCRATCH_SIZE(block_size) (TFS_SCRATCH_BLOCKS * (block_size))
 
-// Returns 0 on successful opening of an existing filesystem
+// Hands TomFS 'size' bytes at 'scratch' to work on blocks in. It needs
+// TFS_SCRATCH_SIZE(tfs->block_size), so give it once the filesystem is
+// opened or its geometry is chosen; an operation that runs out of room fails.
+// Built without EXTERNAL_FILE_HANDLES, tfsInit gives it enough for any block
+// size.
+void tfsSetScratch(TFS *tfs, char *scratch, unsigned int size);
+
+// Returns 0 on successful initialization of a new filesystem
+int tfsInitFilesystem(TFS *tfs, unsigned int num_blocks);
+
+// The same, with 'block_size' byte blocks and 'block_group_size' blocks per
+// block bitmap. Both must be powers of two, between TFS_MIN_BLOCK_SIZE and
+// TFS_MAX_BLOCK_SIZE, and between TFS_MIN_BLOCK_GROUP_SIZE and 4 *
+// 'block_size'. The device must hold 'num_blocks' blocks of the new size. If
+// 'zeroed' is set, the device is known to read back zeros, such as a new
+// sparse image file, and only the header and root directory are written;
+// otherwise every block bitmap is written too.
+int tfsInitFilesystemGeometry(TFS *tfs, unsigned int num_blocks, unsigned int block_size, unsigned int block_group_size, int zeroed);
+
+// Returns 0 on successful opening of an existing filesystem. Fails if the
+// filesystem is striped across a different number of devices than 'tfs' has
+// been attached to (see tfsStripeAttach), in which case the header is still
+// loaded and tfs->header.stripe_devices says how many it needs.
 int tfsOpenFilesystem(TFS *tfs);
 
 // Directory API
+//
+// Functions ending in At work inside a directory handle the caller already
+// has open, rather than looking up a path each time. The handle stays open;
+// handles they return keep their own reference to it.
 
 // Returns a file handle for the new directory, or NULL on failure
 FileHandle *tfsCreateDirectory(TFS *tfs, const char *path, const char *dir_name);
+FileHandle *tfsCreateDirectoryAt(TFS *tfs, FileHandle *directory, const char *dir_name);
 
-// Opens a directory for reading by path (0 on success)
+// Opens a directory for reading by path (NULL on failure). tfsOpenPathAt
+// starts from 'directory' unless the path starts with '/' or 'directory' is
+// NULL; "." and ".." in the path mean the same as usual.
 FileHandle *tfsOpenPath(TFS *tfs, const char *path);
+FileHandle *tfsOpenPathAt(TFS *tfs, FileHandle *directory, const char *path);
 
 // Reads values into the parameters for the next entry in the given directory.
+// 'position' is 0 for the first entry, and is moved past each entry read.
 // Assumes that all the parameters are zeroed out.
 // Returns 0 on success.
-int tfsReadNextEntry(TFS *tfs, FileHandle *directory, unsigned int *entry_index, unsigned int *mode, unsigned int *block_index, unsigned int *file_size, char *filename, int filename_size);
+int tfsReadNextEntry(TFS *tfs, FileHandle *directory, unsigned int *position, unsigned int *mode, unsigned int *block_index, unsigned long long *file_size, char *filename, int filename_size);
+
+// Prepares 'iter' to list the entries of 'directory' from the beginning.
+// 'block_buf' holds the block being decoded, so it must have room for a block
+// of the filesystem, be 8-byte aligned, and last as long as 'iter'.
+void tfsOpenDirIterator(TFSDirIterator *iter, FileHandle *directory, char *block_buf);
+
+// Decodes up to 'max_entries' entries into 'entries', reading each directory
+// block only once no matter how many entries it holds.
+// Returns the number of entries decoded, 0 at the end of the directory, or
+// -1 on error.
+int tfsReadDirectoryBlock(TFS *tfs, TFSDirIterator *iter, TFSDirEntry *entries, int max_entries);
 
 // Finds an entry by name and returns the mode, block index and size.
 // Returns 0 on success.
-int tfsFindEntry(TFS *tfs, FileHandle *directory, char *filename, unsigned int *mode, unsigned int *block_index, unsigned int *file_size);
+int tfsFindEntry(TFS *tfs, FileHandle *directory, char *filename, unsigned int *mode, unsigned int *block_index, unsigned long long *file_size);
 
 // Update an existing entry (returns 0 on success)
-int tfsUpdateEntry(TFS *tfs, FileHandle *directory, int block_index, unsigned int mode, unsigned int file_size);
+int tfsUpdateEntry(TFS *tfs, FileHandle *directory, unsigned int block_index, unsigned int mode, unsigned long long file_size);
 
 // Removes a directory from the parent directory & filesystem
-// Directory must be empty
+// Directory must be empty and not open. Returns 0 on success.
 int tfsDeleteDirectory(TFS *tfs, const char *path, const char *dir_name);
+int tfsDeleteDirectoryAt(TFS *tfs, FileHandle *directory, const char *dir_name);
 
 // Files API
 
 // Creates a new file in the directory specified by 'path' with the given filename.
 // Returns a file handle for the new file, or NULL on failure
 FileHandle *tfsCreateFile(TFS *tfs, const char *path, unsigned int mode, const char *file_name);
+FileHandle *tfsCreateFileAt(TFS *tfs, FileHandle *directory, unsigned int mode, const char *file_name);
 
 // Opens a file by path and filename
 // Returns a file handle for the file, or NULL on failure
 FileHandle *tfsOpenFile(TFS *tfs, char *path, char *file_name);
+FileHandle *tfsOpenFileAt(TFS *tfs, FileHandle *directory, const char *file_name);
 
-// Writes 'size' bytes from 'buf' into the file at offset 'offset'
-int tfsWriteFile(TFS *tfs, FileHandle *handle, const char *buf, unsigned int size, unsigned int offset);
+// Writes 'size' bytes from 'buf' into the file at offset 'offset'. The offset
+// may be past the end of the file; the gap becomes a hole that reads back as
+// zeros without any blocks being allocated for it. Files can grow to
+// TFS_MAX_FILE_SIZE(tfs) bytes.
+int tfsWriteFile(TFS *tfs, FileHandle *handle, const char *buf, unsigned int size, unsigned long long offset);
 
 // Reads up to 'size' bytes from 'buf' from the file at the offset 'offset.
 // Returns the number of bytes actually read, or -1 on error.
-int tfsReadFile(TFS *tfs, FileHandle *handle, char *buf, unsigned int size, unsigned int offset);
+int tfsReadFile(TFS *tfs, FileHandle *handle, char *buf, unsigned int size, unsigned long long offset);
 
-// Removes the file from the directory & filesystem
+// Sets the size of a file. Shrinking cuts the chain after the last block
+// still needed and frees the rest; growing leaves a hole at the end.
+// Returns 0 on success.
+int tfsTruncateFile(TFS *tfs, FileHandle *handle, unsigned long long size);
+
+// Creates a file in the directory specified by 'path' with the same mode and
+// contents as 'source', sharing its data blocks rather than copying them.
+// Either file can be written afterwards; only the blocks written to are
+// copied. Returns a file handle for the new file, or NULL on failure
+FileHandle *tfsCloneFile(TFS *tfs, FileHandle *source, const char *path, const char *file_name);
+
+// Packs the data blocks of a file into compressed chunks. Blocks that are
+// shared with a clone or don't compress are left alone. Reads decompress
+// transparently, and a write into a chunk turns just that chunk back into
+// plain blocks. Directories can't be compressed. Returns the number of blocks
+// freed, or -1 on error.
+int tfsCompressFile(TFS *tfs, FileHandle *handle);
+
+// Returns the number of fragments (runs of consecutive blocks) in the chain
+// of a file, and the number of blocks in 'num_blocks', or -1 on error.
+int tfsCountFragments(TFS *tfs, FileHandle *handle, unsigned int *num_blocks);
+
+// Moves all but the first block of a file into a run of free blocks, right
+// after the first one if there is room. The file stays readable throughout: a
+// crash part way can leak the blocks being moved, but never loses data.
+// Files with blocks shared with a clone are left alone. Don't call this on a
+// directory that is being iterated. Returns the number of blocks moved, or -1
+// on error.
+int tfsDefragmentFile(TFS *tfs, FileHandle *handle);
+
+// Turns on block deduplication, making the dedup index if there isn't one
+// yet. If 'online' is set, full-block writes to files share an identical
+// block already on the filesystem rather than storing another copy, and
+// blocks of zeros become holes; otherwise (and to turn that off again) only
+// tfsDedupFile shares blocks. Returns 0 on success.
+int tfsEnableDedup(TFS *tfs, int online);
+
+// Points each data block of a file at an identical block elsewhere on the
+// filesystem, if there is one, and turns blocks of zeros into holes. Only
+// maps can point at blocks of other files, so a file with plain blocks is
+// first rebuilt as maps, provided that saves more blocks than the maps take.
+// Blocks that aren't shared are listed in the index for later files to
+// share. Directories are left alone. Returns the number of blocks freed, or
+// -1 on error.
+int tfsDedupFile(TFS *tfs, FileHandle *handle);
+
+// Removes the file from the directory & filesystem, freeing its blocks. The
+// file must not be open. Returns 0 on success.
 int tfsDeleteFile(TFS *tfs, char *path, char *file_name);
+int tfsDeleteFileAt(TFS *tfs, FileHandle *directory, const char *file_name);
 
 // Closes a handle to a file or directory
 void tfsCloseHandle(FileHandle *handle);
 
 // Gets the current file size
-unsigned int tfsGetFileSize(FileHandle *handle);
+unsigned long long tfsGetFileSize(FileHandle *handle);
 
 // Returns the number of currently in-use handles
 int tfsGetOpenHandleCount();
 
+// Asynchronous I/O API
+
+// Starts a block request. Returns 0 if it was submitted, in which case it
+// completes later through its callback or the completion queue, or -1 if it
+// was rejected.
+int tfsSubmitRequest(TFS *tfs, TFSIORequest *req);
+
+// Called by the device when a submitted request has finished, with 0 or -1.
+// It can be called from an interrupt handler, but not while another call is
+// reaping completions.
+void tfsCompleteRequest(TFS *tfs, TFSIORequest *req, int result);
+
+// Takes up to 'max_reqs' requests off the completion queue, oldest first.
+// Returns the number of requests stored in 'reqs'.
+int tfsReapCompletions(TFS *tfs, TFSIORequest **reqs, int max_reqs);
+
+// Striping API
+//
+// Spreads a filesystem over several devices: group g goes to device g % N, as
+// that device's group g / N, so each device is laid out like a filesystem of
+// its own groups. Block 0 of the first device holds the header, and block 0
+// of the others is unused. Requests for different devices are submitted to
+// them all before waiting on any, so they run at the same time if the
+// devices are asynchronous.
+
+// Most devices a filesystem can be striped across
+#define TFS_MAX_STRIPE_DEVICES 8
+
+// Requests a stripe can have in flight on its devices at once. Reads and
+// writes beyond this are carried out synchronously.
+#define TFS_STRIPE_QUEUE_DEPTH 64
+
+struct TFSStripe;
+
+// The part of a request that goes to one device
+typedef struct TFSStripeRequest {
+    TFSIORequest req;
+    struct TFSStripe *stripe;
+
+    // The request this is part of, and the first part of it, which counts
+    // the parts still in flight and whether any have failed
+    TFSIORequest *parent;
+    struct TFSStripeRequest *leader;
+    int pending;
+    int result;
+
+    struct TFSStripeRequest *next_free;
+} TFSStripeRequest;
+
+typedef struct TFSStripe {
+    // One per device, with read_fn, write_fn, user_data and optionally
+    // submit_fn pointing at it. They aren't filesystems in their own right,
+    // so they don't need tfsInit; block_size is kept in step with the
+    // filesystem's.
+    TFS *devices;
+    int num_devices;
+
+    // The filesystem on top, set by tfsStripeAttach
+    TFS *tfs;
+
+    TFSStripeRequest requests[TFS_STRIPE_QUEUE_DEPTH];
+    TFSStripeRequest *free_requests;
+} TFSStripe;
+
+// Sets up a stripe across the 'num_devices' devices in 'devices'. Returns 0
+// on success, or -1 if there are too many.
+int tfsStripeInit(TFSStripe *stripe, TFS *devices, int num_devices);
+
+// Points the callbacks of 'tfs' at the stripe. Call after tfsInit, and before
+// tfsInitFilesystem or tfsOpenFilesystem.
+void tfsStripeAttach(TFSStripe *stripe, TFS *tfs);
+
+// Returns how many blocks device 'device' of 'num_devices' needs to hold its
+// share of a filesystem of 'num_blocks' blocks in groups of
+// 'block_group_size'.
+unsigned int tfsStripeDeviceBlocks(unsigned int num_blocks, unsigned int block_group_size, int num_devices, int device);
+
 // Internals
-void tfsSetBitmapBit(char *bitmap_buf, int block_index);
-void tfsClearBitmapBit(char *bitmap_buf, int block_index);
-int tfsCheckBitmapBit(char *bitmap_buf, int block_index);
-int tfsAllocateBlock(TFS *tfs, int desired_block_index, unsigned int node_id, unsigned int initial_block, unsigned int previous_block);
-int tfsWriteBlockData(TFS *tfs, char *data, int block_index);
-int tfsDeallocateBlocks(TFS *tfs, int block_index);
+void tfsSetBitmapBit(char *bitmap_buf, int block_index, int block_group_size);
+void tfsClearBitmapBit(char *bitmap_buf, int block_index, int block_group_size);
+int tfsCheckBitmapBit(char *bitmap_buf, int block_index, int block_group_size);
+unsigned int tfsClaimFreeBlock(TFS *tfs, unsigned int desired_block_index);
+unsigned int tfsAllocateBlock(TFS *tfs, unsigned int desired_block_index, unsigned int node_id, unsigned int initial_block, unsigned int previous_block);
+int tfsWriteBlockData(TFS *tfs, char *data, unsigned int block_index);
+int tfsDeallocateBlocks(TFS *tfs, unsigned int block_index);
+int tfsAppendDirectoryEntry(TFS *tfs, FileHandle *handle, unsigned int mode, unsigned int block_index, unsigned long long file_size, const char *filename);
+
+// LZ codec for compressed chunks. Both return the number of bytes written to
+// 'dest', or -1 if they don't fit in 'dest_size' bytes or (when
+// decompressing) the data is corrupt. 'src_size' must be less than 65535.
+int tfsLZCompress(const char *src, int src_size, char *dest, int dest_size);
+int tfsLZDecompress(const char *src, int src_size, char *dest, int dest_size);
@@ -7,8 +7,8 @@
 int byte_offset = 0;
 
 int read_fn(struct TFS *fs, char *buf, unsigned int block) {
-    fseek((FILE *)fs->user_data, block*TFS_BLOCK_SIZE + byte_offset, SEEK_SET);
-    fread(buf, 1, TFS_BLOCK_SIZE, (FILE *)fs->user_data);
+    fseek((FILE *)fs->user_data, (long)block*fs->block_size + byte_offset, SEEK_SET);
+    fread(buf, 1, fs->block_size, (FILE *)fs->user_data);
     return 0;
 }
 
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tomfs.h"
+
+int kprintf(const char *fmt, ...) {}
+
+int read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    fseek((FILE *)fs->user_data, (long)block * fs->block_size, SEEK_SET);
+    if (fread(buf, fs->block_size, 1, (FILE *)fs->user_data) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    fseek((FILE *)fs->user_data, (long)block * fs->block_size, SEEK_SET);
+    if (fwrite(buf, fs->block_size, 1, (FILE *)fs->user_data) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Splits "/dir/name" into "/dir" and "name"
+static void split_path(char *path, char *dir, char *filename) {
+    int idx;
+    for (idx = strlen(path) - 1; idx > 0 && path[idx] != '/'; --idx) {}
+    strcpy(filename, &path[idx + 1]);
+    strncpy(dir, path, idx);
+    dir[idx] = 0;
+}
+
+int main(int argc, char *argv[]) {
+    TFS tfs;
+    FILE *fImage;
+    char src_dir[256], src_name[256], dest_dir[256], dest_name[256];
+    FileHandle *source, *clone;
+    int ret = -1;
+
+    if (argc < 4) {
+        printf("clone_file image source_path dest_path\n");
+        return 0;
+    }
+
+    fImage = fopen(argv[1], "r+b");
+    if (!fImage) {
+        printf("Failed to open %s.\n", argv[1]);
+        return -1;
+    }
+
+    tfsInit(&tfs, NULL, 0);
+    tfs.read_fn = &read_fn;
+    tfs.write_fn = &write_fn;
+    tfs.user_data = fImage;
+
+    if (tfsOpenFilesystem(&tfs) != 0) {
+        printf("Failed to open filesystem.\n");
+        fclose(fImage);
+        return -1;
+    }
+
+    split_path(argv[2], src_dir, src_name);
+    split_path(argv[3], dest_dir, dest_name);
+
+    if ((source = tfsOpenFile(&tfs, src_dir, src_name)) == NULL) {
+        printf("Failed to open file %s in directory %s.\n", src_name, src_dir);
+    } else {
+        if ((clone = tfsCloneFile(&tfs, source, dest_dir, dest_name)) == NULL) {
+            printf("Failed to clone %s to %s.\n", argv[2], argv[3]);
+        } else {
+            tfsCloseHandle(clone);
+            ret = 0;
+        }
+        tfsCloseHandle(source);
+    }
+
+    fclose(fImage);
+    return ret;
+}
@@ -0,0 +1,143 @@
+// Compares the number of blocks read to load a file from TomFS with and
+// without compression. Files are loaded the way the bootloader loads the
+// kernel and loadELF loads programs: look up the path, then read the whole
+// file with one tfsReadFile call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tomfs.h"
+
+typedef struct {
+    char *base_addr;
+    unsigned int num_blocks;
+    int reads;
+} BenchDevice;
+
+int kprintf(const char *fmt, ...) {}
+
+int read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    BenchDevice *dev = (BenchDevice*)fs->user_data;
+    if (block >= dev->num_blocks) {
+        return -1;
+    }
+    memcpy(buf, &dev->base_addr[block * fs->block_size], fs->block_size);
+    dev->reads++;
+    return 0;
+}
+
+int write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    BenchDevice *dev = (BenchDevice*)fs->user_data;
+    if (block >= dev->num_blocks) {
+        return -1;
+    }
+    memcpy(&dev->base_addr[block * fs->block_size], buf, fs->block_size);
+    return 0;
+}
+
+// Loads /bin/file and returns the number of blocks read, or -1 on error
+static int load_file(TFS *tfs, char *data, int size) {
+    BenchDevice *dev = (BenchDevice*)tfs->user_data;
+    FileHandle *dir, *file;
+    unsigned int mode, block_idx;
+    unsigned long long file_size;
+
+    dev->reads = 0;
+    if ((dir = tfsOpenPath(tfs, "/bin")) == NULL) {
+        return -1;
+    }
+    if (tfsFindEntry(tfs, dir, "file", &mode, &block_idx, &file_size) != 0 || file_size != size) {
+        tfsCloseHandle(dir);
+        return -1;
+    }
+    tfsCloseHandle(dir);
+    if ((file = tfsOpenFile(tfs, "/bin", "file")) == NULL) {
+        return -1;
+    }
+    if (tfsReadFile(tfs, file, data, size, 0) != size) {
+        tfsCloseHandle(file);
+        return -1;
+    }
+    tfsCloseHandle(file);
+    return dev->reads;
+}
+
+static int bench_file(const char *path) {
+    TFS tfs;
+    BenchDevice dev;
+    FILE *fIn;
+    FileHandle *dir, *file;
+    char *data, *loaded;
+    int size, file_blocks, plain_reads, compressed_reads, saved;
+
+    if ((fIn = fopen(path, "rb")) == NULL) {
+        printf("Failed to open %s.\n", path);
+        return -1;
+    }
+    fseek(fIn, 0, SEEK_END);
+    size = ftell(fIn);
+    fseek(fIn, 0, SEEK_SET);
+    data = malloc(size + 1);
+    loaded = malloc(size + 1);
+    if (fread(data, 1, size, fIn) != size) {
+        printf("Failed to read %s.\n", path);
+        fclose(fIn);
+        return -1;
+    }
+    fclose(fIn);
+
+    file_blocks = (size + TFS_BLOCK_DATA_SIZE - 1) / TFS_BLOCK_DATA_SIZE;
+    dev.num_blocks = (file_blocks + 64 < 2560) ? 2560 : file_blocks + 64;
+    dev.base_addr = malloc(dev.num_blocks * TFS_BLOCK_SIZE);
+    dev.reads = 0;
+
+    tfsInit(&tfs, NULL, 0);
+    tfs.read_fn = &read_fn;
+    tfs.write_fn = &write_fn;
+    tfs.user_data = &dev;
+    if (tfsInitFilesystem(&tfs, dev.num_blocks) != 0 ||
+        (dir = tfsCreateDirectory(&tfs, "/", "bin")) == NULL ||
+        (file = tfsCreateFile(&tfs, "/bin", 0755, "file")) == NULL ||
+        tfsWriteFile(&tfs, file, data, size, 0) != size) {
+        printf("Failed to set up filesystem for %s.\n", path);
+        return -1;
+    }
+    tfsCloseHandle(dir);
+
+    plain_reads = load_file(&tfs, loaded, size);
+    if ((saved = tfsCompressFile(&tfs, file)) < 0) {
+        printf("Failed to compress %s.\n", path);
+        return -1;
+    }
+    tfsCloseHandle(file);
+    compressed_reads = load_file(&tfs, loaded, size);
+    if (plain_reads < 0 || compressed_reads < 0 || memcmp(data, loaded, size) != 0) {
+        printf("Failed to load %s back.\n", path);
+        return -1;
+    }
+
+    printf("%-32s %8d %6d %6d %10d %10d\n", path, size, file_blocks, file_blocks - saved, plain_reads, compressed_reads);
+
+    free(dev.base_addr);
+    free(data);
+    free(loaded);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int i, ret = 0;
+
+    if (argc < 2) {
+        printf("compress_bench file [file...]\n");
+        return 0;
+    }
+
+    printf("%-32s %8s %6s %6s %10s %10s\n", "file", "bytes", "blocks", "packed", "reads", "reads (lz)");
+    for (i = 1; i < argc; i++) {
+        if (bench_file(argv[i]) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
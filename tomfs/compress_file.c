@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tomfs.h"
+
+int kprintf(const char *fmt, ...) {}
+
+int read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    fseek((FILE *)fs->user_data, (long)block * fs->block_size, SEEK_SET);
+    if (fread(buf, fs->block_size, 1, (FILE *)fs->user_data) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    fseek((FILE *)fs->user_data, (long)block * fs->block_size, SEEK_SET);
+    if (fwrite(buf, fs->block_size, 1, (FILE *)fs->user_data) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    TFS tfs;
+    FILE *fImage;
+    FileHandle *dir_handle = NULL;
+    char dir_handle_path[256] = "";
+    int i, saved, ret = 0;
+
+    if (argc < 3) {
+        printf("compress_file image path [path...]\n");
+        return 0;
+    }
+
+    fImage = fopen(argv[1], "r+b");
+    if (!fImage) {
+        printf("Failed to open %s.\n", argv[1]);
+        return -1;
+    }
+
+    tfsInit(&tfs, NULL, 0);
+    tfs.read_fn = &read_fn;
+    tfs.write_fn = &write_fn;
+    tfs.user_data = fImage;
+
+    if (tfsOpenFilesystem(&tfs) != 0) {
+        printf("Failed to open filesystem.\n");
+        fclose(fImage);
+        return -1;
+    }
+
+    for (i = 2; i < argc; i++) {
+        char dir[256], filename[256];
+        int idx;
+        FileHandle *handle;
+
+        // Parse path
+        for (idx = strlen(argv[i]) - 1; idx > 0 && argv[i][idx] != '/'; --idx) {}
+        strcpy(filename, &argv[i][idx + 1]);
+        strncpy(dir, argv[i], idx);
+        dir[idx] = 0;
+
+        // Files are usually given a directory at a time, so keep the last
+        // directory open rather than looking it up for every file
+        if (dir_handle == NULL || strcmp(dir, dir_handle_path) != 0) {
+            tfsCloseHandle(dir_handle);
+            dir_handle = tfsOpenPath(&tfs, dir);
+            strcpy(dir_handle_path, dir);
+        }
+
+        if ((handle = tfsOpenFileAt(&tfs, dir_handle, filename)) == NULL) {
+            printf("Failed to open file %s in directory %s.\n", filename, dir);
+            ret = -1;
+            continue;
+        }
+        if ((saved = tfsCompressFile(&tfs, handle)) < 0) {
+            printf("Failed to compress %s.\n", argv[i]);
+            ret = -1;
+        } else {
+            printf("%s: %d blocks saved\n", argv[i], saved);
+        }
+        tfsCloseHandle(handle);
+    }
+
+    tfsCloseHandle(dir_handle);
+    fclose(fImage);
+    return ret;
+}
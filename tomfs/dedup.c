@@ -0,0 +1,148 @@
+// Folds duplicate blocks in a TomFS image: turns on deduplication, then has
+// each file share the blocks it has in common with files already looked at.
+// With no paths, every file on the filesystem is done. --online also leaves
+// write-time deduplication on for whoever mounts the image next.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_io.h"
+
+int kprintf(const char *fmt, ...) {}
+
+static long total_freed = 0;
+
+// Dedups the file 'file_name' in directory 'dir', whose path is 'dir_path',
+// and prints what it saved. Returns 0 on success.
+static int dedup_file(TFS *tfs, FileHandle *dir, const char *dir_path, const char *file_name) {
+    FileHandle *file;
+    char path[512];
+    int freed;
+
+    snprintf(path, sizeof(path), "%s/%s", strcmp(dir_path, "/") ? dir_path : "", file_name);
+    if ((file = tfsOpenFileAt(tfs, dir, file_name)) == NULL) {
+        printf("Failed to open %s.\n", path);
+        return -1;
+    }
+    freed = tfsDedupFile(tfs, file);
+    tfsCloseHandle(file);
+    if (freed < 0) {
+        printf("Failed to dedup %s.\n", path);
+        return -1;
+    }
+    if (freed != 0) {
+        printf("%-40s %8d %12ld\n", path, freed, (long)freed * tfs->block_size);
+    }
+    total_freed += freed;
+    return 0;
+}
+
+// Dedups every file under 'dir_path'. Returns 0 if they all succeeded.
+static int dedup_tree(TFS *tfs, const char *dir_path) {
+    TFSDirIterator iter;
+    TFSDirEntry *entries;
+    char *block_buf;
+    FileHandle *dir;
+    char path[512];
+    int i, count, ret = 0;
+
+    if ((dir = tfsOpenPath(tfs, dir_path)) == NULL) {
+        printf("Failed to open %s.\n", dir_path);
+        return -1;
+    }
+    entries = malloc(16 * sizeof(TFSDirEntry));
+    block_buf = malloc(tfs->block_size);
+    tfsOpenDirIterator(&iter, dir, block_buf);
+    while ((count = tfsReadDirectoryBlock(tfs, &iter, entries, 16)) > 0) {
+        for (i = 0; i < count; i++) {
+            if (strcmp(entries[i].filename, ".") == 0 || strcmp(entries[i].filename, "..") == 0) {
+                continue;
+            }
+            if (entries[i].mode & 0040000) {
+                snprintf(path, sizeof(path), "%s/%s", strcmp(dir_path, "/") ? dir_path : "", entries[i].filename);
+                ret |= dedup_tree(tfs, path);
+            } else {
+                ret |= dedup_file(tfs, dir, dir_path, entries[i].filename);
+            }
+        }
+    }
+    if (count < 0) {
+        printf("Failed to list %s.\n", dir_path);
+        ret = -1;
+    }
+
+    free(block_buf);
+    free(entries);
+    tfsCloseHandle(dir);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    TFS tfs;
+    HostDevice dev;
+    FileHandle *dir;
+    unsigned int index_blocks;
+    int i, first_path = 2, online = 0, ret = 0;
+
+    if (argc > 2 && strcmp(argv[2], "--online") == 0) {
+        online = 1;
+        first_path = 3;
+    }
+    if (argc < 2) {
+        printf("dedup image [--online] [path...]\n");
+        return 0;
+    }
+
+    if (host_dev_open(&dev, argv[1], 0, 0, 0, 0) != 0) {
+        printf("Failed to open %s.\n", argv[1]);
+        return -1;
+    }
+    tfsInit(&tfs, NULL, 0);
+    host_dev_attach(&dev, &tfs);
+    if (tfsOpenFilesystem(&tfs) != 0) {
+        printf("Failed to open filesystem.\n");
+        return -1;
+    }
+
+    index_blocks = tfs.header.dedup_buckets;
+    if (tfsEnableDedup(&tfs, online) != 0) {
+        printf("Failed to make the dedup index.\n");
+        return -1;
+    }
+    index_blocks = tfs.header.dedup_buckets - index_blocks;
+
+    printf("%-40s %8s %12s\n", "file", "blocks", "bytes");
+    if (first_path >= argc) {
+        ret = dedup_tree(&tfs, "/");
+    }
+    for (i = first_path; i < argc; i++) {
+        char dir_path[256], file_name[256];
+        int idx;
+
+        // Parse path
+        for (idx = strlen(argv[i]) - 1; idx > 0 && argv[i][idx] != '/'; --idx) {}
+        strcpy(file_name, &argv[i][idx + 1]);
+        strncpy(dir_path, argv[i], idx);
+        dir_path[idx] = 0;
+        if (idx == 0) {
+            strcpy(dir_path, "/");
+        }
+        if ((dir = tfsOpenPath(&tfs, dir_path)) == NULL) {
+            printf("Failed to open %s.\n", dir_path);
+            ret = -1;
+            continue;
+        }
+        ret |= dedup_file(&tfs, dir, dir_path, file_name);
+        tfsCloseHandle(dir);
+    }
+
+    printf("%-40s %8ld %12ld\n", "total", total_freed, total_freed * tfs.block_size);
+    if (index_blocks != 0) {
+        printf("%-40s %8d %12ld\n", "index", -(int)index_blocks, -(long)index_blocks * tfs.block_size);
+    }
+    printf("Online dedup is %s.\n", online ? "on" : "off");
+
+    host_dev_close(&dev);
+    return ret;
+}
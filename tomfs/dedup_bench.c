@@ -0,0 +1,227 @@
+// Measures what block deduplication saves and what it costs on the write
+// path. Each file is written twice, to /bin and /bin2, the way an image with
+// two variants of the same programs is put together: first with dedup off,
+// then with dedup off followed by a tomfs_dedup style pass, then with online
+// dedup on. For each run it prints the blocks in use (not counting the dedup
+// index), and the block reads, writes and time taken to get there.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tomfs.h"
+
+typedef struct {
+    char *base_addr;
+    unsigned int num_blocks;
+    int reads;
+    int writes;
+} BenchDevice;
+
+typedef struct {
+    const char *name;
+    char *data;
+    int size;
+} BenchFile;
+
+int kprintf(const char *fmt, ...) {}
+
+int read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    BenchDevice *dev = (BenchDevice*)fs->user_data;
+    if (block >= dev->num_blocks) {
+        return -1;
+    }
+    memcpy(buf, &dev->base_addr[block * fs->block_size], fs->block_size);
+    dev->reads++;
+    return 0;
+}
+
+int write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    BenchDevice *dev = (BenchDevice*)fs->user_data;
+    if (block >= dev->num_blocks) {
+        return -1;
+    }
+    memcpy(&dev->base_addr[block * fs->block_size], buf, fs->block_size);
+    dev->writes++;
+    return 0;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Counts the blocks marked in use in the bitmaps, leaving out the dedup index
+static int count_used_blocks(TFS *tfs) {
+    BenchDevice *dev = (BenchDevice*)tfs->user_data;
+    unsigned int group_size = tfs->header.block_group_size;
+    unsigned int i, group;
+    int count = 0;
+
+    for (group = 0; 1 + group * group_size < dev->num_blocks; group++) {
+        char *bitmap = &dev->base_addr[(1 + group * group_size) * tfs->block_size];
+        for (i = 0; i < group_size && 1 + group * group_size + i < dev->num_blocks; i++) {
+            if (tfsCheckBitmapBit(bitmap, i, group_size)) {
+                count++;
+            }
+        }
+    }
+    return count - tfs->header.dedup_buckets;
+}
+
+// Writes every file to 'dir'. Returns 0 on success.
+static int write_files(TFS *tfs, BenchFile *files, int num_files, const char *dir) {
+    FileHandle *handle;
+    int i;
+
+    if ((handle = tfsCreateDirectory(tfs, "/", dir)) == NULL) {
+        return -1;
+    }
+    tfsCloseHandle(handle);
+    for (i = 0; i < num_files; i++) {
+        char name[16];
+        sprintf(name, "%d", i);
+        if ((handle = tfsCreateFile(tfs, dir, 0755, name)) == NULL) {
+            return -1;
+        }
+        if (tfsWriteFile(tfs, handle, files[i].data, files[i].size, 0) != files[i].size) {
+            tfsCloseHandle(handle);
+            return -1;
+        }
+        tfsCloseHandle(handle);
+    }
+    return 0;
+}
+
+// Runs tfsDedupFile on every file in 'dir'. Returns 0 on success.
+static int dedup_files(TFS *tfs, int num_files, const char *dir) {
+    FileHandle *handle;
+    int i, freed;
+
+    for (i = 0; i < num_files; i++) {
+        char name[16];
+        sprintf(name, "%d", i);
+        if ((handle = tfsOpenFile(tfs, (char*)dir, name)) == NULL) {
+            return -1;
+        }
+        freed = tfsDedupFile(tfs, handle);
+        tfsCloseHandle(handle);
+        if (freed < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Checks every file reads back as written. Returns 0 if they all do.
+static int check_files(TFS *tfs, BenchFile *files, int num_files, const char *dir) {
+    FileHandle *handle;
+    char *buf;
+    int i, ret = 0;
+
+    for (i = 0; i < num_files && ret == 0; i++) {
+        char name[16];
+        sprintf(name, "%d", i);
+        if ((handle = tfsOpenFile(tfs, (char*)dir, name)) == NULL) {
+            return -1;
+        }
+        buf = malloc(files[i].size + 1);
+        if (tfsReadFile(tfs, handle, buf, files[i].size, 0) != files[i].size ||
+            memcmp(buf, files[i].data, files[i].size) != 0) {
+            ret = -1;
+        }
+        free(buf);
+        tfsCloseHandle(handle);
+    }
+    return ret;
+}
+
+// 'mode' is 0 for no dedup, 1 for an offline pass after writing, and 2 for
+// online dedup. Returns 0 on success.
+static int run(const char *label, BenchFile *files, int num_files, unsigned int num_blocks, int mode) {
+    TFS tfs;
+    BenchDevice dev;
+    double start;
+
+    dev.num_blocks = num_blocks;
+    dev.base_addr = malloc((size_t)num_blocks * TFS_BLOCK_SIZE);
+
+    tfsInit(&tfs, NULL, 0);
+    tfs.read_fn = &read_fn;
+    tfs.write_fn = &write_fn;
+    tfs.user_data = &dev;
+    if (tfsInitFilesystem(&tfs, num_blocks) != 0 ||
+        (mode != 0 && tfsEnableDedup(&tfs, mode == 2) != 0)) {
+        printf("Failed to set up filesystem.\n");
+        return -1;
+    }
+
+    dev.reads = dev.writes = 0;
+    start = now();
+    if (write_files(&tfs, files, num_files, "bin") != 0 ||
+        write_files(&tfs, files, num_files, "bin2") != 0 ||
+        (mode == 1 && (dedup_files(&tfs, num_files, "/bin") != 0 || dedup_files(&tfs, num_files, "/bin2") != 0))) {
+        printf("Failed to write files.\n");
+        return -1;
+    }
+    start = now() - start;
+
+    if (check_files(&tfs, files, num_files, "/bin") != 0 || check_files(&tfs, files, num_files, "/bin2") != 0) {
+        printf("Files didn't read back as written.\n");
+        return -1;
+    }
+
+    printf("%-16s %8d %8d %8d %10.2f %10u\n", label, count_used_blocks(&tfs), dev.reads, dev.writes, start * 1e3, tfs.header.dedup_buckets);
+
+    free(dev.base_addr);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchFile *files;
+    FILE *fIn;
+    unsigned int num_blocks = 0;
+    int i, num_files = argc - 1;
+
+    if (argc < 2) {
+        printf("dedup_bench file [file...]\n");
+        return 0;
+    }
+
+    files = malloc(num_files * sizeof(BenchFile));
+    for (i = 0; i < num_files; i++) {
+        files[i].name = argv[i + 1];
+        if ((fIn = fopen(files[i].name, "rb")) == NULL) {
+            printf("Failed to open %s.\n", files[i].name);
+            return -1;
+        }
+        fseek(fIn, 0, SEEK_END);
+        files[i].size = ftell(fIn);
+        fseek(fIn, 0, SEEK_SET);
+        files[i].data = malloc(files[i].size + 1);
+        if (fread(files[i].data, 1, files[i].size, fIn) != files[i].size) {
+            printf("Failed to read %s.\n", files[i].name);
+            fclose(fIn);
+            return -1;
+        }
+        fclose(fIn);
+        num_blocks += 2 * ((files[i].size + TFS_BLOCK_DATA_SIZE - 1) / TFS_BLOCK_DATA_SIZE + 2);
+    }
+    // Room for the directories, maps, counts and the index
+    num_blocks = (num_blocks + 512 < 2560) ? 2560 : num_blocks + 512;
+
+    printf("%-16s %8s %8s %8s %10s %10s\n", "dedup", "blocks", "reads", "writes", "ms", "index");
+    if (run("off", files, num_files, num_blocks, 0) != 0 ||
+        run("offline pass", files, num_files, num_blocks, 1) != 0 ||
+        run("online", files, num_files, num_blocks, 2) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < num_files; i++) {
+        free(files[i].data);
+    }
+    free(files);
+    return 0;
+}
@@ -0,0 +1,145 @@
+// Defragments files in a TomFS image, reporting how fragmented each one was
+// and how fast its blocks could be read in order before and after.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "host_io.h"
+
+#define MAX_RUN_BLOCKS 256
+
+int kprintf(const char *fmt, ...) {}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Percentage of the gaps between blocks that aren't contiguous: 0 for a
+// file in one piece, 100 if no two blocks are next to each other
+static double fragmentation_score(int fragments, unsigned int num_blocks) {
+    if (num_blocks < 2) {
+        return 0;
+    }
+    return 100.0 * (fragments - 1) / (num_blocks - 1);
+}
+
+// Reads the blocks of a file's chain straight from the image, bypassing the
+// page cache, one request per run of consecutive blocks. Returns MB/s, or a
+// negative number on error.
+static double read_throughput(TFS *tfs, const char *image, unsigned int first_block) {
+    char header_buf[TFS_MAX_BLOCK_SIZE];
+    TFSBlockHeader *header = (TFSBlockHeader*)header_buf;
+    unsigned int *blocks = NULL, num_blocks = 0, i, run;
+    char *buf;
+    double start, elapsed = 0;
+    long bytes = 0;
+    int fd;
+
+    // Collect the chain first, so only the data reads are timed
+    for (i = first_block; i != 0; i = header->next_block) {
+        if (tfs->read_fn(tfs, header_buf, i) != 0) {
+            return -1;
+        }
+        blocks = realloc(blocks, (num_blocks + 1) * sizeof(unsigned int));
+        blocks[num_blocks++] = i;
+    }
+
+    if ((fd = open(image, O_RDONLY | O_DIRECT)) < 0 ||
+        posix_memalign((void**)&buf, TFS_MIN_BLOCK_SIZE, MAX_RUN_BLOCKS * tfs->block_size) != 0) {
+        return -1;
+    }
+    // Repeat until there's enough time to measure
+    start = now();
+    while (elapsed < 0.25) {
+        for (i = 0; i < num_blocks; i += run) {
+            for (run = 1; i + run < num_blocks && run < MAX_RUN_BLOCKS && blocks[i + run] == blocks[i] + run; run++) {}
+            if (pread(fd, buf, run * tfs->block_size, (off_t)blocks[i] * tfs->block_size) != run * tfs->block_size) {
+                close(fd);
+                return -1;
+            }
+            bytes += run * tfs->block_size;
+        }
+        elapsed = now() - start;
+    }
+
+    close(fd);
+    free(buf);
+    free(blocks);
+    return bytes / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    TFS tfs;
+    HostDevice dev;
+    FileHandle *file, *dir;
+    unsigned int num_blocks, mode, first_block;
+    unsigned long long size;
+    int i, fragments_before, fragments_after, moved, ret = 0;
+    double mbs_before, mbs_after;
+
+    if (argc < 3) {
+        printf("defrag image path [path...]\n");
+        return 0;
+    }
+
+    if (host_dev_open(&dev, argv[1], 0, 0, 0, 0) != 0) {
+        printf("Failed to open %s.\n", argv[1]);
+        return -1;
+    }
+    tfsInit(&tfs, NULL, 0);
+    host_dev_attach(&dev, &tfs);
+    if (tfsOpenFilesystem(&tfs) != 0) {
+        printf("Failed to open filesystem.\n");
+        return -1;
+    }
+
+    printf("%-24s %6s %15s %15s %8s\n", "file", "blocks", "fragments", "score %", "MB/s");
+    for (i = 2; i < argc; i++) {
+        char dir_path[256], file_name[256];
+        int idx;
+
+        // Parse path
+        for (idx = strlen(argv[i]) - 1; idx > 0 && argv[i][idx] != '/'; --idx) {}
+        strcpy(file_name, &argv[i][idx + 1]);
+        strncpy(dir_path, argv[i], idx);
+        dir_path[idx] = 0;
+
+        if ((dir = tfsOpenPath(&tfs, dir_path)) == NULL ||
+            tfsFindEntry(&tfs, dir, file_name, &mode, &first_block, &size) != 0 ||
+            (file = tfsOpenFile(&tfs, dir_path, file_name)) == NULL) {
+            printf("Failed to open %s.\n", argv[i]);
+            tfsCloseHandle(dir);
+            ret = -1;
+            continue;
+        }
+        tfsCloseHandle(dir);
+
+        fragments_before = tfsCountFragments(&tfs, file, &num_blocks);
+        mbs_before = read_throughput(&tfs, argv[1], first_block);
+        moved = tfsDefragmentFile(&tfs, file);
+        fragments_after = tfsCountFragments(&tfs, file, &num_blocks);
+        mbs_after = read_throughput(&tfs, argv[1], first_block);
+        tfsCloseHandle(file);
+        if (fragments_before < 0 || moved < 0 || fragments_after < 0) {
+            printf("Failed to defragment %s.\n", argv[i]);
+            ret = -1;
+            continue;
+        }
+
+        printf("%-24s %6u %6d -> %6d %6.1f -> %6.1f %8.1f -> %.1f\n", argv[i], num_blocks,
+               fragments_before, fragments_after,
+               fragmentation_score(fragments_before, num_blocks), fragmentation_score(fragments_after, num_blocks),
+               mbs_before, mbs_after);
+    }
+
+    host_dev_close(&dev);
+    return ret;
+}
@@ -8,44 +8,25 @@
 #include <errno.h>
 #include <fcntl.h>
 
-#include "tomfs.h"
+#include "host_io.h"
 
 TFS *gTFS;
+HostDevice gDevice;
 
 int kprintf(const char *fmt, ...) {}
 
-int tomfs_read_cb(struct TFS *fs, char *buf, unsigned int block) {
-    fseek((FILE*)fs->user_data, block * TFS_BLOCK_SIZE, SEEK_SET);
-    if (fread(buf, TFS_BLOCK_SIZE, 1, (FILE*)fs->user_data) != 1) {
-        return -1;
-    }
-    return 0;
-}
-
-int tomfs_write_cb(struct TFS *fs, const char *buf, unsigned int block) {
-    fseek((FILE*)fs->user_data, block * TFS_BLOCK_SIZE, SEEK_SET);
-    if (fwrite(buf, TFS_BLOCK_SIZE, 1, (FILE*)fs->user_data) != 1) {
-        return -1;
-    }
-    return 0;
-}
-
-static void tomfs_open_filesystem(char *filename) {
-    FILE *fFS = fopen(filename, "r+b");
-    TFS *tfs;
-
+static void tomfs_open_filesystem(char *filename, int queue_depth, int num_buffers) {
     gTFS = NULL;
 
-    if (!fFS) {
+    if (host_dev_open(&gDevice, filename, queue_depth, num_buffers, num_buffers > 0, 0) != 0) {
         return;
     }
     gTFS = malloc(sizeof(TFS));
-    gTFS->read_fn = tomfs_read_cb;
-    gTFS->write_fn = tomfs_write_cb;
-    gTFS->user_data = fFS;
+    tfsInit(gTFS, NULL, 0);
+    host_dev_attach(&gDevice, gTFS);
 
     if (tfsOpenFilesystem(gTFS) != 0) {
-        fclose(fFS);
+        host_dev_close(&gDevice);
         free(gTFS);
         gTFS = NULL;
         return;
@@ -68,65 +49,106 @@ void split_path(const char *path, char *dir_path, char *file_name) {
     file_name[i - last_slash - 1] = '\0';
 }
 
-static int tomfs_getattr(const char *path, struct stat *stbuf) {
+// The directory the last operation worked in. It is kept open so that a run
+// of operations on files in one directory, like copying a tree in, only
+// looks its path up once.
+static FileHandle *gDirHandle;
+static char gDirPath[1024];
+
+// Splits 'path' and returns a handle for the directory it's in, or NULL if
+// there's no such directory. The handle belongs to the cache, so the caller
+// doesn't close it.
+static FileHandle *open_parent(const char *path, char *file_name) {
     char dir_path[1024];
+
+    split_path(path, dir_path, file_name);
+    if (gDirHandle && strcmp(dir_path, gDirPath) == 0) {
+        return gDirHandle;
+    }
+    tfsCloseHandle(gDirHandle);
+    if ((gDirHandle = tfsOpenPath(gTFS, dir_path)) != NULL) {
+        strcpy(gDirPath, dir_path);
+    }
+    return gDirHandle;
+}
+
+// Closes the cached directory, which would otherwise keep it from being
+// removed
+static void close_parent() {
+    tfsCloseHandle(gDirHandle);
+    gDirHandle = NULL;
+}
+
+static int tomfs_getattr(const char *path, struct stat *stbuf) {
     char file_name[256];
-    char entry_file_name[256];
-    TFSFileEntry *entry;
     FileHandle *dir;
-    int idx, mode, block_idx, size;
+    unsigned int mode, block_idx;
+    unsigned long long size;
     memset(stbuf, 0, sizeof(struct stat));
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 1;
         return 0;
     }
-    split_path(path, dir_path, file_name);
-
-    if ((dir = tfsOpenPath(gTFS, dir_path)) == NULL) {
+    if ((dir = open_parent(path, file_name)) == NULL) {
         return -ENOENT;
     }
     if (tfsFindEntry(gTFS, dir, file_name, &mode, &block_idx, &size) == 0) {
         stbuf->st_mode = mode;
         stbuf->st_nlink = 1;
         stbuf->st_size = size;
-        tfsCloseHandle(dir);
         return 0;
     }
 
-    tfsCloseHandle(dir);
     return -ENOENT;
 }
 
 static int tomfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                            off_t offset, struct fuse_file_info *fi)
 {
-    TFSFileEntry *entry;
-    char entry_file_name[256];
+    TFSDirIterator iter;
+    TFSDirEntry entries[16];
+    char *block_buf;
+    struct stat stbuf;
     FileHandle *dir;
-    int idx, mode, block_idx, size;
+    int i, count;
 
     if ((dir = tfsOpenPath(gTFS, path)) == NULL) {
         return -ENOENT;
     }
 
-    idx = 0;
-    while (tfsReadNextEntry(gTFS, dir, &idx, &mode, &block_idx, &size, entry_file_name, 256) == 0) {
-        filler(buf, entry_file_name, NULL, 0);
+    // Hand the attributes to FUSE along with the names so it doesn't have to
+    // come back and look up every entry again
+    memset(&stbuf, 0, sizeof(struct stat));
+    if ((block_buf = malloc(gTFS->block_size)) == NULL) {
+        tfsCloseHandle(dir);
+        return -ENOMEM;
+    }
+    tfsOpenDirIterator(&iter, dir, block_buf);
+    while ((count = tfsReadDirectoryBlock(gTFS, &iter, entries, 16)) > 0) {
+        for (i = 0; i < count; i++) {
+            stbuf.st_mode = entries[i].mode;
+            stbuf.st_nlink = 1;
+            stbuf.st_size = entries[i].file_size;
+            stbuf.st_ino = entries[i].block_index;
+            filler(buf, entries[i].filename, &stbuf, 0);
+        }
     }
 
-    return 0;
+    free(block_buf);
+    tfsCloseHandle(dir);
+    return (count < 0) ? -EIO : 0;
 }
 
 static int tomfs_open(const char *path, struct fuse_file_info *fi)
 {
-    unsigned int directory_index;
-    char dir_path[1024];
     char file_name[256];
+    FileHandle *dir;
 
-    split_path(path, dir_path, file_name);
-
-    fi->fh = tfsOpenFile(gTFS, dir_path, file_name);
+    if ((dir = open_parent(path, file_name)) == NULL) {
+        return -ENOENT;
+    }
+    fi->fh = tfsOpenFileAt(gTFS, dir, file_name);
     if (fi->fh == NULL) {
         return -ENOENT;
     }
@@ -145,13 +167,13 @@ static int tomfs_read(const char *path, char *buf, size_t size, off_t offset, st
 }
 
 static int tomfs_mkdir(const char *path, mode_t mode) {
-    char dir_path[1024];
     char dir_name[256];
-    FileHandle *dir;
+    FileHandle *parent, *dir;
 
-    split_path(path, dir_path, dir_name);
-
-    dir = tfsCreateDirectory(gTFS, dir_path, dir_name);
+    if ((parent = open_parent(path, dir_name)) == NULL) {
+        return -ENOENT;
+    }
+    dir = tfsCreateDirectoryAt(gTFS, parent, dir_name);
     if (dir == NULL) {
         return -ENOMEM;
     }
@@ -161,12 +183,14 @@ static int tomfs_mkdir(const char *path, mode_t mode) {
 }
 
 static int tomfs_create(const char *path, mode_t mode, struct fuse_file_info *info) {
-    char dir_path[1024];
     char file_name[256];
-    split_path(path, dir_path, file_name);
+    FileHandle *dir;
 
-    printf("tomfs_create %s / %s\n", dir_path, file_name);
-    info->fh = tfsCreateFile(gTFS, dir_path, mode, file_name);
+    printf("tomfs_create %s\n", path);
+    if ((dir = open_parent(path, file_name)) == NULL) {
+        return -ENOENT;
+    }
+    info->fh = tfsCreateFileAt(gTFS, dir, mode, file_name);
     if (info->fh == NULL) {
         printf("tfsCreateFile failed.\n");
         return -ENOMEM;
@@ -185,21 +209,55 @@ static int tomfs_write(const char *path, const char *buf, size_t size, off_t off
     return count;
 }
 
+static int tomfs_truncate(const char *path, off_t size) {
+    char file_name[256];
+    FileHandle *dir, *handle;
+    int ret;
+
+    if ((dir = open_parent(path, file_name)) == NULL ||
+        (handle = tfsOpenFileAt(gTFS, dir, file_name)) == NULL) {
+        return -ENOENT;
+    }
+    ret = tfsTruncateFile(gTFS, handle, size);
+    tfsCloseHandle(handle);
+    return (ret == 0) ? 0 : -EIO;
+}
+
+static int tomfs_ftruncate(const char *path, off_t size, struct fuse_file_info *info) {
+    FileHandle *handle = info->fh;
+    if (tfsTruncateFile(gTFS, handle, size) != 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
 static int tomfs_flush(const char *path, struct fuse_file_info *info) {
     return 0;
 }
 
+static int tomfs_fsync(const char *path, int datasync, struct fuse_file_info *info) {
+    TFSIORequest req;
+    TFSIORequest *done;
+
+    req.op = TFS_IO_FLUSH;
+    req.callback = NULL;
+    if (tfsSubmitRequest(gTFS, &req) != 0 || host_dev_drain(gTFS) != 0) {
+        return -EIO;
+    }
+    tfsReapCompletions(gTFS, &done, 1);
+    return (req.result == 0) ? 0 : -EIO;
+}
+
 static int tomfs_getxattr(const char *path, const char *name, char *value, size_t size) {
     return 0;
 }
 
 static int tomfs_unlink(const char *path) {
-    char dir_path[1024];
     char file_name[256];
+    FileHandle *dir;
 
-    split_path(path, dir_path, file_name);
-
-    if (tfsDeleteFile(gTFS, dir_path, file_name) != 0) {
+    if ((dir = open_parent(path, file_name)) == NULL ||
+        tfsDeleteFileAt(gTFS, dir, file_name) != 0) {
         return -ENOENT;
     }
 
@@ -207,12 +265,13 @@ static int tomfs_unlink(const char *path) {
 }
 
 static int tomfs_rmdir(const char *path) {
-    char dir_path[1024];
     char dir_name[256];
+    FileHandle *dir;
 
-    split_path(path, dir_path, dir_name);
-
-    if (tfsDeleteDirectory(gTFS, dir_path, dir_name) != 0) {
+    // The cache might be holding the directory itself open
+    close_parent();
+    if ((dir = open_parent(path, dir_name)) == NULL ||
+        tfsDeleteDirectoryAt(gTFS, dir, dir_name) != 0) {
         return -ENOENT;
     }
 
@@ -227,7 +286,10 @@ static struct fuse_operations tomfs_oper = {
     .mkdir      = tomfs_mkdir,
     .create     = tomfs_create,
     .write      = tomfs_write,
+    .truncate   = tomfs_truncate,
+    .ftruncate  = tomfs_ftruncate,
     .flush      = tomfs_flush,
+    .fsync      = tomfs_fsync,
     .getxattr   = tomfs_getxattr,
     .unlink     = tomfs_unlink,
     .rmdir      = tomfs_rmdir,
@@ -236,12 +298,17 @@ static struct fuse_operations tomfs_oper = {
 
 struct tomfs_config {
      char *file;
+     // Block backend settings (see host_dev_open)
+     int queue_depth;
+     int buffers;
 };
 
 #define TFS_OPT(t, p, v) { t, offsetof(struct tomfs_config, p), v }
 
 static struct fuse_opt tomfs_opts[] = {
      TFS_OPT("file=%s", file, 0),
+     TFS_OPT("queue_depth=%d", queue_depth, 0),
+     TFS_OPT("buffers=%d", buffers, 0),
      FUSE_OPT_END
 };
 
@@ -253,20 +320,20 @@ int main(int argc, char *argv[])
      TFS *tfs;
 
      memset(&conf, 0, sizeof(conf));
+     conf.queue_depth = 32;
 
      fuse_opt_parse(&args, &conf, tomfs_opts, NULL);
 
      if (!conf.file) {
-         printf("tomfs_fuse -o file=FILENAME MOUNTPOINT\n");
+         printf("tomfs_fuse -o file=FILENAME[,queue_depth=N][,buffers=N] MOUNTPOINT\n");
          return 0;
      }
 
-     tomfs_open_filesystem(conf.file);
+     tomfs_open_filesystem(conf.file, conf.queue_depth, conf.buffers);
      if (!gTFS) {
          printf("Could not open file %s!\n", conf.file);
+         return -1;
      }
 
-     tfsInit(gTFS, NULL, 0);
-
      return fuse_main(args.argc, args.argv, &tomfs_oper, NULL);
 }
@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "host_io.h"
+
+static int host_read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    HostDevice *dev = (HostDevice*)fs->user_data;
+    if (pread(dev->fd, buf, fs->block_size, (off_t)block * fs->block_size) != fs->block_size) {
+        return -1;
+    }
+    return 0;
+}
+
+static int host_write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    HostDevice *dev = (HostDevice*)fs->user_data;
+    if (pwrite(dev->fd, buf, fs->block_size, (off_t)block * fs->block_size) != fs->block_size) {
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_enter(HostDevice *dev, unsigned int to_submit, unsigned int min_complete) {
+    return syscall(__NR_io_uring_enter, dev->ring_fd, to_submit, min_complete,
+                   min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void uring_teardown(HostDevice *dev) {
+    if (dev->sqes) {
+        munmap(dev->sqes, dev->sqes_size);
+    }
+    if (dev->cq_ring && dev->cq_ring != dev->sq_ring) {
+        munmap(dev->cq_ring, dev->cq_ring_size);
+    }
+    if (dev->sq_ring) {
+        munmap(dev->sq_ring, dev->sq_ring_size);
+    }
+    close(dev->ring_fd);
+    dev->sqes = NULL;
+    dev->sq_ring = dev->cq_ring = NULL;
+    dev->use_uring = 0;
+}
+
+// Sets up the ring and maps its queues. Returns 0 on success.
+static int uring_setup(HostDevice *dev) {
+    struct io_uring_params params;
+    struct iovec *iovecs;
+    char *ring;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    dev->ring_fd = syscall(__NR_io_uring_setup, dev->queue_depth, &params);
+    if (dev->ring_fd < 0) {
+        return -1;
+    }
+    dev->use_uring = 1;
+
+    dev->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    dev->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (dev->cq_ring_size > dev->sq_ring_size) {
+            dev->sq_ring_size = dev->cq_ring_size;
+        }
+        dev->cq_ring_size = dev->sq_ring_size;
+    }
+    dev->sq_ring = mmap(NULL, dev->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, dev->ring_fd, IORING_OFF_SQ_RING);
+    if (dev->sq_ring == MAP_FAILED) {
+        dev->sq_ring = NULL;
+        uring_teardown(dev);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        dev->cq_ring = dev->sq_ring;
+    } else {
+        dev->cq_ring = mmap(NULL, dev->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, dev->ring_fd, IORING_OFF_CQ_RING);
+        if (dev->cq_ring == MAP_FAILED) {
+            dev->cq_ring = NULL;
+            uring_teardown(dev);
+            return -1;
+        }
+    }
+    dev->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    dev->sqes = mmap(NULL, dev->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, dev->ring_fd, IORING_OFF_SQES);
+    if (dev->sqes == MAP_FAILED) {
+        dev->sqes = NULL;
+        uring_teardown(dev);
+        return -1;
+    }
+
+    ring = (char*)dev->sq_ring;
+    dev->sq_head = (unsigned int*)(ring + params.sq_off.head);
+    dev->sq_tail = (unsigned int*)(ring + params.sq_off.tail);
+    dev->sq_mask = (unsigned int*)(ring + params.sq_off.ring_mask);
+    dev->sq_array = (unsigned int*)(ring + params.sq_off.array);
+    ring = (char*)dev->cq_ring;
+    dev->cq_head = (unsigned int*)(ring + params.cq_off.head);
+    dev->cq_tail = (unsigned int*)(ring + params.cq_off.tail);
+    dev->cq_mask = (unsigned int*)(ring + params.cq_off.ring_mask);
+    dev->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    if (dev->buffers_registered) {
+        iovecs = malloc(dev->num_buffers * sizeof(struct iovec));
+        for (i = 0; i < dev->num_buffers; i++) {
+            iovecs[i].iov_base = dev->buffers + i * TFS_MAX_BLOCK_SIZE;
+            iovecs[i].iov_len = TFS_MAX_BLOCK_SIZE;
+        }
+        if (syscall(__NR_io_uring_register, dev->ring_fd, IORING_REGISTER_BUFFERS, iovecs, dev->num_buffers) != 0) {
+            // Still usable, just without the fixed buffer shortcut
+            dev->buffers_registered = 0;
+        }
+        free(iovecs);
+    }
+    return 0;
+}
+
+// Opens each of the comma-separated images in 'paths' as a device of its own.
+// Returns 0 on success.
+static int open_members(HostDevice *dev, const char *paths, int queue_depth, int direct) {
+    char path[4096];
+    const char *end;
+    int i, len, count = 1;
+
+    for (end = paths; *end; end++) {
+        if (*end == ',') {
+            count++;
+        }
+    }
+    if (count > TFS_MAX_STRIPE_DEVICES) {
+        return -1;
+    }
+
+    dev->members = calloc(count, sizeof(HostDevice));
+    dev->member_tfs = calloc(count, sizeof(TFS));
+    for (i = 0; i < count; i++) {
+        end = strchr(paths, ',');
+        len = end ? end - paths : strlen(paths);
+        if (len >= sizeof(path)) {
+            break;
+        }
+        memcpy(path, paths, len);
+        path[len] = 0;
+        if (host_dev_open(&dev->members[i], path, queue_depth, 0, 0, direct) != 0) {
+            break;
+        }
+        dev->num_members++;
+        paths = end + 1;
+    }
+    if (dev->num_members < count) {
+        while (dev->num_members > 0) {
+            host_dev_close(&dev->members[--dev->num_members]);
+        }
+        free(dev->members);
+        free(dev->member_tfs);
+        dev->members = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int host_dev_open(HostDevice *dev, const char *path, int queue_depth, int num_buffers, int register_buffers, int direct) {
+    memset(dev, 0, sizeof(HostDevice));
+    dev->ring_fd = -1;
+    if (strchr(path, ',')) {
+        dev->fd = -1;
+        if (open_members(dev, path, queue_depth, direct) != 0) {
+            return -1;
+        }
+    } else {
+        dev->fd = open(path, O_RDWR | (direct ? O_DIRECT : 0));
+        if (dev->fd < 0) {
+            return -1;
+        }
+    }
+
+    // O_DIRECT needs aligned buffers
+    if (num_buffers > 0) {
+        if (posix_memalign((void**)&dev->buffers, TFS_MIN_BLOCK_SIZE, num_buffers * TFS_MAX_BLOCK_SIZE) != 0) {
+            host_dev_close(dev);
+            return -1;
+        }
+        dev->num_buffers = num_buffers;
+        dev->buffers_registered = register_buffers;
+    }
+
+    dev->queue_depth = queue_depth;
+    if (dev->members) {
+        // The members have the rings, and the buffers are shared between them
+        dev->use_uring = dev->members[0].use_uring;
+        dev->buffers_registered = 0;
+        return 0;
+    }
+    if (queue_depth > 0 && uring_setup(dev) != 0) {
+        // Fall back to pread/pwrite
+        dev->use_uring = 0;
+    }
+    if (!dev->use_uring) {
+        dev->buffers_registered = 0;
+    }
+    return 0;
+}
+
+void host_dev_close(HostDevice *dev) {
+    if (dev->members) {
+        while (dev->num_members > 0) {
+            host_dev_close(&dev->members[--dev->num_members]);
+        }
+        free(dev->members);
+        free(dev->member_tfs);
+        dev->members = NULL;
+    }
+    if (dev->use_uring && dev->ring_fd >= 0) {
+        uring_teardown(dev);
+    }
+    free(dev->buffers);
+    dev->buffers = NULL;
+    if (dev->fd >= 0) {
+        close(dev->fd);
+    }
+    dev->fd = -1;
+}
+
+char *host_dev_buffer(HostDevice *dev, int index) {
+    if (index < 0 || index >= dev->num_buffers) {
+        return NULL;
+    }
+    return dev->buffers + index * TFS_MAX_BLOCK_SIZE;
+}
+
+// Completes every request the kernel has finished. Returns the number completed.
+static int uring_reap(TFS *tfs) {
+    HostDevice *dev = (HostDevice*)tfs->user_data;
+    unsigned int head = *dev->cq_head, tail;
+    struct io_uring_cqe *cqe;
+    TFSIORequest *req;
+    int res, count = 0;
+
+    tail = __atomic_load_n(dev->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        cqe = &dev->cqes[head & *dev->cq_mask];
+        req = (TFSIORequest*)(unsigned long)cqe->user_data;
+        res = cqe->res;
+        head++;
+        // Free the slot before the callback runs, in case it submits more
+        __atomic_store_n(dev->cq_head, head, __ATOMIC_RELEASE);
+        dev->in_flight--;
+        count++;
+        if (req->op == TFS_IO_FLUSH) {
+            tfsCompleteRequest(tfs, req, (res == 0) ? 0 : -1);
+        } else {
+            tfsCompleteRequest(tfs, req, (res == tfs->block_size) ? 0 : -1);
+        }
+        tail = __atomic_load_n(dev->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return count;
+}
+
+// Polls every device of a stripe, waiting on one that has requests in
+// flight until 'min_complete' parts of requests have finished
+static int stripe_poll(TFSStripe *stripe, int min_complete) {
+    int i, ret, count = 0;
+
+    while (1) {
+        for (i = 0; i < stripe->num_devices; i++) {
+            if ((ret = host_dev_poll(&stripe->devices[i], 0)) < 0) {
+                return -1;
+            }
+            count += ret;
+        }
+        if (count >= min_complete) {
+            return count;
+        }
+        for (i = 0; i < stripe->num_devices; i++) {
+            if (((HostDevice*)stripe->devices[i].user_data)->in_flight > 0) {
+                break;
+            }
+        }
+        if (i == stripe->num_devices) {
+            // Nothing left to wait for
+            return count;
+        }
+        if ((ret = host_dev_poll(&stripe->devices[i], 1)) < 0) {
+            return -1;
+        }
+        count += ret;
+    }
+}
+
+int host_dev_poll(TFS *tfs, int min_complete) {
+    HostDevice *dev = (HostDevice*)tfs->user_data;
+    int count = 0, ret;
+
+    if (tfs->read_fn != &host_read_fn) {
+        return stripe_poll((TFSStripe*)tfs->user_data, min_complete);
+    }
+
+    if (!dev->use_uring) {
+        // Everything has already completed
+        return 0;
+    }
+
+    while (1) {
+        count += uring_reap(tfs);
+        if (count >= min_complete && dev->to_submit == 0) {
+            return count;
+        }
+        ret = uring_enter(dev, dev->to_submit, (count < min_complete) ? 1 : 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        dev->to_submit -= ret;
+    }
+}
+
+int host_dev_drain(TFS *tfs) {
+    HostDevice *dev = (HostDevice*)tfs->user_data;
+    TFSStripe *stripe;
+    int i;
+
+    if (tfs->read_fn != &host_read_fn) {
+        stripe = (TFSStripe*)tfs->user_data;
+        for (i = 0; i < stripe->num_devices; i++) {
+            if (host_dev_drain(&stripe->devices[i]) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    while (dev->use_uring && (dev->in_flight > 0 || dev->to_submit > 0)) {
+        if (host_dev_poll(tfs, 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int host_submit_fn(struct TFS *fs, TFSIORequest *req) {
+    HostDevice *dev = (HostDevice*)fs->user_data;
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+    int result;
+
+    if (req->op != TFS_IO_READ && req->op != TFS_IO_WRITE && req->op != TFS_IO_FLUSH) {
+        return -1;
+    }
+
+    if (!dev->use_uring) {
+        if (req->op == TFS_IO_READ) {
+            result = host_read_fn(fs, req->buf, req->block);
+        } else if (req->op == TFS_IO_WRITE) {
+            result = host_write_fn(fs, req->buf, req->block);
+        } else {
+            result = (fdatasync(dev->fd) == 0) ? 0 : -1;
+        }
+        tfsCompleteRequest(fs, req, result);
+        return 0;
+    }
+
+    // Make room: wait for a completion if the queue depth has been reached,
+    // and hand over what's queued if the submission queue is full
+    while (dev->in_flight >= dev->queue_depth) {
+        if (host_dev_poll(fs, 1) < 0) {
+            return -1;
+        }
+    }
+    if (dev->to_submit > *dev->sq_mask) {
+        if (host_dev_poll(fs, 0) < 0) {
+            return -1;
+        }
+    }
+
+    tail = *dev->sq_tail;
+    index = tail & *dev->sq_mask;
+    sqe = &dev->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = dev->fd;
+    sqe->user_data = (unsigned long)req;
+    if (req->op == TFS_IO_FLUSH) {
+        // Don't start until everything submitted before has completed
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+    } else {
+        sqe->addr = (unsigned long)req->buf;
+        sqe->len = fs->block_size;
+        sqe->off = (unsigned long long)req->block * fs->block_size;
+        if (dev->buffers_registered && req->buf >= dev->buffers && req->buf < dev->buffers + dev->num_buffers * TFS_MAX_BLOCK_SIZE) {
+            sqe->opcode = (req->op == TFS_IO_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = (req->buf - dev->buffers) / TFS_MAX_BLOCK_SIZE;
+        } else {
+            sqe->opcode = (req->op == TFS_IO_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+        }
+    }
+    dev->sq_array[index] = index;
+    __atomic_store_n(dev->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    dev->to_submit++;
+    dev->in_flight++;
+    return 0;
+}
+
+void host_dev_attach(HostDevice *dev, TFS *tfs) {
+    int i;
+
+    if (dev->members) {
+        for (i = 0; i < dev->num_members; i++) {
+            dev->member_tfs[i].block_size = TFS_MIN_BLOCK_SIZE;
+            host_dev_attach(&dev->members[i], &dev->member_tfs[i]);
+        }
+        tfsStripeInit(&dev->stripe, dev->member_tfs, dev->num_members);
+        tfsStripeAttach(&dev->stripe, tfs);
+        return;
+    }
+    tfs->read_fn = &host_read_fn;
+    tfs->write_fn = &host_write_fn;
+    tfs->submit_fn = &host_submit_fn;
+    tfs->user_data = dev;
+}
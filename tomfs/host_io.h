@@ -0,0 +1,78 @@
+// Block device backend for the host TomFS tools
+//
+// Serves a filesystem image file to TFS. Synchronous reads & writes use
+// pread/pwrite. Requests submitted with tfsSubmitRequest go through io_uring
+// when the kernel supports it, and are passed to the kernel in batches: when
+// the submission queue fills, or when the caller polls for completions.
+// Without io_uring they are carried out with pread/pwrite as they arrive.
+//
+// A comma-separated list of image files opens a filesystem striped across
+// them (see TFSStripe), with a device of its own for each file.
+
+#include "tomfs.h"
+
+typedef struct HostDevice {
+    int fd;
+
+    // Non-zero if requests go through io_uring
+    int use_uring;
+
+    // Maximum number of requests in flight at once
+    int queue_depth;
+
+    // Requests queued but not yet passed to the kernel, and requests passed
+    // to the kernel that haven't completed
+    unsigned int to_submit;
+    unsigned int in_flight;
+
+    // Page aligned buffers of TFS_MAX_BLOCK_SIZE bytes, enough for a block of
+    // any filesystem (see host_dev_buffer). If they are registered with the
+    // ring, requests using them skip the per-request page mapping.
+    char *buffers;
+    int num_buffers;
+    int buffers_registered;
+
+    // io_uring state
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    unsigned int sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned int sqes_size;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // For a striped filesystem, the device for each image file and the stripe
+    // that routes requests to them. The buffers are this device's own.
+    struct HostDevice *members;
+    TFS *member_tfs;
+    int num_members;
+    TFSStripe stripe;
+} HostDevice;
+
+// Opens an image file, or the comma-separated image files a filesystem is
+// striped across. 'queue_depth' is the most requests kept in flight; 0
+// disables io_uring. 'num_buffers' buffers are allocated for requests, and
+// registered with the ring if 'register_buffers' is set. 'direct' opens the
+// file with O_DIRECT, bypassing the page cache; every buffer read or written
+// must then be page aligned, as the ones from host_dev_buffer are. Returns 0
+// on success. Each image of a stripe gets its own queue of 'queue_depth'.
+int host_dev_open(HostDevice *dev, const char *path, int queue_depth, int num_buffers, int register_buffers, int direct);
+
+void host_dev_close(HostDevice *dev);
+
+// Points the callbacks of 'tfs' at the device. Call after tfsInit.
+void host_dev_attach(HostDevice *dev, TFS *tfs);
+
+// Returns buffer 'index' of the ones allocated by host_dev_open
+char *host_dev_buffer(HostDevice *dev, int index);
+
+// Passes queued requests to the kernel and completes finished ones, waiting
+// until at least 'min_complete' have finished. Returns the number completed,
+// or -1 on error. For a striped filesystem, each device's part of a request
+// counts separately.
+int host_dev_poll(TFS *tfs, int min_complete);
+
+// Waits for every submitted request to complete. Returns 0 on success.
+int host_dev_drain(TFS *tfs);
+
@@ -0,0 +1,152 @@
+// Measures random block read throughput of the host block backend: pread
+// one block at a time, then io_uring at a range of queue depths, with and
+// without registered buffers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_io.h"
+
+int kprintf(const char *fmt, ...) {}
+
+// Makes sure the file has at least 'num_blocks' blocks of data in it
+static int prepare_file(const char *path, unsigned int num_blocks) {
+    char buf[TFS_BLOCK_SIZE];
+    FILE *f;
+    long size;
+    unsigned int i;
+
+    if ((f = fopen(path, "r+b")) == NULL && (f = fopen(path, "w+b")) == NULL) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    for (i = size / TFS_BLOCK_SIZE; i < num_blocks; i++) {
+        memset(buf, i, TFS_BLOCK_SIZE);
+        fseek(f, (long)i * TFS_BLOCK_SIZE, SEEK_SET);
+        if (fwrite(buf, TFS_BLOCK_SIZE, 1, f) != 1) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads every block in 'order' with up to 'queue_depth' requests in flight.
+// Returns the time taken in seconds, or a negative number on error.
+static double run(const char *path, unsigned int *order, unsigned int num_blocks, int queue_depth, int register_buffers, int direct, int *used_uring) {
+    TFS tfs;
+    HostDevice dev;
+    TFSIORequest *reqs, *done[64];
+    unsigned int next = 0, completed = 0;
+    int i, count, slots = queue_depth ? queue_depth : 1;
+    double start;
+
+    if (host_dev_open(&dev, path, queue_depth, slots, register_buffers, direct) != 0) {
+        return -1;
+    }
+    tfsInit(&tfs, NULL, 0);
+    host_dev_attach(&dev, &tfs);
+    *used_uring = dev.use_uring;
+
+    reqs = malloc(slots * sizeof(TFSIORequest));
+    start = now();
+    for (i = 0; i < slots && next < num_blocks; i++) {
+        reqs[i].op = TFS_IO_READ;
+        reqs[i].buf = host_dev_buffer(&dev, i);
+        reqs[i].callback = NULL;
+        reqs[i].block = order[next++];
+        if (tfsSubmitRequest(&tfs, &reqs[i]) != 0) {
+            return -1;
+        }
+    }
+    while (completed < num_blocks) {
+        if (host_dev_poll(&tfs, 1) < 0) {
+            return -1;
+        }
+        count = tfsReapCompletions(&tfs, done, 64);
+        for (i = 0; i < count; i++) {
+            if (done[i]->result != 0) {
+                return -1;
+            }
+            completed++;
+            // Reuse the slot for the next block
+            if (next < num_blocks) {
+                done[i]->block = order[next++];
+                if (tfsSubmitRequest(&tfs, done[i]) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    start = now() - start;
+
+    free(reqs);
+    host_dev_close(&dev);
+    return start;
+}
+
+int main(int argc, char *argv[]) {
+    static const int depths[] = { 1, 2, 4, 8, 16, 32, 64 };
+    unsigned int *order, num_blocks, i, j, tmp;
+    int d, reg, direct = 0, used_uring;
+    double secs;
+
+    if (argc < 2) {
+        printf("io_bench file [blocks] [direct]\n");
+        return 0;
+    }
+    num_blocks = (argc > 2) ? atoi(argv[2]) : 16384;
+    direct = (argc > 3) ? atoi(argv[3]) : 0;
+
+    if (prepare_file(argv[1], num_blocks) != 0) {
+        printf("Failed to prepare %s.\n", argv[1]);
+        return -1;
+    }
+
+    // Random order, so neither readahead nor merging can help
+    order = malloc(num_blocks * sizeof(unsigned int));
+    for (i = 0; i < num_blocks; i++) {
+        order[i] = i;
+    }
+    srand(1);
+    for (i = num_blocks - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    printf("%-20s %5s %10s %10s\n", "backend", "qd", "MB/s", "IOPS");
+    if ((secs = run(argv[1], order, num_blocks, 0, 0, direct, &used_uring)) < 0) {
+        printf("Failed to read %s.\n", argv[1]);
+        return -1;
+    }
+    printf("%-20s %5d %10.1f %10.0f\n", "pread", 1, num_blocks * (double)TFS_BLOCK_SIZE / secs / 1e6, num_blocks / secs);
+
+    for (reg = 0; reg < 2; reg++) {
+        for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            if ((secs = run(argv[1], order, num_blocks, depths[d], reg, direct, &used_uring)) < 0) {
+                printf("Failed to read %s.\n", argv[1]);
+                return -1;
+            }
+            if (!used_uring) {
+                printf("io_uring is not available.\n");
+                return 0;
+            }
+            printf("%-20s %5d %10.1f %10.0f\n", reg ? "io_uring (fixed)" : "io_uring", depths[d], num_blocks * (double)TFS_BLOCK_SIZE / secs / 1e6, num_blocks / secs);
+        }
+    }
+
+    free(order);
+    return 0;
+}
@@ -1,47 +1,92 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "tomfs.h"
 
+// Size of the filesystem, which has to fit in the disk image
+#define FS_SIZE (2560 * 4096)
+
 int kprintf(const char *fmt, ...) {}
 
 int read_fn(struct TFS *fs, char *buf, unsigned int block) {
-    fseek((FILE *)fs->user_data, block*TFS_BLOCK_SIZE, SEEK_SET);
-    fread(buf, 1, TFS_BLOCK_SIZE, (FILE *)fs->user_data);
+    fseek((FILE *)fs->user_data, (long)block*fs->block_size, SEEK_SET);
+    fread(buf, 1, fs->block_size, (FILE *)fs->user_data);
     return 0;
 }
 
 int write_fn(struct TFS *fs, char *buf, unsigned int block) {
-    fseek((FILE *)fs->user_data, block*TFS_BLOCK_SIZE, SEEK_SET);
-    fwrite(buf, 1, TFS_BLOCK_SIZE, (FILE *)fs->user_data);
+    fseek((FILE *)fs->user_data, (long)block*fs->block_size, SEEK_SET);
+    fwrite(buf, 1, fs->block_size, (FILE *)fs->user_data);
     return 0;
 }
 
 int main(int argc, const char *argv[]) {
-    TFS tfs;
+    TFS tfs, devices[TFS_MAX_STRIPE_DEVICES];
+    TFSStripe stripe;
     FILE *fOut;
+    char paths[4096], *path;
+    unsigned int block_size = TFS_BLOCK_SIZE, block_group_size, num_blocks;
+    int i, num_devices = 0;
     if (argc < 2) {
-        printf("make_fs image\n");
+        printf("make_fs image[,image...] [block_size [block_group_size]]\n");
         return 0;
     }
+    if (argc > 2) {
+        block_size = atoi(argv[2]);
+    }
+    // By default, groups are as big as a bitmap block has room for
+    block_group_size = (argc > 3) ? atoi(argv[3]) : 4 * block_size;
 
-    fOut = fopen(argv[1], "w+b");
-    if (!fOut) {
-        printf("Failed to write to file.\n");
-        return -1;
+    num_blocks = FS_SIZE / block_size;
+
+    // Several images make a filesystem striped across them, each a device of
+    // its own
+    strncpy(paths, argv[1], sizeof(paths) - 1);
+    paths[sizeof(paths) - 1] = 0;
+    for (path = strtok(paths, ","); path; path = strtok(NULL, ",")) {
+        if (num_devices == TFS_MAX_STRIPE_DEVICES) {
+            printf("Too many images.\n");
+            return -1;
+        }
+        devices[num_devices].read_fn = &read_fn;
+        devices[num_devices].write_fn = &write_fn;
+        devices[num_devices].submit_fn = NULL;
+        devices[num_devices].user_data = fopen(path, "w+b");
+        if (!devices[num_devices].user_data) {
+            printf("Failed to write to %s.\n", path);
+            return -1;
+        }
+        num_devices++;
+    }
+
+    // A new file reads back as zeros, so only the blocks in use need writing
+    for (i = 0; i < num_devices; i++) {
+        fOut = (FILE *)devices[i].user_data;
+        if (ftruncate(fileno(fOut), (off_t)tfsStripeDeviceBlocks(num_blocks, block_group_size, num_devices, i) * block_size) != 0) {
+            printf("Failed to write to file.\n");
+            return -1;
+        }
     }
 
     tfsInit(&tfs, NULL, 0);
 
-    tfs.read_fn = &read_fn;
-    tfs.write_fn = &write_fn;
-    tfs.user_data = fOut;
-    if (tfsInitFilesystem(&tfs, 2560) != 0) {
+    if (num_devices > 1) {
+        tfsStripeInit(&stripe, devices, num_devices);
+        tfsStripeAttach(&stripe, &tfs);
+    } else {
+        tfs.read_fn = &read_fn;
+        tfs.write_fn = &write_fn;
+        tfs.user_data = devices[0].user_data;
+    }
+    if (tfsInitFilesystemGeometry(&tfs, num_blocks, block_size, block_group_size, 1) != 0) {
         printf("Failed to initialize filesystem.\n");
         return -1;
     }
-    fclose(fOut);
+    for (i = 0; i < num_devices; i++) {
+        fclose((FILE *)devices[i].user_data);
+    }
 
     return 0;
 }
-
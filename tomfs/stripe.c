@@ -0,0 +1,187 @@
+// Striping of a filesystem across several devices (see TFSStripe)
+
+#include <tomfs.h>
+
+// Returns the device block 'block' of the filesystem on 'fs' is stored on,
+// and sets 'local' to its block number there. Returns NULL if the stripe
+// doesn't match the filesystem.
+static TFS *map_block(TFSStripe *stripe, TFS *fs, unsigned int block, unsigned int *local) {
+    unsigned int group_size = fs->header.block_group_size;
+    unsigned int num_devices = stripe->num_devices, group;
+    TFS *device;
+
+    if (block == 0) {
+        // The header, which is read before anything about the stripe is known
+        device = &stripe->devices[0];
+        *local = 0;
+    } else {
+        if (group_size == 0 || (fs->header.stripe_devices ? fs->header.stripe_devices : 1) != num_devices) {
+            return NULL;
+        }
+        group = (block - 1) / group_size;
+        device = &stripe->devices[group % num_devices];
+        *local = 1 + (group / num_devices) * group_size + (block - 1) % group_size;
+    }
+    device->block_size = fs->block_size;
+    return device;
+}
+
+static int stripe_read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    TFS *device;
+    unsigned int local;
+
+    if ((device = map_block((TFSStripe*)fs->user_data, fs, block, &local)) == NULL) {
+        return -1;
+    }
+    return device->read_fn(device, buf, local);
+}
+
+static int stripe_write_fn(struct TFS *fs, const char *buf, unsigned int block) {
+    TFS *device;
+    unsigned int local;
+
+    if ((device = map_block((TFSStripe*)fs->user_data, fs, block, &local)) == NULL) {
+        return -1;
+    }
+    return device->write_fn(device, buf, local);
+}
+
+// Called as each part of a request completes. The last one to complete
+// completes the request it's part of.
+static void part_done(struct TFS *fs, TFSIORequest *req) {
+    TFSStripeRequest *part = (TFSStripeRequest*)req, *leader = part->leader;
+    TFSStripe *stripe = part->stripe;
+    TFSIORequest *parent;
+    int result;
+
+    if (req->result != 0) {
+        leader->result = -1;
+    }
+    if (part != leader) {
+        part->next_free = stripe->free_requests;
+        stripe->free_requests = part;
+    }
+    if (--leader->pending == 0) {
+        parent = leader->parent;
+        result = leader->result;
+        leader->next_free = stripe->free_requests;
+        stripe->free_requests = leader;
+        tfsCompleteRequest(stripe->tfs, parent, result);
+    }
+}
+
+// A read or write goes to the one device the block is on. A flush goes to
+// every device, and completes once they all have.
+static int stripe_submit_fn(struct TFS *fs, TFSIORequest *req) {
+    TFSStripe *stripe = (TFSStripe*)fs->user_data;
+    TFSStripeRequest *parts[TFS_MAX_STRIPE_DEVICES], *part;
+    TFS *device = NULL;
+    unsigned int local = 0;
+    int i, result, num_parts = 1;
+
+    if (req->op == TFS_IO_FLUSH) {
+        num_parts = stripe->num_devices;
+    } else if (req->op == TFS_IO_READ || req->op == TFS_IO_WRITE) {
+        if ((device = map_block(stripe, fs, req->block, &local)) == NULL) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+
+    for (i = 0; i < num_parts && stripe->free_requests; i++) {
+        parts[i] = stripe->free_requests;
+        stripe->free_requests = parts[i]->next_free;
+    }
+    if (i < num_parts) {
+        // Out of parts: put back what was taken
+        while (i > 0) {
+            parts[--i]->next_free = stripe->free_requests;
+            stripe->free_requests = parts[i];
+        }
+        if (req->op == TFS_IO_FLUSH) {
+            return -1;
+        }
+        // Carry it out here and now instead
+        if (req->op == TFS_IO_READ) {
+            result = device->read_fn(device, req->buf, local);
+        } else {
+            result = device->write_fn(device, req->buf, local);
+        }
+        tfsCompleteRequest(fs, req, (result < 0) ? -1 : 0);
+        return 0;
+    }
+
+    // Every part is counted before any is submitted, as a device without a
+    // submit_fn completes them straight away
+    parts[0]->parent = req;
+    parts[0]->pending = num_parts;
+    parts[0]->result = 0;
+    for (i = 0; i < num_parts; i++) {
+        part = parts[i];
+        part->leader = parts[0];
+        part->req.op = req->op;
+        part->req.block = local;
+        part->req.buf = req->buf;
+        part->req.callback = &part_done;
+        if (req->op == TFS_IO_FLUSH) {
+            device = &stripe->devices[i];
+            device->block_size = fs->block_size;
+        }
+        if (tfsSubmitRequest(device, &part->req) != 0) {
+            tfsCompleteRequest(device, &part->req, -1);
+        }
+    }
+    return 0;
+}
+
+int tfsStripeInit(TFSStripe *stripe, TFS *devices, int num_devices) {
+    int i;
+
+    if (num_devices < 1 || num_devices > TFS_MAX_STRIPE_DEVICES) {
+        return -1;
+    }
+    stripe->devices = devices;
+    stripe->num_devices = num_devices;
+    stripe->tfs = NULL;
+    stripe->free_requests = NULL;
+    for (i = TFS_STRIPE_QUEUE_DEPTH - 1; i >= 0; i--) {
+        stripe->requests[i].stripe = stripe;
+        stripe->requests[i].next_free = stripe->free_requests;
+        stripe->free_requests = &stripe->requests[i];
+    }
+    for (i = 0; i < num_devices; i++) {
+        devices[i].completed_head = NULL;
+        devices[i].completed_tail = NULL;
+    }
+    return 0;
+}
+
+void tfsStripeAttach(TFSStripe *stripe, TFS *tfs) {
+    stripe->tfs = tfs;
+    tfs->read_fn = &stripe_read_fn;
+    tfs->write_fn = &stripe_write_fn;
+    tfs->submit_fn = &stripe_submit_fn;
+    tfs->user_data = stripe;
+    tfs->header.stripe_devices = stripe->num_devices;
+}
+
+unsigned int tfsStripeDeviceBlocks(unsigned int num_blocks, unsigned int block_group_size, int num_devices, int device) {
+    unsigned int num_groups, last_group;
+
+    if (num_blocks <= 1) {
+        return num_blocks;
+    }
+    num_groups = (num_blocks - 2) / block_group_size + 1;
+    if (device >= num_groups) {
+        // Just the unused block 0
+        return 1;
+    }
+    // The last of this device's groups, which may be the filesystem's last
+    // and only partly there
+    last_group = device + (num_groups - 1 - device) / num_devices * num_devices;
+    if (last_group == num_groups - 1) {
+        return 1 + last_group / num_devices * block_group_size + (num_blocks - 1 - last_group * block_group_size);
+    }
+    return 1 + (last_group / num_devices + 1) * block_group_size;
+}
@@ -0,0 +1,199 @@
+// Measures block throughput of a filesystem striped across 1, 2 and 4 image
+// files. For each, a filesystem is made across the first that many images,
+// then every block after the header is written and read back in random order
+// with a number of requests in flight. The images only speed each other up if
+// they are on different disks. The blocks are overwritten with a pattern, so
+// the filesystems aren't usable afterwards.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host_io.h"
+
+// Small groups, so that even a short run is spread over every image
+#define BENCH_GROUP_SIZE 256
+
+int kprintf(const char *fmt, ...) {}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Creates the images a filesystem of 'num_blocks' blocks striped across
+// 'num_devices' of them needs. 'paths' is comma-separated. Returns 0 on
+// success.
+static int prepare_images(const char *paths, int num_devices, unsigned int num_blocks) {
+    char list[4096], *path;
+    FILE *f;
+    int i = 0;
+
+    strncpy(list, paths, sizeof(list) - 1);
+    list[sizeof(list) - 1] = 0;
+    for (path = strtok(list, ","); path && i < num_devices; path = strtok(NULL, ","), i++) {
+        if ((f = fopen(path, "w+b")) == NULL) {
+            return -1;
+        }
+        if (ftruncate(fileno(f), (off_t)tfsStripeDeviceBlocks(num_blocks, BENCH_GROUP_SIZE, num_devices, i) * TFS_BLOCK_SIZE) != 0) {
+            fclose(f);
+            return -1;
+        }
+        fclose(f);
+    }
+    return 0;
+}
+
+// Carries out 'op' on every block in 'order' with up to 'queue_depth'
+// requests in flight. Returns the time taken in seconds, or a negative number
+// on error.
+static double run_pass(TFS *tfs, HostDevice *dev, int op, unsigned int *order, unsigned int count, int queue_depth) {
+    TFSIORequest *reqs, *done[64];
+    unsigned int next = 0, completed = 0;
+    int i, n;
+    double start;
+
+    reqs = malloc(queue_depth * sizeof(TFSIORequest));
+    start = now();
+    for (i = 0; i < queue_depth && next < count; i++) {
+        reqs[i].op = op;
+        reqs[i].buf = host_dev_buffer(dev, i);
+        reqs[i].callback = NULL;
+        reqs[i].block = order[next++];
+        if (op == TFS_IO_WRITE) {
+            memset(reqs[i].buf, reqs[i].block, TFS_BLOCK_SIZE);
+        }
+        if (tfsSubmitRequest(tfs, &reqs[i]) != 0) {
+            return -1;
+        }
+    }
+    while (completed < count) {
+        if (host_dev_poll(tfs, 1) < 0) {
+            return -1;
+        }
+        n = tfsReapCompletions(tfs, done, 64);
+        for (i = 0; i < n; i++) {
+            if (done[i]->result != 0 || (op == TFS_IO_READ && (unsigned char)done[i]->buf[0] != (done[i]->block & 0xFF))) {
+                return -1;
+            }
+            completed++;
+            // Reuse the slot for the next block
+            if (next < count) {
+                done[i]->block = order[next++];
+                if (op == TFS_IO_WRITE) {
+                    memset(done[i]->buf, done[i]->block, TFS_BLOCK_SIZE);
+                }
+                if (tfsSubmitRequest(tfs, done[i]) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    start = now() - start;
+
+    free(reqs);
+    return start;
+}
+
+// Stripes a filesystem across the first 'num_devices' images in 'paths' and
+// times writing then reading it. Returns 0 on success.
+static int run(const char *paths, int num_devices, unsigned int *order, unsigned int num_blocks, int queue_depth, int direct) {
+    TFS tfs;
+    HostDevice dev;
+    char list[4096];
+    double write_secs, read_secs;
+    int i, len;
+
+    // Cut the list down to the images used
+    for (i = 0, len = 0; paths[len] && len < sizeof(list) - 1; len++) {
+        if (paths[len] == ',' && ++i == num_devices) {
+            break;
+        }
+    }
+    memcpy(list, paths, len);
+    list[len] = 0;
+
+    // The filesystem is made through the page cache, as O_DIRECT needs
+    // aligned buffers, and then the device is opened again for the runs
+    if (prepare_images(list, num_devices, num_blocks) != 0 ||
+        host_dev_open(&dev, list, 0, 0, 0, 0) != 0) {
+        printf("Failed to open %s.\n", list);
+        return -1;
+    }
+    tfsInit(&tfs, NULL, 0);
+    host_dev_attach(&dev, &tfs);
+    if (tfsInitFilesystemGeometry(&tfs, num_blocks, TFS_BLOCK_SIZE, BENCH_GROUP_SIZE, 1) != 0) {
+        printf("Failed to make a filesystem across %s.\n", list);
+        return -1;
+    }
+    host_dev_close(&dev);
+    if (host_dev_open(&dev, list, queue_depth, queue_depth, 0, direct) != 0) {
+        printf("Failed to open %s.\n", list);
+        return -1;
+    }
+    host_dev_attach(&dev, &tfs);
+
+    if ((write_secs = run_pass(&tfs, &dev, TFS_IO_WRITE, order, num_blocks - 1, queue_depth)) < 0 ||
+        (read_secs = run_pass(&tfs, &dev, TFS_IO_READ, order, num_blocks - 1, queue_depth)) < 0) {
+        printf("Failed to write and read back %s.\n", list);
+        return -1;
+    }
+    printf("%-8d %5d %12.1f %12.1f %8s\n", num_devices, queue_depth,
+           (num_blocks - 1) * (double)TFS_BLOCK_SIZE / write_secs / 1e6,
+           (num_blocks - 1) * (double)TFS_BLOCK_SIZE / read_secs / 1e6,
+           dev.use_uring ? "io_uring" : "pwrite");
+
+    host_dev_close(&dev);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const int counts[] = { 1, 2, 4 };
+    unsigned int *order, num_blocks, i, j, tmp;
+    int c, num_paths = 1, queue_depth, direct;
+    const char *p;
+
+    if (argc < 2) {
+        printf("stripe_bench image,image,image,image [blocks [queue_depth [direct]]]\n");
+        return 0;
+    }
+    num_blocks = (argc > 2) ? atoi(argv[2]) : 16384;
+    queue_depth = (argc > 3) ? atoi(argv[3]) : 32;
+    direct = (argc > 4) ? atoi(argv[4]) : 0;
+    for (p = argv[1]; *p; p++) {
+        if (*p == ',') {
+            num_paths++;
+        }
+    }
+    if (num_blocks < 3 || queue_depth < 1 || queue_depth > 64) {
+        printf("Need at least 3 blocks and a queue depth of 1 to 64.\n");
+        return -1;
+    }
+
+    // Every block but the header, in random order so neither readahead nor
+    // merging can help
+    order = malloc((num_blocks - 1) * sizeof(unsigned int));
+    for (i = 0; i < num_blocks - 1; i++) {
+        order[i] = i + 1;
+    }
+    srand(1);
+    for (i = num_blocks - 2; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    printf("%-8s %5s %12s %12s %8s\n", "devices", "qd", "write MB/s", "read MB/s", "backend");
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]) && counts[c] <= num_paths; c++) {
+        if (run(argv[1], counts[c], order, num_blocks, queue_depth, direct) != 0) {
+            return -1;
+        }
+    }
+
+    free(order);
+    return 0;
+}
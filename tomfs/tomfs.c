@@ -4,19 +4,40 @@ typedef struct FileHandle {
     unsigned int block_index;
     FileHandle *directory;
     unsigned int mode;
-    unsigned int current_size;
+    unsigned long long current_size;
     unsigned int ref_count;
+    // Next handle on the free list, while this one isn't in use
+    FileHandle *next_free;
+    // Two slots of the handle index (see index_slot). They have nothing to do
+    // with this handle; keeping them here means the storage given to tfsInit
+    // holds the index as well as the handles.
+    unsigned short index_slots[2];
 } FileHandle;
 
 #ifndef EXTERNAL_FILE_HANDLES
 #define MAX_FILE_HANDLES 1024
 
 FileHandle gFileHandles[MAX_FILE_HANDLES];
+
+// Scratch memory for tfsInit to hand out, enough for the biggest blocks
+static unsigned long long gScratch[TFS_SCRATCH_SIZE(TFS_MAX_BLOCK_SIZE) / sizeof(unsigned long long)];
 #else
 FileHandle *gFileHandles;
 int MAX_FILE_HANDLES;
+
+// Callers size their handle storage with TFS_FILE_HANDLE_SIZE
+typedef char file_handle_size_check[(sizeof(FileHandle) == TFS_FILE_HANDLE_SIZE) ? 1 : -1];
 #endif
 
+// Directory records have the same layout whatever the host's ABI
+typedef char dir_record_size_check[(sizeof(TFSDirRecord) == 24) ? 1 : -1];
+
+// Handles that aren't in use, linked through next_free
+static FileHandle *gFreeHandles;
+
+// Sum of the reference counts of all the handles in use
+static int gOpenHandleCount;
+
 int kprintf(const char *fmt, ...);
 
 // 60 prime numbers
@@ -28,49 +49,162 @@ static int gPrimeNumberTable[] = {
     419, 421, 431, 433, 439, 443, 449, 457, 461, 463,
     467, 479, 487, 491, 499, 503, 509, 521, 523, 541 };
 
-static FileHandle *get_file_handle(unsigned int block_index, FileHandle *directory, unsigned int mode, unsigned int current_size) {
-    int i;
-    for (i = 0; i < MAX_FILE_HANDLES; i++) {
-        if (gFileHandles[i].block_index == block_index) {
-            gFileHandles[i].ref_count++;
-            return &gFileHandles[i];
-        }
+// The handle index is an open-addressed hash table of 2*MAX_FILE_HANDLES
+// slots, keyed by block index, with linear probing. A slot is 0 if empty, or
+// 1 + the position of a handle in gFileHandles. It is never more than half
+// full, so probe sequences stay short.
+static unsigned short *index_slot(unsigned int slot) {
+    return &gFileHandles[slot >> 1].index_slots[slot & 1];
+}
+
+static unsigned int index_home(unsigned int block_index) {
+    return (block_index * 2654435761u) % (2 * MAX_FILE_HANDLES);
+}
+
+static FileHandle *find_handle(unsigned int block_index) {
+    unsigned int slot;
+    unsigned short entry;
+
+    if (MAX_FILE_HANDLES == 0) {
+        return NULL;
     }
-    for (i = 0; i < MAX_FILE_HANDLES; i++) {
-        if (gFileHandles[i].block_index == 0) {
-            gFileHandles[i].block_index = block_index;
-            gFileHandles[i].directory = directory;
-            gFileHandles[i].mode = mode;
-            gFileHandles[i].current_size = current_size;
-            gFileHandles[i].ref_count = 1;
-            if (directory) {
-                directory->ref_count++;
-            }
-            return &gFileHandles[i];
+    slot = index_home(block_index);
+    while ((entry = *index_slot(slot)) != 0) {
+        if (gFileHandles[entry - 1].block_index == block_index) {
+            return &gFileHandles[entry - 1];
         }
+        slot = (slot + 1) % (2 * MAX_FILE_HANDLES);
     }
     return NULL;
 }
 
+static void insert_handle_index(FileHandle *handle) {
+    unsigned int slot = index_home(handle->block_index);
+    while (*index_slot(slot) != 0) {
+        slot = (slot + 1) % (2 * MAX_FILE_HANDLES);
+    }
+    *index_slot(slot) = handle - gFileHandles + 1;
+}
+
+// Takes a handle out of the index, shifting back any entries after it that
+// would otherwise no longer be found. Returns 0 if the handle wasn't in it.
+static int remove_handle_index(FileHandle *handle) {
+    unsigned int table_size = 2 * MAX_FILE_HANDLES;
+    unsigned int slot, next, home;
+    unsigned short entry, target = handle - gFileHandles + 1;
+
+    if (handle < gFileHandles || handle >= gFileHandles + MAX_FILE_HANDLES) {
+        return 0;
+    }
+    slot = index_home(handle->block_index);
+    while ((entry = *index_slot(slot)) != target) {
+        if (entry == 0) {
+            return 0;
+        }
+        slot = (slot + 1) % table_size;
+    }
+
+    for (next = (slot + 1) % table_size; (entry = *index_slot(next)) != 0; next = (next + 1) % table_size) {
+        // The entry can fill the gap if the gap lies between its home slot
+        // and where it is now
+        home = index_home(gFileHandles[entry - 1].block_index);
+        if ((next + table_size - home) % table_size >= (next + table_size - slot) % table_size) {
+            *index_slot(slot) = entry;
+            slot = next;
+        }
+    }
+    *index_slot(slot) = 0;
+    return 1;
+}
+
+static FileHandle *get_file_handle(unsigned int block_index, FileHandle *directory, unsigned int mode, unsigned long long current_size) {
+    FileHandle *handle;
+
+    if ((handle = find_handle(block_index)) != NULL) {
+        handle->ref_count++;
+        gOpenHandleCount++;
+        return handle;
+    }
+    if ((handle = gFreeHandles) == NULL) {
+        return NULL;
+    }
+    gFreeHandles = handle->next_free;
+
+    handle->block_index = block_index;
+    handle->directory = directory;
+    handle->mode = mode;
+    handle->current_size = current_size;
+    handle->ref_count = 1;
+    handle->next_free = NULL;
+    insert_handle_index(handle);
+    gOpenHandleCount++;
+    if (directory) {
+        directory->ref_count++;
+        gOpenHandleCount++;
+    }
+    return handle;
+}
+
 void tfsInit(TFS *tfs, FileHandle *handles, int max_handles) {
     int i;
 #ifdef EXTERNAL_FILE_HANDLES
     gFileHandles = handles;
-    MAX_FILE_HANDLES = max_handles;
+    // Index slots only have room for this many
+    MAX_FILE_HANDLES = (max_handles > 0xFFFF) ? 0xFFFF : max_handles;
+#endif
+    tfs->submit_fn = NULL;
+    tfs->block_size = TFS_MIN_BLOCK_SIZE;
+    tfs->header.stripe_devices = 0;
+    tfs->completed_head = NULL;
+    tfs->completed_tail = NULL;
+#ifndef EXTERNAL_FILE_HANDLES
+    tfsSetScratch(tfs, (char*)gScratch, sizeof(gScratch));
+#else
+    tfsSetScratch(tfs, NULL, 0);
 #endif
-    for (i = 0; i < MAX_FILE_HANDLES; i++) {
+    gFreeHandles = NULL;
+    gOpenHandleCount = 0;
+    for (i = MAX_FILE_HANDLES - 1; i >= 0; i--) {
         gFileHandles[i].block_index = 0;
+        gFileHandles[i].ref_count = 0;
+        gFileHandles[i].index_slots[0] = 0;
+        gFileHandles[i].index_slots[1] = 0;
+        gFileHandles[i].next_free = gFreeHandles;
+        gFreeHandles = &gFileHandles[i];
     }
 }
 
-int tfsWriteFilesystemHeader(TFS *tfs) {
+void tfsSetScratch(TFS *tfs, char *scratch, unsigned int size) {
+    tfs->scratch = scratch;
+    tfs->scratch_size = size;
+    tfs->scratch_used = 0;
+}
+
+// Takes 'count' blocks of the scratch memory, or returns NULL if there isn't
+// that much left. Scratch is a stack: whatever is taken is given back with
+// put_scratch before returning, and so before anything taken earlier.
+static char *get_scratch(TFS *tfs, unsigned int count) {
+    char *buf;
+
+    if (tfs->scratch_used + count > tfs->scratch_size / tfs->block_size) {
+        return NULL;
+    }
+    buf = tfs->scratch + tfs->scratch_used * tfs->block_size;
+    tfs->scratch_used += count;
+    return buf;
+}
+
+static void put_scratch(TFS *tfs, unsigned int count) {
+    tfs->scratch_used -= count;
+}
+
+static int do_write_filesystem_header(TFS *tfs, char *block_buf) {
     int i;
-    char block_buf[TFS_BLOCK_SIZE];
 
     for (i = 0; i < sizeof(TFSFilesystemHeader); i++) {
         block_buf[i] = ((char *)&tfs->header)[i];
     }
-    for (i = sizeof(TFSFilesystemHeader); i < TFS_BLOCK_SIZE; i++) {
+    for (i = sizeof(TFSFilesystemHeader); i < tfs->block_size; i++) {
         block_buf[i] = 0;
     }
 
@@ -81,54 +215,77 @@ int tfsWriteFilesystemHeader(TFS *tfs) {
     return 0;
 }
 
-int tfsInitFilesystem(TFS *tfs, int num_blocks) {
-    int i;
-    char block_buf[TFS_BLOCK_SIZE];
-    char bitmap_buf[TFS_BLOCK_SIZE];
+int tfsWriteFilesystemHeader(TFS *tfs) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_write_filesystem_header(tfs, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Returns 1 if both are powers of two in range, and a block bitmap has room
+// for the whole tree of a group
+static int valid_geometry(unsigned int block_size, unsigned int block_group_size) {
+    return block_size >= TFS_MIN_BLOCK_SIZE && block_size <= TFS_MAX_BLOCK_SIZE &&
+        (block_size & (block_size - 1)) == 0 &&
+        block_group_size >= TFS_MIN_BLOCK_GROUP_SIZE && block_group_size <= 4 * block_size &&
+        (block_group_size & (block_group_size - 1)) == 0;
+}
+
+// Writes out a new filesystem with the geometry already in tfs->header
+static int do_init_filesystem(TFS *tfs, unsigned int num_blocks, int zeroed, char *bitmap_buf) {
+    unsigned int i;
     FileHandle *handle;
 
+    if (num_blocks < 3) {
+        // No room for the header, a bitmap and the root directory
+        return -1;
+    }
+
     // Initialize header
     tfs->header.magic = TFS_MAGIC;
     tfs->header.current_node_id = 1;
     tfs->header.total_blocks = num_blocks;
+    tfs->header.seed = 0;
     tfs->header.stride_offset = 0;
+    tfs->header.format_version = TFS_FORMAT_VERSION;
+    tfs->header.refcount_block = 0;
+    tfs->header.alloc_group = 0;
+    tfs->header.dedup_block = 0;
+    tfs->header.dedup_buckets = 0;
+    tfs->header.dedup_writes = 0;
     // Data blocks are num_blocks - 1 for the filesystem header
-    // - ciel((num_blocks - 1) / TFS_BLOCK_GROUP_SIZE) for block bitmaps
-    tfs->header.data_blocks = num_blocks - 1 - (num_blocks + TFS_BLOCK_GROUP_SIZE - 2) / TFS_BLOCK_GROUP_SIZE;
+    // - ciel((num_blocks - 1) / block_group_size) for block bitmaps, worked
+    // out so that it can't overflow near 2^32 blocks
+    tfs->header.data_blocks = num_blocks - 1 - ((num_blocks - 2) / tfs->header.block_group_size + 1);
 
     if (tfsWriteFilesystemHeader(tfs) != 0) {
         return -1;
     }
 
-    // Zero out the rest of the structure
-    for (i = 0; i < sizeof(TFSFilesystemHeader); i++) {
-        block_buf[i] = 0;
-    }
-
     // Create bitmap structure
-    for (i = 0; i < TFS_BLOCK_SIZE; i++) {
+    for (i = 0; i < tfs->block_size; i++) {
         bitmap_buf[i] = 0;
     }
     // The bitmap is initialized to have exactly one bit set: the bit
     // corresponding to the block this bitmap is stored in (block 0 in this
     // block group)
-    tfsSetBitmapBit(bitmap_buf, 0);
+    tfsSetBitmapBit(bitmap_buf, 0, tfs->header.block_group_size);
 
-    // Write out all the remaining bitmap & data blocks
-    for (i = 1; i < num_blocks; i++) {
-        if ((i - 1) % TFS_BLOCK_GROUP_SIZE == 0) {
-            if (tfs->write_fn(tfs, bitmap_buf, i) != 0) {
-                return -1;
-            }
-        } else {
-            if (tfs->write_fn(tfs, block_buf, i) != 0) {
-                return -1;
-            }
+    // Write out all the bitmaps. Free blocks don't need to be cleared, and an
+    // all-zero bitmap reads back as an empty group (see read_bitmap), so a
+    // zeroed device needs none of this.
+    for (i = 0; !zeroed && i <= (num_blocks - 2) / tfs->header.block_group_size; i++) {
+        if (tfs->write_fn(tfs, bitmap_buf, 1 + i * tfs->header.block_group_size) != 0) {
+            return -1;
         }
     }
 
     // Create root directory
-    if ((handle = tfsCreateDirectory(tfs, NULL, NULL)) == NULL) {
+    if ((handle = tfsCreateDirectoryAt(tfs, NULL, NULL)) == NULL) {
         return -1;
     }
 
@@ -137,9 +294,39 @@ int tfsInitFilesystem(TFS *tfs, int num_blocks) {
     return 0;
 }
 
+static int init_filesystem(TFS *tfs, unsigned int num_blocks, int zeroed) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_init_filesystem(tfs, num_blocks, zeroed, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+int tfsInitFilesystem(TFS *tfs, unsigned int num_blocks) {
+    return tfsInitFilesystemGeometry(tfs, num_blocks, TFS_BLOCK_SIZE, TFS_BLOCK_GROUP_SIZE, 0);
+}
+
+int tfsInitFilesystemGeometry(TFS *tfs, unsigned int num_blocks, unsigned int block_size, unsigned int block_group_size, int zeroed) {
+    if (!valid_geometry(block_size, block_group_size)) {
+        return -1;
+    }
+    tfs->block_size = block_size;
+    tfs->header.block_size = block_size;
+    tfs->header.block_group_size = block_group_size;
+    return init_filesystem(tfs, num_blocks, zeroed);
+}
+
 int tfsOpenFilesystem(TFS *tfs) {
     int i;
-    char block_buf[TFS_BLOCK_SIZE];
+    char block_buf[TFS_MIN_BLOCK_SIZE];
+    unsigned int stripe_devices = tfs->header.stripe_devices;
+
+    // The header is at the start of block 0 whatever the block size is, so
+    // read it as the smallest block there can be
+    tfs->block_size = TFS_MIN_BLOCK_SIZE;
     if (tfs->read_fn(tfs, block_buf, 0) != 0) {
         return -1;
     }
@@ -148,15 +335,23 @@ int tfsOpenFilesystem(TFS *tfs) {
         ((char *)&tfs->header)[i] = block_buf[i];
     }
 
-    if (tfs->header.magic != TFS_MAGIC) {
+    if (tfs->header.magic != TFS_MAGIC || tfs->header.format_version != TFS_FORMAT_VERSION) {
+        return -1;
+    }
+    if (!valid_geometry(tfs->header.block_size, tfs->header.block_group_size) || tfs->header.total_blocks < 3) {
+        return -1;
+    }
+    // Blocks past the first group would be looked for on the wrong devices
+    if ((stripe_devices > 1 || tfs->header.stripe_devices > 1) && stripe_devices != tfs->header.stripe_devices) {
         return -1;
     }
+    tfs->block_size = tfs->header.block_size;
 
     return 0;
 }
 
-FileHandle *tfsCreateDirectory(TFS *tfs, const char *path, const char *dir_name) {
-    FileHandle *handle = tfsCreateFile(tfs, path, 0040755, dir_name);
+FileHandle *tfsCreateDirectoryAt(TFS *tfs, FileHandle *directory, const char *dir_name) {
+    FileHandle *handle = tfsCreateFileAt(tfs, directory, 0040755, dir_name);
     if (handle) {
         tfsAppendDirectoryEntry(tfs, handle, 0040755, 0, 0, ".");
         tfsAppendDirectoryEntry(tfs, handle, 0040755, 0, 0, "..");
@@ -164,8 +359,19 @@ FileHandle *tfsCreateDirectory(TFS *tfs, const char *path, const char *dir_name)
     return handle;
 }
 
-unsigned long hash_filename(char *filename) {
-    unsigned long hash = 5381;
+FileHandle *tfsCreateDirectory(TFS *tfs, const char *path, const char *dir_name) {
+    FileHandle *dir, *handle;
+
+    if ((dir = tfsOpenPath(tfs, path)) == NULL) {
+        return NULL;
+    }
+    handle = tfsCreateDirectoryAt(tfs, dir, dir_name);
+    tfsCloseHandle(dir);
+    return handle;
+}
+
+unsigned int hash_filename(const char *filename) {
+    unsigned int hash = 5381;
     int c;
 
     while (c = *filename++)
@@ -174,71 +380,149 @@ unsigned long hash_filename(char *filename) {
     return hash;
 }
 
-// TODO: Reclaim space from deleted entries
-int tfsAppendDirectoryEntry(TFS *tfs, FileHandle *handle, unsigned int mode, unsigned int block_index, unsigned int file_size, char *filename) {
+// Returns the record at byte 'pos' of the data of a directory block, or NULL
+// if the rest of the block is padding
+static TFSDirRecord *dir_record(TFS *tfs, char *block_buf, unsigned int pos) {
+    TFSDirRecord *record = (TFSDirRecord*)&block_buf[sizeof(TFSBlockHeader) + pos];
+
+    if (pos + sizeof(TFSDirRecord) > TFS_DATA_SIZE(tfs) || record->record_length == 0 ||
+        record->record_length < TFS_DIR_RECORD_LENGTH(record->name_length) ||
+        pos + record->record_length > TFS_DATA_SIZE(tfs)) {
+        return NULL;
+    }
+    return record;
+}
+
+// Looks for the entry named 'filename', or if that's NULL, the entry for the
+// file starting at 'block_index'. Each directory block is read once, and only
+// names with a matching hash are compared. Copies the entry's record into
+// 'found' and returns its byte offset in the directory, or -1 if there's no
+// such entry.
+static int do_find_record(TFS *tfs, FileHandle *directory, const char *filename, unsigned int block_index, TFSDirRecord *found, char *block_buf) {
     int i;
-    int entry_idx;
-    char *fpos;
-    TFSFileEntry entry;
-    TFSFilenameEntry name_entry;
-
-    entry.mode = mode;
-    entry.block_index = block_index;
-    entry.file_size = file_size;
-    entry.name_hash = (unsigned short)(hash_filename(filename));
-
-    entry_idx = handle->current_size / sizeof(TFSFileEntry);
-    entry.filename_entry = entry_idx;
-
-    fpos = filename;
-    i = 0;
-    do {
-        name_entry.mode = TFS_FILENAME_ENTRY;
-        name_entry.filename[i++] = *fpos;
-        if (i == 10 || !*fpos) {
-            name_entry.next_entry = entry_idx + 1;
-            if (tfsWriteFile(tfs, handle, (char*)&name_entry, sizeof(TFSFilenameEntry), entry_idx * sizeof(TFSFileEntry)) != sizeof(TFSFilenameEntry)) {
-                return -1;
+    unsigned int base, pos, next_block = directory->block_index;
+    unsigned int size = (unsigned int)directory->current_size;
+    unsigned int name_hash = filename ? hash_filename(filename) : 0;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    TFSDirRecord *record;
+
+    for (base = 0; base < size; base += TFS_DATA_SIZE(tfs)) {
+        if (next_block == 0 || tfs->read_fn(tfs, block_buf, next_block) != 0) {
+            return -1;
+        }
+        next_block = header->next_block;
+
+        for (pos = 0; base + pos < size && (record = dir_record(tfs, block_buf, pos)) != NULL; pos += record->record_length) {
+            if (record->mode == 0) {
+                continue;
+            }
+            if (filename) {
+                char *name = (char*)record + sizeof(TFSDirRecord);
+                if (record->name_hash != name_hash) {
+                    continue;
+                }
+                // Verify by actually comparing the strings
+                for (i = 0; i < record->name_length && filename[i] == name[i]; i++) {}
+                if (i < record->name_length || filename[i] != '\0') {
+                    continue;
+                }
+            } else if (record->block_index != block_index) {
+                continue;
             }
-            entry_idx = name_entry.next_entry;
-            i = 0;
+            *found = *record;
+            return base + pos;
         }
-    } while (*fpos++);
+    }
+
+    return -1;
+}
+
+static int find_record(TFS *tfs, FileHandle *directory, const char *filename, unsigned int block_index, TFSDirRecord *found) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_find_record(tfs, directory, filename, block_index, found, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// TODO: Reclaim space from deleted entries
+int tfsAppendDirectoryEntry(TFS *tfs, FileHandle *handle, unsigned int mode, unsigned int block_index, unsigned long long file_size, const char *filename) {
+    // Room to pad out the rest of a block as well as for the record itself
+    unsigned long long buf[TFS_DIR_RECORD_LENGTH(TFS_MAX_FILENAME) / 4];
+    char *bytes = (char*)buf;
+    unsigned int i, pad, name_length, record_length;
+    unsigned int offset = (unsigned int)handle->current_size;
+    TFSDirRecord *record;
+
+    for (name_length = 0; filename[name_length]; name_length++) {}
+    if (name_length == 0 || name_length > TFS_MAX_FILENAME) {
+        return -1;
+    }
+    record_length = TFS_DIR_RECORD_LENGTH(name_length);
+
+    // If the record doesn't fit in what's left of the last block, zero the
+    // rest of it and start the record at the beginning of the next one
+    pad = TFS_DATA_SIZE(tfs) - offset % TFS_DATA_SIZE(tfs);
+    if (pad >= record_length) {
+        pad = 0;
+    }
+    for (i = 0; i < pad + record_length; i++) {
+        bytes[i] = 0;
+    }
+
+    record = (TFSDirRecord*)&bytes[pad];
+    record->file_size = file_size;
+    record->mode = mode;
+    record->block_index = block_index;
+    record->name_hash = hash_filename(filename);
+    record->record_length = record_length;
+    record->name_length = name_length;
+    for (i = 0; i < name_length; i++) {
+        bytes[pad + sizeof(TFSDirRecord) + i] = filename[i];
+    }
 
-    if (tfsWriteFile(tfs, handle, (char*)&entry, sizeof(TFSFileEntry), entry_idx * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
+    if (tfsWriteFile(tfs, handle, bytes, pad + record_length, offset) != pad + record_length) {
         return -1;
     }
 
     return 0;
 }
 
-FileHandle *tfsOpenPath(TFS *tfs, const char *path) {
+FileHandle *tfsOpenPathAt(TFS *tfs, FileHandle *directory, const char *path) {
     FileHandle *handle;
-    TFSFileEntry *entry;
     int path_pos = 0;
-    char path_entry[256];
+    char path_entry[TFS_MAX_FILENAME + 1];
 
-    if (path[path_pos] == '/') {
-        path_pos++;
+    if (path[path_pos] == '/' || directory == NULL) {
+        // Open root directory
+        while (path[path_pos] == '/') {
+            path_pos++;
+        }
+        handle = get_file_handle(2, NULL, 0040755, tfs->header.root_dir_size);
+    } else {
+        // Take another reference to the directory we start from
+        handle = get_file_handle(directory->block_index, directory->directory, directory->mode, directory->current_size);
     }
-
-    // Open root directory
-    handle = get_file_handle(2, NULL, 0040755, tfs->header.root_dir_size);
     if (handle == NULL) {
         return NULL;
     }
 
     while (path[path_pos]) {
-        unsigned int mode, block_index, file_size;
+        unsigned int mode, block_index;
+        unsigned long long file_size;
         int idx = 0;
         FileHandle *prev_handle = handle;
-        while (path[idx + path_pos] && path[idx + path_pos] != '/' && idx < 255) {
+        while (path[idx + path_pos] && path[idx + path_pos] != '/' && idx <= TFS_MAX_FILENAME) {
             path_entry[idx] = path[idx + path_pos];
             idx++;
         }
-        if (idx == 255) {
+        if (idx > TFS_MAX_FILENAME) {
+            // Longer than any name can be
             tfsCloseHandle(prev_handle);
-            return -1;
+            return NULL;
         }
         if (path[idx + path_pos] == '/') {
             path_pos += idx + 1;
@@ -246,6 +530,23 @@ FileHandle *tfsOpenPath(TFS *tfs, const char *path) {
             path_pos += idx;
         }
         path_entry[idx] = '\0';
+
+        if (idx == 0 || (idx == 1 && path_entry[0] == '.')) {
+            continue;
+        }
+        if (idx == 2 && path_entry[0] == '.' && path_entry[1] == '.') {
+            // The entry for the parent doesn't say where it is, but the
+            // handle does. The root is its own parent.
+            if (handle->directory) {
+                handle = get_file_handle(handle->directory->block_index, handle->directory->directory, handle->directory->mode, handle->directory->current_size);
+                tfsCloseHandle(prev_handle);
+                if (!handle) {
+                    return NULL;
+                }
+            }
+            continue;
+        }
+
         if (tfsFindEntry(tfs, handle, path_entry, &mode, &block_index, &file_size) != 0) {
             // Could not find the subdirectory. Release the parent handle.
             tfsCloseHandle(handle);
@@ -262,467 +563,1526 @@ FileHandle *tfsOpenPath(TFS *tfs, const char *path) {
     return handle;
 }
 
-int tfsReadNextEntry(TFS *tfs, FileHandle *directory, unsigned int *entry_index, unsigned int *mode, unsigned int *block_index, unsigned int *file_size, char *filename, int filename_size) {
-    int i, filename_entry;
-    char *fout;
-    TFSFileEntry entry;
-    TFSFilenameEntry name_entry;
-    int num_entries = directory->current_size / sizeof(TFSFileEntry);
-    if ((*entry_index) >= num_entries) {
-        return -1;
-    }
+FileHandle *tfsOpenPath(TFS *tfs, const char *path) {
+    return tfsOpenPathAt(tfs, NULL, path);
+}
+
+int tfsReadNextEntry(TFS *tfs, FileHandle *directory, unsigned int *position, unsigned int *mode, unsigned int *block_index, unsigned long long *file_size, char *filename, int filename_size) {
+    int i, length;
+    unsigned int pos, size = (unsigned int)directory->current_size;
+    // A block header's worth of space in front, so the record can be decoded
+    // with dir_record as if it were at the start of a block
+    unsigned long long buf[(sizeof(TFSBlockHeader) + TFS_DIR_RECORD_LENGTH(TFS_MAX_FILENAME)) / 8];
+    char *record_buf = (char*)buf;
+    TFSDirRecord *record;
 
     while (1) {
-        if (tfsReadFile(tfs, directory, (char*)&entry, sizeof(TFSFileEntry), (*entry_index) * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
+        if (*position >= size) {
             return -1;
         }
-        if (entry.mode != 0 && entry.mode != TFS_FILENAME_ENTRY) {
-            break;
+
+        // Read as much as the longest record, without running into the next
+        // block
+        pos = *position % TFS_DATA_SIZE(tfs);
+        length = TFS_DATA_SIZE(tfs) - pos;
+        if (length > TFS_DIR_RECORD_LENGTH(TFS_MAX_FILENAME)) {
+            length = TFS_DIR_RECORD_LENGTH(TFS_MAX_FILENAME);
         }
-        if (++(*entry_index) >= num_entries) {
+        if ((length = tfsReadFile(tfs, directory, &record_buf[sizeof(TFSBlockHeader)], length, *position)) < 0) {
             return -1;
         }
-    }
-
-    *mode = entry.mode;
-    *block_index = entry.block_index;
-    *file_size = entry.file_size;
-    fout = filename;
-    filename_entry = entry.filename_entry;
-    while (1) {
-        if (tfsReadFile(tfs, directory, (char*)&name_entry, sizeof(TFSFilenameEntry),filename_entry * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
-            return -1;
+        for (i = length; i < TFS_DIR_RECORD_LENGTH(TFS_MAX_FILENAME); i++) {
+            record_buf[sizeof(TFSBlockHeader) + i] = 0;
         }
-        for (i = 0; i < 10; i++) {
-            *fout = name_entry.filename[i];
-            if (fout == &filename[filename_size - 1]) {
-                // Ran out of buffer space, so truncate.
-                *fout = '\0';
-            }
-            if (*fout == '\0') {
-                break;
-            }
-            fout++;
+
+        if ((record = dir_record(tfs, record_buf, 0)) == NULL || record->record_length > TFS_DATA_SIZE(tfs) - pos) {
+            // The rest of the block is padding
+            *position += TFS_DATA_SIZE(tfs) - pos;
+            continue;
         }
-        if (i < 10) {
+        *position += record->record_length;
+        if (record->mode != 0) {
             break;
         }
-        filename_entry = name_entry.next_entry;
     }
-    ++(*entry_index);
+
+    *mode = record->mode;
+    *block_index = record->block_index;
+    *file_size = record->file_size;
+    for (i = 0; i < record->name_length && i < filename_size - 1; i++) {
+        filename[i] = ((char*)record)[sizeof(TFSDirRecord) + i];
+    }
+    filename[i] = '\0';
     return 0;
 }
 
-int tfsFindEntry(TFS *tfs, FileHandle *directory, char *filename, unsigned int *mode, unsigned int *block_index, unsigned int *file_size) {
-    int i;
-    TFSFileEntry entry;
-    TFSFilenameEntry name_entry;
-    unsigned short name_hash = (unsigned short)hash_filename(filename);
-    int num_entries = directory->current_size / sizeof(TFSFileEntry);
-
-    for (i = 0; i < num_entries; i++) {
-        if (tfsReadFile(tfs, directory, (char*)&entry, sizeof(TFSFileEntry), i * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
-            return -1;
-        }
-        if (entry.name_hash == name_hash) {
-            // Verify by actually comparing the strings
-            int filename_entry = entry.filename_entry;
-            char *fcmp = filename;
-            int mismatch = 0;
-            while (1) {
-                if (tfsReadFile(tfs, directory, (char*)&name_entry, sizeof(TFSFilenameEntry), filename_entry * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
-                    return -1;
-                }
-                for (i = 0; i < 10; i++) {
-                    if (*fcmp != name_entry.filename[i]) {
-                        mismatch = 1;
-                        break;
-                    }
-                    if (*fcmp == '\0') {
-                        // Both strings ended - we have a match
-                        break;
-                    }
-                    fcmp++;
-                }
-                if (mismatch == 1 || *fcmp == '\0') {
-                    break;
-                }
-                filename_entry = name_entry.next_entry;
-            }
-            if (mismatch == 0) {
-                // We have a full match on filename
-                *mode = entry.mode;
-                *block_index = entry.block_index;
-                *file_size = entry.file_size;
-                return 0;
+void tfsOpenDirIterator(TFSDirIterator *iter, FileHandle *directory, char *block_buf) {
+    iter->block_buf = block_buf;
+    iter->directory = directory;
+    iter->block_index = 0;
+    iter->offset = 0;
+}
+
+int tfsReadDirectoryBlock(TFS *tfs, TFSDirIterator *iter, TFSDirEntry *entries, int max_entries) {
+    int i, count = 0;
+    unsigned int size, pos;
+    TFSBlockHeader *header = (TFSBlockHeader*)iter->block_buf;
+    TFSDirRecord *record;
+
+    if (!iter->directory || iter->directory->block_index == 0 || max_entries <= 0) {
+        return -1;
+    }
+    size = (unsigned int)iter->directory->current_size;
+
+    // Keep going until we have at least one entry, so that a block holding
+    // only free entries doesn't look like the end of the directory
+    while (count == 0 && iter->offset < size) {
+        if (iter->offset % TFS_DATA_SIZE(tfs) == 0) {
+            // Follow the chain to the block holding the next record. The
+            // block buffer still holds the previous block, if there was one.
+            unsigned int next_block = (iter->offset == 0) ? iter->directory->block_index : header->next_block;
+            if (next_block == 0 || tfs->read_fn(tfs, iter->block_buf, next_block) != 0) {
+                return -1;
             }
+            iter->block_index = next_block;
         }
-    }
 
-    return -1;
-}
+        while (count < max_entries && iter->offset < size) {
+            pos = iter->offset % TFS_DATA_SIZE(tfs);
+            if ((record = dir_record(tfs, iter->block_buf, pos)) == NULL) {
+                // The rest of the block is padding
+                iter->offset += TFS_DATA_SIZE(tfs) - pos;
+                break;
+            }
 
-int tfsUpdateEntry(TFS *tfs, FileHandle *directory, int block_index, unsigned int mode, unsigned int file_size) {
-    int i;
-    TFSFileEntry entry;
-    int num_entries = directory->current_size / sizeof(TFSFileEntry);
+            if (record->mode != 0) {
+                TFSDirEntry *out = &entries[count++];
+                out->mode = record->mode;
+                out->block_index = record->block_index;
+                out->file_size = record->file_size;
+                for (i = 0; i < record->name_length; i++) {
+                    out->filename[i] = ((char*)record)[sizeof(TFSDirRecord) + i];
+                }
+                out->filename[i] = '\0';
+            }
 
-    for (i = 0; i < num_entries; i++) {
-        if (tfsReadFile(tfs, directory, (char*)&entry, sizeof(TFSFileEntry), i * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
-            return -1;
-        }
-        if (entry.block_index == block_index) {
-            entry.mode = mode;
-            entry.file_size = file_size;
-            if (!tfsWriteFile(tfs, directory, (char*)&entry, sizeof(TFSFileEntry), i * sizeof(TFSFileEntry)) != sizeof(TFSFileEntry)) {
-                return -1;
+            iter->offset += record->record_length;
+            if (iter->offset % TFS_DATA_SIZE(tfs) == 0) {
+                break;
             }
-            return 0;
         }
     }
 
-    return -1;
+    return count;
 }
 
-// TODO: Reimplement & write unit tests
-int tfsDeleteDirectory(TFS *tfs, const char *path, const char *dir_name) {
-    /*
-    TFSFileEntry *entry;
-    unsigned int directory_index;
-    int i, start;
-    char dir_path[1024];
+int tfsFindEntry(TFS *tfs, FileHandle *directory, char *filename, unsigned int *mode, unsigned int *block_index, unsigned long long *file_size) {
+    TFSDirRecord record;
+
+    if (find_record(tfs, directory, filename, 0, &record) < 0) {
+        return -1;
+    }
+    *mode = record.mode;
+    *block_index = record.block_index;
+    *file_size = record.file_size;
+    return 0;
+}
 
-    // Open directory we are attempting to delete
-    for (i = 0; path[i]; i++) { dir_path[i] = path[i]; }
-    dir_path[i] = '/';
-    start = i + 1;
-    for (i = 0; dir_name[i]; i++) { dir_path[i + start] = dir_name[i]; }
-    dir_path[i + start] = '\0';
+int tfsUpdateEntry(TFS *tfs, FileHandle *directory, unsigned int block_index, unsigned int mode, unsigned long long file_size) {
+    int offset;
+    TFSDirRecord record;
 
-    if (tfsOpenPath(tfs, dir_path) < 0) {
+    if ((offset = find_record(tfs, directory, NULL, block_index, &record)) < 0) {
         return -1;
     }
-    // Directory must already be empty (except for . and ..)
-    tfsReadNextEntry();
-    tfsReadNextEntry();
-    if (tfsReadNextEntry() != NULL) {
+    record.mode = mode;
+    record.file_size = file_size;
+    if (tfsWriteFile(tfs, directory, (char*)&record, sizeof(TFSDirRecord), offset) != sizeof(TFSDirRecord)) {
         return -1;
     }
+    return 0;
+}
+
+// Removes the entry 'name' from 'directory' and frees the blocks of what it
+// names, which has to be a directory if 'is_dir' is set and a file if not.
+// Anything still open is left alone, as are directories with entries other
+// than "." and "..". Returns 0 on success.
+static int delete_entry(TFS *tfs, FileHandle *directory, const char *name, int is_dir) {
+    int offset, ret;
+    unsigned int position = 0, mode, block_index;
+    unsigned long long file_size;
+    char filename[TFS_MAX_FILENAME + 1];
+    TFSDirRecord record;
+    FileHandle *handle;
 
-    directory_index = tfsOpenPath(tfs, path);
-    if (directory_index < 0) {
+    if (!directory || (offset = find_record(tfs, directory, name, 0, &record)) < 0) {
         return -1;
     }
-    while (entry = tfsReadNextEntry()) {
-        int i;
-        for (i = 0; dir_name[i]; i++) {
-            if (dir_name[i] != entry->file_name[i]) {
-                break;
-            }
+    // "." and ".." don't point anywhere
+    if (record.block_index == 0 || ((record.mode & 0040000) != 0) != is_dir || find_handle(record.block_index) != NULL) {
+        return -1;
+    }
+
+    if (is_dir) {
+        if ((handle = get_file_handle(record.block_index, directory, record.mode, record.file_size)) == NULL) {
+            return -1;
         }
-        if (!dir_name[i] && !entry->file_name[i]) {
-            // Remove the entry & dellocate all the directory blocks
-            if (tfsUpdateEntry(entry->block_index, TFS_DELETED_FILE, 0) != 0 ||
-                tfsDeallocateBlocks(tfs, entry->block_index) != 0) {
-                return -1;
-            }
-            tfsWriteDirectory(tfs);
-            return 0;
+        while ((ret = tfsReadNextEntry(tfs, handle, &position, &mode, &block_index, &file_size, filename, sizeof(filename))) == 0 &&
+               block_index == 0) {}
+        tfsCloseHandle(handle);
+        if (ret == 0) {
+            return -1;
         }
     }
-    */
-    return -1;
+
+    // Drop the entry before the blocks, so a crash in between leaks them
+    // rather than leaving an entry pointing at free blocks
+    block_index = record.block_index;
+    record.mode = 0;
+    if (tfsWriteFile(tfs, directory, (char*)&record, sizeof(TFSDirRecord), offset) != sizeof(TFSDirRecord)) {
+        return -1;
+    }
+    return tfsDeallocateBlocks(tfs, block_index);
 }
 
-FileHandle *tfsCreateFile(TFS *tfs, const char *path, unsigned int mode, const char *file_name) {
-    int block_index;
-    FileHandle *dir = NULL, *file;
+int tfsDeleteDirectoryAt(TFS *tfs, FileHandle *directory, const char *dir_name) {
+    return delete_entry(tfs, directory, dir_name, 1);
+}
 
-    if (path) {
-        // Find the directory
-        if ((dir = tfsOpenPath(tfs, path)) == NULL) {
-            return NULL;
-        }
+int tfsDeleteDirectory(TFS *tfs, const char *path, const char *dir_name) {
+    FileHandle *dir;
+    int ret;
+
+    if ((dir = tfsOpenPath(tfs, path)) == NULL) {
+        return -1;
     }
+    ret = delete_entry(tfs, dir, dir_name, 1);
+    tfsCloseHandle(dir);
+    return ret;
+}
+
+FileHandle *tfsCreateFileAt(TFS *tfs, FileHandle *directory, unsigned int mode, const char *file_name) {
+    unsigned int block_index;
 
     // 2 is the first free block on the filesystem
     block_index = tfsAllocateBlock(tfs, 2, tfs->header.current_node_id, 0, 0);
     if (block_index == 0) {
-        tfsCloseHandle(dir);
         return NULL;
     }
 
     tfs->header.current_node_id++;
     if (tfsWriteFilesystemHeader(tfs) != 0) {
-        tfsCloseHandle(dir);
         return NULL;
     }
 
-    if (dir && tfsAppendDirectoryEntry(tfs, dir, mode, block_index, 0, file_name) != 0) {
-        tfsCloseHandle(dir);
+    if (directory && tfsAppendDirectoryEntry(tfs, directory, mode, block_index, 0, file_name) != 0) {
         return NULL;
     }
 
-    file = get_file_handle(block_index, dir, mode, 0);
+    return get_file_handle(block_index, directory, mode, 0);
+}
+
+FileHandle *tfsCreateFile(TFS *tfs, const char *path, unsigned int mode, const char *file_name) {
+    FileHandle *dir = NULL, *file;
+
+    if (path) {
+        // Find the directory
+        if ((dir = tfsOpenPath(tfs, path)) == NULL) {
+            return NULL;
+        }
+    }
+
+    file = tfsCreateFileAt(tfs, dir, mode, file_name);
     tfsCloseHandle(dir);
     return file;
 }
 
-FileHandle *tfsOpenFile(TFS *tfs, char *path, char *file_name) {
-    int mode, block_index, file_size;
-    TFSFileEntry *entry;
-    FileHandle *dir;
+FileHandle *tfsOpenFileAt(TFS *tfs, FileHandle *directory, const char *file_name) {
+    unsigned int mode, block_index;
+    unsigned long long file_size;
 
-    if ((dir = tfsOpenPath(tfs, path)) == NULL) {
+    if (!directory || tfsFindEntry(tfs, directory, (char*)file_name, &mode, &block_index, &file_size) != 0) {
         return NULL;
     }
-    if (tfsFindEntry(tfs, dir, file_name, &mode, &block_index, &file_size) != 0) {
+    return get_file_handle(block_index, directory, mode, file_size);
+}
+
+FileHandle *tfsOpenFile(TFS *tfs, char *path, char *file_name) {
+    FileHandle *dir, *file;
+
+    if ((dir = tfsOpenPath(tfs, path)) == NULL) {
         return NULL;
     }
-    return get_file_handle(block_index, dir, mode, file_size);
+    file = tfsOpenFileAt(tfs, dir, file_name);
+    tfsCloseHandle(dir);
+    return file;
 }
 
-int tfsWriteFile(TFS *tfs, FileHandle *handle, const char *buf, unsigned int size, unsigned int offset) {
-    int i, cur_offset, cur_block_index, next_block_index, bytes_to_write, block_offset, buf_offset;
-    char block_buf[TFS_BLOCK_SIZE];
+// Reads a block, points one of its chain links at 'value' and writes it back.
+// 'next' selects next_block (1) or previous_block (0).
+static int do_set_block_link(TFS *tfs, unsigned int block_index, int next, unsigned int value, char *block_buf) {
     TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
 
-    if (!handle || handle->block_index == 0) {
+    if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
         return -1;
     }
+    if (next) {
+        header->next_block = value;
+    } else {
+        header->previous_block = value;
+    }
+    return tfs->write_fn(tfs, block_buf, block_index);
+}
 
-    if (offset > handle->current_size) {
-        // Can't start a write past the end of the file
+static int set_block_link(TFS *tfs, unsigned int block_index, int next, unsigned int value) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_set_block_link(tfs, block_index, next, value, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Updates the size of a file in its handle and in its directory entry
+static int set_file_size(TFS *tfs, FileHandle *handle, unsigned long long size) {
+    // Update handle
+    handle->current_size = size;
+
+    // Update directory
+    if (handle->directory) {
+        return tfsUpdateEntry(tfs, handle->directory, handle->block_index, handle->mode, handle->current_size);
+    }
+
+    // This should only happen for the root directory!
+    tfs->header.root_dir_size = handle->current_size;
+    return tfsWriteFilesystemHeader(tfs);
+}
+
+// Splits a byte offset in a file into a logical block number and the offset
+// into that block, for offsets below TFS_MAX_FILE_SIZE. The data size of a
+// block isn't a power of two, and 32-bit targets can't divide 64-bit numbers
+// without libgcc, so this divides 16 bits at a time instead. The remainder is
+// always less than the data size, so each step fits in 32 bits.
+static unsigned int split_offset(TFS *tfs, unsigned long long offset, unsigned int *block_offset) {
+    unsigned int data_size = TFS_DATA_SIZE(tfs), logical = 0, remainder = 0, part;
+    int shift;
+
+    for (shift = 48; shift >= 0; shift -= 16) {
+        part = (remainder << 16) | (unsigned int)((offset >> shift) & 0xFFFF);
+        logical = (logical << 16) | (part / data_size);
+        remainder = part % data_size;
+    }
+    *block_offset = remainder;
+    return logical;
+}
+
+// Number of logical blocks covered by a block in a file's chain
+static unsigned int block_span(TFS *tfs, TFSBlockHeader *header) {
+    if (header->flags & TFS_BLOCK_MAP) {
+        return TFS_MAP_ENTRIES(tfs);
+    }
+    if (header->flags & TFS_BLOCK_COMPRESSED) {
+        return ((TFSChunkHeader*)(header + 1))->block_count;
+    }
+    return 1;
+}
+
+// Sets up a handle on the reference count file. It isn't in any directory and
+// never changes size, so it doesn't need a slot in the handle table.
+static void open_refcount_file(TFS *tfs, FileHandle *handle) {
+    handle->block_index = tfs->header.refcount_block;
+    handle->directory = NULL;
+    handle->mode = 0100600;
+    handle->current_size = (unsigned long long)tfs->header.total_blocks * sizeof(unsigned short);
+    handle->ref_count = 1;
+}
+
+// Returns the number of extra references to a block (0 if a single file uses
+// it), or -1 on error
+static int get_block_refs(TFS *tfs, unsigned int block_index) {
+    FileHandle refs;
+    unsigned short count;
+
+    if (tfs->header.refcount_block == 0) {
+        // Nothing has ever been shared
+        return 0;
+    }
+
+    open_refcount_file(tfs, &refs);
+    if (tfsReadFile(tfs, &refs, (char*)&count, sizeof(count), (unsigned long long)block_index * sizeof(count)) != sizeof(count)) {
         return -1;
     }
+    return count;
+}
 
-    cur_block_index = handle->block_index;
-    cur_offset = 0;
-    do {
-        if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+// Adds a reference to each non-zero block in 'blocks' (delta > 0) or drops
+// one (delta < 0). When dropping, the blocks that were shared are zeroed out
+// of the array, so what is left are the blocks nobody uses any more. Each
+// piece of the count file is written at most once per call, and only the
+// pieces holding counts for 'blocks' are looked at. If a count would overflow,
+// nothing is changed.
+static int do_update_block_refs(TFS *tfs, unsigned int *blocks, int count, int delta, unsigned short *counts) {
+    int i, dirty, pass;
+    unsigned int piece, next_piece, piece_bytes;
+    unsigned long long piece_offset;
+    unsigned int counts_per_piece = TFS_DATA_SIZE(tfs) / sizeof(unsigned short);
+    FileHandle refs;
+
+    if (tfs->header.refcount_block == 0) {
+        if (delta < 0) {
+            return 0;
+        }
+        // This is the first clone, so create the count file. It starts out
+        // as one big hole, so every count reads back as zero.
+        refs.block_index = tfsAllocateBlock(tfs, 2, tfs->header.current_node_id, 0, 0);
+        if (refs.block_index == 0) {
             return -1;
         }
-        if (offset - cur_offset < TFS_BLOCK_DATA_SIZE) {
-            // This block contains the start of our data
-            block_offset = offset - cur_offset;
-            break;
+        tfs->header.current_node_id++;
+        tfs->header.refcount_block = refs.block_index;
+        if (tfsWriteFilesystemHeader(tfs) != 0) {
+            return -1;
         }
-        cur_offset += TFS_BLOCK_DATA_SIZE;
-        if (header->next_block == 0) {
-            if (offset - cur_offset == 0) {
-                // This write coincides with the beginning of a new block, so
-                // we don't expect it to exist yet. Create it.
-                header->next_block = tfsAllocateBlock(tfs, cur_block_index + 1, header->node_id, header->initial_block, cur_block_index);
-                if (header->next_block == 0) {
-                    // Failed to allocate block. Abort.
-                    return -1;
+    }
+    open_refcount_file(tfs, &refs);
+
+    // Adding goes through the pieces twice: first only to check that no count
+    // would overflow, so a clone that fails hasn't raised any of them, then
+    // to write the new counts
+    for (pass = (delta > 0) ? 0 : 1; pass < 2; pass++) {
+        for (piece = 0; ; piece++) {
+            // Skip to the next piece holding a count we need. On a big
+            // filesystem most pieces have nothing to do with any of the blocks.
+            next_piece = 0xFFFFFFFF;
+            for (i = 0; i < count; i++) {
+                if (blocks[i] != 0 && blocks[i] / counts_per_piece >= piece && blocks[i] / counts_per_piece < next_piece) {
+                    next_piece = blocks[i] / counts_per_piece;
                 }
-                // Write the block to update the header
-                if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
-                    return -1;
+            }
+            if (next_piece == 0xFFFFFFFF) {
+                break;
+            }
+            piece = next_piece;
+
+            piece_offset = (unsigned long long)piece * TFS_DATA_SIZE(tfs);
+            piece_bytes = (refs.current_size - piece_offset > TFS_DATA_SIZE(tfs)) ? TFS_DATA_SIZE(tfs) : refs.current_size - piece_offset;
+            if (tfsReadFile(tfs, &refs, (char*)counts, piece_bytes, piece_offset) != (int)piece_bytes) {
+                return -1;
+            }
+            dirty = 0;
+            for (i = 0; i < count; i++) {
+                unsigned short *slot;
+                if (blocks[i] == 0 || blocks[i] / counts_per_piece != piece) {
+                    continue;
                 }
-            } else {
-                // There is no block even though our file size dictates there
-                // out to be. Bail.
+                slot = &counts[blocks[i] % counts_per_piece];
+                if (delta > 0) {
+                    if (*slot == 0xFFFF) {
+                        // Too many clones
+                        return -1;
+                    }
+                    (*slot)++;
+                    dirty = 1;
+                } else if (*slot > 0) {
+                    (*slot)--;
+                    blocks[i] = 0;
+                    dirty = 1;
+                }
+            }
+            if (pass == 1 && dirty && tfsWriteFile(tfs, &refs, (char*)counts, piece_bytes, piece_offset) != (int)piece_bytes) {
                 return -1;
             }
         }
-        cur_block_index = header->next_block;
-    } while (1);
+    }
 
-    bytes_to_write = size;
-    buf_offset = 0;
-    while (1) {
-        int block_bytes = (bytes_to_write > TFS_BLOCK_DATA_SIZE - block_offset) ? TFS_BLOCK_DATA_SIZE - block_offset : bytes_to_write;
+    return 0;
+}
 
-        for (i = 0; i < block_bytes; i++) {
-            block_buf[i + block_offset + sizeof(TFSBlockHeader)] = buf[i + buf_offset];
-        }
-        buf_offset += block_bytes;
-        bytes_to_write -= block_bytes;
-        block_offset = 0;
+static int update_block_refs(TFS *tfs, unsigned int *blocks, int count, int delta) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
 
-        if (bytes_to_write == 0) {
-            if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
-                return -1;
-            }
-            break;
-        }
+    if (scratch) {
+        result = do_update_block_refs(tfs, blocks, count, delta, (unsigned short*)scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
 
-        if (header->next_block == 0) {
-            // Allocate the next block before writing current block so we update
-            // the header appropriately
-            header->next_block = tfsAllocateBlock(tfs, cur_block_index + 1, header->node_id, header->initial_block, cur_block_index);
-            if (header->next_block == 0) {
-                // Failed to allocate block. Abort.
-                return -1;
-            }
+static int free_block_batch(TFS *tfs, unsigned int *blocks, int count);
+
+// Drops a reference to each block in 'blocks' and frees the ones that nobody
+// else is using. Entries are zeroed as they are handled.
+static int release_blocks(TFS *tfs, unsigned int *blocks, int count) {
+    if (update_block_refs(tfs, blocks, count, -1) != 0) {
+        return -1;
+    }
+    return free_block_batch(tfs, blocks, count);
+}
+
+// If the chain block in 'block_buf' is shared with a clone, gives this file
+// its own copy before the caller changes the data: the neighbours are relinked
+// to a fresh block and our reference to the old one is dropped. On return
+// 'block_index' is where the caller should write the block.
+static int unshare_block(TFS *tfs, char *block_buf, unsigned int *block_index) {
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    unsigned int old_block_index = *block_index, new_block_index;
+    int refs = get_block_refs(tfs, old_block_index);
+
+    if (refs <= 0) {
+        return refs;
+    }
+
+    new_block_index = tfsClaimFreeBlock(tfs, old_block_index + 1);
+    if (new_block_index == 0) {
+        return -1;
+    }
+    // The first block of a file is never shared, so there is always a
+    // previous block
+    if (set_block_link(tfs, header->previous_block, 1, new_block_index) != 0 ||
+        (header->next_block != 0 && set_block_link(tfs, header->next_block, 0, new_block_index) != 0) ||
+        update_block_refs(tfs, &old_block_index, 1, -1) != 0) {
+        return -1;
+    }
+
+    *block_index = new_block_index;
+    return 0;
+}
+
+// Copies part of logical block 'logical' of a file out of the compressed
+// chunk in 'chunk_buf'. Reading a whole block decompresses it straight into
+// 'buf'.
+static int read_chunk_data(TFS *tfs, char *chunk_buf, unsigned int logical, char *buf, unsigned int offset, unsigned int size) {
+    int i;
+    unsigned int start = sizeof(TFSBlockHeader) + sizeof(TFSChunkHeader);
+    TFSBlockHeader *header = (TFSBlockHeader*)chunk_buf;
+    TFSChunkHeader *chunk = (TFSChunkHeader*)&chunk_buf[sizeof(TFSBlockHeader)];
+    unsigned int index = logical - header->logical_block;
+    char *data_buf;
+    int result;
+
+    if (index >= chunk->block_count || index >= TFS_CHUNK_BLOCKS) {
+        return -1;
+    }
+    for (i = 0; i < index; i++) {
+        start += chunk->lengths[i];
+    }
+    if (start + chunk->lengths[index] > tfs->block_size) {
+        return -1;
+    }
+
+    if (chunk->lengths[index] == 0) {
+        for (i = 0; i < size; i++) {
+            buf[i] = 0;
         }
+        return 0;
+    }
 
-        if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
-            return -1;
+    if (offset == 0 && size == TFS_DATA_SIZE(tfs)) {
+        return (tfsLZDecompress(&chunk_buf[start], chunk->lengths[index], buf, size) == size) ? 0 : -1;
+    }
+
+    // Part of a block has to be decompressed somewhere else first
+    if ((data_buf = get_scratch(tfs, 1)) == NULL) {
+        return -1;
+    }
+    result = -1;
+    if (tfsLZDecompress(&chunk_buf[start], chunk->lengths[index], data_buf, TFS_DATA_SIZE(tfs)) == TFS_DATA_SIZE(tfs)) {
+        for (i = 0; i < size; i++) {
+            buf[i] = data_buf[i + offset];
         }
+        result = 0;
+    }
+    put_scratch(tfs, 1);
+    return result;
+}
 
-        cur_block_index = header->next_block;
-        if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
-            return -1;
+// Copies part of logical block 'logical' of a file from a block referenced
+// from its map into 'buf', or zeros if the map has a hole there (block_index
+// 0). Returns 1 if the block was a compressed chunk, 0 if not, or -1 on error.
+static int do_read_mapped_data(TFS *tfs, unsigned int block_index, unsigned int logical, char *buf, unsigned int offset, unsigned int size, char *block_buf) {
+    int i;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+
+    if (block_index == 0) {
+        for (i = 0; i < size; i++) {
+            buf[i] = 0;
         }
+        return 0;
     }
 
-    // Did we expand the file past its original size?
-    if (offset + size > handle->current_size) {
-        // Update handle
-        handle->current_size = offset + size;
+    if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+        return -1;
+    }
+    if (header->flags & TFS_BLOCK_COMPRESSED) {
+        return (read_chunk_data(tfs, block_buf, logical, buf, offset, size) == 0) ? 1 : -1;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = block_buf[i + offset + sizeof(TFSBlockHeader)];
+    }
+    return 0;
+}
 
-        // Update directory
-        if (handle->directory) {
-            tfsUpdateEntry(tfs, handle->directory, handle->block_index, handle->mode, handle->current_size);
-        } else {
-            // This should only happen for the root directory!
-            tfs->header.root_dir_size = handle->current_size;
-            tfsWriteFilesystemHeader(tfs);
+static int read_mapped_data(TFS *tfs, unsigned int block_index, unsigned int logical, char *buf, unsigned int offset, unsigned int size) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_read_mapped_data(tfs, block_index, logical, buf, offset, size, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+static int read_bitmap(TFS *tfs, char *bitmap_buf, unsigned int block_group_num);
+
+// Returns 1 if the first 'size' bytes of 'data' are all zeros
+static int all_zeros(const char *data, unsigned int size) {
+    unsigned int i;
+    for (i = 0; i < size; i++) {
+        if (data[i] != 0) {
+            return 0;
         }
     }
+    return 1;
+}
 
-    return size;
+// FNV-1a hash of a block's worth of data, for the dedup index
+static unsigned int hash_block_data(TFS *tfs, const char *data) {
+    unsigned int i, hash = 2166136261u;
+    for (i = 0; i < TFS_DATA_SIZE(tfs); i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
 }
 
-int tfsReadFile(TFS *tfs, FileHandle *handle, char *buf, unsigned int size, unsigned int offset) {
-    int i, cur_offset, cur_block_index, next_block_index, bytes_to_read, block_offset, buf_offset;
-    char block_buf[TFS_BLOCK_SIZE];
+// Returns 1 if a block listed in the dedup index still holds 'data' and can
+// take another reference, 0 if not, or -1 on error. The index is only a
+// hint, so this rules out blocks that have been freed or reused since they
+// were listed, and blocks that get changed in place without looking at their
+// count: maps, chunks, the first block of a file, the count file, bitmaps
+// and the index itself.
+static int do_dedup_candidate(TFS *tfs, unsigned int block_index, const char *data, char *block_buf) {
+    int i, refs;
+    unsigned int group_size = tfs->header.block_group_size;
     TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
 
-    if (!handle || handle->block_index == 0) {
+    if (block_index < 2 || block_index >= tfs->header.total_blocks || (block_index - 1) % group_size == 0 ||
+        (block_index >= tfs->header.dedup_block && block_index < tfs->header.dedup_block + tfs->header.dedup_buckets)) {
+        return 0;
+    }
+
+    if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
         return -1;
     }
+    if (header->flags != 0 || header->initial_block == block_index ||
+        (tfs->header.refcount_block != 0 && header->initial_block == tfs->header.refcount_block)) {
+        return 0;
+    }
+    for (i = 0; i < TFS_DATA_SIZE(tfs); i++) {
+        if (block_buf[i + sizeof(TFSBlockHeader)] != data[i]) {
+            return 0;
+        }
+    }
 
-    if (offset > handle->current_size) {
-        // Can't start a read past the end of the file
+    if (read_bitmap(tfs, block_buf, (block_index - 1) / group_size) != 0) {
+        return -1;
+    }
+    if (!tfsCheckBitmapBit(block_buf, (block_index - 1) % group_size, group_size)) {
+        return 0;
+    }
+    if ((refs = get_block_refs(tfs, block_index)) < 0) {
         return -1;
     }
+    return (refs < 0xFFFF) ? 1 : 0;
+}
 
-    cur_block_index = handle->block_index;
-    cur_offset = 0;
-    do {
-        if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+static int dedup_candidate(TFS *tfs, unsigned int block_index, const char *data) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_dedup_candidate(tfs, block_index, data, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Looks in the dedup index for a block other than 'exclude' that holds the
+// block's worth of 'data'. The bucket for the data's hash is left in 'bucket'
+// and the hash in 'hash', ready for remember_block. Returns 0 with the block
+// found in 'match' (0 if there isn't one), or -1 on error.
+static int find_duplicate(TFS *tfs, const char *data, unsigned int exclude, TFSDedupEntry *bucket, unsigned int *hash, unsigned int *match) {
+    int valid;
+    unsigned int i, entries = tfs->block_size / sizeof(TFSDedupEntry);
+
+    *hash = hash_block_data(tfs, data);
+    *match = 0;
+    if (tfs->read_fn(tfs, (char*)bucket, tfs->header.dedup_block + *hash % tfs->header.dedup_buckets) != 0) {
+        return -1;
+    }
+    for (i = 0; i < entries; i++) {
+        if (bucket[i].block_index == 0 || bucket[i].hash != *hash || bucket[i].block_index == exclude) {
+            continue;
+        }
+        if ((valid = dedup_candidate(tfs, bucket[i].block_index, data)) < 0) {
             return -1;
         }
-        if (offset - cur_offset < TFS_BLOCK_DATA_SIZE) {
-            // This block contains the start of our data
-            block_offset = offset - cur_offset;
+        if (valid) {
+            *match = bucket[i].block_index;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Lists a block in the bucket read by find_duplicate and writes the bucket
+// back. An entry with the same hash is replaced, since it is either stale or
+// a block that can't be shared; otherwise the block goes in an empty slot,
+// or if there are none, over an entry picked by the hash.
+static int remember_block(TFS *tfs, TFSDedupEntry *bucket, unsigned int hash, unsigned int block_index) {
+    unsigned int i, entries = tfs->block_size / sizeof(TFSDedupEntry);
+    unsigned int slot = entries, victim = (hash / tfs->header.dedup_buckets) % entries;
+
+    for (i = 0; i < entries; i++) {
+        if (bucket[i].block_index != 0 && bucket[i].hash == hash) {
+            slot = i;
             break;
         }
-        cur_offset += TFS_BLOCK_DATA_SIZE;
-        if (header->next_block == 0) {
-            // There is no block even though our file size dictates there
-            // out to be. Bail.
-            return -1;
+        if (bucket[i].block_index == 0 && slot == entries) {
+            slot = i;
         }
-        cur_block_index = header->next_block;
-    } while (1);
-
-    bytes_to_read = size;
-    if (offset + bytes_to_read > handle->current_size) {
-        bytes_to_read = handle->current_size - offset;
     }
-    buf_offset = 0;
-    while (1) {
-        int block_bytes = (bytes_to_read > (TFS_BLOCK_DATA_SIZE - block_offset)) ? (TFS_BLOCK_DATA_SIZE - block_offset) : bytes_to_read;
+    if (slot == entries) {
+        slot = victim;
+    }
 
-        for (i = 0; i < block_bytes; i++) {
-            buf[i + buf_offset] = block_buf[i + block_offset + sizeof(TFSBlockHeader)];
-        }
-        buf_offset += block_bytes;
-        bytes_to_read -= block_bytes;
-        block_offset = 0;
+    bucket[slot].hash = hash;
+    bucket[slot].block_index = block_index;
+    return tfs->write_fn(tfs, (char*)bucket, tfs->header.dedup_block + hash % tfs->header.dedup_buckets);
+}
 
-        if (bytes_to_read == 0 || header->next_block == 0) {
-            break;
+// Writes part of logical block 'entry' of the map in 'map_buf', or zeros if
+// 'buf' is NULL. If the data block is shared or compressed, or the map has a
+// hole there, the data goes to a new block and the map is updated and written
+// back. With online dedup, a whole block of zeros becomes a hole, and a whole
+// block that is already on the filesystem shares that copy.
+static int do_write_mapped_data(TFS *tfs, char *map_buf, unsigned int map_block_index, unsigned int entry, const char *buf, unsigned int offset, unsigned int size, char *block_buf, TFSDedupEntry *bucket) {
+    int i, refs = 0, compressed = 0, remember = 0;
+    unsigned int *map = (unsigned int*)&map_buf[sizeof(TFSBlockHeader)];
+    unsigned int block_index = map[entry], new_block_index, hash, match = 0;
+    unsigned int logical = ((TFSBlockHeader*)map_buf)->logical_block + entry;
+
+    if (tfs->header.dedup_writes && buf && offset == 0 && size == TFS_DATA_SIZE(tfs)) {
+        if (!all_zeros(buf, size)) {
+            if (find_duplicate(tfs, buf, block_index, bucket, &hash, &match) != 0) {
+                return -1;
+            }
+            // If there's no copy, this block becomes the one to share
+            remember = (match == 0);
         }
+        if (!remember) {
+            if (match != 0 && update_block_refs(tfs, &match, 1, 1) != 0) {
+                return -1;
+            }
+            map[entry] = match;
+            if (tfs->write_fn(tfs, map_buf, map_block_index) != 0) {
+                return -1;
+            }
+            return (block_index != 0) ? release_blocks(tfs, &block_index, 1) : 0;
+        }
+    }
+
+    for (i = 0; i < sizeof(TFSBlockHeader); i++) {
+        block_buf[i] = 0;
+    }
+    if ((compressed = read_mapped_data(tfs, block_index, logical, &block_buf[sizeof(TFSBlockHeader)], 0, TFS_DATA_SIZE(tfs))) < 0 ||
+        (block_index != 0 && (refs = get_block_refs(tfs, block_index)) < 0)) {
+        return -1;
+    }
 
-        // Read the next block
-        cur_block_index = header->next_block;
-        if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+    for (i = 0; i < size; i++) {
+        block_buf[i + offset + sizeof(TFSBlockHeader)] = buf ? buf[i] : 0;
+    }
+
+    if (block_index != 0 && refs == 0 && !compressed) {
+        // Nobody else is using this block, so update it in place
+        if (tfs->write_fn(tfs, block_buf, block_index) != 0) {
             return -1;
         }
+        return remember ? remember_block(tfs, bucket, hash, block_index) : 0;
     }
 
-    if (bytes_to_read > 0) {
-        // Hit the end of the file, so return the number of bytes actuall read
-        size -= bytes_to_read;
+    new_block_index = tfsClaimFreeBlock(tfs, (block_index != 0) ? block_index + 1 : map_block_index + entry + 1);
+    if (new_block_index == 0) {
+        return -1;
     }
-    return size;
+    map[entry] = new_block_index;
+    if (tfs->write_fn(tfs, block_buf, new_block_index) != 0 ||
+        tfs->write_fn(tfs, map_buf, map_block_index) != 0 ||
+        (remember && remember_block(tfs, bucket, hash, new_block_index) != 0)) {
+        return -1;
+    }
+
+    return (block_index != 0) ? update_block_refs(tfs, &block_index, 1, -1) : 0;
 }
 
-// TODO: Reimplement & write unit tests
-int tfsDeleteFile(TFS *tfs, char *path, char *file_name) {
-    /*
-    TFSFileEntry *entry;
-    unsigned int directory_index;
+static int write_mapped_data(TFS *tfs, char *map_buf, unsigned int map_block_index, unsigned int entry, const char *buf, unsigned int offset, unsigned int size) {
+    char *scratch = get_scratch(tfs, 2);
+    int result = -1;
+
+    if (scratch) {
+        result = do_write_mapped_data(tfs, map_buf, map_block_index, entry, buf, offset, size, scratch, (TFSDedupEntry*)(scratch + tfs->block_size));
+        put_scratch(tfs, 2);
+    }
+    return result;
+}
+
+// Turns the compressed chunk in 'chunk_buf' back into plain blocks linked into
+// the chain in its place, so that they can be written to. Blocks that are all
+// zeros become holes. Unless the chunk is shared, its first block is written
+// over it, so the first block of a file never moves.
+static int do_expand_chunk(TFS *tfs, char *chunk_buf, unsigned int chunk_block_index, char *block_buf) {
+    int i, j, refs;
+    unsigned int blocks[TFS_CHUNK_BLOCKS];
+    unsigned int first_block_index = 0, last_block_index;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    TFSBlockHeader *chunk_header = (TFSBlockHeader*)chunk_buf;
+    TFSChunkHeader *chunk = (TFSChunkHeader*)&chunk_buf[sizeof(TFSBlockHeader)];
 
-    directory_index = tfsOpenPath(tfs, path);
-    if (directory_index < 0) {
+    if ((refs = get_block_refs(tfs, chunk_block_index)) < 0 || chunk->block_count > TFS_CHUNK_BLOCKS) {
         return -1;
     }
-    while (entry = tfsReadNextEntry()) {
-        int i;
-        for (i = 0; file_name[i]; i++) {
-            if (file_name[i] != entry->file_name[i]) {
+
+    for (i = 0; i < chunk->block_count; i++) {
+        if (i == 0 && refs == 0) {
+            blocks[i] = chunk_block_index;
+        } else if (chunk->lengths[i] == 0) {
+            blocks[i] = 0;
+        } else if ((blocks[i] = tfsClaimFreeBlock(tfs, chunk_block_index + i)) == 0) {
+            return -1;
+        }
+    }
+
+    last_block_index = chunk_header->previous_block;
+    for (i = 0; i < chunk->block_count; i++) {
+        if (blocks[i] == 0) {
+            continue;
+        }
+        header->node_id = chunk_header->node_id;
+        header->initial_block = chunk_header->initial_block;
+        header->previous_block = last_block_index;
+        header->next_block = chunk_header->next_block;
+        for (j = i + 1; j < chunk->block_count; j++) {
+            if (blocks[j] != 0) {
+                header->next_block = blocks[j];
                 break;
             }
         }
-        if (!file_name[i] && !entry->file_name[i]) {
-            // Remove the entry & dellocate all the file blocks
-            if (tfsUpdateEntry(entry->block_index, TFS_DELETED_FILE, 0) != 0 ||
-                tfsDeallocateBlocks(tfs, entry->block_index) != 0) {
-                return -1;
-            }
-            tfsWriteDirectory(tfs);
-            return 0;
+        header->logical_block = chunk_header->logical_block + i;
+        header->flags = 0;
+        for (j = 0; j < 2; j++) {
+            header->reserved[j] = 0;
+        }
+        if (read_chunk_data(tfs, chunk_buf, header->logical_block, &block_buf[sizeof(TFSBlockHeader)], 0, TFS_DATA_SIZE(tfs)) != 0 ||
+            tfs->write_fn(tfs, block_buf, blocks[i]) != 0) {
+            return -1;
         }
+        if (first_block_index == 0) {
+            first_block_index = blocks[i];
+        }
+        last_block_index = blocks[i];
     }
-    */
-    return -1;
+
+    // Point the neighbours at the new blocks
+    if (first_block_index == 0) {
+        first_block_index = chunk_header->next_block;
+    }
+    if (chunk_header->previous_block != 0 && first_block_index != chunk_block_index &&
+        set_block_link(tfs, chunk_header->previous_block, 1, first_block_index) != 0) {
+        return -1;
+    }
+    if (chunk_header->next_block != 0 && last_block_index != chunk_block_index &&
+        set_block_link(tfs, chunk_header->next_block, 0, last_block_index) != 0) {
+        return -1;
+    }
+
+    return (refs > 0) ? update_block_refs(tfs, &chunk_block_index, 1, -1) : 0;
 }
 
-void tfsSetBitmapBit(char *bitmap_buf, int block_index) {
-    int cur_bit_offset = 2048 * 8;
-    while (cur_bit_offset > 0) {
-        int byte_offset = (cur_bit_offset + block_index) >> 3;
-        int bit_mask = 1 << ((cur_bit_offset + block_index) & 0x7);
-        int alternate_bit_mask;
-        bitmap_buf[byte_offset] |= bit_mask;
-        switch (bit_mask) {
-        case 0x01: alternate_bit_mask = 0x02; break;
-        case 0x02: alternate_bit_mask = 0x01; break;
-        case 0x04: alternate_bit_mask = 0x08; break;
-        case 0x08: alternate_bit_mask = 0x04; break;
-        case 0x10: alternate_bit_mask = 0x20; break;
-        case 0x20: alternate_bit_mask = 0x10; break;
-        case 0x40: alternate_bit_mask = 0x80; break;
-        case 0x80: alternate_bit_mask = 0x40; break;
-        }
-        if ((bitmap_buf[byte_offset] & alternate_bit_mask) == 0) {
-            // The other branch of the binary tree is not full, so the parent
-            // is not full either. Break.
-            break;
-        }
+static int expand_chunk(TFS *tfs, char *chunk_buf, unsigned int chunk_block_index) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
 
-        cur_bit_offset >>= 1;
-        block_index >>= 1;
+    if (scratch) {
+        result = do_expand_chunk(tfs, chunk_buf, chunk_block_index, scratch);
+        put_scratch(tfs, 1);
     }
+    return result;
 }
 
-void tfsClearBitmapBit(char *bitmap_buf, int block_index) {
-    int cur_bit_offset = 2048 * 8;
-    while (cur_bit_offset > 0) {
-        int byte_offset = (cur_bit_offset + block_index) >> 3;
-        int bit_mask = 1 << ((cur_bit_offset + block_index) & 0x7);
-        int alternate_bit_mask;
+// Returns 1 if full-block writes to a file are deduplicated. Directories are
+// listed straight from their chain blocks, and the count file is written
+// while blocks are being shared, so neither ever is.
+static int dedup_file(TFS *tfs, FileHandle *handle) {
+    return tfs->header.dedup_writes && !(handle->mode & 0040000) && handle->block_index != tfs->header.refcount_block;
+}
 
-        if ((bitmap_buf[byte_offset] & bit_mask) == 0) {
-            // This bit is already clear; we can exit early
-            break;
+static int do_write_file(TFS *tfs, FileHandle *handle, const char *buf, unsigned int size, unsigned long long offset, char *block_buf) {
+    int i;
+    unsigned int cur_block_index, cur_logical, prev_block_index, prev_end, logical, block_offset, block_bytes, buf_offset;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+
+    if (!handle || handle->block_index == 0 || offset + size > TFS_MAX_FILE_SIZE(tfs)) {
+        return -1;
+    }
+
+    // The first block of a file always exists and always holds logical block
+    // 0, so start there
+    cur_block_index = handle->block_index;
+    cur_logical = 0;
+    prev_block_index = 0;
+    prev_end = 0;
+    if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+        return -1;
+    }
+
+    logical = split_offset(tfs, offset, &block_offset);
+    buf_offset = 0;
+    while (buf_offset < size) {
+        // Walk forward until we reach the block we want or pass where it
+        // would be
+        while (cur_logical + block_span(tfs, header) <= logical && header->next_block != 0) {
+            prev_block_index = cur_block_index;
+            prev_end = cur_logical + block_span(tfs, header);
+            cur_block_index = header->next_block;
+            if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+            cur_logical = header->logical_block;
+        }
+
+        if ((header->flags & TFS_BLOCK_COMPRESSED) && logical >= cur_logical && logical < cur_logical + block_span(tfs, header)) {
+            // Chunks can't be updated in place. Unpack this one and start
+            // again from the top, since it may have been the first block.
+            if (expand_chunk(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+            cur_block_index = handle->block_index;
+            cur_logical = 0;
+            prev_block_index = 0;
+            prev_end = 0;
+            if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (logical < cur_logical || logical >= cur_logical + block_span(tfs, header)) {
+            // We are writing into a hole (or past the last block), so a new
+            // block has to be linked into the chain here
+            unsigned int new_block_index, node_id = header->node_id, initial_block = header->initial_block;
+            unsigned int new_logical = logical, new_flags = 0;
+            if (dedup_file(tfs, handle)) {
+                // Make it a map if the hole has room for one, so that full
+                // blocks written here and nearby can be shared. Like the maps
+                // of a clone, it starts on a multiple of its span if it can.
+                unsigned int hole_start = (cur_logical < logical) ? cur_logical + block_span(tfs, header) : prev_end;
+                unsigned int map_logical = logical - logical % TFS_MAP_ENTRIES(tfs);
+                if (map_logical < hole_start) {
+                    map_logical = hole_start;
+                }
+                if (cur_logical < logical || map_logical + TFS_MAP_ENTRIES(tfs) <= cur_logical) {
+                    new_logical = map_logical;
+                    new_flags = TFS_BLOCK_MAP;
+                }
+            }
+            if (cur_logical < logical) {
+                // New last block in the chain, after the current block
+                new_block_index = tfsClaimFreeBlock(tfs, cur_block_index + (logical - cur_logical));
+                if (new_block_index == 0) {
+                    return -1;
+                }
+                header->next_block = new_block_index;
+                if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
+                    return -1;
+                }
+                prev_block_index = cur_block_index;
+                cur_block_index = 0;
+            } else {
+                // New block goes between the previous block and this one
+                new_block_index = tfsClaimFreeBlock(tfs, cur_block_index - (cur_logical - logical));
+                if (new_block_index == 0) {
+                    return -1;
+                }
+                header->previous_block = new_block_index;
+                if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0 ||
+                    set_block_link(tfs, prev_block_index, 1, new_block_index) != 0) {
+                    return -1;
+                }
+            }
+
+            header->node_id = node_id;
+            header->initial_block = initial_block;
+            header->previous_block = prev_block_index;
+            header->next_block = cur_block_index;
+            header->logical_block = new_logical;
+            header->flags = new_flags;
+            for (i = 0; i < 2; i++) {
+                header->reserved[i] = 0;
+            }
+            for (i = sizeof(TFSBlockHeader); i < tfs->block_size; i++) {
+                block_buf[i] = 0;
+            }
+            cur_block_index = new_block_index;
+            cur_logical = new_logical;
+            // Until a new map is written out, the block still holds whatever
+            // was in it before, which the dedup index may list
+            if (new_flags && tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+        }
+
+        block_bytes = (size - buf_offset > TFS_DATA_SIZE(tfs) - block_offset) ? TFS_DATA_SIZE(tfs) - block_offset : size - buf_offset;
+        if (header->flags & TFS_BLOCK_MAP) {
+            if (write_mapped_data(tfs, block_buf, cur_block_index, logical - cur_logical, buf + buf_offset, block_offset, block_bytes) != 0) {
+                return -1;
+            }
+        } else {
+            // Blocks of the count file are never shared, and checking would
+            // mean reading the count file while we are writing it
+            if (handle->block_index != tfs->header.refcount_block &&
+                unshare_block(tfs, block_buf, &cur_block_index) != 0) {
+                return -1;
+            }
+            for (i = 0; i < block_bytes; i++) {
+                block_buf[i + block_offset + sizeof(TFSBlockHeader)] = buf[i + buf_offset];
+            }
+            if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+        }
+
+        buf_offset += block_bytes;
+        block_offset = 0;
+        logical++;
+    }
+
+    // Did we expand the file past its original size?
+    if (offset + size > handle->current_size) {
+        set_file_size(tfs, handle, offset + size);
+    }
+
+    return size;
+}
+
+int tfsWriteFile(TFS *tfs, FileHandle *handle, const char *buf, unsigned int size, unsigned long long offset) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_write_file(tfs, handle, buf, size, offset, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+static int do_read_file(TFS *tfs, FileHandle *handle, char *buf, unsigned int size, unsigned long long offset, char *block_buf) {
+    int i;
+    unsigned int cur_block_index, cur_logical, logical, bytes_to_read, block_offset, block_bytes, buf_offset;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+
+    if (!handle || handle->block_index == 0) {
+        return -1;
+    }
+
+    if (offset > handle->current_size) {
+        // Can't start a read past the end of the file
+        return -1;
+    }
+
+    bytes_to_read = size;
+    if (bytes_to_read > handle->current_size - offset) {
+        bytes_to_read = handle->current_size - offset;
+    }
+
+    cur_block_index = handle->block_index;
+    cur_logical = 0;
+    if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+        return -1;
+    }
+
+    logical = split_offset(tfs, offset, &block_offset);
+    buf_offset = 0;
+    while (buf_offset < bytes_to_read) {
+        block_bytes = (bytes_to_read - buf_offset > TFS_DATA_SIZE(tfs) - block_offset) ? TFS_DATA_SIZE(tfs) - block_offset : bytes_to_read - buf_offset;
+
+        // Walk forward until we reach the block we want or pass where it
+        // would be. We never read a block until we need its data.
+        while (cur_logical + block_span(tfs, header) <= logical && header->next_block != 0) {
+            cur_block_index = header->next_block;
+            if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+            cur_logical = header->logical_block;
+        }
+
+        if (logical < cur_logical || logical >= cur_logical + block_span(tfs, header)) {
+            // No block here: this is a hole
+            for (i = 0; i < block_bytes; i++) {
+                buf[i + buf_offset] = 0;
+            }
+        } else if (header->flags & TFS_BLOCK_MAP) {
+            unsigned int *map = (unsigned int*)&block_buf[sizeof(TFSBlockHeader)];
+            if (read_mapped_data(tfs, map[logical - cur_logical], logical, buf + buf_offset, block_offset, block_bytes) < 0) {
+                return -1;
+            }
+        } else if (header->flags & TFS_BLOCK_COMPRESSED) {
+            if (read_chunk_data(tfs, block_buf, logical, buf + buf_offset, block_offset, block_bytes) != 0) {
+                return -1;
+            }
+        } else {
+            for (i = 0; i < block_bytes; i++) {
+                buf[i + buf_offset] = block_buf[i + block_offset + sizeof(TFSBlockHeader)];
+            }
+        }
+
+        buf_offset += block_bytes;
+        block_offset = 0;
+        logical++;
+    }
+
+    return bytes_to_read;
+}
+
+int tfsReadFile(TFS *tfs, FileHandle *handle, char *buf, unsigned int size, unsigned long long offset) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_read_file(tfs, handle, buf, size, offset, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+static int do_truncate_file(TFS *tfs, FileHandle *handle, unsigned long long size, char *block_buf) {
+    int i;
+    unsigned int cur_block_index, cur_logical, last_logical, keep_blocks, tail_block_index;
+    unsigned int end_logical, end_offset;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+
+    if (!handle || handle->block_index == 0 || size > TFS_MAX_FILE_SIZE(tfs)) {
+        return -1;
+    }
+
+    if (size >= handle->current_size) {
+        // Growing the file just leaves a hole at the end
+        return (size == handle->current_size) ? 0 : set_file_size(tfs, handle, size);
+    }
+
+    // Find the last block we are keeping. The first block is always kept,
+    // even when the file is truncated to nothing. The new end of file is
+    // 'end_offset' bytes into logical block 'end_logical'.
+    end_logical = split_offset(tfs, size, &end_offset);
+    last_logical = (end_offset == 0 && end_logical > 0) ? end_logical - 1 : end_logical;
+    keep_blocks = (end_offset == 0) ? end_logical : end_logical + 1;
+    cur_block_index = handle->block_index;
+    cur_logical = 0;
+    if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+        return -1;
+    }
+    tail_block_index = 0;
+    while (header->next_block != 0) {
+        unsigned int next_block = header->next_block;
+        if (tfs->read_fn(tfs, block_buf, next_block) != 0) {
+            return -1;
+        }
+        if (header->logical_block > last_logical) {
+            // Everything from here on goes away. Go back to the block
+            // before it so we can cut the chain there.
+            tail_block_index = next_block;
+            if (tfs->read_fn(tfs, block_buf, cur_block_index) != 0) {
+                return -1;
+            }
+            break;
+        }
+        cur_block_index = next_block;
+        cur_logical = header->logical_block;
+    }
+
+    if ((header->flags & TFS_BLOCK_COMPRESSED) && cur_logical + block_span(tfs, header) > end_logical) {
+        // The new end of file is inside this chunk. Unpack it so the cut can
+        // be made between plain blocks.
+        if (expand_chunk(tfs, block_buf, cur_block_index) != 0) {
+            return -1;
+        }
+        return tfsTruncateFile(tfs, handle, size);
+    }
+
+    // If the new end of file falls inside this block, zero the rest of it so
+    // that growing the file later reads back zeros rather than stale data
+    if (header->flags & TFS_BLOCK_MAP) {
+        unsigned int *map = (unsigned int*)&block_buf[sizeof(TFSBlockHeader)];
+        unsigned int entry = end_logical - cur_logical;
+        if (end_offset != 0 && entry < TFS_MAP_ENTRIES(tfs) && map[entry] != 0 &&
+            write_mapped_data(tfs, block_buf, cur_block_index, entry, NULL, end_offset, TFS_DATA_SIZE(tfs) - end_offset) != 0) {
+            return -1;
+        }
+        // A map can reach past the new end of file, so release those entries
+        entry = (keep_blocks > cur_logical) ? keep_blocks - cur_logical : 0;
+        if (entry < TFS_MAP_ENTRIES(tfs) && release_blocks(tfs, &map[entry], TFS_MAP_ENTRIES(tfs) - entry) != 0) {
+            return -1;
+        }
+    } else if (cur_logical == end_logical) {
+        if (unshare_block(tfs, block_buf, &cur_block_index) != 0) {
+            return -1;
+        }
+        for (i = end_offset + sizeof(TFSBlockHeader); i < tfs->block_size; i++) {
+            block_buf[i] = 0;
+        }
+    }
+    header->next_block = 0;
+    if (tfs->write_fn(tfs, block_buf, cur_block_index) != 0) {
+        return -1;
+    }
+
+    // Release the tail
+    if (tail_block_index != 0 && tfsDeallocateBlocks(tfs, tail_block_index) != 0) {
+        return -1;
+    }
+
+    return set_file_size(tfs, handle, size);
+}
+
+int tfsTruncateFile(TFS *tfs, FileHandle *handle, unsigned long long size) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_truncate_file(tfs, handle, size, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Writes out the clone's map block in 'map_buf' once the blocks it points at
+// have been given their extra reference. The first 'private_entries' entries
+// point at blocks that belong to the clone alone.
+static int write_clone_map(TFS *tfs, char *map_buf, unsigned int map_block_index, int private_entries) {
+    unsigned int *map = (unsigned int*)&map_buf[sizeof(TFSBlockHeader)];
+
+    if (update_block_refs(tfs, &map[private_entries], TFS_MAP_ENTRIES(tfs) - private_entries, 1) != 0) {
+        return -1;
+    }
+    return tfs->write_fn(tfs, map_buf, map_block_index);
+}
+
+// Builds maps pointing at every data block and chunk of the file whose chain
+// starts at 'source_block_index', giving each of them an extra reference. The
+// first map goes in 'map_block_index', with the header already in 'map_buf',
+// and the rest in blocks claimed as needed. Only the source chain's own
+// blocks are read, never the data behind a map.
+static int do_map_chain(TFS *tfs, unsigned int source_block_index, char *map_buf, unsigned int map_block_index, char *block_buf) {
+    int i, j, private_entries;
+    unsigned int block_index, shared_block_index, next_block, logical, span, map_logical;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    TFSBlockHeader *map_header = (TFSBlockHeader*)map_buf;
+    unsigned int *source_map = (unsigned int*)&block_buf[sizeof(TFSBlockHeader)];
+    unsigned int *map = (unsigned int*)&map_buf[sizeof(TFSBlockHeader)];
+
+    map_logical = 0;
+    private_entries = 0;
+    map_header->flags = TFS_BLOCK_MAP;
+    for (i = 0; i < TFS_MAP_ENTRIES(tfs); i++) {
+        map[i] = 0;
+    }
+
+    block_index = source_block_index;
+    while (block_index != 0) {
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+        next_block = header->next_block;
+        span = block_span(tfs, header);
+        shared_block_index = block_index;
+
+        if (block_index == source_block_index && !(header->flags & TFS_BLOCK_MAP)) {
+            // The first block of a file can't be shared, since it can never
+            // move, so the maps get their own copy of that one
+            shared_block_index = tfsClaimFreeBlock(tfs, map_block_index + 1);
+            header->previous_block = 0;
+            header->next_block = 0;
+            if (shared_block_index == 0 || tfs->write_fn(tfs, block_buf, shared_block_index) != 0) {
+                return -1;
+            }
+            private_entries = 1;
+        }
+
+        for (i = 0; i < span; i++) {
+            unsigned int data_block_index = (header->flags & TFS_BLOCK_MAP) ? source_map[i] : shared_block_index;
+            if (data_block_index == 0) {
+                continue;
+            }
+
+            logical = header->logical_block + i;
+            if (logical >= map_logical + TFS_MAP_ENTRIES(tfs)) {
+                // Move on to a new map block for this part of the file.
+                // Ranges with nothing in them don't get a map at all.
+                unsigned int new_block_index = tfsClaimFreeBlock(tfs, map_block_index + 1);
+                if (new_block_index == 0) {
+                    return -1;
+                }
+                map_header->next_block = new_block_index;
+                if (write_clone_map(tfs, map_buf, map_block_index, private_entries) != 0) {
+                    return -1;
+                }
+                map_header->previous_block = map_block_index;
+                map_header->next_block = 0;
+                map_logical = logical - logical % TFS_MAP_ENTRIES(tfs);
+                map_header->logical_block = map_logical;
+                for (j = 0; j < TFS_MAP_ENTRIES(tfs); j++) {
+                    map[j] = 0;
+                }
+                map_block_index = new_block_index;
+                private_entries = 0;
+            }
+
+            map[logical - map_logical] = data_block_index;
+        }
+
+        block_index = next_block;
+    }
+
+    return write_clone_map(tfs, map_buf, map_block_index, private_entries);
+}
+
+static int map_chain(TFS *tfs, unsigned int source_block_index, char *map_buf, unsigned int map_block_index) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_map_chain(tfs, source_block_index, map_buf, map_block_index, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+static FileHandle *do_clone_file(TFS *tfs, FileHandle *source, const char *path, const char *file_name, char *map_buf) {
+    FileHandle *clone;
+
+    if (!source || source->block_index == 0) {
+        return NULL;
+    }
+
+    if ((clone = tfsCreateFile(tfs, path, source->mode, file_name)) == NULL) {
+        return NULL;
+    }
+
+    // The first block of the clone becomes its first map block
+    if (tfs->read_fn(tfs, map_buf, clone->block_index) != 0 ||
+        map_chain(tfs, source->block_index, map_buf, clone->block_index) != 0 ||
+        set_file_size(tfs, clone, source->current_size) != 0) {
+        tfsCloseHandle(clone);
+        return NULL;
+    }
+
+    return clone;
+}
+
+FileHandle *tfsCloneFile(TFS *tfs, FileHandle *source, const char *path, const char *file_name) {
+    char *scratch = get_scratch(tfs, 1);
+    FileHandle *result = NULL;
+
+    if (scratch) {
+        result = do_clone_file(tfs, source, path, file_name, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Puts the chunk in 'chunk_buf' into the chain in place of the 'count'
+// consecutive blocks in 'blocks', reusing the first of them. Returns the
+// number of blocks freed, or -1 on error.
+static int write_chunk(TFS *tfs, char *chunk_buf, unsigned int *blocks, int count) {
+    TFSBlockHeader *header = (TFSBlockHeader*)chunk_buf;
+    TFSChunkHeader *chunk = (TFSChunkHeader*)&chunk_buf[sizeof(TFSBlockHeader)];
+
+    if (count < 2) {
+        // A chunk of one block saves nothing
+        return 0;
+    }
+
+    chunk->block_count = count;
+    if (tfs->write_fn(tfs, chunk_buf, blocks[0]) != 0 ||
+        (header->next_block != 0 && set_block_link(tfs, header->next_block, 0, blocks[0]) != 0) ||
+        release_blocks(tfs, &blocks[1], count - 1) != 0) {
+        return -1;
+    }
+    return count - 1;
+}
+
+// Compresses the data of the plain block in 'block_buf' into 'dest'. Returns
+// the compressed size (0 if the block is all zeros), or -1 if it doesn't fit.
+static int compress_block(TFS *tfs, char *block_buf, char *dest, int dest_size) {
+    int i;
+    char *data = &block_buf[sizeof(TFSBlockHeader)];
+
+    for (i = 0; i < TFS_DATA_SIZE(tfs) && data[i] == 0; i++) {}
+    if (i == TFS_DATA_SIZE(tfs)) {
+        return 0;
+    }
+    return tfsLZCompress(data, TFS_DATA_SIZE(tfs), dest, dest_size);
+}
+
+static int do_compress_file(TFS *tfs, FileHandle *handle, char *block_buf, char *chunk_buf) {
+    int i, length, refs, count = 0, saved = 0, freed;
+    unsigned int block_index, next_block, used = 0;
+    unsigned int blocks[TFS_CHUNK_BLOCKS];
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    TFSBlockHeader *chunk_header = (TFSBlockHeader*)chunk_buf;
+    TFSChunkHeader *chunk = (TFSChunkHeader*)&chunk_buf[sizeof(TFSBlockHeader)];
+    char *chunk_data = &chunk_buf[sizeof(TFSBlockHeader) + sizeof(TFSChunkHeader)];
+
+    // Directory records and reference counts are read straight from their
+    // blocks, so those have to stay plain
+    if (!handle || handle->block_index == 0 || (handle->mode & 0040000) ||
+        handle->block_index == tfs->header.refcount_block) {
+        return -1;
+    }
+
+    // Gather runs of consecutive plain blocks into chunks, as many as fit
+    block_index = handle->block_index;
+    while (block_index != 0) {
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+        next_block = header->next_block;
+
+        length = -1;
+        if (header->flags == 0) {
+            // Blocks shared with a clone have to stay as they are
+            if ((refs = get_block_refs(tfs, block_index)) < 0) {
+                return -1;
+            }
+            if (refs == 0) {
+                if (count == TFS_CHUNK_BLOCKS ||
+                    (count > 0 && header->logical_block != chunk_header->logical_block + count) ||
+                    (count > 0 && (length = compress_block(tfs, block_buf, &chunk_data[used], TFS_CHUNK_DATA_SIZE(tfs) - used)) < 0)) {
+                    // Doesn't belong in the current chunk, so finish it and
+                    // try starting a new one with this block
+                    if ((freed = write_chunk(tfs, chunk_buf, blocks, count)) < 0) {
+                        return -1;
+                    }
+                    saved += freed;
+                    count = 0;
+                }
+                if (count == 0) {
+                    for (i = 0; i < tfs->block_size; i++) {
+                        chunk_buf[i] = 0;
+                    }
+                    used = 0;
+                    length = compress_block(tfs, block_buf, chunk_data, TFS_CHUNK_DATA_SIZE(tfs));
+                }
+            }
+        }
+
+        if (length >= 0) {
+            if (count == 0) {
+                for (i = 0; i < sizeof(TFSBlockHeader); i++) {
+                    chunk_buf[i] = block_buf[i];
+                }
+                chunk_header->flags = TFS_BLOCK_COMPRESSED;
+            }
+            chunk_header->next_block = next_block;
+            chunk->lengths[count] = length;
+            blocks[count++] = block_index;
+            used += length;
+        } else {
+            // This block stays as it is, which ends the run
+            if ((freed = write_chunk(tfs, chunk_buf, blocks, count)) < 0) {
+                return -1;
+            }
+            saved += freed;
+            count = 0;
+        }
+
+        block_index = next_block;
+    }
+
+    if ((freed = write_chunk(tfs, chunk_buf, blocks, count)) < 0) {
+        return -1;
+    }
+    return saved + freed;
+}
+
+int tfsCompressFile(TFS *tfs, FileHandle *handle) {
+    char *scratch = get_scratch(tfs, 2);
+    int result = -1;
+
+    if (scratch) {
+        result = do_compress_file(tfs, handle, scratch, scratch + tfs->block_size);
+        put_scratch(tfs, 2);
+    }
+    return result;
+}
+
+int tfsDeleteFileAt(TFS *tfs, FileHandle *directory, const char *file_name) {
+    return delete_entry(tfs, directory, file_name, 0);
+}
+
+int tfsDeleteFile(TFS *tfs, char *path, char *file_name) {
+    FileHandle *dir;
+    int ret;
+
+    if ((dir = tfsOpenPath(tfs, path)) == NULL) {
+        return -1;
+    }
+    ret = delete_entry(tfs, dir, file_name, 0);
+    tfsCloseHandle(dir);
+    return ret;
+}
+
+void tfsSetBitmapBit(char *bitmap_buf, int block_index, int block_group_size) {
+    int cur_bit_offset = block_group_size;
+    while (cur_bit_offset > 0) {
+        int byte_offset = (cur_bit_offset + block_index) >> 3;
+        int bit_mask = 1 << ((cur_bit_offset + block_index) & 0x7);
+        int alternate_bit_mask;
+        bitmap_buf[byte_offset] |= bit_mask;
+        switch (bit_mask) {
+        case 0x01: alternate_bit_mask = 0x02; break;
+        case 0x02: alternate_bit_mask = 0x01; break;
+        case 0x04: alternate_bit_mask = 0x08; break;
+        case 0x08: alternate_bit_mask = 0x04; break;
+        case 0x10: alternate_bit_mask = 0x20; break;
+        case 0x20: alternate_bit_mask = 0x10; break;
+        case 0x40: alternate_bit_mask = 0x80; break;
+        case 0x80: alternate_bit_mask = 0x40; break;
+        }
+        if ((bitmap_buf[byte_offset] & alternate_bit_mask) == 0) {
+            // The other branch of the binary tree is not full, so the parent
+            // is not full either. Break.
+            break;
+        }
+
+        cur_bit_offset >>= 1;
+        block_index >>= 1;
+    }
+}
+
+void tfsClearBitmapBit(char *bitmap_buf, int block_index, int block_group_size) {
+    int cur_bit_offset = block_group_size;
+    while (cur_bit_offset > 0) {
+        int byte_offset = (cur_bit_offset + block_index) >> 3;
+        int bit_mask = 1 << ((cur_bit_offset + block_index) & 0x7);
+        int alternate_bit_mask;
+
+        if ((bitmap_buf[byte_offset] & bit_mask) == 0) {
+            // This bit is already clear; we can exit early
+            break;
         }
         bitmap_buf[byte_offset] &= ~bit_mask;
         switch (bit_mask) {
@@ -735,216 +2095,858 @@ void tfsClearBitmapBit(char *bitmap_buf, int block_index) {
         case 0x40: alternate_bit_mask = 0x80; break;
         case 0x80: alternate_bit_mask = 0x40; break;
         }
-
-        cur_bit_offset >>= 1;
-        block_index >>= 1;
+
+        cur_bit_offset >>= 1;
+        block_index >>= 1;
+    }
+}
+
+int tfsCheckBitmapBit(char *bitmap_buf, int block_num, int block_group_size) {
+    int byte_offset = (block_group_size >> 3) + (block_num >> 3);
+    int bit_mask = 1 << (block_num & 0x7);
+    return (bitmap_buf[byte_offset] & bit_mask) ? 1 : 0;
+}
+
+// Block holding the bitmap of a block group
+static unsigned int bitmap_block(TFS *tfs, unsigned int block_group_num) {
+    return 1 + block_group_num * tfs->header.block_group_size;
+}
+
+// Reads the bitmap of a block group. A filesystem made on a zeroed device
+// only gets a bitmap written for a group once something is allocated there,
+// and until then it reads back as all zeros. The only block in use in such a
+// group is the bitmap block itself, so its bit is set here rather than
+// trusted to be on disk.
+static int read_bitmap(TFS *tfs, char *bitmap_buf, unsigned int block_group_num) {
+    if (tfs->read_fn(tfs, bitmap_buf, bitmap_block(tfs, block_group_num)) != 0) {
+        return -1;
+    }
+    tfsSetBitmapBit(bitmap_buf, 0, tfs->header.block_group_size);
+    return 0;
+}
+
+// Returns 1 if the root of a group's bitmap tree says every block is in use
+static int bitmap_full(char *bitmap_buf) {
+    return (bitmap_buf[0] & 0x02) ? 1 : 0;
+}
+
+static int do_attempt_to_allocate_block(TFS *tfs, unsigned int block_index, char *block_bitmap) {
+    unsigned int block_group_num = (block_index - 1) / tfs->header.block_group_size;
+    unsigned int block_num = (block_index - 1) % tfs->header.block_group_size;
+
+    if (read_bitmap(tfs, block_bitmap, block_group_num) != 0) {
+        return -1;
+    }
+
+    if (tfsCheckBitmapBit(block_bitmap, block_num, tfs->header.block_group_size) == 1) {
+        return -1;
+    }
+
+    tfsSetBitmapBit(block_bitmap, block_num, tfs->header.block_group_size);
+    if (tfs->write_fn(tfs, block_bitmap, bitmap_block(tfs, block_group_num)) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int tfsAttemptToAllocateBlock(TFS *tfs, unsigned int block_index) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_attempt_to_allocate_block(tfs, block_index, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// 'levels' is the depth of the tree, log2 of the number of blocks per group
+int find_empty_block_recursive(char *block_bitmap, int levels, int level, int idx, int *seed, int stride, int modulo, int block_group_size) {
+    int ret;
+    int bit_index = (1 << (levels - level)) + idx;
+    int byte_index = bit_index >> 3;
+    int bit_mask = 1 << (bit_index & 0x7);
+
+    // Check for out-of-bounds first
+    if ((idx << level) >= block_group_size) {
+        // Block is past the end of the filesystem
+        return -1;
+    }
+
+    // Check the "subtree full" bit at this level
+    if ((block_bitmap[byte_index] & bit_mask) != 0) {
+        // This subtree is full.
+        return -1;
+    }
+
+    if (level == 0) {
+        // We are at the block level, so we must have an available block
+        return idx;
+    }
+
+    // Flip a coin to determine whether to go left or right first
+    if ((*seed) % modulo < (modulo >> 1)) {
+        *seed += stride;
+        ret = find_empty_block_recursive(block_bitmap, levels, level - 1, (idx << 1) + 0, seed, stride, modulo, block_group_size);
+        if (ret >= 0) {
+            return ret;
+        }
+        ret = find_empty_block_recursive(block_bitmap, levels, level - 1, (idx << 1) + 1, seed, stride, modulo, block_group_size);
+        if (ret >= 0) {
+            return ret;
+        }
+    } else {
+        *seed += stride;
+        ret = find_empty_block_recursive(block_bitmap, levels, level - 1, (idx << 1) + 1, seed, stride, modulo, block_group_size);
+        if (ret >= 0) {
+            return ret;
+        }
+        ret = find_empty_block_recursive(block_bitmap, levels, level - 1, (idx << 1) + 0, seed, stride, modulo, block_group_size);
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+
+    // Didn't find one in either subtree. This can happen legitimately if the
+    // right subtree extends beyond the end of the filesystem
+    return -1;
+}
+
+// Returns a free block, or 0 if there are none. The search starts in the
+// group the last block came from, so it only has to read the bitmaps of
+// other groups when that one fills up.
+static unsigned int do_find_empty_block(TFS *tfs, char *block_bitmap) {
+    unsigned int i;
+    unsigned int num_block_groups = (tfs->header.total_blocks - 2) / tfs->header.block_group_size + 1;
+    unsigned int first_group = tfs->header.alloc_group % num_block_groups;
+    int seed = tfs->header.seed;
+    int stride = gPrimeNumberTable[tfs->header.stride_offset];
+    int modulo = 1291; // TODO: Random modulo?
+    unsigned int found_block = 0;
+    int levels = 0;
+
+    while ((1 << levels) < tfs->header.block_group_size) {
+        levels++;
+    }
+    for (i = 0; i < num_block_groups; i++) {
+        // Look for free blocks in each group in turn, starting from the
+        // group we last allocated from
+        unsigned int block_group_num = (first_group + i) % num_block_groups;
+        // The last block group may have fewer blocks than the rest, so we
+        // shouldn't return blocks past the end of the filesystem
+        unsigned int block_group_size = tfs->header.total_blocks - bitmap_block(tfs, block_group_num);
+        int block_num;
+
+        if (block_group_size > tfs->header.block_group_size) {
+            block_group_size = tfs->header.block_group_size;
+        }
+
+        // Load the block bitmap for the block group
+        if (read_bitmap(tfs, block_bitmap, block_group_num) != 0) {
+            break;
+        }
+        if (bitmap_full(block_bitmap)) {
+            continue;
+        }
+
+        block_num = find_empty_block_recursive(block_bitmap, levels, levels, 0, &seed, stride, modulo, block_group_size);
+        if (block_num >= 0) {
+            // We found a block, return it
+            found_block = bitmap_block(tfs, block_group_num) + block_num;
+            tfs->header.alloc_group = block_group_num;
+            break;
+        }
+        
+        seed += stride;
+    }
+
+    // Update our seed & stride offset
+    tfs->header.seed = seed;
+    tfs->header.stride_offset = (tfs->header.stride_offset + 1) % 60;
+    tfsWriteFilesystemHeader(tfs);
+
+    return found_block;
+}
+
+unsigned int tfsFindEmptyBlock(TFS *tfs) {
+    char *scratch = get_scratch(tfs, 1);
+    unsigned int result = 0;
+
+    if (scratch) {
+        result = do_find_empty_block(tfs, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+unsigned int tfsClaimFreeBlock(TFS *tfs, unsigned int desired_block_index) {
+    unsigned int block_index;
+
+    // Blocks 0 and 1 are the header and the first bitmap, and anything past
+    // total_blocks doesn't exist
+    if (desired_block_index >= 2 && desired_block_index < tfs->header.total_blocks &&
+        tfsAttemptToAllocateBlock(tfs, desired_block_index) == 0) {
+        return desired_block_index;
+    }
+
+    block_index = tfsFindEmptyBlock(tfs);
+    if (block_index == 0) {
+        return 0;
+    }
+    if (tfsAttemptToAllocateBlock(tfs, block_index) != 0) {
+        return 0;
+    }
+    return block_index;
+}
+
+static unsigned int do_allocate_block(TFS *tfs, unsigned int desired_block_index, unsigned int node_id, unsigned int initial_block, unsigned int previous_block, char *block_buf) {
+    int i;
+    TFSBlockHeader header;
+    unsigned int block_index = tfsClaimFreeBlock(tfs, desired_block_index);
+    if (block_index == 0) {
+        return 0;
+    }
+
+    header.node_id = node_id;
+    header.initial_block = (initial_block == 0) ? block_index : initial_block;
+    header.previous_block = previous_block;
+    header.next_block = 0;
+    header.logical_block = 0;
+    header.flags = 0;
+    for (i = 0; i < 2; i++) {
+        header.reserved[i] = 0;
+    }
+
+    for (i = 0; i < sizeof(TFSBlockHeader); i++) {
+        block_buf[i] = ((char *)&header)[i];
+    }
+    for (i = sizeof(TFSBlockHeader); i < tfs->block_size; i++) {
+        block_buf[i] = 0;
+    }
+
+    if (tfs->write_fn(tfs, block_buf, block_index) != 0) {
+        return 0;
+    }
+
+    return block_index;
+}
+
+unsigned int tfsAllocateBlock(TFS *tfs, unsigned int desired_block_index, unsigned int node_id, unsigned int initial_block, unsigned int previous_block) {
+    char *scratch = get_scratch(tfs, 1);
+    unsigned int result = 0;
+
+    if (scratch) {
+        result = do_allocate_block(tfs, desired_block_index, node_id, initial_block, previous_block, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+static int do_write_block_data(TFS *tfs, char *data, unsigned int block_index, char *block_buf) {
+    int i;
+
+    if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+        return -1;
+    }
+
+    for (i = sizeof(TFSBlockHeader); i < tfs->block_size; i++) {
+        block_buf[i] = data[i - sizeof(TFSBlockHeader)];
+    }
+
+    if (tfs->write_fn(tfs, block_buf, block_index) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int tfsWriteBlockData(TFS *tfs, char *data, unsigned int block_index) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_write_block_data(tfs, data, block_index, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Clears the bitmap bits for a batch of blocks, reading and writing each
+// block group's bitmap once no matter how many of the blocks are in it.
+// Entries in 'blocks' are zeroed as they are handled.
+static int do_free_block_batch(TFS *tfs, unsigned int *blocks, int count, char *block_bitmap) {
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        unsigned int block_group_num;
+        if (blocks[i] == 0) {
+            continue;
+        }
+        block_group_num = (blocks[i] - 1) / tfs->header.block_group_size;
+        if (read_bitmap(tfs, block_bitmap, block_group_num) != 0) {
+            return -1;
+        }
+        for (j = i; j < count; j++) {
+            if (blocks[j] != 0 && (blocks[j] - 1) / tfs->header.block_group_size == block_group_num) {
+                tfsClearBitmapBit(block_bitmap, (blocks[j] - 1) % tfs->header.block_group_size, tfs->header.block_group_size);
+                blocks[j] = 0;
+            }
+        }
+        if (tfs->write_fn(tfs, block_bitmap, bitmap_block(tfs, block_group_num)) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int free_block_batch(TFS *tfs, unsigned int *blocks, int count) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_free_block_batch(tfs, blocks, count, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+#define TFS_FREE_BATCH_SIZE 256
+
+static int do_deallocate_blocks(TFS *tfs, unsigned int block_index, char *block_buf) {
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    unsigned int batch[TFS_FREE_BATCH_SIZE];
+    int count = 0;
+
+    while (block_index != 0) {
+        // We have to read each block anyway to find the next one
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+        if ((header->flags & TFS_BLOCK_MAP) &&
+            release_blocks(tfs, (unsigned int*)&block_buf[sizeof(TFSBlockHeader)], TFS_MAP_ENTRIES(tfs)) != 0) {
+            return -1;
+        }
+        batch[count++] = block_index;
+        if (count == TFS_FREE_BATCH_SIZE) {
+            if (release_blocks(tfs, batch, count) != 0) {
+                return -1;
+            }
+            count = 0;
+        }
+        block_index = header->next_block;
+    }
+
+    return release_blocks(tfs, batch, count);
+}
+
+int tfsDeallocateBlocks(TFS *tfs, unsigned int block_index) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_deallocate_blocks(tfs, block_index, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Looks for 'count' free blocks in a row, starting at 'preferred' if that is
+// free and otherwise scanning on from there, round to the start of the
+// filesystem. Returns the first block of the run, or 0 if there isn't one.
+// Every block group starts with its bitmap, so runs never cross groups, and
+// full groups are skipped without looking at their blocks.
+static unsigned int do_find_free_run(TFS *tfs, unsigned int preferred, unsigned int count, char *block_bitmap) {
+    unsigned int block, scanned, group, group_end, loaded_group = 0xFFFFFFFF;
+    unsigned int run_start = 0, run_length = 0;
+
+    if (preferred < 2 || preferred >= tfs->header.total_blocks) {
+        preferred = 2;
+    }
+    block = preferred;
+    for (scanned = 0; scanned < tfs->header.total_blocks; scanned++, block++) {
+        if (block >= tfs->header.total_blocks) {
+            // A run can't wrap round the end
+            block = 2;
+            run_length = 0;
+        }
+        group = (block - 1) / tfs->header.block_group_size;
+        if (group != loaded_group) {
+            if (read_bitmap(tfs, block_bitmap, group) != 0) {
+                return 0;
+            }
+            loaded_group = group;
+            if (bitmap_full(block_bitmap)) {
+                // Carry on from the last block of the group
+                group_end = tfs->header.total_blocks - 1 - bitmap_block(tfs, group);
+                group_end = bitmap_block(tfs, group) + ((group_end < tfs->header.block_group_size - 1) ? group_end : tfs->header.block_group_size - 1);
+                scanned += group_end - block;
+                block = group_end;
+                run_length = 0;
+                continue;
+            }
+        }
+        if (tfsCheckBitmapBit(block_bitmap, (block - 1) % tfs->header.block_group_size, tfs->header.block_group_size)) {
+            run_length = 0;
+            continue;
+        }
+        if (run_length == 0) {
+            run_start = block;
+        }
+        if (++run_length == count) {
+            return run_start;
+        }
+    }
+    return 0;
+}
+
+static unsigned int find_free_run(TFS *tfs, unsigned int preferred, unsigned int count) {
+    char *scratch = get_scratch(tfs, 1);
+    unsigned int result = 0;
+
+    if (scratch) {
+        result = do_find_free_run(tfs, preferred, count, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+// Marks a run found by find_free_run as used
+static int do_claim_run(TFS *tfs, unsigned int start, unsigned int count, char *block_bitmap) {
+    unsigned int i, block_group_num = (start - 1) / tfs->header.block_group_size;
+
+    if (read_bitmap(tfs, block_bitmap, block_group_num) != 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        tfsSetBitmapBit(block_bitmap, (start + i - 1) % tfs->header.block_group_size, tfs->header.block_group_size);
+    }
+    return tfs->write_fn(tfs, block_bitmap, bitmap_block(tfs, block_group_num));
+}
+
+static int claim_run(TFS *tfs, unsigned int start, unsigned int count) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_claim_run(tfs, start, count, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
+}
+
+static int do_count_fragments(TFS *tfs, FileHandle *handle, unsigned int *num_blocks, char *block_buf) {
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    unsigned int block_index, prev = 0;
+    int fragments = 0;
+
+    *num_blocks = 0;
+    if (!handle || handle->block_index == 0) {
+        return -1;
+    }
+    for (block_index = handle->block_index; block_index != 0; block_index = header->next_block) {
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+        if (block_index != prev + 1) {
+            fragments++;
+        }
+        prev = block_index;
+        (*num_blocks)++;
     }
+    return fragments;
 }
 
-int tfsCheckBitmapBit(char *bitmap_buf, int block_num) {
-    int byte_offset = 2048 + (block_num >> 3);
-    int bit_mask = 1 << (block_num & 0x7);
-    return (bitmap_buf[byte_offset] & bit_mask) ? 1 : 0;
+int tfsCountFragments(TFS *tfs, FileHandle *handle, unsigned int *num_blocks) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_count_fragments(tfs, handle, num_blocks, scratch);
+        put_scratch(tfs, 1);
+    }
+    return result;
 }
 
-int tfsAttemptToAllocateBlock(TFS *tfs, int block_index) {
-    char block_bitmap[TFS_BLOCK_SIZE];
-    int block_group_num = (block_index - 1) / TFS_BLOCK_GROUP_SIZE;
-    int block_num = (block_index - 1) % TFS_BLOCK_GROUP_SIZE;
+static int do_defragment_file(TFS *tfs, FileHandle *handle, char *block_buf) {
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    unsigned int batch[TFS_FREE_BATCH_SIZE];
+    unsigned int first_block, old_next, block_index, next_block, run;
+    unsigned int num_blocks, i;
+    int fragments, refs, count = 0;
 
-    if (tfs->read_fn(tfs, block_bitmap, 1 + block_group_num * TFS_BLOCK_GROUP_SIZE) != 0) {
+    if ((fragments = tfsCountFragments(tfs, handle, &num_blocks)) < 0) {
         return -1;
     }
+    if (fragments <= 1) {
+        return 0;
+    }
 
-    if (tfsCheckBitmapBit(block_bitmap, block_num) == 1) {
-        return -1;
+    // The first block stays where it is, since it is what identifies the
+    // file. Find room for the rest, ideally right after it. If they can only
+    // go somewhere else, that's two fragments, which only helps if there are
+    // more than that now.
+    first_block = handle->block_index;
+    run = find_free_run(tfs, first_block + 1, num_blocks - 1);
+    if (run == 0 || (run != first_block + 1 && fragments <= 2)) {
+        return 0;
     }
 
-    tfsSetBitmapBit(block_bitmap, block_num);
-    if (tfs->write_fn(tfs, block_bitmap, 1 + block_group_num * TFS_BLOCK_GROUP_SIZE) != 0) {
+    if (tfs->read_fn(tfs, block_buf, first_block) != 0) {
         return -1;
     }
+    old_next = header->next_block;
 
-    return 0;
-}
+    // Blocks shared with a clone would have to be copied rather than moved,
+    // so leave those files alone
+    for (block_index = old_next; block_index != 0; block_index = header->next_block) {
+        if ((refs = get_block_refs(tfs, block_index)) != 0) {
+            return (refs < 0) ? -1 : 0;
+        }
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+    }
 
-int find_empty_block_recursive(char *block_bitmap, int level, int idx, int *seed, int stride, int modulo, int block_group_size) {
-    int ret;
-    int bit_index = (1 << (14 - level)) + idx;
-    int byte_index = bit_index >> 3;
-    int bit_mask = 1 << (bit_index & 0x7);
+    // Copy the chain into the run. Nothing points at the copies yet, so if
+    // we stop here the file is untouched and the run is merely lost.
+    if (claim_run(tfs, run, num_blocks - 1) != 0) {
+        return -1;
+    }
+    for (i = 0, block_index = old_next; block_index != 0; i++, block_index = next_block) {
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+        next_block = header->next_block;
+        header->previous_block = (i == 0) ? first_block : run + i - 1;
+        header->next_block = (next_block == 0) ? 0 : run + i + 1;
+        if (tfs->write_fn(tfs, block_buf, run + i) != 0) {
+            return -1;
+        }
+    }
 
-    // Check for out-of-bounds first
-    if ((idx << level) >= block_group_size) {
-        // Block is past the end of the filesystem
+    // Switch the file over. Only the header changes, and it is in the first
+    // sector of the block, so even a torn write leaves one chain or the other.
+    if (set_block_link(tfs, first_block, 1, run) != 0) {
         return -1;
     }
 
-    // Check the "subtree full" bit at this level
-    if ((block_bitmap[byte_index] & bit_mask) != 0) {
-        // This subtree is full.
+    // The old chain is unreachable now, but still intact, so walk it to free it
+    for (block_index = old_next; block_index != 0; block_index = header->next_block) {
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
+        }
+        batch[count++] = block_index;
+        if (count == TFS_FREE_BATCH_SIZE) {
+            if (free_block_batch(tfs, batch, count) != 0) {
+                return -1;
+            }
+            count = 0;
+        }
+    }
+    if (free_block_batch(tfs, batch, count) != 0) {
         return -1;
     }
+    return num_blocks - 1;
+}
 
-    if (level == 0) {
-        // We are at the block level, so we must have an available block
-        return idx;
+int tfsDefragmentFile(TFS *tfs, FileHandle *handle) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
+
+    if (scratch) {
+        result = do_defragment_file(tfs, handle, scratch);
+        put_scratch(tfs, 1);
     }
+    return result;
+}
 
-    // Flip a coin to determine whether to go left or right first
-    if ((*seed) % modulo < (modulo >> 1)) {
-        *seed += stride;
-        ret = find_empty_block_recursive(block_bitmap, level - 1, (idx << 1) + 0, seed, stride, modulo, block_group_size);
-        if (ret >= 0) {
-            return ret;
+static int do_enable_dedup(TFS *tfs, int online, char *block_buf) {
+    unsigned int i, buckets, start = 0;
+
+    if (tfs->header.dedup_block == 0) {
+        // Room to list every data block, up to the limit. The buckets are
+        // found by adding to the first one, so they have to be in a single
+        // run; settle for fewer if there isn't one that long.
+        buckets = tfs->header.data_blocks / (tfs->block_size / sizeof(TFSDedupEntry)) + 1;
+        if (buckets > TFS_DEDUP_MAX_BUCKETS) {
+            buckets = TFS_DEDUP_MAX_BUCKETS;
         }
-        ret = find_empty_block_recursive(block_bitmap, level - 1, (idx << 1) + 1, seed, stride, modulo, block_group_size);
-        if (ret >= 0) {
-            return ret;
+        while (buckets > 0 && (start = find_free_run(tfs, 2, buckets)) == 0) {
+            buckets /= 2;
         }
-    } else {
-        *seed += stride;
-        ret = find_empty_block_recursive(block_bitmap, level - 1, (idx << 1) + 1, seed, stride, modulo, block_group_size);
-        if (ret >= 0) {
-            return ret;
+        if (start == 0 || claim_run(tfs, start, buckets) != 0) {
+            return -1;
         }
-        ret = find_empty_block_recursive(block_bitmap, level - 1, (idx << 1) + 0, seed, stride, modulo, block_group_size);
-        if (ret >= 0) {
-            return ret;
+        for (i = 0; i < tfs->block_size; i++) {
+            block_buf[i] = 0;
+        }
+        for (i = 0; i < buckets; i++) {
+            if (tfs->write_fn(tfs, block_buf, start + i) != 0) {
+                return -1;
+            }
         }
+        tfs->header.dedup_block = start;
+        tfs->header.dedup_buckets = buckets;
     }
 
-    // Didn't find one in either subtree. This can happen legitimately if the
-    // right subtree extends beyond the end of the filesystem
-    return -1;
+    tfs->header.dedup_writes = online ? 1 : 0;
+    return tfsWriteFilesystemHeader(tfs);
 }
 
-int tfsFindEmptyBlock(TFS *tfs) {
-    int i;
-    char block_bitmap[TFS_BLOCK_SIZE];
-    int num_block_groups = (tfs->header.total_blocks + (TFS_BLOCK_GROUP_SIZE - 1)) / TFS_BLOCK_GROUP_SIZE;
-    int seed = tfs->header.seed;
-    int stride = gPrimeNumberTable[tfs->header.stride_offset];
-    int modulo = 1291; // TODO: Random modulo?
-    int found_block = -1;
-    for (i = 0; i < num_block_groups; i++) {
-        // Look for free blocks in group (seed % num_block_groups)
-        int block_group_num = seed % num_block_groups;
-        // The last block group may have fewer blocks than the rest, so we
-        // shouldn't return blocks past the end of the filesystem
-        int block_group_size = (i == (num_block_groups - 1)) ?
-            (tfs->header.total_blocks - 1) % TFS_BLOCK_GROUP_SIZE : TFS_BLOCK_GROUP_SIZE;
-        int block_num;
-
-        // Load the block bitmap for the block group
-        if (tfs->read_fn(tfs, block_bitmap, 1 + block_group_num * TFS_BLOCK_GROUP_SIZE) != 0) {
-            break;
-        }
+int tfsEnableDedup(TFS *tfs, int online) {
+    char *scratch = get_scratch(tfs, 1);
+    int result = -1;
 
-        block_num = find_empty_block_recursive(block_bitmap, 14, 0, &seed, stride, modulo, block_group_size);
-        if (block_num >= 0) {
-            // We found a block, return it
-            found_block = 1 + (block_group_num * TFS_BLOCK_GROUP_SIZE) + block_num;
-            break;
-        }
-        
-        seed += stride;
+    if (scratch) {
+        result = do_enable_dedup(tfs, online, scratch);
+        put_scratch(tfs, 1);
     }
-
-    // Update our seed & stride offset
-    tfs->header.seed = seed;
-    tfs->header.stride_offset = (tfs->header.stride_offset + 1) % 60;
-    tfsWriteFilesystemHeader(tfs);
-
-    return found_block;
+    return result;
 }
 
-int tfsAllocateBlock(TFS *tfs, int desired_block_index, unsigned int node_id, unsigned int initial_block, unsigned int previous_block) {
-    int i;
-    TFSBlockHeader header;
-    char block_buf[TFS_BLOCK_SIZE];
-    int block_index = 0;
-    if (tfsAttemptToAllocateBlock(tfs, desired_block_index) == 0) {
-        block_index = desired_block_index;
-    }
+// Works out what rebuilding a file's chain as maps would save: plain blocks
+// that are all zeros, or have a copy elsewhere. Plain blocks without a copy
+// are listed in the index along the way, apart from the first block, which
+// can't be shared. 'cost' is set to the number of blocks the rebuild would
+// add: maps beyond the one in the first block, less the maps there already,
+// plus a copy of the first block's data. Returns the number of blocks saved,
+// or -1 on error.
+static int do_dedup_savings(TFS *tfs, FileHandle *handle, int *cost, char *block_buf, TFSDedupEntry *bucket) {
+    int saved = 0, first_copy = 0;
+    unsigned int i, block_index, range, last_range = 0, maps = 1, old_maps = 0, plain_blocks = 0, hash, match;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    unsigned int *map = (unsigned int*)&block_buf[sizeof(TFSBlockHeader)];
 
-    if (block_index == 0) {
-        block_index = tfsFindEmptyBlock(tfs);
-        if (block_index < 0) {
-            return 0;
+    *cost = 0;
+    for (block_index = handle->block_index; block_index != 0; block_index = header->next_block) {
+        if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+            return -1;
         }
-        if (tfsAttemptToAllocateBlock(tfs, block_index) != 0) {
-            return 0;
+
+        // Count the map ranges the file has anything in, the way map_chain
+        // lays them out
+        for (i = 0; i < block_span(tfs, header); i++) {
+            if ((header->flags & TFS_BLOCK_MAP) && map[i] == 0) {
+                continue;
+            }
+            range = (header->logical_block + i) / TFS_MAP_ENTRIES(tfs);
+            if (range != last_range) {
+                maps++;
+                last_range = range;
+            }
         }
-    }
 
-    header.node_id = node_id;
-    header.initial_block = (initial_block == 0) ? block_index : initial_block;
-    header.previous_block = previous_block;
-    header.next_block = 0;
+        if (header->flags & TFS_BLOCK_MAP) {
+            if (block_index != handle->block_index) {
+                old_maps++;
+            }
+            continue;
+        }
+        if (block_index == handle->block_index) {
+            first_copy = 1;
+        }
+        if (header->flags != 0) {
+            continue;
+        }
+        plain_blocks++;
 
-    for (i = 0; i < sizeof(TFSBlockHeader); i++) {
-        block_buf[i] = ((char *)&header)[i];
-    }
-    for (i = sizeof(TFSBlockHeader); i < TFS_BLOCK_SIZE; i++) {
-        block_buf[i] = 0;
+        if (all_zeros(&block_buf[sizeof(TFSBlockHeader)], TFS_DATA_SIZE(tfs))) {
+            saved++;
+            continue;
+        }
+        if (find_duplicate(tfs, &block_buf[sizeof(TFSBlockHeader)], block_index, bucket, &hash, &match) != 0) {
+            return -1;
+        }
+        if (match != 0) {
+            saved++;
+        } else if (block_index != handle->block_index && remember_block(tfs, bucket, hash, block_index) != 0) {
+            return -1;
+        }
     }
 
-    if (tfs->write_fn(tfs, block_buf, block_index) != 0) {
-        return 0;
+    if (plain_blocks > 0) {
+        *cost = (int)(maps - 1) - (int)old_maps + first_copy;
     }
+    return saved;
+}
 
-    return block_index;
+static int dedup_savings(TFS *tfs, FileHandle *handle, int *cost) {
+    char *scratch = get_scratch(tfs, 2);
+    int result = -1;
+
+    if (scratch) {
+        result = do_dedup_savings(tfs, handle, cost, scratch, (TFSDedupEntry*)(scratch + tfs->block_size));
+        put_scratch(tfs, 2);
+    }
+    return result;
 }
 
-int tfsWriteBlockData(TFS *tfs, char *data, int block_index) {
+// Rebuilds the chain of a file as maps pointing at the blocks it has now.
+// The maps are built with a spare block standing in for the first one, then
+// copied over it in a single write, so a crash before then leaks the new
+// blocks but leaves the file as it was.
+static int do_convert_to_maps(TFS *tfs, FileHandle *handle, char *block_buf, char *map_buf) {
     int i;
-    char block_buf[TFS_BLOCK_SIZE];
+    unsigned int spare, old_next;
+    TFSBlockHeader *header = (TFSBlockHeader*)block_buf;
+    TFSBlockHeader *map_header = (TFSBlockHeader*)map_buf;
 
-    if (tfs->read_fn(tfs, block_buf, block_index) != 0) {
+    if (tfs->read_fn(tfs, block_buf, handle->block_index) != 0) {
         return -1;
     }
+    old_next = header->next_block;
+    for (i = 0; i < sizeof(TFSBlockHeader); i++) {
+        map_buf[i] = block_buf[i];
+    }
+    map_header->next_block = 0;
 
-    for (i = sizeof(TFSBlockHeader); i < TFS_BLOCK_SIZE; i++) {
-        block_buf[i] = data[i - sizeof(TFSBlockHeader)];
+    if ((spare = tfsClaimFreeBlock(tfs, handle->block_index + 1)) == 0 ||
+        map_chain(tfs, handle->block_index, map_buf, spare) != 0 ||
+        tfs->read_fn(tfs, map_buf, spare) != 0) {
+        return -1;
+    }
+    if (map_header->next_block != 0 && set_block_link(tfs, map_header->next_block, 0, handle->block_index) != 0) {
+        return -1;
+    }
+    if (tfs->write_fn(tfs, map_buf, handle->block_index) != 0 ||
+        free_block_batch(tfs, &spare, 1) != 0) {
+        return -1;
     }
 
-    if (tfs->write_fn(tfs, block_buf, block_index) != 0) {
+    // The new maps hold their own references to everything, so drop the
+    // old chain's: those of the old first block if it was a map, then the
+    // rest of the chain, which is unreachable now
+    if ((header->flags & TFS_BLOCK_MAP) &&
+        release_blocks(tfs, (unsigned int*)&block_buf[sizeof(TFSBlockHeader)], TFS_MAP_ENTRIES(tfs)) != 0) {
         return -1;
     }
+    return (old_next != 0) ? tfsDeallocateBlocks(tfs, old_next) : 0;
+}
 
-    return 0;
+static int convert_to_maps(TFS *tfs, FileHandle *handle) {
+    char *scratch = get_scratch(tfs, 2);
+    int result = -1;
+
+    if (scratch) {
+        result = do_convert_to_maps(tfs, handle, scratch, scratch + tfs->block_size);
+        put_scratch(tfs, 2);
+    }
+    return result;
 }
 
-// TODO: Follow the linked list and deallocate all the blocks
-int tfsDeallocateBlocks(TFS *tfs, int block_index) {
-    char block_bitmap[TFS_BLOCK_SIZE];
-    int block_group_num = (block_index - 1) / TFS_BLOCK_GROUP_SIZE;
-    int block_num = (block_index - 1) % TFS_BLOCK_GROUP_SIZE;
+// Goes through the maps of a file a block at a time, pointing them at the
+// duplicates of their blocks. The new blocks get their references before the
+// map points at them, and the old ones are only dropped once it doesn't.
+// Returns the number of blocks freed, or -1 on error.
+static int dedup_maps(TFS *tfs, FileHandle *handle, char *map_buf, char *block_buf, unsigned int *old_blocks, unsigned int *matches, TFSDedupEntry *bucket) {
+    int i, freed = 0, changed;
+    unsigned int block_index, hash;
+    TFSBlockHeader *map_header = (TFSBlockHeader*)map_buf;
+    unsigned int *map = (unsigned int*)&map_buf[sizeof(TFSBlockHeader)];
+
+    for (block_index = handle->block_index; block_index != 0; block_index = map_header->next_block) {
+        if (tfs->read_fn(tfs, map_buf, block_index) != 0) {
+            return -1;
+        }
+        if (!(map_header->flags & TFS_BLOCK_MAP)) {
+            continue;
+        }
+
+        changed = 0;
+        for (i = 0; i < TFS_MAP_ENTRIES(tfs); i++) {
+            old_blocks[i] = matches[i] = 0;
+            if (map[i] == 0) {
+                continue;
+            }
+            if (tfs->read_fn(tfs, block_buf, map[i]) != 0) {
+                return -1;
+            }
+            if (((TFSBlockHeader*)block_buf)->flags & TFS_BLOCK_COMPRESSED) {
+                continue;
+            }
+            if (!all_zeros(&block_buf[sizeof(TFSBlockHeader)], TFS_DATA_SIZE(tfs))) {
+                if (find_duplicate(tfs, &block_buf[sizeof(TFSBlockHeader)], map[i], bucket, &hash, &matches[i]) != 0) {
+                    return -1;
+                }
+                if (matches[i] == 0) {
+                    if (remember_block(tfs, bucket, hash, map[i]) != 0) {
+                        return -1;
+                    }
+                    continue;
+                }
+            }
+            old_blocks[i] = map[i];
+            map[i] = matches[i];
+            changed = 1;
+        }
+        if (!changed) {
+            continue;
+        }
 
-    if (tfs->read_fn(tfs, block_bitmap, 1 + block_group_num * TFS_BLOCK_GROUP_SIZE) != 0) {
-        return -1;
+        if (update_block_refs(tfs, matches, TFS_MAP_ENTRIES(tfs), 1) != 0 ||
+            tfs->write_fn(tfs, map_buf, block_index) != 0 ||
+            update_block_refs(tfs, old_blocks, TFS_MAP_ENTRIES(tfs), -1) != 0) {
+            return -1;
+        }
+        for (i = 0; i < TFS_MAP_ENTRIES(tfs); i++) {
+            if (old_blocks[i] != 0) {
+                freed++;
+            }
+        }
+        if (free_block_batch(tfs, old_blocks, TFS_MAP_ENTRIES(tfs)) != 0) {
+            return -1;
+        }
     }
 
-    tfsClearBitmapBit(block_bitmap, block_num);
-    if (tfs->write_fn(tfs, block_bitmap, 1 + block_group_num * TFS_BLOCK_GROUP_SIZE) != 0) {
+    return freed;
+}
+
+int tfsDedupFile(TFS *tfs, FileHandle *handle) {
+    int saved, cost, freed = 0;
+    char *scratch;
+
+    if (!handle || handle->block_index == 0 || tfs->header.dedup_block == 0) {
         return -1;
     }
+    if (handle->mode & 0040000) {
+        return 0;
+    }
 
-    return 0;
+    if ((saved = dedup_savings(tfs, handle, &cost)) < 0) {
+        return -1;
+    }
+    if (saved > cost) {
+        if (convert_to_maps(tfs, handle) != 0) {
+            return -1;
+        }
+        freed = -cost;
+    }
 
-    return 0;
+    // Taken only now, so it isn't held through the conversion as well
+    if ((scratch = get_scratch(tfs, 5)) == NULL) {
+        return -1;
+    }
+    saved = dedup_maps(tfs, handle, scratch, scratch + tfs->block_size, (unsigned int*)(scratch + 2 * tfs->block_size), (unsigned int*)(scratch + 3 * tfs->block_size), (TFSDedupEntry*)(scratch + 4 * tfs->block_size));
+    put_scratch(tfs, 5);
+    return (saved < 0) ? -1 : freed + saved;
 }
 
 void tfsCloseHandle(FileHandle *handle) {
     if (!handle) return;
 
     handle->ref_count--;
+    gOpenHandleCount--;
     if (handle->ref_count == 0) {
         if (handle->directory) {
             // Recursively release the parent directory handle
             tfsCloseHandle(handle->directory);
         }
+        if (remove_handle_index(handle)) {
+            handle->next_free = gFreeHandles;
+            gFreeHandles = handle;
+        }
         handle->block_index = 0;
         handle->directory = NULL;
         handle->mode = 0;
@@ -952,18 +2954,215 @@ void tfsCloseHandle(FileHandle *handle) {
     }
 }
 
-unsigned int tfsGetFileSize(FileHandle *handle) {
+unsigned long long tfsGetFileSize(FileHandle *handle) {
     if (!handle) return 0;
     return handle->current_size;
 }
 
 int tfsGetOpenHandleCount() {
-    int i, count = 0;
-    for (i = 0; i < MAX_FILE_HANDLES; i++) {
-        if (gFileHandles[i].block_index != 0) {
-            count += gFileHandles[i].ref_count;
-        }
+    return gOpenHandleCount;
+}
+
+int tfsSubmitRequest(TFS *tfs, TFSIORequest *req) {
+    int result;
+
+    req->next = NULL;
+    if (tfs->submit_fn) {
+        return tfs->submit_fn(tfs, req);
+    }
+
+    switch (req->op) {
+    case TFS_IO_READ:
+        result = tfs->read_fn(tfs, req->buf, req->block);
+        break;
+    case TFS_IO_WRITE:
+        result = tfs->write_fn(tfs, req->buf, req->block);
+        break;
+    case TFS_IO_FLUSH:
+        // write_fn has already finished every earlier write
+        result = 0;
+        break;
+    default:
+        return -1;
+    }
+    tfsCompleteRequest(tfs, req, (result < 0) ? -1 : 0);
+    return 0;
+}
+
+void tfsCompleteRequest(TFS *tfs, TFSIORequest *req, int result) {
+    req->result = result;
+    if (req->callback) {
+        req->callback(tfs, req);
+        return;
+    }
+
+    req->next = NULL;
+    if (tfs->completed_tail) {
+        tfs->completed_tail->next = req;
+    } else {
+        tfs->completed_head = req;
+    }
+    tfs->completed_tail = req;
+}
+
+int tfsReapCompletions(TFS *tfs, TFSIORequest **reqs, int max_reqs) {
+    int count = 0;
+
+    while (count < max_reqs && tfs->completed_head) {
+        reqs[count++] = tfs->completed_head;
+        tfs->completed_head = tfs->completed_head->next;
+    }
+    if (!tfs->completed_head) {
+        tfs->completed_tail = NULL;
     }
     return count;
 }
 
+// The LZ format is a series of sequences. Each starts with a token byte whose
+// high nibble is the number of literal bytes and low nibble is the match
+// length minus TFS_LZ_MIN_MATCH. A nibble of 15 is followed by extra length
+// bytes, which are added on, for as long as they are 255. Then come the
+// literals and, unless the input ends there, a 2-byte little-endian offset
+// back into the output to copy the match from.
+#define TFS_LZ_MIN_MATCH 4
+#define TFS_LZ_HASH_BITS 10
+
+static int lz_put_length(char *dest, int pos, int dest_size, unsigned int length) {
+    while (length >= 255) {
+        if (pos >= dest_size) {
+            return -1;
+        }
+        dest[pos++] = (char)255;
+        length -= 255;
+    }
+    if (pos >= dest_size) {
+        return -1;
+    }
+    dest[pos++] = length;
+    return pos;
+}
+
+static int lz_put_sequence(char *dest, int pos, int dest_size, const char *literals, int literal_length, int offset, int match_length) {
+    int i;
+    int match_code = match_length ? match_length - TFS_LZ_MIN_MATCH : 0;
+
+    if (pos >= dest_size) {
+        return -1;
+    }
+    dest[pos++] = ((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15);
+    if (literal_length >= 15 && (pos = lz_put_length(dest, pos, dest_size, literal_length - 15)) < 0) {
+        return -1;
+    }
+    if (pos + literal_length > dest_size) {
+        return -1;
+    }
+    for (i = 0; i < literal_length; i++) {
+        dest[pos++] = literals[i];
+    }
+
+    if (match_length == 0) {
+        // Last sequence
+        return pos;
+    }
+    if (pos + 2 > dest_size) {
+        return -1;
+    }
+    dest[pos++] = offset & 0xff;
+    dest[pos++] = offset >> 8;
+    if (match_code >= 15 && (pos = lz_put_length(dest, pos, dest_size, match_code - 15)) < 0) {
+        return -1;
+    }
+    return pos;
+}
+
+int tfsLZCompress(const char *src, int src_size, char *dest, int dest_size) {
+    int i, pos = 0, anchor = 0, ip = 0;
+    // Last position + 1 seen for each hash of 4 bytes, or 0
+    unsigned short table[1 << TFS_LZ_HASH_BITS];
+
+    for (i = 0; i < (1 << TFS_LZ_HASH_BITS); i++) {
+        table[i] = 0;
+    }
+
+    while (ip + TFS_LZ_MIN_MATCH <= src_size) {
+        const unsigned char *p = (const unsigned char*)&src[ip];
+        unsigned int hash = ((p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24)) * 2654435761u) >> (32 - TFS_LZ_HASH_BITS);
+        int ref = table[hash] - 1;
+        table[hash] = ip + 1;
+
+        if (ref >= 0 && src[ref] == src[ip] && src[ref + 1] == src[ip + 1] &&
+            src[ref + 2] == src[ip + 2] && src[ref + 3] == src[ip + 3]) {
+            int length = TFS_LZ_MIN_MATCH;
+            while (ip + length < src_size && src[ref + length] == src[ip + length]) {
+                length++;
+            }
+            if ((pos = lz_put_sequence(dest, pos, dest_size, &src[anchor], ip - anchor, ip - ref, length)) < 0) {
+                return -1;
+            }
+            ip += length;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    if (anchor < src_size) {
+        pos = lz_put_sequence(dest, pos, dest_size, &src[anchor], src_size - anchor, 0, 0);
+    }
+    return pos;
+}
+
+int tfsLZDecompress(const char *src, int src_size, char *dest, int dest_size) {
+    const unsigned char *in = (const unsigned char*)src;
+    int ip = 0, op = 0, length, offset;
+
+    while (ip < src_size) {
+        int token = in[ip++];
+
+        length = token >> 4;
+        if (length == 15) {
+            do {
+                if (ip >= src_size) {
+                    return -1;
+                }
+                length += in[ip];
+            } while (in[ip++] == 255);
+        }
+        if (ip + length > src_size || op + length > dest_size) {
+            return -1;
+        }
+        while (length-- > 0) {
+            dest[op++] = src[ip++];
+        }
+
+        if (ip == src_size) {
+            // The last sequence has no match
+            break;
+        }
+        if (ip + 2 > src_size) {
+            return -1;
+        }
+        offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        length = token & 15;
+        if (length == 15) {
+            do {
+                if (ip >= src_size) {
+                    return -1;
+                }
+                length += in[ip];
+            } while (in[ip++] == 255);
+        }
+        length += TFS_LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + length > dest_size) {
+            return -1;
+        }
+        // Byte by byte, since the match can overlap what it produces
+        while (length-- > 0) {
+            dest[op] = dest[op - offset];
+            op++;
+        }
+    }
+
+    return op;
+}
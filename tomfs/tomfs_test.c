@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#include "tomfs.h"
+#include "host_io.h"
 
 #define RUNTEST(x) { printf("Running " #x "...\n"); if (x() != 0) { printf("Test failed!\n"); return -1; } }
 #define ASSERT(x) if (!(x)) { printf("Assert failed: " #x " on line %d\n", __LINE__); return -1; }
@@ -14,6 +16,8 @@ typedef struct {
     char *base_addr;
     unsigned int num_blocks;
     int overrun; // Set if we try to write outside of the block bounds
+    int reads; // Number of blocks read so far
+    int writes; // Number of blocks written so far
 } TestMemPtr;
 
 int error_fn(struct TFS *fs, char *buf, unsigned int block) {
@@ -26,6 +30,14 @@ int dummy_count_fn(struct TFS *fs, char *buf, unsigned int block) {
     return 0;
 }
 
+int dummy_read_count_fn(struct TFS *fs, char *buf, unsigned int block) {
+    int i;
+    for (i = 0; i < fs->block_size; i++) {
+        buf[i] = 0;
+    }
+    return dummy_count_fn(fs, buf, block);
+}
+
 int mem_write_fn(struct TFS *fs, char *buf, unsigned int block) {
     TestMemPtr *ptr = (TestMemPtr *)fs->user_data;
     char *addr;
@@ -35,8 +47,9 @@ int mem_write_fn(struct TFS *fs, char *buf, unsigned int block) {
         ptr->overrun = 1;
         return -1;
     }
-    addr = ptr->base_addr + block * TFS_BLOCK_SIZE;
-    for (i = 0; i < TFS_BLOCK_SIZE; i++) {
+    ptr->writes++;
+    addr = ptr->base_addr + block * fs->block_size;
+    for (i = 0; i < fs->block_size; i++) {
         addr[i] = buf[i];
     }
     return 0;
@@ -51,13 +64,43 @@ int mem_read_fn(struct TFS *fs, char *buf, unsigned int block) {
         ptr->overrun = 1;
         return -1;
     }
-    addr = ptr->base_addr + block * TFS_BLOCK_SIZE;
-    for (i = 0; i < TFS_BLOCK_SIZE; i++) {
+    ptr->reads++;
+    addr = ptr->base_addr + block * fs->block_size;
+    for (i = 0; i < fs->block_size; i++) {
         buf[i] = addr[i];
     }
     return 0;
 }
 
+// Backs a filesystem with a sparse file, for volumes far bigger than memory.
+// Blocks past the end of the file read back as zeros.
+int file_read_fn(struct TFS *fs, char *buf, unsigned int block) {
+    TestMemPtr *ptr = (TestMemPtr *)fs->user_data;
+    int fd = *(int *)ptr->base_addr;
+    ssize_t count = pread(fd, buf, fs->block_size, (off_t)block * fs->block_size);
+    if (block >= ptr->num_blocks) {
+        ptr->overrun = 1;
+        return -1;
+    }
+    if (count < 0) {
+        return -1;
+    }
+    memset(&buf[count], 0, fs->block_size - count);
+    ptr->reads++;
+    return 0;
+}
+
+int file_write_fn(struct TFS *fs, char *buf, unsigned int block) {
+    TestMemPtr *ptr = (TestMemPtr *)fs->user_data;
+    int fd = *(int *)ptr->base_addr;
+    if (block >= ptr->num_blocks) {
+        ptr->overrun = 1;
+        return -1;
+    }
+    ptr->writes++;
+    return (pwrite(fd, buf, fs->block_size, (off_t)block * fs->block_size) == fs->block_size) ? 0 : -1;
+}
+
 // Returns 0 or 1 if the block node is full, -1 on error
 int validate_block_bitmap_recursive(char *bitmap_buf, int level, int idx) {
     int child1, child2;
@@ -93,6 +136,38 @@ int validate_block_bitmap(char *bitmap_buf) {
     return (validate_block_bitmap_recursive(bitmap_buf, 14, 0) >= 0) ? 0 : -1;
 }
 
+// Counts the blocks marked as used in the first block group's bitmap
+int count_used_blocks(TestMemPtr *ptr) {
+    int i, count = 0;
+    for (i = 0; i < ptr->num_blocks - 1; i++) {
+        if (tfsCheckBitmapBit(&ptr->base_addr[TFS_BLOCK_SIZE], i, TFS_BLOCK_GROUP_SIZE)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Walks a file's chain directly on the "disk" and checks that logical block
+// numbers increase and that the previous/next links agree. Returns the number
+// of blocks in the chain, or -1 if it is broken.
+int validate_chain(TestMemPtr *ptr, unsigned int first_block) {
+    unsigned int block = first_block, prev = 0;
+    int count = 0;
+    int last_logical = -1;
+    while (block != 0) {
+        TFSBlockHeader *header = (TFSBlockHeader*)(ptr->base_addr + block * TFS_BLOCK_SIZE);
+        if (header->previous_block != prev || (int)header->logical_block <= last_logical ||
+            header->initial_block != first_block) {
+            return -1;
+        }
+        last_logical = header->logical_block;
+        prev = block;
+        block = header->next_block;
+        count++;
+    }
+    return count;
+}
+
 int test_init_handles_errors() {
     TFS tfs;
     
@@ -108,13 +183,20 @@ int test_init_writes_blocks() {
     TFS tfs;
     int counter = 0;
     
-    tfs.read_fn = &dummy_count_fn;
+    tfs.read_fn = &dummy_read_count_fn;
     tfs.write_fn = &dummy_count_fn;
     tfs.user_data = &counter;
     tfsInit(&tfs, NULL, 0);
 
+    // Free blocks are left as they are, so only the header, the bitmap and
+    // the root directory are written
     ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
-    ASSERT_EQUALS(counter, 2576);
+    ASSERT_EQUALS(counter, 12);
+
+    // On a zeroed device the bitmap can be left out too
+    counter = 0;
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, TFS_BLOCK_SIZE, TFS_BLOCK_GROUP_SIZE, 1), 0);
+    ASSERT_EQUALS(counter, 11);
 
     return 0;
 }
@@ -186,7 +268,7 @@ int test_set_bitmap() {
         // Blockgroup is not full
         ASSERT_EQUALS(block_bitmap[0] & 0x2, 0);
 
-        tfsSetBitmapBit(block_bitmap, idx);
+        tfsSetBitmapBit(block_bitmap, idx, TFS_BLOCK_GROUP_SIZE);
 
         // Skip around through the bitmap by jumping forward by a prime number
         idx = (idx + 977) % TFS_BLOCK_GROUP_SIZE;
@@ -199,7 +281,7 @@ int test_set_bitmap() {
     // Incrementally clear each but in a block bitmap until it's empty
     idx = 457;
     for (i = 0; i < TFS_BLOCK_GROUP_SIZE; i++) {
-        tfsClearBitmapBit(block_bitmap, idx);
+        tfsClearBitmapBit(block_bitmap, idx, TFS_BLOCK_GROUP_SIZE);
 
         // Block bitmap is valid
         ASSERT_EQUALS(validate_block_bitmap(block_bitmap), 0);
@@ -365,7 +447,7 @@ int test_directories() {
     int count;
     int mode;
     int block_idx;
-    int size;
+    unsigned long long size;
     char filename[256];
 
     mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
@@ -496,6 +578,1716 @@ int test_directories() {
     return 0;
 }
 
+int test_directory_iterator() {
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *dir, *file;
+    TFSDirIterator iter;
+    unsigned long long iter_buf[TFS_BLOCK_SIZE / sizeof(unsigned long long)];
+    TFSDirEntry entries[7];
+    int i, count, total, idx;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char filename[256];
+    char expected[256];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+    ASSERT_NOTEQUALS(dir = tfsCreateDirectory(&tfs, "/", "many"), NULL);
+    tfsCloseHandle(dir);
+
+    // Enough files with long names that the directory spans several blocks,
+    // with the ends of the blocks padded out
+    for (i = 0; i < 200; i++) {
+        sprintf(filename, "file_number_%d_with_a_fairly_long_name", i);
+        ASSERT_NOTEQUALS(file = tfsCreateFile(&tfs, "/many", 0644, filename), 0);
+        ASSERT_NOERROR(tfsWriteFile(&tfs, file, filename, i, 0));
+        tfsCloseHandle(file);
+    }
+
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/many"), NULL);
+    ASSERT(tfsGetFileSize(dir) > 3 * TFS_BLOCK_DATA_SIZE);
+
+    // The iterator returns the same entries as tfsReadNextEntry, in order
+    tfsOpenDirIterator(&iter, dir, (char*)iter_buf);
+    idx = 0;
+    total = 0;
+    mem_ptr.reads = 0;
+    while ((count = tfsReadDirectoryBlock(&tfs, &iter, entries, 7)) > 0) {
+        for (i = 0; i < count; i++) {
+            ASSERT_EQUALS(tfsReadNextEntry(&tfs, dir, &idx, &mode, &block_idx, &size, filename, 256), 0);
+            ASSERT(strcmp(filename, entries[i].filename) == 0);
+            ASSERT_EQUALS(entries[i].mode, mode);
+            ASSERT_EQUALS(entries[i].block_index, block_idx);
+            ASSERT_EQUALS(entries[i].file_size, size);
+            if (total >= 2) {
+                sprintf(expected, "file_number_%d_with_a_fairly_long_name", total - 2);
+                ASSERT(strcmp(entries[i].filename, expected) == 0);
+                ASSERT_EQUALS(entries[i].file_size, total - 2);
+            }
+            total++;
+        }
+    }
+    ASSERT_EQUALS(count, 0);
+    ASSERT_EQUALS(total, 202);
+    ASSERT_NOTEQUALS(tfsReadNextEntry(&tfs, dir, &idx, &mode, &block_idx, &size, filename, 256), 0);
+
+    // Listing only with the iterator reads each directory block exactly once
+    tfsOpenDirIterator(&iter, dir, (char*)iter_buf);
+    mem_ptr.reads = 0;
+    total = 0;
+    while ((count = tfsReadDirectoryBlock(&tfs, &iter, entries, 7)) > 0) {
+        total += count;
+    }
+    ASSERT_EQUALS(total, 202);
+    ASSERT_EQUALS(mem_ptr.reads, (tfsGetFileSize(dir) + TFS_BLOCK_DATA_SIZE - 1) / TFS_BLOCK_DATA_SIZE);
+
+    tfsCloseHandle(dir);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+int test_directory_records() {
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *dir, *file, *ez, *fy;
+    TFSDirIterator iter;
+    unsigned long long iter_buf[TFS_BLOCK_SIZE / sizeof(unsigned long long)];
+    TFSDirEntry entries[4];
+    int i, count, total, dir_blocks;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char filename[TFS_MAX_FILENAME + 2];
+    char path[TFS_MAX_FILENAME + 16];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+
+    // Short names take a single record of 32 bytes
+    ASSERT_NOTEQUALS(dir = tfsCreateDirectory(&tfs, "/", "names"), NULL);
+    ASSERT_EQUALS(tfsGetFileSize(dir), 2 * 32);
+    tfsCloseHandle(dir);
+
+    // Names of the longest length are kept whole. They don't divide a block
+    // evenly, so some records start a new block and leave padding behind.
+    for (i = 0; i < 20; i++) {
+        memset(filename, 'a' + i, TFS_MAX_FILENAME);
+        filename[TFS_MAX_FILENAME] = '\0';
+        ASSERT_NOTEQUALS(file = tfsCreateFile(&tfs, "/names", 0644, filename), NULL);
+        tfsCloseHandle(file);
+    }
+    memset(filename, 'z', TFS_MAX_FILENAME + 1);
+    filename[TFS_MAX_FILENAME + 1] = '\0';
+    ASSERT_EQUALS(tfsCreateFile(&tfs, "/names", 0644, filename), NULL);
+
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/names"), NULL);
+    dir_blocks = (tfsGetFileSize(dir) + TFS_BLOCK_DATA_SIZE - 1) / TFS_BLOCK_DATA_SIZE;
+    ASSERT_EQUALS(dir_blocks, 2);
+    tfsOpenDirIterator(&iter, dir, (char*)iter_buf);
+    total = 0;
+    while ((count = tfsReadDirectoryBlock(&tfs, &iter, entries, 4)) > 0) {
+        for (i = 0; i < count; i++, total++) {
+            if (total >= 2) {
+                ASSERT_EQUALS(strlen(entries[i].filename), TFS_MAX_FILENAME);
+                ASSERT_EQUALS(entries[i].filename[0], 'a' + total - 2);
+                ASSERT_EQUALS(entries[i].filename[TFS_MAX_FILENAME - 1], 'a' + total - 2);
+            }
+        }
+    }
+    ASSERT_EQUALS(total, 22);
+
+    // A lookup reads each directory block once, even for the last entry
+    memset(filename, 'a' + 19, TFS_MAX_FILENAME);
+    filename[TFS_MAX_FILENAME] = '\0';
+    mem_ptr.reads = 0;
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, filename, &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(mem_ptr.reads, dir_blocks);
+    filename[TFS_MAX_FILENAME - 1] = '\0';
+    ASSERT_NOTEQUALS(tfsFindEntry(&tfs, dir, filename, &mode, &block_idx, &size), 0);
+    tfsCloseHandle(dir);
+
+    // A directory with the longest name can be gone through by path, but a
+    // component any longer can't be
+    memset(filename, 'd', TFS_MAX_FILENAME);
+    filename[TFS_MAX_FILENAME] = '\0';
+    ASSERT_NOTEQUALS(dir = tfsCreateDirectory(&tfs, "/names", filename), NULL);
+    tfsCloseHandle(dir);
+    sprintf(path, "/names/%s", filename);
+    ASSERT_NOTEQUALS(file = tfsCreateFile(&tfs, path, 0644, "inner"), NULL);
+    tfsCloseHandle(file);
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, path), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "inner", &mode, &block_idx, &size), 0);
+    tfsCloseHandle(dir);
+    strcat(path, "d");
+    ASSERT_EQUALS(tfsOpenPath(&tfs, path), NULL);
+
+    // Names with the same hash are still told apart
+    ASSERT_NOTEQUALS(ez = tfsCreateFile(&tfs, "/", 0644, "Ez"), NULL);
+    ASSERT_NOTEQUALS(fy = tfsCreateFile(&tfs, "/", 0600, "FY"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, fy, "FY", 2, 0), 2);
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "Ez", &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(mode, 0644);
+    ASSERT_EQUALS(size, 0);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "FY", &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(mode, 0600);
+    ASSERT_EQUALS(size, 2);
+    ASSERT_NOTEQUALS(tfsFindEntry(&tfs, dir, "E", &mode, &block_idx, &size), 0);
+
+    tfsCloseHandle(dir);
+    tfsCloseHandle(ez);
+    tfsCloseHandle(fy);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+int test_directory_handles() {
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *logs, *deeper, *dir, *file;
+    int i, used_blocks, path_reads, at_reads;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char filename[32];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+    ASSERT_NOTEQUALS(dir = tfsCreateDirectory(&tfs, "/", "var"), NULL);
+    ASSERT_NOTEQUALS(logs = tfsCreateDirectoryAt(&tfs, dir, "logs"), NULL);
+    tfsCloseHandle(dir);
+    used_blocks = count_used_blocks(&mem_ptr);
+
+    // Creating files by path looks the path up every time; creating them in
+    // an open directory doesn't
+    mem_ptr.reads = 0;
+    for (i = 0; i < 20; i++) {
+        sprintf(filename, "path_%d", i);
+        ASSERT_NOTEQUALS(file = tfsCreateFile(&tfs, "/var/logs", 0644, filename), NULL);
+        tfsCloseHandle(file);
+    }
+    path_reads = mem_ptr.reads;
+    mem_ptr.reads = 0;
+    for (i = 0; i < 20; i++) {
+        sprintf(filename, "at_%d", i);
+        ASSERT_NOTEQUALS(file = tfsCreateFileAt(&tfs, logs, 0644, filename), NULL);
+        tfsCloseHandle(file);
+    }
+    at_reads = mem_ptr.reads;
+    ASSERT(at_reads < path_reads);
+
+    // Files made either way can be found either way
+    ASSERT_NOTEQUALS(file = tfsOpenFileAt(&tfs, logs, "path_3"), NULL);
+    tfsCloseHandle(file);
+    ASSERT_NOTEQUALS(file = tfsOpenFileAt(&tfs, logs, "at_3"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, file, "at_3", 4, 0), 4);
+    tfsCloseHandle(file);
+    ASSERT_NOTEQUALS(file = tfsOpenFile(&tfs, "/var/logs", "at_3"), NULL);
+    ASSERT_EQUALS(tfsGetFileSize(file), 4);
+    tfsCloseHandle(file);
+    ASSERT_EQUALS(tfsOpenFileAt(&tfs, logs, "missing"), NULL);
+
+    // Paths are relative to the directory unless they start with '/'
+    ASSERT_NOTEQUALS(deeper = tfsCreateDirectoryAt(&tfs, logs, "deeper"), NULL);
+    tfsCloseHandle(deeper);
+    ASSERT_NOTEQUALS(dir = tfsOpenPathAt(&tfs, logs, "deeper"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "..", &mode, &block_idx, &size), 0);
+    ASSERT_NOTEQUALS(deeper = tfsOpenPathAt(&tfs, dir, "../.."), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, deeper, "logs", &mode, &block_idx, &size), 0);
+    tfsCloseHandle(deeper);
+    ASSERT_NOTEQUALS(deeper = tfsOpenPathAt(&tfs, dir, "/var/./logs/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, deeper, "at_3", &mode, &block_idx, &size), 0);
+    tfsCloseHandle(deeper);
+    ASSERT_EQUALS(tfsOpenPathAt(&tfs, logs, "var"), NULL);
+    tfsCloseHandle(dir);
+
+    // Deleting a file frees its blocks and its name
+    ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, "missing"), -1);
+    for (i = 0; i < 20; i++) {
+        sprintf(filename, "at_%d", i);
+        ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, filename), 0);
+        sprintf(filename, "path_%d", i);
+        ASSERT_EQUALS(tfsDeleteFile(&tfs, "/var/logs", filename), 0);
+    }
+    ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, "at_3"), -1);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, logs, "at_3", &mode, &block_idx, &size), -1);
+
+    // Open files, directories that aren't empty, and the wrong kind of entry
+    // are left alone
+    ASSERT_NOTEQUALS(file = tfsCreateFileAt(&tfs, logs, 0644, "open"), NULL);
+    ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, "open"), -1);
+    tfsCloseHandle(file);
+    ASSERT_EQUALS(tfsDeleteDirectoryAt(&tfs, logs, "open"), -1);
+    ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, "deeper"), -1);
+    ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, ".."), -1);
+    ASSERT_EQUALS(tfsDeleteDirectory(&tfs, "/var", "logs"), -1);
+    ASSERT_EQUALS(tfsDeleteFileAt(&tfs, logs, "open"), 0);
+    ASSERT_EQUALS(tfsDeleteDirectoryAt(&tfs, logs, "deeper"), 0);
+    tfsCloseHandle(logs);
+    ASSERT_EQUALS(tfsDeleteDirectory(&tfs, "/var", "logs"), 0);
+    ASSERT_EQUALS(tfsOpenPath(&tfs, "/var/logs"), NULL);
+
+    // Only the directory it was in is left, and that doesn't shrink
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks - 1);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+int test_sparse_files() {
+    int i, used_blocks;
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *handle;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char buf[TFS_BLOCK_DATA_SIZE*3];
+    char pattern[100];
+    FileHandle *dir;
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+
+    for (i = 0; i < 100; i++) {
+        pattern[i] = i + 1;
+    }
+
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0644, "sparse"), 0);
+    used_blocks = count_used_blocks(&mem_ptr);
+
+    // Writing far past the end only allocates the block that holds the data
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, pattern, 100, TFS_BLOCK_DATA_SIZE * 1000 + 5), 100);
+    ASSERT_EQUALS(tfsGetFileSize(handle), TFS_BLOCK_DATA_SIZE * 1000 + 105);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 1);
+
+    // The directory entry has the new size
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "sparse", &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(size, TFS_BLOCK_DATA_SIZE * 1000 + 105);
+    tfsCloseHandle(dir);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 2);
+
+    // The hole reads back as zeros, the data as written
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 3, TFS_BLOCK_DATA_SIZE * 500), TFS_BLOCK_DATA_SIZE * 3);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 3; i++) {
+        ASSERT_EQUALS(buf[i], 0);
+    }
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 200, TFS_BLOCK_DATA_SIZE * 1000), 105);
+    for (i = 0; i < 5; i++) {
+        ASSERT_EQUALS(buf[i], 0);
+    }
+    for (i = 0; i < 100; i++) {
+        ASSERT_EQUALS(buf[i + 5], i + 1);
+    }
+
+    // Fill in part of the hole, straddling two blocks. The new blocks are
+    // linked in between the existing ones.
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, pattern, 100, TFS_BLOCK_DATA_SIZE * 500 - 50), 100);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 3);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 4);
+    ASSERT_EQUALS(tfsGetFileSize(handle), TFS_BLOCK_DATA_SIZE * 1000 + 105);
+
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 2, TFS_BLOCK_DATA_SIZE * 499), TFS_BLOCK_DATA_SIZE * 2);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 2; i++) {
+        if (i >= TFS_BLOCK_DATA_SIZE - 50 && i < TFS_BLOCK_DATA_SIZE + 50) {
+            ASSERT_EQUALS(buf[i], i - (TFS_BLOCK_DATA_SIZE - 50) + 1);
+        } else {
+            ASSERT_EQUALS(buf[i], 0);
+        }
+    }
+
+    // A hole right after the first block, filled in front of the others
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, pattern, 10, TFS_BLOCK_DATA_SIZE + 7), 10);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 5);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 10, TFS_BLOCK_DATA_SIZE + 7), 10);
+    for (i = 0; i < 10; i++) {
+        ASSERT_EQUALS(buf[i], i + 1);
+    }
+
+    // The end of the file is still intact
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 100, TFS_BLOCK_DATA_SIZE * 1000 + 5), 100);
+    for (i = 0; i < 100; i++) {
+        ASSERT_EQUALS(buf[i], i + 1);
+    }
+
+    tfsCloseHandle(handle);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+int test_truncate() {
+    int i, used_blocks;
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *handle, *dir;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char buf[TFS_BLOCK_DATA_SIZE*5];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 5; i++) {
+        buf[i] = (i % 127) + 1;
+    }
+
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0644, "log"), 0);
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_NOERROR(tfsWriteFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 5, 0));
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 4);
+
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "log", &mode, &block_idx, &size), 0);
+
+    // Cut the file in the middle of the third block
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, TFS_BLOCK_DATA_SIZE * 2 + 100), 0);
+    ASSERT_EQUALS(tfsGetFileSize(handle), TFS_BLOCK_DATA_SIZE * 2 + 100);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 2);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 3);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "log", &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(size, TFS_BLOCK_DATA_SIZE * 2 + 100);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 5, 0), TFS_BLOCK_DATA_SIZE * 2 + 100);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 2 + 100; i++) {
+        ASSERT_EQUALS(buf[i], (i % 127) + 1);
+    }
+
+    // Growing it again reads zeros past the old end, not the old data
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, TFS_BLOCK_DATA_SIZE * 4), 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 2);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 5, 0), TFS_BLOCK_DATA_SIZE * 4);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 4; i++) {
+        ASSERT_EQUALS(buf[i], ((i < TFS_BLOCK_DATA_SIZE * 2 + 100) ? (i % 127) + 1 : 0));
+    }
+
+    // Truncating to a block boundary keeps exactly the blocks before it
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, TFS_BLOCK_DATA_SIZE * 2), 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 1);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 2);
+
+    // Truncating to nothing keeps only the first block, and the file can be
+    // written again like a new one
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, 0), 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 1);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 10, 0), 0);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, "hello", 5, 0), 5);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 10, 0), 5);
+    ASSERT_EQUALS(buf[4], 'o');
+
+    // Freeing a long tail updates the bitmap once, not once per block
+    for (i = 0; i < 40; i++) {
+        ASSERT_NOERROR(tfsWriteFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE, i * TFS_BLOCK_DATA_SIZE));
+    }
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 39);
+    mem_ptr.writes = 0;
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, 10), 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks);
+    // Last kept block + bitmap + directory entry
+    ASSERT_EQUALS(mem_ptr.writes, 3);
+
+    // Truncating a sparse file releases the blocks past the cut
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, "0123456789", 10, TFS_BLOCK_DATA_SIZE * 100), 10);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, "0123456789", 10, TFS_BLOCK_DATA_SIZE * 200), 10);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 2);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, TFS_BLOCK_DATA_SIZE * 150), 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 1);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 10, TFS_BLOCK_DATA_SIZE * 100), 10);
+    ASSERT_EQUALS(buf[9], '9');
+
+    tfsCloseHandle(dir);
+    tfsCloseHandle(handle);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+// Finds the reference count of 'block' directly on the "disk", in the piece
+// of the count file holding it. Returns NULL if that piece is a hole.
+unsigned short *find_refcount(TestMemPtr *ptr, TFS *tfs, unsigned int block) {
+    unsigned int counts_per_piece = TFS_BLOCK_DATA_SIZE / sizeof(unsigned short);
+    unsigned int index = tfs->header.refcount_block;
+    TFSBlockHeader *header;
+
+    while (index != 0) {
+        header = (TFSBlockHeader*)(ptr->base_addr + index * TFS_BLOCK_SIZE);
+        if (header->logical_block == block / counts_per_piece) {
+            return (unsigned short*)((char*)header + sizeof(TFSBlockHeader)) + block % counts_per_piece;
+        }
+        index = header->next_block;
+    }
+    return NULL;
+}
+
+int test_clone_files() {
+    int i, initial_blocks, used_blocks, refcount_blocks;
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *handle, *clone, *clone2, *dir, *big, *big_clone;
+    TFSBlockHeader *header;
+    unsigned short *first_count, *last_count;
+    unsigned int mode, block_idx, clone_idx, first_block, last_block;
+    unsigned long long size;
+    char buf[TFS_BLOCK_DATA_SIZE*31];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+    ASSERT_EQUALS(tfs.header.refcount_block, 0);
+    initial_blocks = count_used_blocks(&mem_ptr);
+
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 10; i++) {
+        buf[i] = (i % 127) + 1;
+    }
+
+    // Ten blocks of data, a hole, and one more block at the end
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0644, "base"), 0);
+    ASSERT_NOERROR(tfsWriteFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 10, 0));
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, "end", 3, TFS_BLOCK_DATA_SIZE * 30), 3);
+    used_blocks = count_used_blocks(&mem_ptr);
+
+    // A clone costs its map block, a copy of the first block and the count
+    // file, however big the source is
+    ASSERT_NOTEQUALS(clone = tfsCloneFile(&tfs, handle, "/", "clone"), NULL);
+    ASSERT_NOTEQUALS(tfs.header.refcount_block, 0);
+    refcount_blocks = validate_chain(&mem_ptr, tfs.header.refcount_block);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 2 + refcount_blocks);
+    ASSERT_EQUALS(tfsGetFileSize(clone), TFS_BLOCK_DATA_SIZE * 30 + 3);
+
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "base", &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "clone", &mode, &clone_idx, &size), 0);
+    ASSERT_EQUALS(mode, 0644);
+    ASSERT_EQUALS(size, TFS_BLOCK_DATA_SIZE * 30 + 3);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, clone_idx), 1);
+
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, TFS_BLOCK_DATA_SIZE * 31, 0), TFS_BLOCK_DATA_SIZE * 30 + 3);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 30; i++) {
+        ASSERT_EQUALS(buf[i], ((i < TFS_BLOCK_DATA_SIZE * 10) ? (i % 127) + 1 : 0));
+    }
+    ASSERT_EQUALS(buf[TFS_BLOCK_DATA_SIZE * 30 + 2], 'd');
+
+    // Writing to a shared block copies just that block, for either file
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, clone, "clone", 5, TFS_BLOCK_DATA_SIZE * 4), 5);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 1);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, clone, "again", 5, TFS_BLOCK_DATA_SIZE * 4 + 5), 5);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 1);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, "base", 4, TFS_BLOCK_DATA_SIZE * 6), 4);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 2);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 11);
+
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 10, TFS_BLOCK_DATA_SIZE * 4), 10);
+    ASSERT_EQUALS(buf[0], ((TFS_BLOCK_DATA_SIZE * 4) % 127) + 1);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 10, TFS_BLOCK_DATA_SIZE * 4), 10);
+    ASSERT_EQUALS(memcmp(buf, "cloneagain", 10), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 4, TFS_BLOCK_DATA_SIZE * 6), 4);
+    ASSERT_EQUALS(memcmp(buf, "base", 4), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 4, TFS_BLOCK_DATA_SIZE * 6), 4);
+    ASSERT_EQUALS(buf[0], ((TFS_BLOCK_DATA_SIZE * 6) % 127) + 1);
+
+    // Filling a hole in the clone doesn't touch the source
+    ASSERT_EQUALS(tfsWriteFile(&tfs, clone, "hole", 4, TFS_BLOCK_DATA_SIZE * 20), 4);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 4, TFS_BLOCK_DATA_SIZE * 20), 4);
+    ASSERT_EQUALS(buf[0], 0);
+
+    // Clones of clones share blocks with both
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_NOTEQUALS(clone2 = tfsCloneFile(&tfs, clone, "/", "clone2"), NULL);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 1);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone2, buf, 4, TFS_BLOCK_DATA_SIZE * 20), 4);
+    ASSERT_EQUALS(memcmp(buf, "hole", 4), 0);
+
+    // Blocks are only freed when the last file using them lets go
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, 0), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 3, TFS_BLOCK_DATA_SIZE * 30), 3);
+    ASSERT_EQUALS(memcmp(buf, "end", 3), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, clone, TFS_BLOCK_DATA_SIZE * 4 + 3), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone2, buf, 10, TFS_BLOCK_DATA_SIZE * 4), 10);
+    ASSERT_EQUALS(memcmp(buf, "cloneagain", 10), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 10, TFS_BLOCK_DATA_SIZE * 4), 3);
+    ASSERT_EQUALS(memcmp(buf, "clo", 3), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, clone, 0), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, clone2, 0), 0);
+
+    // Everything is back to one block per file plus the count file
+    refcount_blocks = validate_chain(&mem_ptr, tfs.header.refcount_block);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), initial_blocks + 3 + refcount_blocks);
+
+    // A clone that would take a count past its limit fails without raising
+    // any of them. The file's blocks are spread over the first two pieces of
+    // the count file, and the count that overflows is in the second.
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 25; i++) {
+        buf[i] = (i % 127) + 1;
+    }
+    ASSERT_NOTEQUALS(big = tfsCreateFile(&tfs, "/", 0644, "big"), NULL);
+    for (i = 0; i < 900; i += 25) {
+        ASSERT_EQUALS(tfsWriteFile(&tfs, big, buf, TFS_BLOCK_DATA_SIZE * 25, (unsigned long long)i * TFS_BLOCK_DATA_SIZE), TFS_BLOCK_DATA_SIZE * 25);
+    }
+    ASSERT_NOTEQUALS(big_clone = tfsCloneFile(&tfs, big, "/", "big.1"), NULL);
+    tfsCloseHandle(big_clone);
+
+    // Every block of the file but the first is shared. Find the lowest and
+    // highest of them.
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "big", &mode, &block_idx, &size), 0);
+    header = (TFSBlockHeader*)(mem_ptr.base_addr + block_idx * TFS_BLOCK_SIZE);
+    first_block = 0xFFFFFFFF;
+    last_block = 0;
+    while (header->next_block != 0) {
+        first_block = (header->next_block < first_block) ? header->next_block : first_block;
+        last_block = (header->next_block > last_block) ? header->next_block : last_block;
+        header = (TFSBlockHeader*)(mem_ptr.base_addr + header->next_block * TFS_BLOCK_SIZE);
+    }
+    ASSERT(first_block < TFS_BLOCK_DATA_SIZE / sizeof(unsigned short));
+    ASSERT(last_block >= TFS_BLOCK_DATA_SIZE / sizeof(unsigned short));
+    ASSERT_NOTEQUALS(first_count = find_refcount(&mem_ptr, &tfs, first_block), NULL);
+    ASSERT_NOTEQUALS(last_count = find_refcount(&mem_ptr, &tfs, last_block), NULL);
+    ASSERT_EQUALS(*first_count, 1);
+    ASSERT_EQUALS(*last_count, 1);
+
+    *last_count = 0xFFFF;
+    ASSERT_EQUALS(tfsCloneFile(&tfs, big, "/", "big.2"), NULL);
+    ASSERT_EQUALS(*first_count, 1);
+    ASSERT_EQUALS(*last_count, 0xFFFF);
+    *last_count = 1;
+    ASSERT_NOTEQUALS(big_clone = tfsCloneFile(&tfs, big, "/", "big.3"), NULL);
+    ASSERT_EQUALS(*first_count, 2);
+    ASSERT_EQUALS(*last_count, 2);
+    tfsCloseHandle(big_clone);
+    tfsCloseHandle(big);
+
+    tfsCloseHandle(dir);
+    tfsCloseHandle(handle);
+    tfsCloseHandle(clone);
+    tfsCloseHandle(clone2);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+// Fills 'buf' with something like a log file, with a run of zeros and a block
+// of noise that won't compress
+void fill_compressible(char *buf, int size) {
+    int i;
+    unsigned int seed = 12345;
+    for (i = 0; i < size; i++) {
+        if (i / TFS_BLOCK_DATA_SIZE == 7) {
+            seed = seed * 1103515245 + 12345;
+            buf[i] = seed >> 16;
+        } else if (i / TFS_BLOCK_DATA_SIZE >= 3 && i / TFS_BLOCK_DATA_SIZE < 5) {
+            buf[i] = 0;
+        } else {
+            buf[i] = "[kernel] mounted /dev/hda, 2560 blocks\n"[i % 40] + (i / 400) % 3;
+        }
+    }
+}
+
+int test_lz_codec() {
+    int i, size, length;
+    char src[TFS_BLOCK_DATA_SIZE];
+    char packed[TFS_BLOCK_SIZE];
+    char unpacked[TFS_BLOCK_DATA_SIZE];
+
+    fill_compressible(src, TFS_BLOCK_DATA_SIZE);
+
+    // Round trips for all sorts of sizes, including ones too short to match
+    for (size = 0; size <= TFS_BLOCK_DATA_SIZE; size += (size < 20) ? 1 : 509) {
+        ASSERT_NOERROR(length = tfsLZCompress(src, size, packed, TFS_BLOCK_SIZE));
+        ASSERT_EQUALS(tfsLZDecompress(packed, length, unpacked, TFS_BLOCK_DATA_SIZE), size);
+        ASSERT_EQUALS(memcmp(src, unpacked, size), 0);
+    }
+
+    // Text compresses well, and zeros compress to almost nothing
+    ASSERT_EQUALS((tfsLZCompress(src, TFS_BLOCK_DATA_SIZE, packed, TFS_BLOCK_SIZE) < TFS_BLOCK_DATA_SIZE / 4), 1);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE; i++) {
+        src[i] = 0;
+    }
+    ASSERT_NOERROR(length = tfsLZCompress(src, TFS_BLOCK_DATA_SIZE, packed, TFS_BLOCK_SIZE));
+    ASSERT_EQUALS((length < 32), 1);
+    ASSERT_EQUALS(tfsLZDecompress(packed, length, unpacked, TFS_BLOCK_DATA_SIZE), TFS_BLOCK_DATA_SIZE);
+    ASSERT_EQUALS(unpacked[TFS_BLOCK_DATA_SIZE - 1], 0);
+
+    // Running out of room is an error, not an overrun
+    ASSERT_EQUALS(tfsLZCompress(src, TFS_BLOCK_DATA_SIZE, packed, 4), -1);
+    ASSERT_EQUALS(tfsLZDecompress(packed, length, unpacked, 100), -1);
+
+    // So is corrupt data
+    ASSERT_EQUALS(tfsLZDecompress(packed, length - 1, unpacked, TFS_BLOCK_DATA_SIZE), -1);
+    packed[0] = 0x0f;
+    packed[1] = 0xff;
+    packed[2] = 0xff;
+    ASSERT_EQUALS(tfsLZDecompress(packed, 3, unpacked, TFS_BLOCK_DATA_SIZE), -1);
+
+    return 0;
+}
+
+int test_compressed_files() {
+    int i, used_blocks, saved, reads;
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *handle, *clone, *dir;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char expected[TFS_BLOCK_DATA_SIZE*12];
+    char buf[TFS_BLOCK_DATA_SIZE*12];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+
+    fill_compressible(expected, TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0755, "kernel"), 0);
+    ASSERT_NOERROR(tfsWriteFile(&tfs, handle, expected, TFS_BLOCK_DATA_SIZE * 12 - 100, 0));
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "kernel", &mode, &block_idx, &size), 0);
+
+    mem_ptr.reads = 0;
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12 - 100);
+    reads = mem_ptr.reads;
+
+    // Blocks 0-6 go in one chunk, the noise in block 7 stays as it is, and
+    // blocks 8-11 go in another chunk
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_EQUALS(saved = tfsCompressFile(&tfs, handle), 6 + 3);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks - saved);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 3);
+
+    // Reading it all back takes fewer reads, and so does reading bits of it
+    mem_ptr.reads = 0;
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12 - 100);
+    ASSERT_EQUALS(mem_ptr.reads, 3);
+    ASSERT_EQUALS((mem_ptr.reads < reads), 1);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12 - 100), 0);
+    for (i = 0; i < TFS_BLOCK_DATA_SIZE * 12 - 100; i += 1357) {
+        ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, 100, i), 100);
+        ASSERT_EQUALS(memcmp(buf, &expected[i], 100), 0);
+    }
+
+    // Compressing again finds nothing more to do
+    ASSERT_EQUALS(tfsCompressFile(&tfs, handle), 0);
+
+    // Directories are left alone, or their records couldn't be found
+    ASSERT_EQUALS(tfsCompressFile(&tfs, dir), -1);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "kernel", &mode, &block_idx, &size), 0);
+
+    // Clones share the chunks
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_NOTEQUALS(clone = tfsCloneFile(&tfs, handle, "/", "kernel.bak"), NULL);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12 - 100);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12 - 100), 0);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, clone, "patched", 7, TFS_BLOCK_DATA_SIZE * 9), 7);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 7, TFS_BLOCK_DATA_SIZE * 9), 7);
+    ASSERT_EQUALS(memcmp(buf, "patched", 7), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 7, TFS_BLOCK_DATA_SIZE * 10), 7);
+    ASSERT_EQUALS(memcmp(buf, &expected[TFS_BLOCK_DATA_SIZE * 10], 7), 0);
+
+    // Writing into a chunk unpacks it, including when the chunk holds the
+    // first block of the file
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, "hello", 5, 10), 5);
+    memcpy(&expected[10], "hello", 5);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12 - 100);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12 - 100), 0);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "kernel", &mode, &block_idx, &size), 0);
+    // The zero blocks come back as holes
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 5 + 1 + 1);
+
+    // The clone still sees the original data
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 15, 0), 15);
+    ASSERT_EQUALS(memcmp(buf, expected, 10), 0);
+    ASSERT_NOTEQUALS(memcmp(buf, expected, 15), 0);
+
+    // Truncating in the middle of a chunk
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, TFS_BLOCK_DATA_SIZE * 9 + 10), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, TFS_BLOCK_DATA_SIZE * 10), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 10);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 9 + 10), 0);
+    ASSERT_EQUALS(buf[TFS_BLOCK_DATA_SIZE * 9 + 10], 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 7, TFS_BLOCK_DATA_SIZE * 11), 7);
+    ASSERT_EQUALS(memcmp(buf, &expected[TFS_BLOCK_DATA_SIZE * 11], 7), 0);
+
+    // Once both are gone, so are the chunks
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, handle, 0), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, clone, 0), 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), 2 + 2 + validate_chain(&mem_ptr, tfs.header.refcount_block));
+
+    tfsCloseHandle(dir);
+    tfsCloseHandle(handle);
+    tfsCloseHandle(clone);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+// Fills 'buf' with blocks that each differ from the others, apart from block
+// 5, which is all zeros
+void fill_distinct_blocks(char *buf, int num_blocks) {
+    int i, j;
+    for (i = 0; i < num_blocks; i++) {
+        for (j = 0; j < TFS_BLOCK_DATA_SIZE; j++) {
+            buf[i * TFS_BLOCK_DATA_SIZE + j] = (i == 5) ? 0 : (j * 31 + i * 17) % 253 + 1;
+        }
+    }
+}
+
+int test_dedup() {
+    int initial_blocks, used_blocks, refcount_blocks;
+    TestMemPtr mem_ptr;
+    TFS tfs;
+    FileHandle *a, *b, *c, *d, *dir;
+    unsigned int mode, block_idx;
+    unsigned long long size;
+    char expected[TFS_BLOCK_DATA_SIZE*12];
+    char buf[TFS_BLOCK_DATA_SIZE*12];
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+    fill_distinct_blocks(expected, 12);
+    ASSERT_NOTEQUALS(a = tfsCreateFile(&tfs, "/", 0755, "a"), 0);
+    ASSERT_NOTEQUALS(b = tfsCreateFile(&tfs, "/", 0755, "b"), 0);
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, a, expected, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, b, expected, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+
+    // There's nothing to look blocks up in until dedup is turned on
+    ASSERT_EQUALS(tfsDedupFile(&tfs, a), -1);
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_EQUALS(tfsEnableDedup(&tfs, 0), 0);
+    ASSERT_NOTEQUALS(tfs.header.dedup_block, 0);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + tfs.header.dedup_buckets);
+    // Everything but the two files
+    initial_blocks = count_used_blocks(&mem_ptr) - 2 * 12;
+
+    // The first file has nothing to share with yet, and turning one zero
+    // block into a hole doesn't pay for a copy of its first block, so it is
+    // left alone. Its blocks are listed for the second file to share, which
+    // is rebuilt as a map: that costs a copy of its first block, and frees
+    // the zero block and the ten blocks the first file has too.
+    ASSERT_EQUALS(tfsDedupFile(&tfs, a), 0);
+    ASSERT_EQUALS(tfsDedupFile(&tfs, b), 11 - 1);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "b", &mode, &block_idx, &size), 0);
+    ASSERT_EQUALS(validate_chain(&mem_ptr, block_idx), 1);
+    refcount_blocks = validate_chain(&mem_ptr, tfs.header.refcount_block);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), initial_blocks + 12 + 2 + refcount_blocks);
+    ASSERT_EQUALS(tfsReadFile(&tfs, b, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12), 0);
+
+    // Running it again finds nothing more, and directories are left alone
+    ASSERT_EQUALS(tfsDedupFile(&tfs, b), 0);
+    ASSERT_EQUALS(tfsDedupFile(&tfs, dir), 0);
+
+    // Shared blocks are copied when written, like those of a clone
+    ASSERT_EQUALS(tfsWriteFile(&tfs, b, "b", 1, TFS_BLOCK_DATA_SIZE * 3), 1);
+    ASSERT_EQUALS(tfsReadFile(&tfs, a, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, b, buf, 2, TFS_BLOCK_DATA_SIZE * 3), 2);
+    ASSERT_EQUALS(buf[0], 'b');
+    ASSERT_EQUALS(buf[1], expected[TFS_BLOCK_DATA_SIZE * 3 + 1]);
+
+    // With online dedup, writing the same data again only costs the first
+    // block and a map
+    ASSERT_EQUALS(tfsEnableDedup(&tfs, 1), 0);
+    used_blocks = count_used_blocks(&mem_ptr);
+    ASSERT_NOTEQUALS(c = tfsCreateFile(&tfs, "/", 0755, "c"), 0);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, c, expected, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + 2);
+    ASSERT_EQUALS(tfsReadFile(&tfs, c, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12), 0);
+
+    // New data is listed as it is written, so the next copy of it is shared
+    // too
+    refcount_blocks = validate_chain(&mem_ptr, tfs.header.refcount_block);
+    used_blocks = count_used_blocks(&mem_ptr) - refcount_blocks;
+    ASSERT_NOTEQUALS(d = tfsCreateFile(&tfs, "/", 0755, "d"), 0);
+    memset(buf, 0, TFS_BLOCK_DATA_SIZE);
+    memcpy(buf, "new", 3);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, c, buf, TFS_BLOCK_DATA_SIZE, TFS_BLOCK_DATA_SIZE * 20), TFS_BLOCK_DATA_SIZE);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, d, buf, TFS_BLOCK_DATA_SIZE, TFS_BLOCK_DATA_SIZE), TFS_BLOCK_DATA_SIZE);
+    // The block goes to c, and d takes its first block and a map
+    refcount_blocks = validate_chain(&mem_ptr, tfs.header.refcount_block);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks + refcount_blocks + 1 + 1 + 1);
+    ASSERT_EQUALS(tfsReadFile(&tfs, d, buf, 4, TFS_BLOCK_DATA_SIZE), 4);
+    ASSERT_EQUALS(memcmp(buf, "new", 4), 0);
+
+    // Once everything is truncated away nothing is left behind, and the
+    // index entries for the freed blocks aren't trusted
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, a, 0), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, b, 0), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, c, 0), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, d, 0), 0);
+    refcount_blocks = validate_chain(&mem_ptr, tfs.header.refcount_block);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), initial_blocks + 4 + refcount_blocks);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, a, expected, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), initial_blocks + 4 + refcount_blocks + 1 + 10);
+    ASSERT_EQUALS(tfsReadFile(&tfs, a, buf, TFS_BLOCK_DATA_SIZE * 12, 0), TFS_BLOCK_DATA_SIZE * 12);
+    ASSERT_EQUALS(memcmp(buf, expected, TFS_BLOCK_DATA_SIZE * 12), 0);
+
+    tfsCloseHandle(dir);
+    tfsCloseHandle(a);
+    tfsCloseHandle(b);
+    tfsCloseHandle(c);
+    tfsCloseHandle(d);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    return 0;
+}
+
+int test_handle_table() {
+    TFS tfs;
+    TestMemPtr mem_ptr;
+    FileHandle *dirs[200], *handle;
+    char name[16];
+    int i;
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+
+    // Every directory holds its own handle plus a reference to the root
+    for (i = 0; i < 200; i++) {
+        sprintf(name, "d%d", i);
+        ASSERT_NOTEQUALS(dirs[i] = tfsCreateDirectory(&tfs, "/", name), NULL);
+    }
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 400);
+
+    // Opening an open directory again finds the same handle
+    for (i = 0; i < 200; i++) {
+        sprintf(name, "/d%d", i);
+        ASSERT(tfsOpenPath(&tfs, name) == dirs[i]);
+    }
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 600);
+
+    // Drop every third directory entirely, then look the rest up again
+    for (i = 0; i < 200; i += 3) {
+        tfsCloseHandle(dirs[i]);
+        tfsCloseHandle(dirs[i]);
+    }
+    for (i = 0; i < 200; i++) {
+        sprintf(name, "/d%d", i);
+        ASSERT_NOTEQUALS(handle = tfsOpenPath(&tfs, name), NULL);
+        if (i % 3) {
+            ASSERT(handle == dirs[i]);
+        }
+        tfsCloseHandle(handle);
+    }
+
+    for (i = 0; i < 200; i++) {
+        if (i % 3) {
+            tfsCloseHandle(dirs[i]);
+            tfsCloseHandle(dirs[i]);
+        }
+    }
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+
+    // The index is usable again once everything has been released
+    ASSERT_NOTEQUALS(handle = tfsOpenPath(&tfs, "/d5"), NULL);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 2);
+    tfsCloseHandle(handle);
+    ASSERT_EQUALS(tfsGetOpenHandleCount(), 0);
+
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+    return 0;
+}
+
+// A device that holds on to requests until the test completes them
+TFSIORequest *gDeferredRequests[8];
+int gDeferredCount;
+int gCallbackCount;
+
+int deferred_submit_fn(struct TFS *fs, TFSIORequest *req) {
+    if (gDeferredCount == 8) {
+        return -1;
+    }
+    gDeferredRequests[gDeferredCount++] = req;
+    return 0;
+}
+
+void count_callback(struct TFS *fs, TFSIORequest *req) {
+    gCallbackCount++;
+}
+
+int test_async_io() {
+    TFS tfs;
+    TestMemPtr mem_ptr;
+    TFSIORequest reqs[4], *done[8];
+    char write_buf[TFS_BLOCK_SIZE], read_buf[TFS_BLOCK_SIZE];
+    int i;
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    for (i = 0; i < TFS_BLOCK_SIZE; i++) {
+        write_buf[i] = i * 7;
+        read_buf[i] = 0;
+    }
+    for (i = 0; i < 4; i++) {
+        reqs[i].callback = NULL;
+        reqs[i].buf = NULL;
+        reqs[i].block = 0;
+    }
+
+    // Without submit_fn, requests complete before tfsSubmitRequest returns
+    reqs[0].op = TFS_IO_WRITE;
+    reqs[0].block = 10;
+    reqs[0].buf = write_buf;
+    reqs[1].op = TFS_IO_FLUSH;
+    reqs[2].op = TFS_IO_READ;
+    reqs[2].block = 10;
+    reqs[2].buf = read_buf;
+    reqs[3].op = 0;
+    ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[0]), 0);
+    ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[1]), 0);
+    ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[2]), 0);
+    ASSERT_ERROR(tfsSubmitRequest(&tfs, &reqs[3]));
+    ASSERT(memcmp(write_buf, read_buf, TFS_BLOCK_SIZE) == 0);
+
+    // Completions are reaped in order, as many at a time as asked for
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 2), 2);
+    ASSERT(done[0] == &reqs[0] && done[1] == &reqs[1]);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 1);
+    ASSERT(done[0] == &reqs[2]);
+    ASSERT_EQUALS(reqs[2].result, 0);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 0);
+
+    // Errors from the device are reported in the request
+    reqs[0].op = TFS_IO_READ;
+    reqs[0].block = 5000;
+    reqs[0].buf = read_buf;
+    ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[0]), 0);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 1);
+    ASSERT_EQUALS(reqs[0].result, -1);
+    mem_ptr.overrun = 0;
+
+    // With submit_fn, requests stay in flight until the device completes
+    // them, in whatever order it likes
+    tfs.submit_fn = &deferred_submit_fn;
+    gDeferredCount = 0;
+    gCallbackCount = 0;
+    for (i = 0; i < 4; i++) {
+        reqs[i].op = TFS_IO_READ;
+        reqs[i].block = i;
+        reqs[i].buf = read_buf;
+        reqs[i].callback = (i % 2) ? &count_callback : NULL;
+        ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[i]), 0);
+    }
+    ASSERT_EQUALS(gDeferredCount, 4);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 0);
+
+    for (i = 3; i >= 0; i--) {
+        tfsCompleteRequest(&tfs, gDeferredRequests[i], 0);
+    }
+    ASSERT_EQUALS(gCallbackCount, 2);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 2);
+    ASSERT(done[0] == &reqs[2] && done[1] == &reqs[0]);
+
+    // tfsInit goes back to synchronous I/O
+    tfsInit(&tfs, NULL, 0);
+    ASSERT(tfs.submit_fn == NULL);
+
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+    return 0;
+}
+
+// A filesystem striped across three devices, with groups small enough that a
+// file spans several of them
+int test_striping() {
+    TFS tfs, devices[3];
+    TFSStripe stripe;
+    TestMemPtr mem_ptrs[3];
+    TFSIORequest reqs[4], *done[8];
+    FileHandle *handle;
+    char *write_buf, *read_buf, block_buf[TFS_BLOCK_SIZE];
+    int i, size = 300 * TFS_BLOCK_DATA_SIZE;
+
+    // 1000 blocks make 16 groups of 64, the last of them 39 blocks long.
+    // Device 0 has groups 0, 3, ..., 15 and the header, and the others have
+    // five whole groups and an unused block 0.
+    ASSERT_EQUALS(tfsStripeDeviceBlocks(1000, 64, 3, 0), 1 + 5 * 64 + 39);
+    ASSERT_EQUALS(tfsStripeDeviceBlocks(1000, 64, 3, 1), 1 + 5 * 64);
+    ASSERT_EQUALS(tfsStripeDeviceBlocks(1000, 64, 3, 2), 1 + 5 * 64);
+    ASSERT_EQUALS(tfsStripeDeviceBlocks(100, 64, 3, 2), 1);
+
+    for (i = 0; i < 3; i++) {
+        mem_ptrs[i].num_blocks = tfsStripeDeviceBlocks(1000, 64, 3, i);
+        mem_ptrs[i].base_addr = malloc(mem_ptrs[i].num_blocks * TFS_BLOCK_SIZE);
+        mem_ptrs[i].overrun = 0;
+        devices[i].read_fn = &mem_read_fn;
+        devices[i].write_fn = &mem_write_fn;
+        devices[i].submit_fn = NULL;
+        devices[i].user_data = &mem_ptrs[i];
+    }
+    ASSERT_EQUALS(tfsStripeInit(&stripe, devices, TFS_MAX_STRIPE_DEVICES + 1), -1);
+    ASSERT_EQUALS(tfsStripeInit(&stripe, devices, 3), 0);
+    tfsInit(&tfs, NULL, 0);
+    tfsStripeAttach(&stripe, &tfs);
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 1000, TFS_BLOCK_SIZE, 64, 0), 0);
+    ASSERT_EQUALS(tfs.header.stripe_devices, 3);
+
+    write_buf = malloc(size);
+    read_buf = malloc(size);
+    for (i = 0; i < size; i++) {
+        write_buf[i] = i * 13 + i / 4093;
+    }
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0644, "striped"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, write_buf, size, 0), size);
+    tfsCloseHandle(handle);
+
+    // It reads back after reopening, with every device doing its share
+    tfsInit(&tfs, NULL, 0);
+    tfsStripeAttach(&stripe, &tfs);
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+    for (i = 0; i < 3; i++) {
+        mem_ptrs[i].reads = 0;
+    }
+    ASSERT_NOTEQUALS(handle = tfsOpenFile(&tfs, "/", "striped"), NULL);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, read_buf, size, 0), size);
+    ASSERT(memcmp(write_buf, read_buf, size) == 0);
+    tfsCloseHandle(handle);
+    for (i = 0; i < 3; i++) {
+        ASSERT(mem_ptrs[i].reads > 50);
+    }
+
+    // It can't be opened from one device, or across the wrong number, but
+    // the header says how many it needs
+    tfsInit(&tfs, NULL, 0);
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptrs[0];
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), -1);
+    ASSERT_EQUALS(tfs.header.stripe_devices, 3);
+    tfsInit(&tfs, NULL, 0);
+    ASSERT_EQUALS(tfsStripeInit(&stripe, devices, 2), 0);
+    tfsStripeAttach(&stripe, &tfs);
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), -1);
+
+    // Requests are passed to every device they involve before any completes.
+    // Blocks 2, 66 and 130 are in groups 0, 1 and 2, so on different devices,
+    // and a flush goes to all three.
+    tfsInit(&tfs, NULL, 0);
+    ASSERT_EQUALS(tfsStripeInit(&stripe, devices, 3), 0);
+    tfsStripeAttach(&stripe, &tfs);
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+    for (i = 0; i < 3; i++) {
+        devices[i].submit_fn = &deferred_submit_fn;
+    }
+    gDeferredCount = 0;
+    for (i = 0; i < 4; i++) {
+        reqs[i].op = (i < 3) ? TFS_IO_READ : TFS_IO_FLUSH;
+        reqs[i].block = 2 + i * 64;
+        reqs[i].buf = read_buf + i * TFS_BLOCK_SIZE;
+        reqs[i].callback = NULL;
+        ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[i]), 0);
+    }
+    ASSERT_EQUALS(gDeferredCount, 6);
+    // Each is the second block of its device's first group
+    ASSERT(gDeferredRequests[0]->block == 2 && gDeferredRequests[1]->block == 2 && gDeferredRequests[2]->block == 2);
+    for (i = 0; i < 3; i++) {
+        tfsCompleteRequest(&devices[i], gDeferredRequests[i], 0);
+    }
+
+    // The flush only completes once it has on every device
+    tfsCompleteRequest(&devices[0], gDeferredRequests[3], 0);
+    tfsCompleteRequest(&devices[1], gDeferredRequests[4], -1);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 3);
+    tfsCompleteRequest(&devices[2], gDeferredRequests[5], 0);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 1);
+    ASSERT(done[0] == &reqs[3]);
+    ASSERT_EQUALS(reqs[3].result, -1);
+    for (i = 0; i < 3; i++) {
+        devices[i].submit_fn = NULL;
+    }
+
+    // Without a submit_fn on the devices, requests complete straight away
+    reqs[0].op = TFS_IO_READ;
+    reqs[0].block = 130;
+    reqs[0].buf = read_buf;
+    ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[0]), 0);
+    ASSERT_EQUALS(tfsReapCompletions(&tfs, done, 8), 1);
+    ASSERT_EQUALS(reqs[0].result, 0);
+    ASSERT_EQUALS(tfs.read_fn(&tfs, block_buf, 130), 0);
+    ASSERT(memcmp(block_buf, read_buf, TFS_BLOCK_SIZE) == 0);
+
+    for (i = 0; i < 3; i++) {
+        ASSERT_EQUALS(mem_ptrs[i].overrun, 0);
+    }
+    free(write_buf);
+    free(read_buf);
+    return 0;
+}
+
+// Writes fail once this reaches zero, as if the machine had stopped
+int gWritesUntilCrash;
+
+int crashing_write_fn(struct TFS *fs, char *buf, unsigned int block) {
+    if (gWritesUntilCrash-- <= 0) {
+        return -1;
+    }
+    return mem_write_fn(fs, buf, block);
+}
+
+int test_defragment() {
+    TFS tfs;
+    TestMemPtr mem_ptr;
+    FileHandle *file, *dir;
+    char *snapshot;
+    char buf[40 * 4064], read_buf[40 * 4064 + 8], taken[2560];
+    unsigned int num_blocks, first_block, mode;
+    unsigned long long size;
+    int i, ret, used_blocks;
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+    snapshot = malloc(2560 * TFS_BLOCK_SIZE);
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = (i * 31) ^ (i >> 9);
+    }
+    ASSERT_NOTEQUALS(file = tfsCreateFile(&tfs, "/", 0644, "scattered"), NULL);
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "scattered", &mode, &first_block, &size), 0);
+    tfsCloseHandle(dir);
+
+    // Pretend the blocks right after the first one, and every other block
+    // elsewhere, belong to other files while this one is written, so none of
+    // its blocks end up next to each other
+    memset(taken, 0, sizeof(taken));
+    for (i = 1; i < 2559; i++) {
+        if ((i >= first_block && i < first_block + 39) || i % 2 == first_block % 2) {
+            taken[i] = !tfsCheckBitmapBit(&mem_ptr.base_addr[TFS_BLOCK_SIZE], i, TFS_BLOCK_GROUP_SIZE);
+            tfsSetBitmapBit(&mem_ptr.base_addr[TFS_BLOCK_SIZE], i, TFS_BLOCK_GROUP_SIZE);
+        }
+    }
+    ASSERT_EQUALS(tfsWriteFile(&tfs, file, buf, sizeof(buf), 0), sizeof(buf));
+    for (i = 0; i < 2559; i++) {
+        if (taken[i]) {
+            tfsClearBitmapBit(&mem_ptr.base_addr[TFS_BLOCK_SIZE], i, TFS_BLOCK_GROUP_SIZE);
+        }
+    }
+    ASSERT_EQUALS(tfsCountFragments(&tfs, file, &num_blocks), 40);
+    ASSERT_EQUALS(num_blocks, 40);
+    tfsCloseHandle(file);
+    used_blocks = count_used_blocks(&mem_ptr);
+    memcpy(snapshot, mem_ptr.base_addr, 2560 * TFS_BLOCK_SIZE);
+
+    // Stop the defragmenter after every possible number of writes. Whatever
+    // made it to disk, the file must read back the same.
+    for (i = 0; ; i++) {
+        memcpy(mem_ptr.base_addr, snapshot, 2560 * TFS_BLOCK_SIZE);
+        tfs.write_fn = &mem_write_fn;
+        tfsInit(&tfs, NULL, 0);
+        ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+        ASSERT_NOTEQUALS(file = tfsOpenFile(&tfs, "/", "scattered"), NULL);
+
+        tfs.write_fn = &crashing_write_fn;
+        gWritesUntilCrash = i;
+        ret = tfsDefragmentFile(&tfs, file);
+        tfs.write_fn = &mem_write_fn;
+
+        ASSERT_EQUALS(validate_chain(&mem_ptr, first_block), 40);
+        ASSERT_EQUALS(tfsReadFile(&tfs, file, read_buf, sizeof(buf), 0), sizeof(buf));
+        ASSERT(memcmp(buf, read_buf, sizeof(buf)) == 0);
+        if (ret >= 0) {
+            break;
+        }
+        // Nothing can be lost, only leaked
+        ASSERT(count_used_blocks(&mem_ptr) >= used_blocks);
+    }
+    ASSERT_EQUALS(ret, 39);
+    ASSERT(i > 40);
+
+    // Now the file is in one piece, right after its first block, and the old
+    // blocks have been freed
+    ASSERT_EQUALS(tfsCountFragments(&tfs, file, &num_blocks), 1);
+    ASSERT_EQUALS(num_blocks, 40);
+    ASSERT_EQUALS(count_used_blocks(&mem_ptr), used_blocks);
+    ASSERT_EQUALS(tfsDefragmentFile(&tfs, file), 0);
+
+    // It is still an ordinary file
+    ASSERT_EQUALS(tfsWriteFile(&tfs, file, "appended", 8, sizeof(buf)), 8);
+    ASSERT_EQUALS(tfsReadFile(&tfs, file, read_buf, sizeof(buf) + 8, 0), sizeof(buf) + 8);
+    ASSERT(memcmp(buf, read_buf, sizeof(buf)) == 0 && memcmp(read_buf + sizeof(buf), "appended", 8) == 0);
+    tfsCloseHandle(file);
+
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+    free(snapshot);
+    return 0;
+}
+
+// Makes a filesystem of 'num_blocks' blocks with the given geometry, and
+// checks that files work and that every block can be allocated. TomFS only
+// gets the scratch memory it asks for, as in the kernel and stage 2.
+int check_geometry(unsigned int block_size, unsigned int block_group_size, unsigned int num_blocks) {
+    TFS tfs;
+    TestMemPtr mem_ptr;
+    FileHandle *handle, *clone;
+    unsigned int data_size = block_size - sizeof(TFSBlockHeader);
+    unsigned int size = data_size * 9 + 100, group, i, used;
+    char *expected, *buf, *scratch;
+
+    mem_ptr.base_addr = malloc(num_blocks * block_size);
+    mem_ptr.num_blocks = num_blocks;
+    mem_ptr.overrun = 0;
+    expected = malloc(size);
+    buf = malloc(size);
+    scratch = malloc(TFS_SCRATCH_SIZE(block_size));
+
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+    tfsSetScratch(&tfs, scratch, TFS_SCRATCH_SIZE(block_size));
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, num_blocks, block_size, block_group_size, 0), 0);
+    ASSERT_EQUALS(tfs.block_size, block_size);
+
+    for (i = 0; i < size; i++) {
+        expected[i] = "[kernel] mounted /dev/hda\n"[i % 26] + (i / 1000) % 3;
+    }
+    ASSERT_NOTEQUALS(handle = tfsCreateDirectory(&tfs, "/", "dir"), NULL);
+    tfsCloseHandle(handle);
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/dir", 0644, "file"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, handle, expected, size, 0), size);
+    ASSERT_NOTEQUALS(clone = tfsCloneFile(&tfs, handle, "/dir", "clone"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, clone, "changed", 7, data_size * 4 - 3), 7);
+    ASSERT(tfsCompressFile(&tfs, handle) > 0);
+    tfsCloseHandle(handle);
+    tfsCloseHandle(clone);
+
+    // Everything can be found again from the header alone
+    tfsInit(&tfs, NULL, 0);
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+    ASSERT_EQUALS(tfs.block_size, block_size);
+
+    // Without enough scratch memory operations fail rather than overrun it
+    tfsSetScratch(&tfs, scratch, block_size);
+    ASSERT_NOTEQUALS(handle = tfsOpenFile(&tfs, "/dir", "file"), NULL);
+    ASSERT_EQUALS(tfsCloneFile(&tfs, handle, "/dir", "clone2"), NULL);
+    tfsCloseHandle(handle);
+
+    tfsSetScratch(&tfs, scratch, TFS_SCRATCH_SIZE(block_size));
+    ASSERT_EQUALS(tfsOpenFile(&tfs, "/dir", "clone2"), NULL);
+    ASSERT_NOTEQUALS(handle = tfsOpenFile(&tfs, "/dir", "file"), NULL);
+    ASSERT_EQUALS(tfsReadFile(&tfs, handle, buf, size, 0), size);
+    ASSERT(memcmp(buf, expected, size) == 0);
+    ASSERT_NOTEQUALS(clone = tfsOpenFile(&tfs, "/dir", "clone"), NULL);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, size, 0), size);
+    ASSERT(memcmp(buf, expected, data_size * 4 - 3) == 0);
+    ASSERT(memcmp(&buf[data_size * 4 - 3], "changed", 7) == 0);
+    ASSERT(memcmp(&buf[data_size * 4 + 4], &expected[data_size * 4 + 4], size - data_size * 4 - 4) == 0);
+    tfsCloseHandle(handle);
+    tfsCloseHandle(clone);
+
+    // Fill it up. Every block but the header ends up marked in the bitmap of
+    // its group, and nothing is written past the end.
+    for (i = 0; i < num_blocks && tfsAllocateBlock(&tfs, 0, 1, 0, 0) != 0; i++) {}
+    ASSERT(i < num_blocks);
+    used = 0;
+    for (i = 1; i < num_blocks; i++) {
+        group = (i - 1) / block_group_size;
+        used += tfsCheckBitmapBit(&mem_ptr.base_addr[(1 + group * block_group_size) * block_size], (i - 1) % block_group_size, block_group_size);
+    }
+    ASSERT_EQUALS(used, num_blocks - 1);
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+
+    free(mem_ptr.base_addr);
+    free(expected);
+    free(buf);
+    free(scratch);
+    return 0;
+}
+
+int test_block_geometry() {
+    TFS tfs;
+    TestMemPtr mem_ptr;
+    FileHandle *handle;
+    TFSFilesystemHeader *header;
+
+    // 10 MB each: small groups of default sized blocks, big blocks with
+    // groups as big as they can be, and the biggest blocks with several
+    // groups
+    ASSERT_EQUALS(check_geometry(4096, 1024, 2560), 0);
+    ASSERT_EQUALS(check_geometry(16384, 65536, 640), 0);
+    ASSERT_EQUALS(check_geometry(65536, 64, 160), 0);
+
+    mem_ptr.base_addr = malloc(2560 * TFS_BLOCK_SIZE);
+    mem_ptr.num_blocks = 2560;
+    mem_ptr.overrun = 0;
+    tfs.read_fn = &mem_read_fn;
+    tfs.write_fn = &mem_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    // Sizes must be powers of two, and the tree of a group must fit in a block
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, 2048, 1024, 0), -1);
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, 131072, 1024, 0), -1);
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, 12288, 1024, 0), -1);
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, 4096, 32768, 0), -1);
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, 4096, 1000, 0), -1);
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2560, 4096, 32, 0), -1);
+
+    // Filesystems with directory entries from before names were stored in
+    // the entry can't be read
+    ASSERT_EQUALS(tfsInitFilesystem(&tfs, 2560), 0);
+    ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0644, "old"), NULL);
+    tfsCloseHandle(handle);
+    header = (TFSFilesystemHeader*)mem_ptr.base_addr;
+    tfsInit(&tfs, NULL, 0);
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+    header->format_version = 4;
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), -1);
+
+    // Nor ones with a geometry that makes no sense
+    header->format_version = TFS_FORMAT_VERSION;
+    header->block_size = 6000;
+    header->block_group_size = TFS_BLOCK_GROUP_SIZE;
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), -1);
+
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+    free(mem_ptr.base_addr);
+    return 0;
+}
+
+// A 12 TB volume of 786432 block groups, on a sparse file
+int test_large_volume() {
+    TFS tfs;
+    TestMemPtr mem_ptr;
+    FileHandle *dir, *file, *clone;
+    FILE *image;
+    int fd, i;
+    unsigned int mode, block_idx, block, num_blocks = 0xC0000000u;
+    unsigned long long size, far = 5ULL << 40;
+    char buf[100];
+
+    ASSERT_NOTEQUALS(image = tmpfile(), NULL);
+    fd = fileno(image);
+    mem_ptr.base_addr = (char *)&fd;
+    mem_ptr.num_blocks = num_blocks;
+    mem_ptr.overrun = 0;
+    mem_ptr.reads = 0;
+    mem_ptr.writes = 0;
+
+    tfs.read_fn = &file_read_fn;
+    tfs.write_fn = &file_write_fn;
+    tfs.user_data = &mem_ptr;
+    tfsInit(&tfs, NULL, 0);
+
+    // Making it doesn't touch the block groups
+    ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, num_blocks, 4096, 4096, 1), 0);
+    ASSERT(mem_ptr.writes < 20);
+    ASSERT(tfs.header.total_blocks == num_blocks);
+    ASSERT(tfs.header.data_blocks == num_blocks - 1 - 786432);
+
+    // A multi-terabyte sparse file
+    ASSERT_NOTEQUALS(file = tfsCreateFile(&tfs, "/", 0644, "big"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, file, "start", 5, 0), 5);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, file, "the end", 7, far), 7);
+    ASSERT(tfsGetFileSize(file) == far + 7);
+    ASSERT_EQUALS(tfsReadFile(&tfs, file, buf, 100, far), 7);
+    ASSERT_EQUALS(memcmp(buf, "the end", 7), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, file, buf, 10, far / 2), 10);
+    for (i = 0; i < 10; i++) {
+        ASSERT_EQUALS(buf[i], 0);
+    }
+    // Past the largest offset a logical block number can reach
+    ASSERT_EQUALS(tfsWriteFile(&tfs, file, "x", 1, TFS_MAX_FILE_SIZE(&tfs)), -1);
+
+    // Clones of it only copy the block that changes, even though the count
+    // file covers every block of the volume
+    ASSERT_NOTEQUALS(clone = tfsCloneFile(&tfs, file, "/", "clone"), NULL);
+    ASSERT_EQUALS(tfsWriteFile(&tfs, clone, "THE", 3, far), 3);
+    ASSERT_EQUALS(tfsReadFile(&tfs, file, buf, 7, far), 7);
+    ASSERT_EQUALS(memcmp(buf, "the end", 7), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, clone, buf, 7, far), 7);
+    ASSERT_EQUALS(memcmp(buf, "THE end", 7), 0);
+    tfsCloseHandle(clone);
+
+    // The size survives a trip through the directory
+    tfsCloseHandle(file);
+    tfsInit(&tfs, NULL, 0);
+    ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+    ASSERT_NOTEQUALS(dir = tfsOpenPath(&tfs, "/"), NULL);
+    ASSERT_EQUALS(tfsFindEntry(&tfs, dir, "big", &mode, &block_idx, &size), 0);
+    ASSERT(size == far + 7);
+    tfsCloseHandle(dir);
+
+    ASSERT_NOTEQUALS(file = tfsOpenFile(&tfs, "/", "big"), NULL);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, file, far - 3), 0);
+    ASSERT(tfsGetFileSize(file) == far - 3);
+    ASSERT_EQUALS(tfsReadFile(&tfs, file, buf, 10, far - 3), 0);
+    ASSERT_EQUALS(tfsTruncateFile(&tfs, file, 3), 0);
+    ASSERT_EQUALS(tfsReadFile(&tfs, file, buf, 10, 0), 3);
+    ASSERT_EQUALS(memcmp(buf, "sta", 3), 0);
+    tfsCloseHandle(file);
+
+    // Blocks past 2^31 can be claimed and freed
+    block = num_blocks - 2;
+    ASSERT(tfsClaimFreeBlock(&tfs, block) == block);
+    ASSERT(tfsClaimFreeBlock(&tfs, block) != block);
+    ASSERT_EQUALS(tfsDeallocateBlocks(&tfs, block), 0);
+    ASSERT(tfsClaimFreeBlock(&tfs, block) == block);
+
+    // Filling a group moves allocation on to the next one, without looking
+    // through the bitmaps of the rest
+    mem_ptr.reads = 0;
+    for (i = 0; i < 3 * 4096; i++) {
+        ASSERT_NOTEQUALS(tfsAllocateBlock(&tfs, 0, 1, 0, 0), 0);
+    }
+    ASSERT(mem_ptr.reads < 3 * 3 * 4096);
+
+    ASSERT_EQUALS(mem_ptr.overrun, 0);
+    fclose(image);
+    return 0;
+}
+
+// Blocks the host backend tests write to: two in each of groups 4 to 7, clear
+// of the groups' bitmaps and of the file in group 0, and so on both devices
+// of a two-way stripe
+#define HOST_IO_BATCH 8
+#define HOST_IO_BLOCK(i) (1 + (4 + (i) % 4) * 256 + 16 + (i))
+
+void host_io_fill(char *buf, unsigned int block, int seed) {
+    int i;
+    for (i = 0; i < TFS_BLOCK_SIZE; i++) {
+        buf[i] = block * 31 + i * 7 + seed;
+    }
+}
+
+// Submits a batch of requests to the test blocks, with a flush after them if
+// 'flush' is set, and checks they all complete. Reads are checked against
+// the pattern for 'seed'; writes are made from it.
+int host_io_batch(TFS *tfs, HostDevice *dev, int op, int seed, int flush) {
+    TFSIORequest reqs[HOST_IO_BATCH + 1], *done[HOST_IO_BATCH + 1];
+    char expected[TFS_BLOCK_SIZE];
+    int i, j, n, total = HOST_IO_BATCH + (flush ? 1 : 0), completed = 0;
+
+    for (i = 0; i < total; i++) {
+        reqs[i].op = (i < HOST_IO_BATCH) ? op : TFS_IO_FLUSH;
+        reqs[i].block = HOST_IO_BLOCK(i);
+        reqs[i].buf = host_dev_buffer(dev, i % HOST_IO_BATCH);
+        reqs[i].callback = NULL;
+        reqs[i].result = 1;
+        if (reqs[i].op == TFS_IO_WRITE) {
+            host_io_fill(reqs[i].buf, reqs[i].block, seed);
+        } else if (reqs[i].op == TFS_IO_READ) {
+            memset(reqs[i].buf, 0, TFS_BLOCK_SIZE);
+        }
+        ASSERT_EQUALS(tfsSubmitRequest(tfs, &reqs[i]), 0);
+    }
+    while (completed < total) {
+        ASSERT_NOERROR(host_dev_poll(tfs, 1));
+        n = tfsReapCompletions(tfs, done, HOST_IO_BATCH + 1);
+        ASSERT(n > 0 || dev->use_uring);
+        for (i = 0; i < n; i++) {
+            ASSERT_EQUALS(done[i]->result, 0);
+            if (done[i]->op == TFS_IO_FLUSH) {
+                // Not until every write before it has completed
+                ASSERT_EQUALS(completed, HOST_IO_BATCH);
+            } else if (op == TFS_IO_READ) {
+                host_io_fill(expected, done[i]->block, seed);
+                ASSERT_EQUALS(memcmp(done[i]->buf, expected, TFS_BLOCK_SIZE), 0);
+            }
+            completed++;
+        }
+    }
+    ASSERT_EQUALS(tfsReapCompletions(tfs, done, 1), 0);
+    return 0;
+}
+
+int test_host_io() {
+    TFS tfs;
+    HostDevice dev;
+    TFSIORequest reqs[HOST_IO_BATCH], *done[HOST_IO_BATCH + 1];
+    FileHandle *handle;
+    char paths[2][32], list[(TFS_MAX_STRIPE_DEVICES + 1) * 32];
+    char write_buf[3000], read_buf[3000];
+    int depths[3] = { 0, 8, 0 };
+    int num_devices, pass, i, fd, next_fd;
+
+    // A stripe with a member that can't be opened fails as a whole, closing
+    // the members it did open
+    next_fd = dup(0);
+    close(next_fd);
+    ASSERT_EQUALS(host_dev_open(&dev, "/dev/null,/nonexistent/tomfs_test.img", 8, HOST_IO_BATCH, 0, 0), -1);
+    ASSERT(dev.members == NULL);
+    ASSERT_EQUALS(fd = dup(0), next_fd);
+    close(fd);
+
+    // As does one across too many images
+    list[0] = 0;
+    for (i = 0; i <= TFS_MAX_STRIPE_DEVICES; i++) {
+        strcat(list, (i > 0) ? ",/dev/null" : "/dev/null");
+    }
+    ASSERT_EQUALS(host_dev_open(&dev, list, 8, HOST_IO_BATCH, 0, 0), -1);
+    ASSERT(dev.members == NULL);
+    ASSERT_EQUALS(fd = dup(0), next_fd);
+    close(fd);
+
+    for (i = 0; i < sizeof(write_buf); i++) {
+        write_buf[i] = i * 13 + i / 251;
+    }
+
+    // A filesystem of 2048 blocks in groups of 256 on one image, then striped
+    // across two. Each pass writes with a new pattern and checks the last
+    // pass's, so data written through io_uring is read back without it and
+    // the other way around.
+    for (num_devices = 1; num_devices <= 2; num_devices++) {
+        list[0] = 0;
+        for (i = 0; i < num_devices; i++) {
+            strcpy(paths[i], "/tmp/tomfs_test_XXXXXX");
+            ASSERT_NOERROR(fd = mkstemp(paths[i]));
+            ASSERT_EQUALS(ftruncate(fd, (off_t)tfsStripeDeviceBlocks(2048, 256, num_devices, i) * TFS_BLOCK_SIZE), 0);
+            close(fd);
+            if (i > 0) {
+                strcat(list, ",");
+            }
+            strcat(list, paths[i]);
+        }
+
+        for (pass = 0; pass < 3; pass++) {
+            ASSERT_EQUALS(host_dev_open(&dev, list, depths[pass], HOST_IO_BATCH, 0, 0), 0);
+            ASSERT_EQUALS(dev.num_members, ((num_devices > 1) ? num_devices : 0));
+            printf("  %d image(s), queue depth %d: %s\n", num_devices, depths[pass], dev.use_uring ? "io_uring" : "pread/pwrite");
+            if (depths[pass] == 0) {
+                ASSERT_EQUALS(dev.use_uring, 0);
+            }
+            tfsInit(&tfs, NULL, 0);
+            host_dev_attach(&dev, &tfs);
+            if (pass == 0) {
+                ASSERT_EQUALS(tfsInitFilesystemGeometry(&tfs, 2048, TFS_BLOCK_SIZE, 256, 1), 0);
+                ASSERT_NOTEQUALS(handle = tfsCreateFile(&tfs, "/", 0644, "file"), NULL);
+                ASSERT_EQUALS(tfsWriteFile(&tfs, handle, write_buf, sizeof(write_buf), 0), sizeof(write_buf));
+                tfsCloseHandle(handle);
+            } else {
+                // The filesystem and the last pass's blocks survived reopening
+                ASSERT_EQUALS(tfsOpenFilesystem(&tfs), 0);
+                ASSERT_EQUALS(tfs.header.stripe_devices, ((num_devices > 1) ? num_devices : 0));
+                ASSERT_NOTEQUALS(handle = tfsOpenFile(&tfs, "/", "file"), NULL);
+                ASSERT_EQUALS(tfsReadFile(&tfs, handle, read_buf, sizeof(read_buf), 0), sizeof(read_buf));
+                ASSERT_EQUALS(memcmp(read_buf, write_buf, sizeof(read_buf)), 0);
+                tfsCloseHandle(handle);
+                ASSERT_EQUALS(host_io_batch(&tfs, &dev, TFS_IO_READ, pass - 1, 0), 0);
+            }
+
+            // host_dev_drain waits for everything submitted, leaving it to
+            // be reaped
+            for (i = 0; i < HOST_IO_BATCH; i++) {
+                reqs[i].op = TFS_IO_WRITE;
+                reqs[i].block = HOST_IO_BLOCK(i);
+                reqs[i].buf = host_dev_buffer(&dev, i);
+                reqs[i].callback = NULL;
+                host_io_fill(reqs[i].buf, reqs[i].block, pass);
+                ASSERT_EQUALS(tfsSubmitRequest(&tfs, &reqs[i]), 0);
+            }
+            ASSERT_EQUALS(host_dev_drain(&tfs), 0);
+            ASSERT_EQUALS(tfsReapCompletions(&tfs, done, HOST_IO_BATCH + 1), HOST_IO_BATCH);
+            for (i = 0; i < HOST_IO_BATCH; i++) {
+                ASSERT_EQUALS(reqs[i].result, 0);
+            }
+
+            // A flush completes after the writes before it, and they read back
+            ASSERT_EQUALS(host_io_batch(&tfs, &dev, TFS_IO_WRITE, pass, 1), 0);
+            ASSERT_EQUALS(host_io_batch(&tfs, &dev, TFS_IO_READ, pass, 0), 0);
+            host_dev_close(&dev);
+        }
+        for (i = 0; i < num_devices; i++) {
+            unlink(paths[i]);
+        }
+    }
+
+    return 0;
+}
+
 int main() {
     // Low-level tests
     RUNTEST(test_set_bitmap);
@@ -507,8 +2299,24 @@ int main() {
     RUNTEST(test_init_works);
     RUNTEST(test_allocate_blocks);
     RUNTEST(test_directories);
+    RUNTEST(test_directory_iterator);
+    RUNTEST(test_directory_records);
+    RUNTEST(test_directory_handles);
     RUNTEST(test_write_files);
     RUNTEST(test_read_files);
+    RUNTEST(test_sparse_files);
+    RUNTEST(test_truncate);
+    RUNTEST(test_clone_files);
+    RUNTEST(test_lz_codec);
+    RUNTEST(test_compressed_files);
+    RUNTEST(test_dedup);
+    RUNTEST(test_handle_table);
+    RUNTEST(test_async_io);
+    RUNTEST(test_striping);
+    RUNTEST(test_defragment);
+    RUNTEST(test_block_geometry);
+    RUNTEST(test_large_volume);
+    RUNTEST(test_host_io);
     printf("All tests pass. Yay!\n");
     return 0;
 }